@@ -0,0 +1,287 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "blake3.h"
+
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+
+static const uint32_t iv[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const unsigned char message_schedule[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}
+};
+
+/* The pending output of a chunk or parent node. It becomes a chaining
+ * value, or the root hash if it's the last node left.
+ */
+struct output {
+    uint32_t cv[8];
+    uint32_t block_words[16];
+    uint64_t counter;
+    uint32_t block_size;
+    uint32_t flags;
+};
+
+static uint32_t rotr32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void g(uint32_t state[16],
+              int a,
+              int b,
+              int c,
+              int d,
+              uint32_t x,
+              uint32_t y) {
+    state[a] = state[a] + state[b] + x;
+    state[d] = rotr32(state[d] ^ state[a], 16);
+    state[c] = state[c] + state[d];
+    state[b] = rotr32(state[b] ^ state[c], 12);
+    state[a] = state[a] + state[b] + y;
+    state[d] = rotr32(state[d] ^ state[a], 8);
+    state[c] = state[c] + state[d];
+    state[b] = rotr32(state[b] ^ state[c], 7);
+}
+
+static void compress(const uint32_t cv[8],
+                     const uint32_t block_words[16],
+                     uint64_t counter,
+                     uint32_t block_size,
+                     uint32_t flags,
+                     uint32_t out[16]) {
+    uint32_t state[16];
+    int round;
+    int i;
+
+    memcpy(state, cv, 8 * sizeof(uint32_t));
+    memcpy(state + 8, iv, 4 * sizeof(uint32_t));
+    state[12] = (uint32_t)counter;
+    state[13] = (uint32_t)(counter >> 32);
+    state[14] = block_size;
+    state[15] = flags;
+
+    for (round = 0; round < 7; round++) {
+        const unsigned char *s = message_schedule[round];
+
+        g(state, 0, 4, 8, 12, block_words[s[0]], block_words[s[1]]);
+        g(state, 1, 5, 9, 13, block_words[s[2]], block_words[s[3]]);
+        g(state, 2, 6, 10, 14, block_words[s[4]], block_words[s[5]]);
+        g(state, 3, 7, 11, 15, block_words[s[6]], block_words[s[7]]);
+        g(state, 0, 5, 10, 15, block_words[s[8]], block_words[s[9]]);
+        g(state, 1, 6, 11, 12, block_words[s[10]], block_words[s[11]]);
+        g(state, 2, 7, 8, 13, block_words[s[12]], block_words[s[13]]);
+        g(state, 3, 4, 9, 14, block_words[s[14]], block_words[s[15]]);
+    }
+
+    for (i = 0; i < 8; i++) {
+        out[i] = state[i] ^ state[i + 8];
+        out[i + 8] = state[i + 8] ^ cv[i];
+    }
+}
+
+/* Windows only runs on little-endian CPUs. */
+static void load_block_words(const unsigned char block[BLAKE3_BLOCK_SIZE],
+                             uint32_t block_words[16]) {
+    memcpy(block_words, block, BLAKE3_BLOCK_SIZE);
+}
+
+static void output_chaining_value(const struct output *output,
+                                  uint32_t cv[8]) {
+    uint32_t out[16];
+
+    compress(
+        output->cv,
+        output->block_words,
+        output->counter,
+        output->block_size,
+        output->flags,
+        out);
+    memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static void parent_output(const uint32_t left_cv[8],
+                          const uint32_t right_cv[8],
+                          struct output *output) {
+    memcpy(output->cv, iv, sizeof(output->cv));
+    memcpy(output->block_words, left_cv, 8 * sizeof(uint32_t));
+    memcpy(output->block_words + 8, right_cv, 8 * sizeof(uint32_t));
+    output->counter = 0;
+    output->block_size = BLAKE3_BLOCK_SIZE;
+    output->flags = PARENT;
+}
+
+static void chunk_state_init(struct blake3_chunk_state *chunk,
+                             uint64_t chunk_counter) {
+    memcpy(chunk->cv, iv, sizeof(chunk->cv));
+    chunk->chunk_counter = chunk_counter;
+    memset(chunk->block, 0, sizeof(chunk->block));
+    chunk->block_size = 0;
+    chunk->blocks_compressed = 0;
+}
+
+static size_t chunk_state_size(const struct blake3_chunk_state *chunk) {
+    return BLAKE3_BLOCK_SIZE * chunk->blocks_compressed + chunk->block_size;
+}
+
+static uint32_t chunk_start_flag(const struct blake3_chunk_state *chunk) {
+    return chunk->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+/* The last block of a chunk is only compressed in chunk_state_output(),
+ * because it needs the CHUNK_END flag.
+ */
+static void chunk_state_update(struct blake3_chunk_state *chunk,
+                               const unsigned char *p,
+                               size_t size) {
+    while (size > 0) {
+        size_t n;
+
+        if (chunk->block_size == BLAKE3_BLOCK_SIZE) {
+            uint32_t block_words[16];
+            uint32_t out[16];
+
+            load_block_words(chunk->block, block_words);
+            compress(
+                chunk->cv,
+                block_words,
+                chunk->chunk_counter,
+                BLAKE3_BLOCK_SIZE,
+                chunk_start_flag(chunk),
+                out);
+            memcpy(chunk->cv, out, sizeof(chunk->cv));
+            chunk->blocks_compressed++;
+            memset(chunk->block, 0, sizeof(chunk->block));
+            chunk->block_size = 0;
+        }
+
+        n = BLAKE3_BLOCK_SIZE - chunk->block_size;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(chunk->block + chunk->block_size, p, n);
+        chunk->block_size += n;
+        p += n;
+        size -= n;
+    }
+}
+
+static void chunk_state_output(const struct blake3_chunk_state *chunk,
+                               struct output *output) {
+    memcpy(output->cv, chunk->cv, sizeof(output->cv));
+    load_block_words(chunk->block, output->block_words);
+    output->counter = chunk->chunk_counter;
+    output->block_size = (uint32_t)chunk->block_size;
+    output->flags = chunk_start_flag(chunk) | CHUNK_END;
+}
+
+/* Merges the new chunk with as many subtrees on the stack as there are
+ * trailing zero bits in the total number of chunks, which keeps the stack
+ * as the binary representation of the chunk count.
+ */
+static void add_chunk_chaining_value(struct blake3_hasher *hasher,
+                                     uint32_t cv[8],
+                                     uint64_t total_chunks) {
+    while ((total_chunks & 1) == 0) {
+        struct output output;
+
+        hasher->cv_stack_size--;
+        parent_output(hasher->cv_stack[hasher->cv_stack_size], cv, &output);
+        output_chaining_value(&output, cv);
+        total_chunks >>= 1;
+    }
+    memcpy(hasher->cv_stack[hasher->cv_stack_size], cv, 8 * sizeof(uint32_t));
+    hasher->cv_stack_size++;
+}
+
+void blake3_init(struct blake3_hasher *hasher) {
+    chunk_state_init(&hasher->chunk, 0);
+    hasher->cv_stack_size = 0;
+}
+
+void blake3_update(struct blake3_hasher *hasher,
+                   const void *data,
+                   size_t size) {
+    const unsigned char *p = data;
+
+    while (size > 0) {
+        size_t n;
+
+        /* A full chunk is finished only once more input arrives, since the
+         * last one is treated differently.
+         */
+        if (chunk_state_size(&hasher->chunk) == BLAKE3_CHUNK_SIZE) {
+            struct output output;
+            uint32_t cv[8];
+            uint64_t total_chunks = hasher->chunk.chunk_counter + 1;
+
+            chunk_state_output(&hasher->chunk, &output);
+            output_chaining_value(&output, cv);
+            add_chunk_chaining_value(hasher, cv, total_chunks);
+            chunk_state_init(&hasher->chunk, total_chunks);
+        }
+
+        n = BLAKE3_CHUNK_SIZE - chunk_state_size(&hasher->chunk);
+        if (n > size) {
+            n = size;
+        }
+        chunk_state_update(&hasher->chunk, p, n);
+        p += n;
+        size -= n;
+    }
+}
+
+void blake3_final(const struct blake3_hasher *hasher,
+                  unsigned char out[BLAKE3_OUT_SIZE]) {
+    struct output output;
+    uint32_t words[16];
+    size_t i;
+
+    chunk_state_output(&hasher->chunk, &output);
+    for (i = hasher->cv_stack_size; i > 0; i--) {
+        uint32_t cv[8];
+
+        output_chaining_value(&output, cv);
+        parent_output(hasher->cv_stack[i - 1], cv, &output);
+    }
+
+    compress(
+        output.cv,
+        output.block_words,
+        0,
+        output.block_size,
+        output.flags | ROOT,
+        words);
+    memcpy(out, words, BLAKE3_OUT_SIZE);
+}
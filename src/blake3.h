@@ -0,0 +1,59 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_BLAKE3_H
+#define WDD_BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_OUT_SIZE 32
+#define BLAKE3_BLOCK_SIZE 64
+#define BLAKE3_CHUNK_SIZE 1024
+#define BLAKE3_MAX_DEPTH 54
+
+struct blake3_chunk_state {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    unsigned char block[BLAKE3_BLOCK_SIZE];
+    size_t block_size;
+    size_t blocks_compressed;
+};
+
+/* Incremental BLAKE3 in the default hashing mode. Completed chunks are
+ * merged into a stack of subtree chaining values as soon as possible, so
+ * the memory needed doesn't depend on the input size.
+ */
+struct blake3_hasher {
+    struct blake3_chunk_state chunk;
+    uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+    size_t cv_stack_size;
+};
+
+void blake3_init(struct blake3_hasher *hasher);
+void blake3_update(struct blake3_hasher *hasher,
+                   const void *data,
+                   size_t size);
+void blake3_final(const struct blake3_hasher *hasher,
+                  unsigned char out[BLAKE3_OUT_SIZE]);
+
+#endif
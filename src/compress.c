@@ -0,0 +1,144 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "compress.h"
+#include "gzip.h"
+#include "lz4.h"
+#include "zstd.h"
+
+#define GZIP_MAX_LEVEL 9
+
+static const struct {
+    const char *name;
+    int default_level;
+    int max_level;
+    SIZE_T state_size;
+} formats[] = {
+    {"none", 0, 0, 0},
+    {"zstd", ZSTD_DEFAULT_LEVEL, ZSTD_MAX_LEVEL, sizeof(struct zstd_state)},
+    {"lz4", 0, 0, sizeof(struct lz4_state)},
+    {"gzip", GZIP_DEFAULT_LEVEL, GZIP_MAX_LEVEL, sizeof(struct gzip_state)},
+    {"xz", 0, 0, 0}
+};
+
+BOOL compress_parse(const char *value, enum compress_type *type, int *level) {
+    const char *colon = strchr(value, ':');
+    size_t name_length = colon != NULL ? (size_t)(colon - value)
+                                       : strlen(value);
+    int i;
+
+    for (i = COMPRESS_ZSTD; i <= COMPRESS_GZIP; i++) {
+        if (strlen(formats[i].name) == name_length
+            && strncmp(value, formats[i].name, name_length) == 0) {
+            break;
+        }
+    }
+    if (i > COMPRESS_GZIP) {
+        return FALSE;
+    }
+
+    *type = (enum compress_type)i;
+    *level = formats[i].default_level;
+    if (colon != NULL) {
+        char *end = NULL;
+
+        *level = (int)strtol(colon + 1, &end, 10);
+        if (end == colon + 1
+            || *end != '\0'
+            || *level < 1
+            || *level > formats[i].max_level) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+SIZE_T compress_bound(enum compress_type type, SIZE_T size) {
+    switch (type) {
+        case COMPRESS_ZSTD:
+            return zstd_compress_bound(size);
+        case COMPRESS_LZ4:
+            return lz4_compress_bound(size);
+        case COMPRESS_GZIP:
+            return gzip_compress_bound(size);
+        default:
+            return size;
+    }
+}
+
+/* Zstandard and LZ4 decoders skip frames with magic numbers 0x184D2A50 to
+ * 0x184D2A5F, gzip has nothing like that.
+ */
+BOOL compress_has_seek_table(enum compress_type type) {
+    return type == COMPRESS_ZSTD || type == COMPRESS_LZ4;
+}
+
+BOOL compress_init(struct compressor *compressor,
+                   enum compress_type type,
+                   int level) {
+    compressor->type = type;
+    compressor->level = level;
+    compressor->state = VirtualAlloc(
+        NULL,
+        formats[type].state_size,
+        MEM_COMMIT | MEM_RESERVE,
+        PAGE_READWRITE);
+    return compressor->state != NULL;
+}
+
+DWORD compress_frame(struct compressor *compressor,
+                     const void *data,
+                     DWORD size,
+                     void *frame) {
+    switch (compressor->type) {
+        case COMPRESS_ZSTD:
+            return (DWORD)zstd_compress_frame(
+                compressor->state,
+                compressor->level,
+                data,
+                size,
+                frame);
+        case COMPRESS_LZ4:
+            return (DWORD)lz4_compress_frame(
+                compressor->state,
+                data,
+                size,
+                frame);
+        case COMPRESS_GZIP:
+            return (DWORD)gzip_compress_member(
+                compressor->state,
+                compressor->level,
+                data,
+                size,
+                frame);
+        default:
+            return 0;
+    }
+}
+
+void compress_free(const struct compressor *compressor) {
+    if (compressor->state != NULL) {
+        VirtualFree(compressor->state, 0, MEM_RELEASE);
+    }
+}
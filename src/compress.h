@@ -0,0 +1,77 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_COMPRESS_H
+#define WDD_COMPRESS_H
+
+#include <windows.h>
+
+/* Data is compressed in independent frames of at least this size, so that
+ * they can be compressed in parallel and decompressed separately.
+ */
+#define COMPRESS_FRAME_SIZE (1 << 20)
+
+enum compress_type {
+    COMPRESS_NONE,
+    COMPRESS_ZSTD,
+    COMPRESS_LZ4,
+    COMPRESS_GZIP,
+    COMPRESS_XZ
+};
+
+/* One compressor per thread. The state is large, so it's allocated
+ * separately.
+ */
+struct compressor {
+    enum compress_type type;
+    int level;
+    void *state;
+};
+
+/* Parses the value of compress=, which is a format name optionally followed
+ * by a colon and a level.
+ */
+BOOL compress_parse(const char *value, enum compress_type *type, int *level);
+
+/* Returns the most space a frame of size bytes can take. */
+SIZE_T compress_bound(enum compress_type type, SIZE_T size);
+
+/* Returns TRUE if frames of this type can be followed by a seek table in a
+ * skippable frame.
+ */
+BOOL compress_has_seek_table(enum compress_type type);
+
+BOOL compress_init(struct compressor *compressor,
+                   enum compress_type type,
+                   int level);
+
+/* Compresses data as one frame (a gzip member for gzip) and returns the
+ * size of the frame.
+ */
+DWORD compress_frame(struct compressor *compressor,
+                     const void *data,
+                     DWORD size,
+                     void *frame);
+
+void compress_free(const struct compressor *compressor);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <windows.h>
+#include "copy.h"
+#include "drive.h"
+#include "file.h"
+#include "journal.h"
+#include "options.h"
+#include "wdd.h"
+#include "writer.h"
+#include "zero.h"
+
+#define FAST_COPY_CHUNK_SIZE GB
+
+DWORD WINAPI stripe_thread_proc(LPVOID param) {
+    struct program_state *s = param;
+    struct io_queue in_queue;
+    struct io_queue out_queue;
+    char *buffer;
+    DWORD index;
+
+    index = (DWORD)InterlockedIncrement(&s->num_workers_started) - 1;
+    buffer = s->buffer + (SIZE_T)s->buffer_size * index;
+
+    ZeroMemory(&in_queue, sizeof(in_queue));
+    ZeroMemory(&out_queue, sizeof(out_queue));
+    if (!io_queue_init(&in_queue, s->in_file, FALSE, 1)
+        || !io_queue_init(&out_queue, s->out_file, FALSE, 1)) {
+        abort_copy(s, GetLastError(), "Failed to create I/O queue");
+        io_queue_free(&in_queue);
+        return 1;
+    }
+
+    while (!s->aborted) {
+        ULONGLONG start;
+        DWORD size;
+        DWORD write_size;
+        DWORD num_bytes;
+        DWORD error;
+
+        start = (ULONGLONG)InterlockedExchangeAdd64(
+            (volatile LONGLONG *)&s->next_stripe,
+            s->buffer_size);
+        if (start >= s->stripe_length) {
+            break;
+        }
+        size = (DWORD)min(s->buffer_size, s->stripe_length - start);
+
+        io_queue_submit(
+            &in_queue,
+            IO_READ,
+            buffer,
+            size,
+            s->in_offset + start);
+        error = io_queue_complete(&in_queue, &num_bytes);
+        if (error == ERROR_HANDLE_EOF || error == ERROR_SECTOR_NOT_FOUND) {
+            num_bytes = 0;
+        } else if (error != ERROR_SUCCESS) {
+            if (!s->noerror) {
+                abort_copy(s, error, "Error reading from file");
+                break;
+            }
+            if (!skip_bad_block(
+                    s,
+                    &in_queue,
+                    buffer,
+                    s->in_offset + start,
+                    size)) {
+                abort_copy(s, GetLastError(), "Failed to skip bad block");
+                break;
+            }
+            num_bytes = size;
+        }
+        if (num_bytes == 0) {
+            continue;
+        }
+        add_to_counter(&s->num_bytes_in, num_bytes);
+        if (num_bytes < size && s->sync) {
+            ZeroMemory(buffer + num_bytes, size - num_bytes);
+            s->sync_padding = size - num_bytes;
+        } else {
+            size = num_bytes;
+        }
+
+        if (s->sparse && is_zero_block(buffer, size)) {
+            add_to_counter(&s->num_bytes_out, size);
+            continue;
+        }
+
+        write_size = size;
+        if (write_size % s->out_alignment != 0) {
+            /* Only the last stripe can be unaligned, see writer_thread_proc
+             * for how that is dealt with.
+             */
+            write_size =
+                (write_size / s->out_alignment + 1) * s->out_alignment;
+            s->out_padding = write_size - size;
+            ZeroMemory(buffer + size, s->out_padding);
+        }
+
+        io_queue_submit(
+            &out_queue,
+            IO_WRITE,
+            buffer,
+            write_size,
+            s->out_offset + start);
+        error = io_queue_complete(&out_queue, &num_bytes);
+        if (error != ERROR_SUCCESS) {
+            abort_copy(s, error, "Error writing to file");
+            break;
+        }
+
+        add_to_counter(&s->num_bytes_out, min(num_bytes, size));
+        add_to_counter(&s->num_blocks_copied, 1);
+    }
+
+    io_queue_free(&in_queue);
+    io_queue_free(&out_queue);
+    return 0;
+}
+
+/* Lets the file system share the input's clusters with the output (block
+ * cloning on ReFS). Only whole clusters can be cloned; returns the number of
+ * bytes cloned.
+ */
+static ULONGLONG clone_file_range(struct program_state *s,
+                                  ULONGLONG length,
+                                  DWORD cluster_size) {
+    DUPLICATE_EXTENTS_DATA data;
+    FILE_BASIC_INFO basic_info;
+    ULONGLONG num_bytes_cloned = 0;
+
+    length -= length % cluster_size;
+    if (length == 0
+        || s->in_offset % cluster_size != 0
+        || s->out_offset % cluster_size != 0) {
+        return 0;
+    }
+
+    /* The target range must already exist, and cloning from a sparse file
+     * requires the target to be sparse as well.
+     */
+    if (!extend_file(s->out_file, s->out_offset + length)) {
+        return 0;
+    }
+    if (GetFileInformationByHandleEx(
+            s->in_file,
+            FileBasicInfo,
+            &basic_info,
+            sizeof(basic_info))
+        && (basic_info.FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)) {
+        control_device(s->out_file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, NULL);
+    }
+
+    while (num_bytes_cloned < length) {
+        ULONGLONG size = min(length - num_bytes_cloned, FAST_COPY_CHUNK_SIZE);
+
+        data.FileHandle = s->in_file;
+        data.SourceFileOffset.QuadPart =
+            (LONGLONG)(s->in_offset + num_bytes_cloned);
+        data.TargetFileOffset.QuadPart =
+            (LONGLONG)(s->out_offset + num_bytes_cloned);
+        data.ByteCount.QuadPart = (LONGLONG)size;
+        if (!control_device(
+                s->out_file,
+                FSCTL_DUPLICATE_EXTENTS_TO_FILE,
+                &data,
+                sizeof(data),
+                NULL,
+                0,
+                NULL)) {
+            break;
+        }
+        num_bytes_cloned += size;
+    }
+
+    return num_bytes_cloned;
+}
+
+/* Copies data inside the storage array with offloaded data transfer (ODX),
+ * so it never travels to the host. Ranges must be sector-aligned; returns
+ * the number of bytes copied.
+ */
+static ULONGLONG offload_file_range(struct program_state *s,
+                                    ULONGLONG length,
+                                    DWORD sector_size) {
+    FSCTL_OFFLOAD_READ_INPUT read_input;
+    FSCTL_OFFLOAD_READ_OUTPUT read_output;
+    FSCTL_OFFLOAD_WRITE_INPUT write_input;
+    FSCTL_OFFLOAD_WRITE_OUTPUT write_output;
+    ULONGLONG num_bytes_copied = 0;
+
+    length -= length % sector_size;
+    if (length == 0
+        || s->in_offset % sector_size != 0
+        || s->out_offset % sector_size != 0) {
+        return 0;
+    }
+    if (!extend_file(s->out_file, s->out_offset + length)) {
+        return 0;
+    }
+
+    while (num_bytes_copied < length) {
+        ULONGLONG num_bytes_written = 0;
+
+        ZeroMemory(&read_input, sizeof(read_input));
+        read_input.Size = sizeof(read_input);
+        read_input.FileOffset = s->in_offset + num_bytes_copied;
+        read_input.CopyLength =
+            min(length - num_bytes_copied, FAST_COPY_CHUNK_SIZE);
+        if (!control_device(
+                s->in_file,
+                FSCTL_OFFLOAD_READ,
+                &read_input,
+                sizeof(read_input),
+                &read_output,
+                sizeof(read_output),
+                NULL)
+            || read_output.TransferLength == 0) {
+            break;
+        }
+
+        /* The token may be consumed in several writes. */
+        while (num_bytes_written < read_output.TransferLength) {
+            ZeroMemory(&write_input, sizeof(write_input));
+            write_input.Size = sizeof(write_input);
+            write_input.FileOffset =
+                s->out_offset + num_bytes_copied + num_bytes_written;
+            write_input.CopyLength =
+                read_output.TransferLength - num_bytes_written;
+            write_input.TransferOffset = num_bytes_written;
+            CopyMemory(
+                write_input.Token,
+                read_output.Token,
+                sizeof(write_input.Token));
+            if (!control_device(
+                    s->out_file,
+                    FSCTL_OFFLOAD_WRITE,
+                    &write_input,
+                    sizeof(write_input),
+                    &write_output,
+                    sizeof(write_output),
+                    NULL)
+                || write_output.LengthWritten == 0) {
+                break;
+            }
+            num_bytes_written += write_output.LengthWritten;
+        }
+
+        num_bytes_copied += num_bytes_written;
+        if (num_bytes_written < read_output.TransferLength) {
+            break;
+        }
+    }
+
+    return num_bytes_copied;
+}
+
+void copy_file_extents(struct program_state *s,
+                       const struct program_options *options) {
+    ULONGLONG length;
+    ULONGLONG num_bytes_copied;
+    DWORD cluster_size;
+    DWORD sector_size;
+    DWORD file_system_flags;
+
+    if (s->in_offset >= s->in_file_size) {
+        return;
+    }
+    length = min(s->max_bytes_in, s->in_file_size - s->in_offset);
+
+    cluster_size = get_cluster_size(options->filename_out);
+    if (cluster_size != 0
+        && GetVolumeInformationByHandleW(
+            s->out_file,
+            NULL,
+            0,
+            NULL,
+            NULL,
+            &file_system_flags,
+            NULL,
+            0)
+        && (file_system_flags & FILE_SUPPORTS_BLOCK_REFCOUNTING)) {
+        num_bytes_copied = clone_file_range(s, length, cluster_size);
+        s->in_offset += num_bytes_copied;
+        s->out_offset += num_bytes_copied;
+        s->max_bytes_in -= num_bytes_copied;
+        length -= num_bytes_copied;
+        add_to_counter(&s->num_bytes_in, num_bytes_copied);
+        add_to_counter(&s->num_bytes_out, num_bytes_copied);
+    }
+
+    sector_size = max(
+        get_sector_size(s->in_file, options->filename_in),
+        get_sector_size(s->out_file, options->filename_out));
+    num_bytes_copied = offload_file_range(s, length, sector_size);
+    s->in_offset += num_bytes_copied;
+    s->out_offset += num_bytes_copied;
+    s->max_bytes_in -= num_bytes_copied;
+    add_to_counter(&s->num_bytes_in, num_bytes_copied);
+    add_to_counter(&s->num_bytes_out, num_bytes_copied);
+}
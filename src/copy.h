@@ -0,0 +1,44 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_COPY_H
+#define WDD_COPY_H
+
+#include <windows.h>
+#include "options.h"
+#include "wdd.h"
+
+/* Worker thread for jobs=N. Each worker repeatedly claims the next stripe
+ * of the input and copies it with positioned I/O using its own buffer, so
+ * there are as many requests in flight as there are workers.
+ */
+DWORD WINAPI stripe_thread_proc(LPVOID param);
+
+/* Copies file to file without moving the data through our buffers, first by
+ * cloning and then by offloading what couldn't be cloned. Whatever is left,
+ * such as an unaligned tail, is copied by the reader and writer threads
+ * starting from the updated offsets.
+ */
+void copy_file_extents(struct program_state *s,
+                       const struct program_options *options);
+
+#endif
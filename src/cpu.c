@@ -0,0 +1,103 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "cpu.h"
+
+#ifdef CPU_X86
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #include <immintrin.h>
+    #else
+        #include <cpuid.h>
+    #endif
+#endif
+
+#ifdef CPU_X86
+
+static void cpuid(int leaf, int subleaf, unsigned int regs[4]) {
+#ifdef _MSC_VER
+    __cpuidex((int *)regs, leaf, subleaf);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long xgetbv(unsigned int index) {
+#ifdef _MSC_VER
+    return _xgetbv(index);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+    return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+#endif /* CPU_X86 */
+
+int cpu_has_avx2(void) {
+#ifdef CPU_X86
+    static int has_avx2 = -1;
+    unsigned int regs[4];
+
+    if (has_avx2 >= 0) {
+        return has_avx2;
+    }
+
+    has_avx2 = 0;
+    cpuid(0, 0, regs);
+    if (regs[0] < 7) {
+        return has_avx2;
+    }
+
+    /* The OS must also save the YMM registers on context switches. */
+    cpuid(1, 0, regs);
+    if ((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0) {
+        return has_avx2;
+    }
+    if ((xgetbv(0) & 0x6) != 0x6) {
+        return has_avx2;
+    }
+
+    cpuid(7, 0, regs);
+    has_avx2 = (regs[1] & (1 << 5)) != 0;
+    return has_avx2;
+#else
+    return 0;
+#endif
+}
+
+int cpu_has_sse42(void) {
+#ifdef CPU_X86
+    static int has_sse42 = -1;
+    unsigned int regs[4];
+
+    if (has_sse42 >= 0) {
+        return has_sse42;
+    }
+
+    cpuid(1, 0, regs);
+    has_sse42 = (regs[2] & (1 << 20)) != 0;
+    return has_sse42;
+#else
+    return 0;
+#endif
+}
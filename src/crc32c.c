@@ -0,0 +1,132 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "cpu.h"
+#include "crc32c.h"
+
+#if defined(CPU_X86)
+    #include <nmmintrin.h>
+#endif
+
+#define POLYNOMIAL 0x82F63B78
+
+/* Slicing-by-8 tables for CPUs without a CRC32 instruction. */
+static uint32_t table[8][256];
+static int table_ready;
+
+static void init_table(void) {
+    uint32_t i;
+    int j;
+
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (POLYNOMIAL & (0 - (crc & 1)));
+        }
+        table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            table[j][i] =
+                (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xFF];
+        }
+    }
+    table_ready = 1;
+}
+
+static uint32_t crc32c_scalar(uint32_t crc,
+                              const unsigned char *p,
+                              size_t size) {
+    if (!table_ready) {
+        init_table();
+    }
+    while (size >= 8) {
+        uint32_t low;
+        uint32_t high;
+
+        memcpy(&low, p, sizeof(low));
+        memcpy(&high, p + 4, sizeof(high));
+        low ^= crc;
+        crc = table[7][low & 0xFF]
+            ^ table[6][(low >> 8) & 0xFF]
+            ^ table[5][(low >> 16) & 0xFF]
+            ^ table[4][low >> 24]
+            ^ table[3][high & 0xFF]
+            ^ table[2][(high >> 8) & 0xFF]
+            ^ table[1][(high >> 16) & 0xFF]
+            ^ table[0][high >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xFF];
+        p++;
+        size--;
+    }
+    return crc;
+}
+
+#if defined(CPU_X86)
+
+TARGET_SSE42
+static uint32_t crc32c_sse42(uint32_t crc,
+                             const unsigned char *p,
+                             size_t size) {
+#if defined(_M_X64) || defined(__x86_64__)
+    uint64_t crc64 = crc;
+
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        size -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (size >= 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+        p += 4;
+        size -= 4;
+    }
+    while (size > 0) {
+        crc = _mm_crc32_u8(crc, *p);
+        p++;
+        size--;
+    }
+    return crc;
+}
+
+#endif
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t size) {
+    crc = ~crc;
+#if defined(CPU_X86)
+    if (cpu_has_sse42()) {
+        return ~crc32c_sse42(crc, data, size);
+    }
+#endif
+    return ~crc32c_scalar(crc, data, size);
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "decompress.h"
+#include "gzip.h"
+#include "lz4.h"
+#include "xz.h"
+#include "zstd.h"
+
+/* Streams that declare a smaller window than this get it anyway, so that
+ * a later frame or stream with a larger one still fits. Most Zstandard
+ * levels and xz presets stay within it.
+ */
+#define MIN_WINDOW_SIZE (8 << 20)
+
+static const struct {
+    const char *extension;
+    const unsigned char *magic;
+    DWORD magic_size;
+    SIZE_T state_size;
+} formats[] = {
+    {NULL, NULL, 0, 0},
+    {".zst", (const unsigned char *)"\x28\xB5\x2F\xFD", 4,
+        sizeof(struct zstd_decoder)},
+    {".lz4", (const unsigned char *)"\x04\x22\x4D\x18", 4,
+        sizeof(struct lz4_decoder)},
+    {".gz", (const unsigned char *)"\x1F\x8B\x08", 3,
+        sizeof(struct gzip_decoder)},
+    {".xz", (const unsigned char *)"\xFD\x37\x7A\x58\x5A\x00", 6,
+        sizeof(struct xz_decoder)}
+};
+
+enum compress_type decompress_detect(const void *data, DWORD size) {
+    int i;
+
+    for (i = COMPRESS_ZSTD; i <= COMPRESS_XZ; i++) {
+        if (size >= formats[i].magic_size
+            && memcmp(data, formats[i].magic, formats[i].magic_size) == 0) {
+            return (enum compress_type)i;
+        }
+    }
+    return COMPRESS_NONE;
+}
+
+enum compress_type decompress_type_from_name(const char *filename) {
+    const char *extension = strrchr(filename, '.');
+    int i;
+
+    if (extension == NULL) {
+        return COMPRESS_NONE;
+    }
+    for (i = COMPRESS_ZSTD; i <= COMPRESS_XZ; i++) {
+        if (lstrcmpiA(extension, formats[i].extension) == 0) {
+            return (enum compress_type)i;
+        }
+    }
+    return COMPRESS_NONE;
+}
+
+SIZE_T decompress_window_size(enum compress_type type,
+                              const void *data,
+                              DWORD size) {
+    uint64_t window_size;
+
+    switch (type) {
+        case COMPRESS_ZSTD:
+            window_size = zstd_window_size(data, size);
+            break;
+        case COMPRESS_LZ4:
+            return LZ4_WINDOW_SIZE;
+        case COMPRESS_GZIP:
+            return GZIP_WINDOW_SIZE;
+        case COMPRESS_XZ:
+            window_size = xz_dictionary_size(data, size);
+            break;
+        default:
+            return 0;
+    }
+    if (window_size > (SIZE_T)-1) {
+        return (SIZE_T)-1;
+    }
+    return max((SIZE_T)window_size, MIN_WINDOW_SIZE);
+}
+
+SIZE_T decompress_step_size(enum compress_type type) {
+    switch (type) {
+        case COMPRESS_ZSTD:
+            return ZSTD_BLOCK_SIZE;
+        case COMPRESS_LZ4:
+            return LZ4_MAX_BLOCK_SIZE;
+        case COMPRESS_GZIP:
+            return GZIP_DECODE_SIZE;
+        case COMPRESS_XZ:
+            return XZ_MAX_CHUNK_SIZE;
+        default:
+            return 0;
+    }
+}
+
+BOOL decompress_init(struct decompressor *decompressor,
+                     enum compress_type type) {
+    decompressor->type = type;
+    decompressor->state = VirtualAlloc(
+        NULL,
+        formats[type].state_size,
+        MEM_COMMIT | MEM_RESERVE,
+        PAGE_READWRITE);
+    if (decompressor->state == NULL) {
+        return FALSE;
+    }
+    decompress_reset(decompressor, -1);
+    return TRUE;
+}
+
+void decompress_reset(struct decompressor *decompressor, int xz_check_type) {
+    switch (decompressor->type) {
+        case COMPRESS_ZSTD:
+            zstd_decoder_init(decompressor->state);
+            break;
+        case COMPRESS_LZ4:
+            lz4_decoder_init(decompressor->state);
+            break;
+        case COMPRESS_GZIP:
+            gzip_decoder_init(decompressor->state);
+            break;
+        case COMPRESS_XZ:
+            if (xz_check_type >= 0) {
+                xz_decoder_init_block(decompressor->state, xz_check_type);
+            } else {
+                xz_decoder_init(decompressor->state);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+enum decode_status decompress_step(struct decompressor *decompressor,
+                                   struct in_stream *in,
+                                   struct out_window *out) {
+    switch (decompressor->type) {
+        case COMPRESS_ZSTD:
+            return zstd_decode(decompressor->state, in, out);
+        case COMPRESS_LZ4:
+            return lz4_decode(decompressor->state, in, out);
+        case COMPRESS_GZIP:
+            return gzip_decode(decompressor->state, in, out);
+        case COMPRESS_XZ:
+            return xz_decode(decompressor->state, in, out);
+        default:
+            return DECODE_UNSUPPORTED;
+    }
+}
+
+void decompress_free(const struct decompressor *decompressor) {
+    if (decompressor->state != NULL) {
+        VirtualFree(decompressor->state, 0, MEM_RELEASE);
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_DECOMPRESS_H
+#define WDD_DECOMPRESS_H
+
+#include <windows.h>
+#include "compress.h"
+#include "stream.h"
+
+/* How many bytes of input to have at hand before decompress_detect() and
+ * decompress_window_size() are called.
+ */
+#define DECOMPRESS_HEADER_SIZE 64
+
+/* The most input a decoder asks for at once: an LZ4 block of the largest
+ * size with its header and checksum.
+ */
+#define DECOMPRESS_MAX_INPUT_SIZE ((4 << 20) + 16)
+
+/* One decompressor per thread, like compressors. */
+struct decompressor {
+    enum compress_type type;
+    void *state;
+};
+
+/* Returns the format that data starts with, or COMPRESS_NONE. */
+enum compress_type decompress_detect(const void *data, DWORD size);
+
+/* Returns the format that the extension of filename stands for, or
+ * COMPRESS_NONE.
+ */
+enum compress_type decompress_type_from_name(const char *filename);
+
+/* Returns how much earlier output the decoder needs to keep while
+ * decompressing the stream that starts with data.
+ */
+SIZE_T decompress_window_size(enum compress_type type,
+                              const void *data,
+                              DWORD size);
+
+/* Returns how much room the output needs for each decompress_step(). */
+SIZE_T decompress_step_size(enum compress_type type);
+
+/* Must be called before any other threads use a decompressor, some of the
+ * tables are shared.
+ */
+BOOL decompress_init(struct decompressor *decompressor,
+                     enum compress_type type);
+
+/* Gets ready for new input. For xz, a check type of 0 or more means that
+ * the input is a single block as listed in the index rather than a whole
+ * stream.
+ */
+void decompress_reset(struct decompressor *decompressor, int xz_check_type);
+
+/* Decompresses the next piece of input, which is a block for most formats.
+ * Returns DECODE_END when the input ends where a stream may end.
+ */
+enum decode_status decompress_step(struct decompressor *decompressor,
+                                   struct in_stream *in,
+                                   struct out_window *out);
+
+void decompress_free(const struct decompressor *decompressor);
+
+#endif
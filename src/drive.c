@@ -0,0 +1,455 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <windows.h>
+#include <setupapi.h>
+#include "drive.h"
+
+#define DESCRIPTOR_BUFFER_SIZE 1024
+
+/* GUID_DEVINTERFACE_DISK, defined here to avoid pulling in initguid.h. */
+static const GUID disk_interface_guid = {
+    0x53f56307, 0xb6bf, 0x11d0, {0x94, 0xf2, 0x00, 0xa0, 0xc9, 0x1e, 0xfb, 0x8b}
+};
+
+/* A TRIM of a single range. The range follows the attributes, aligned as
+ * its 64-bit fields require.
+ */
+struct trim_request {
+    DEVICE_MANAGE_DATA_SET_ATTRIBUTES attributes;
+    DEVICE_DATA_SET_RANGE range;
+};
+
+static const char *bus_names[] = {
+    "Unknown",
+    "SCSI",
+    "ATAPI",
+    "ATA",
+    "1394",
+    "SSA",
+    "Fibre",
+    "USB",
+    "RAID",
+    "iSCSI",
+    "SAS",
+    "SATA",
+    "SD",
+    "MMC",
+    "Virtual",
+    "File",
+    "Spaces",
+    "NVMe",
+    "SCM",
+    "UFS"
+};
+
+BOOL control_device(HANDLE device,
+                    DWORD code,
+                    void *in_buffer,
+                    DWORD in_buffer_size,
+                    void *out_buffer,
+                    DWORD out_buffer_size,
+                    DWORD *num_bytes_returned) {
+    OVERLAPPED overlapped;
+    DWORD num_bytes = 0;
+    DWORD error = ERROR_SUCCESS;
+    BOOL result;
+
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL) {
+        return FALSE;
+    }
+
+    result = DeviceIoControl(
+        device,
+        code,
+        in_buffer,
+        in_buffer_size,
+        out_buffer,
+        out_buffer_size,
+        &num_bytes,
+        &overlapped);
+    if (!result) {
+        error = GetLastError();
+        if (error == ERROR_IO_PENDING || error == ERROR_MORE_DATA) {
+            /* The OVERLAPPED has the real byte count in both cases. */
+            result =
+                GetOverlappedResult(device, &overlapped, &num_bytes, TRUE);
+            error = result ? ERROR_SUCCESS : GetLastError();
+        }
+    }
+    if (num_bytes_returned != NULL) {
+        *num_bytes_returned = num_bytes;
+    }
+
+    CloseHandle(overlapped.hEvent);
+    SetLastError(error);
+    return result;
+}
+
+static BOOL query_property(HANDLE drive,
+                           STORAGE_PROPERTY_ID id,
+                           void *buffer,
+                           DWORD size) {
+    STORAGE_PROPERTY_QUERY query;
+
+    ZeroMemory(&query, sizeof(query));
+    query.PropertyId = id;
+    query.QueryType = PropertyStandardQuery;
+    ZeroMemory(buffer, size);
+    return control_device(
+        drive,
+        IOCTL_STORAGE_QUERY_PROPERTY,
+        &query,
+        sizeof(query),
+        buffer,
+        size,
+        NULL);
+}
+
+/* Copies one of the strings of a device descriptor. ATA drives pad them
+ * with spaces on both ends.
+ */
+static void copy_descriptor_string(char *buffer,
+                                   size_t buffer_size,
+                                   const char *descriptor,
+                                   DWORD descriptor_size,
+                                   DWORD offset) {
+    size_t length = 0;
+
+    buffer[0] = '\0';
+    if (offset == 0 || offset >= descriptor_size) {
+        return;
+    }
+    while (offset < descriptor_size && descriptor[offset] == ' ') {
+        offset++;
+    }
+    while (offset < descriptor_size
+           && descriptor[offset] != '\0'
+           && length < buffer_size - 1) {
+        buffer[length++] = descriptor[offset++];
+    }
+    while (length > 0 && buffer[length - 1] == ' ') {
+        length--;
+    }
+    buffer[length] = '\0';
+}
+
+BOOL drive_query(HANDLE drive, struct drive_info *info) {
+    DISK_GEOMETRY_EX geometry;
+    DWORD descriptor_buffer[DESCRIPTOR_BUFFER_SIZE / sizeof(DWORD)];
+    const STORAGE_DEVICE_DESCRIPTOR *device =
+        (const STORAGE_DEVICE_DESCRIPTOR *)descriptor_buffer;
+    STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR alignment;
+    STORAGE_ADAPTER_DESCRIPTOR adapter;
+    DEVICE_SEEK_PENALTY_DESCRIPTOR seek_penalty;
+    DEVICE_TRIM_DESCRIPTOR trim;
+    DEVICE_LB_PROVISIONING_DESCRIPTOR provisioning;
+
+    ZeroMemory(info, sizeof(*info));
+    info->is_rotational = -1;
+
+    if (!control_device(
+            drive,
+            IOCTL_DISK_GET_DRIVE_GEOMETRY_EX,
+            NULL,
+            0,
+            &geometry,
+            sizeof(geometry),
+            NULL)) {
+        return FALSE;
+    }
+    info->size = (ULONGLONG)geometry.DiskSize.QuadPart;
+    info->logical_sector_size = geometry.Geometry.BytesPerSector;
+    info->physical_sector_size = geometry.Geometry.BytesPerSector;
+
+    if (query_property(
+            drive,
+            StorageDeviceProperty,
+            descriptor_buffer,
+            sizeof(descriptor_buffer))) {
+        DWORD size = min(device->Size, sizeof(descriptor_buffer));
+
+        copy_descriptor_string(
+            info->vendor,
+            sizeof(info->vendor),
+            (const char *)descriptor_buffer,
+            size,
+            device->VendorIdOffset);
+        copy_descriptor_string(
+            info->model,
+            sizeof(info->model),
+            (const char *)descriptor_buffer,
+            size,
+            device->ProductIdOffset);
+        copy_descriptor_string(
+            info->serial,
+            sizeof(info->serial),
+            (const char *)descriptor_buffer,
+            size,
+            device->SerialNumberOffset);
+        info->is_removable = device->RemovableMedia;
+        info->bus_type = (int)device->BusType;
+    }
+
+    /* Drives with 4 KB physical sectors that emulate 512-byte ones only
+     * tell the difference here.
+     */
+    if (query_property(
+            drive,
+            StorageAccessAlignmentProperty,
+            &alignment,
+            sizeof(alignment))
+        && alignment.BytesPerLogicalSector > 0) {
+        info->logical_sector_size = alignment.BytesPerLogicalSector;
+        info->physical_sector_size = max(
+            alignment.BytesPerPhysicalSector,
+            alignment.BytesPerLogicalSector);
+    }
+
+    if (query_property(
+            drive,
+            StorageAdapterProperty,
+            &adapter,
+            sizeof(adapter))) {
+        info->max_transfer_size = adapter.MaximumTransferLength;
+    }
+
+    if (query_property(
+            drive,
+            StorageDeviceSeekPenaltyProperty,
+            &seek_penalty,
+            sizeof(seek_penalty))) {
+        info->is_rotational = seek_penalty.IncursSeekPenalty ? 1 : 0;
+    }
+
+    if (query_property(
+            drive,
+            StorageDeviceTrimProperty,
+            &trim,
+            sizeof(trim))) {
+        info->trim_enabled = trim.TrimEnabled;
+    }
+
+    /* ThinProvisioningReadZeros is LBPRZ on SCSI and RZAT on ATA drives:
+     * sectors that have been trimmed read as zeros.
+     */
+    if (query_property(
+            drive,
+            StorageDeviceLBProvisioningProperty,
+            &provisioning,
+            sizeof(provisioning))) {
+        info->zeros_after_trim = provisioning.ThinProvisioningReadZeros;
+        info->unmap_granularity = provisioning.OptimalUnmapGranularity;
+        if (provisioning.UnmapGranularityAlignmentValid) {
+            info->unmap_alignment = provisioning.UnmapGranularityAlignment;
+        }
+    }
+
+    return TRUE;
+}
+
+static int compare_drives(const void *a, const void *b) {
+    const struct drive_info *drive_a = a;
+    const struct drive_info *drive_b = b;
+
+    if (drive_a->number != drive_b->number) {
+        return drive_a->number < drive_b->number ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Opens a disk interface without asking for any access, so that this works
+ * without administrator rights, and finds out which physical drive it is.
+ */
+static BOOL query_interface(HDEVINFO devices,
+                            SP_DEVICE_INTERFACE_DATA *interface_data,
+                            struct drive_info *info) {
+    SP_DEVICE_INTERFACE_DETAIL_DATA_A *detail;
+    STORAGE_DEVICE_NUMBER device_number;
+    DWORD size = 0;
+    HANDLE drive;
+    BOOL result;
+
+    SetupDiGetDeviceInterfaceDetailA(
+        devices,
+        interface_data,
+        NULL,
+        0,
+        &size,
+        NULL);
+    if (size == 0) {
+        return FALSE;
+    }
+    detail = HeapAlloc(GetProcessHeap(), 0, size);
+    if (detail == NULL) {
+        return FALSE;
+    }
+    detail->cbSize = sizeof(*detail);
+    if (!SetupDiGetDeviceInterfaceDetailA(
+            devices,
+            interface_data,
+            detail,
+            size,
+            NULL,
+            NULL)) {
+        HeapFree(GetProcessHeap(), 0, detail);
+        return FALSE;
+    }
+
+    drive = CreateFileA(
+        detail->DevicePath,
+        0,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        0,
+        NULL);
+    HeapFree(GetProcessHeap(), 0, detail);
+    if (drive == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    result = control_device(
+        drive,
+        IOCTL_STORAGE_GET_DEVICE_NUMBER,
+        NULL,
+        0,
+        &device_number,
+        sizeof(device_number),
+        NULL);
+    if (result) {
+        result = drive_query(drive, info);
+        info->number = device_number.DeviceNumber;
+    }
+    CloseHandle(drive);
+    return result;
+}
+
+BOOL drive_enumerate(struct drive_info **drives, SIZE_T *count) {
+    HDEVINFO devices;
+    SP_DEVICE_INTERFACE_DATA interface_data;
+    struct drive_info info;
+    SIZE_T capacity = 0;
+    DWORD error = ERROR_SUCCESS;
+    DWORD i;
+
+    *drives = NULL;
+    *count = 0;
+
+    devices = SetupDiGetClassDevsA(
+        &disk_interface_guid,
+        NULL,
+        NULL,
+        DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+    if (devices == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    for (i = 0; ; i++) {
+        interface_data.cbSize = sizeof(interface_data);
+        if (!SetupDiEnumDeviceInterfaces(
+                devices,
+                NULL,
+                &disk_interface_guid,
+                i,
+                &interface_data)) {
+            if (GetLastError() != ERROR_NO_MORE_ITEMS) {
+                error = GetLastError();
+            }
+            break;
+        }
+
+        /* Drives that go away or can't be opened meanwhile are left out. */
+        if (!query_interface(devices, &interface_data, &info)) {
+            continue;
+        }
+
+        if (*count == capacity) {
+            SIZE_T new_capacity = max(capacity * 2, 16);
+            struct drive_info *new_drives = *drives == NULL
+                ? HeapAlloc(
+                    GetProcessHeap(),
+                    0,
+                    sizeof(*new_drives) * new_capacity)
+                : HeapReAlloc(
+                    GetProcessHeap(),
+                    0,
+                    *drives,
+                    sizeof(*new_drives) * new_capacity);
+            if (new_drives == NULL) {
+                error = ERROR_NOT_ENOUGH_MEMORY;
+                break;
+            }
+            *drives = new_drives;
+            capacity = new_capacity;
+        }
+        (*drives)[(*count)++] = info;
+    }
+
+    SetupDiDestroyDeviceInfoList(devices);
+
+    if (error != ERROR_SUCCESS) {
+        HeapFree(GetProcessHeap(), 0, *drives);
+        *drives = NULL;
+        *count = 0;
+        SetLastError(error);
+        return FALSE;
+    }
+    if (*count > 1) {
+        qsort(*drives, *count, sizeof(**drives), compare_drives);
+    }
+    return TRUE;
+}
+
+BOOL drive_trim(HANDLE drive, ULONGLONG offset, ULONGLONG length) {
+    struct trim_request request;
+
+    ZeroMemory(&request, sizeof(request));
+    request.attributes.Size = sizeof(request.attributes);
+    request.attributes.Action = DeviceDsmAction_Trim;
+    request.attributes.DataSetRangesOffset =
+        offsetof(struct trim_request, range);
+    request.attributes.DataSetRangesLength = sizeof(request.range);
+    request.range.StartingOffset = (LONGLONG)offset;
+    request.range.LengthInBytes = length;
+
+    return control_device(
+        drive,
+        IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES,
+        &request,
+        sizeof(request),
+        NULL,
+        0,
+        NULL);
+}
+
+const char *drive_bus_name(int bus_type) {
+    if (bus_type < 0
+        || bus_type >= (int)(sizeof(bus_names) / sizeof(bus_names[0]))) {
+        return bus_names[0];
+    }
+    return bus_names[bus_type];
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_DRIVE_H
+#define WDD_DRIVE_H
+
+#include <windows.h>
+
+/* What a drive reports about itself. Anything that couldn't be queried is
+ * left at 0, except is_rotational, which is -1 when unknown.
+ */
+struct drive_info {
+    DWORD number;
+    char vendor[64];
+    char model[64];
+    char serial[64];
+    ULONGLONG size;
+    DWORD logical_sector_size;
+    DWORD physical_sector_size;
+    DWORD max_transfer_size;
+    int is_rotational;
+    BOOL is_removable;
+    int bus_type;
+    BOOL trim_enabled;
+    BOOL zeros_after_trim;
+    ULONGLONG unmap_granularity;
+    ULONGLONG unmap_alignment;
+};
+
+/* DeviceIoControl() for handles opened with FILE_FLAG_OVERLAPPED, which
+ * require an OVERLAPPED structure even for requests we want to wait for.
+ * Works the same for other handles.
+ */
+BOOL control_device(HANDLE device,
+                    DWORD code,
+                    void *in_buffer,
+                    DWORD in_buffer_size,
+                    void *out_buffer,
+                    DWORD out_buffer_size,
+                    DWORD *num_bytes_returned);
+
+/* Fills in everything but the number from a handle to a drive, which
+ * needs no access rights. Returns FALSE if it isn't a drive.
+ */
+BOOL drive_query(HANDLE drive, struct drive_info *info);
+
+/* Lists the drives that are present in order of their numbers, as in
+ * \\.\PhysicalDriveN. The array is allocated from the process heap.
+ */
+BOOL drive_enumerate(struct drive_info **drives, SIZE_T *count);
+
+/* Tells the drive that a range of bytes is no longer in use. The range must
+ * be made of whole sectors, and only drives with zeros_after_trim set are
+ * bound to read it back as zeros.
+ */
+BOOL drive_trim(HANDLE drive, ULONGLONG offset, ULONGLONG length);
+
+/* Returns the name of a STORAGE_BUS_TYPE. */
+const char *drive_bus_name(int bus_type);
+
+#endif
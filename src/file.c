@@ -0,0 +1,274 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <windows.h>
+#include "drive.h"
+#include "file.h"
+#include "wdd.h"
+
+HANDLE reopen_if_not_disk(HANDLE file,
+                          DWORD access,
+                          DWORD flags,
+                          BOOL *synchronous) {
+    HANDLE new_file;
+
+    *synchronous = FALSE;
+    if (GetFileType(file) == FILE_TYPE_DISK) {
+        return file;
+    }
+
+    new_file = ReOpenFile(
+        file,
+        access,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        flags & ~FILE_FLAG_OVERLAPPED);
+    if (new_file == INVALID_HANDLE_VALUE) {
+        return file;
+    }
+
+    CloseHandle(file);
+    *synchronous = TRUE;
+    return new_file;
+}
+
+HANDLE open_output_file(const char *filename,
+                        DWORD access,
+                        DWORD flags) {
+    HANDLE file;
+
+    /* First try to open as an existing file, then as a new file. We can't
+     * use OPEN_ALWAYS because it fails when the output is a physical drive
+     * (no idea why).
+     */
+    file = CreateFileA(
+        filename,
+        access,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        flags | FILE_FLAG_OVERLAPPED,
+        NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        file = CreateFileA(
+            filename,
+            access,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL,
+            CREATE_ALWAYS,
+            flags | FILE_FLAG_OVERLAPPED,
+            NULL);
+    }
+    return file;
+}
+
+BOOL is_drive(HANDLE file) {
+    DISK_GEOMETRY_EX disk_geometry;
+
+    return GetFileType(file) == FILE_TYPE_DISK
+        && control_device(
+            file,
+            IOCTL_DISK_GET_DRIVE_GEOMETRY,
+            NULL,
+            0,
+            &disk_geometry,
+            sizeof(disk_geometry),
+            NULL);
+}
+
+BOOL is_regular_file(HANDLE file) {
+    return GetFileType(file) == FILE_TYPE_DISK && !is_drive(file);
+}
+
+DWORD get_cluster_size(const char *filename) {
+    char volume_path[MAX_PATH];
+    DWORD sectors_per_cluster;
+    DWORD bytes_per_sector;
+    DWORD num_free_clusters;
+    DWORD num_clusters;
+
+    if (GetVolumePathNameA(filename, volume_path, sizeof(volume_path))
+        && GetDiskFreeSpaceA(
+            volume_path,
+            &sectors_per_cluster,
+            &bytes_per_sector,
+            &num_free_clusters,
+            &num_clusters)) {
+        return sectors_per_cluster * bytes_per_sector;
+    }
+    return 0;
+}
+
+DWORD get_sector_size(HANDLE file, const char *filename) {
+    DISK_GEOMETRY_EX disk_geometry;
+    char volume_path[MAX_PATH];
+    DWORD sectors_per_cluster;
+    DWORD bytes_per_sector;
+    DWORD num_free_clusters;
+    DWORD num_clusters;
+
+    if (control_device(
+            file,
+            IOCTL_DISK_GET_DRIVE_GEOMETRY,
+            NULL,
+            0,
+            &disk_geometry,
+            sizeof(disk_geometry),
+            NULL)) {
+        return disk_geometry.Geometry.BytesPerSector;
+    }
+    if (GetVolumePathNameA(filename, volume_path, sizeof(volume_path))
+        && GetDiskFreeSpaceA(
+            volume_path,
+            &sectors_per_cluster,
+            &bytes_per_sector,
+            &num_free_clusters,
+            &num_clusters)) {
+        return bytes_per_sector;
+    }
+    return BUFFER_SIZE;
+}
+
+ULONGLONG round_to_sector_size(ULONGLONG size, DWORD sector_size) {
+    if (size < sector_size) {
+        return sector_size;
+    }
+    return (size / sector_size) * sector_size;
+}
+
+DWORD get_write_sector_size(HANDLE drive,
+                            DWORD sector_size,
+                            ULONGLONG block_size) {
+    struct drive_info info;
+
+    if (drive_query(drive, &info)
+        && info.physical_sector_size > sector_size
+        && info.physical_sector_size % sector_size == 0
+        && block_size >= info.physical_sector_size) {
+        return info.physical_sector_size;
+    }
+    return sector_size;
+}
+
+BOOL set_end_of_file(HANDLE file, ULONGLONG size) {
+    FILE_END_OF_FILE_INFO info;
+
+    info.EndOfFile.QuadPart = (LONGLONG)size;
+    return SetFileInformationByHandle(
+        file,
+        FileEndOfFileInfo,
+        &info,
+        sizeof(info));
+}
+
+BOOL extend_file(HANDLE file, ULONGLONG size) {
+    LARGE_INTEGER file_size;
+
+    if (!GetFileSizeEx(file, &file_size)) {
+        return FALSE;
+    }
+    if ((ULONGLONG)file_size.QuadPart >= size) {
+        return TRUE;
+    }
+    return set_end_of_file(file, size);
+}
+
+BOOL query_allocated_ranges(HANDLE file,
+                            struct allocated_ranges *map,
+                            ULONGLONG offset) {
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    DWORD num_bytes;
+    BOOL result;
+
+    query.FileOffset.QuadPart = (LONGLONG)offset;
+    query.Length.QuadPart = (LONGLONG)(map->file_size - offset);
+    result = control_device(
+        file,
+        FSCTL_QUERY_ALLOCATED_RANGES,
+        &query,
+        sizeof(query),
+        map->ranges,
+        sizeof(map->ranges),
+        &num_bytes);
+    if (!result && GetLastError() != ERROR_MORE_DATA) {
+        return FALSE;
+    }
+
+    map->count = num_bytes / sizeof(map->ranges[0]);
+    map->index = 0;
+    if (result || map->count == 0) {
+        map->known_end = map->file_size;
+    } else {
+        FILE_ALLOCATED_RANGE_BUFFER *last = &map->ranges[map->count - 1];
+        map->known_end =
+            (ULONGLONG)(last->FileOffset.QuadPart + last->Length.QuadPart);
+    }
+    return TRUE;
+}
+
+BOOL is_hole(HANDLE file,
+             struct allocated_ranges *map,
+             ULONGLONG offset,
+             DWORD *size) {
+    ULONGLONG end;
+
+    if (offset >= map->file_size) {
+        return FALSE;
+    }
+    end = min(offset + *size, map->file_size);
+
+    if (offset >= map->known_end) {
+        if (!query_allocated_ranges(file, map, offset)) {
+            return FALSE;
+        }
+    }
+    if (end > map->known_end) {
+        /* Don't bother with holes that span two batches. */
+        return FALSE;
+    }
+
+    while (map->index < map->count) {
+        FILE_ALLOCATED_RANGE_BUFFER *range = &map->ranges[map->index];
+        ULONGLONG range_start = (ULONGLONG)range->FileOffset.QuadPart;
+        ULONGLONG range_end = range_start + range->Length.QuadPart;
+
+        if (range_end <= offset) {
+            map->index++;
+            continue;
+        }
+        if (range_start < end) {
+            return FALSE;
+        }
+        break;
+    }
+
+    *size = (DWORD)(end - offset);
+    return TRUE;
+}
+
+DWORD get_write_alignment(HANDLE file,
+                          const char *filename,
+                          BOOL direct) {
+    if (direct || is_drive(file)) {
+        return get_sector_size(file, filename);
+    }
+    return 1;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_FILE_H
+#define WDD_FILE_H
+
+#include <windows.h>
+
+#define MAX_ALLOCATED_RANGES 64
+
+/* Allocated parts of a sparse input file, fetched from the file system a
+ * batch at a time as the reader moves forward. Ranges are known up to
+ * known_end; everything in between them is a hole.
+ */
+struct allocated_ranges {
+    FILE_ALLOCATED_RANGE_BUFFER ranges[MAX_ALLOCATED_RANGES];
+    DWORD count;
+    DWORD index;
+    ULONGLONG known_end;
+    ULONGLONG file_size;
+};
+
+/* Overlapped requests carry their own file offset, which means nothing to
+ * pipes and character devices such as NUL or CON. Handles of those types
+ * are reopened for plain synchronous I/O.
+ */
+HANDLE reopen_if_not_disk(HANDLE file,
+                          DWORD access,
+                          DWORD flags,
+                          BOOL *synchronous);
+
+/* Opens an existing output file, disk or volume for overlapped I/O, or
+ * creates a new file.
+ */
+HANDLE open_output_file(const char *filename,
+                        DWORD access,
+                        DWORD flags);
+
+/* Returns TRUE for disks and volumes. */
+BOOL is_drive(HANDLE file);
+
+/* Returns TRUE for files on a file system, as opposed to disks, volumes,
+ * pipes and character devices.
+ */
+BOOL is_regular_file(HANDLE file);
+
+/* Returns the cluster size of the volume a file resides on, or 0 if it
+ * can't be determined.
+ */
+DWORD get_cluster_size(const char *filename);
+
+/* Returns the sector size of a disk or of the volume a file resides on,
+ * which is the alignment unbuffered I/O has to respect.
+ */
+DWORD get_sector_size(HANDLE file, const char *filename);
+
+/* Rounds a block size down to a whole number of sectors, but no less than
+ * one sector.
+ */
+ULONGLONG round_to_sector_size(ULONGLONG size, DWORD sector_size);
+
+/* Drives with 4 KB physical sectors behind 512-byte logical ones have to
+ * read and rewrite a whole physical sector for any write that covers only
+ * part of it, so blocks that are large enough are made whole physical
+ * sectors.
+ */
+DWORD get_write_sector_size(HANDLE drive,
+                            DWORD sector_size,
+                            ULONGLONG block_size);
+
+/* Truncates or extends the file to exactly size bytes. */
+BOOL set_end_of_file(HANDLE file, ULONGLONG size);
+
+/* Makes the file at least size bytes long. Blocks skipped at the end of a
+ * sparse output are not written, so the file may be too short otherwise.
+ */
+BOOL extend_file(HANDLE file, ULONGLONG size);
+
+/* Fetches the next batch of allocated ranges starting at offset. */
+BOOL query_allocated_ranges(HANDLE file,
+                            struct allocated_ranges *map,
+                            ULONGLONG offset);
+
+/* Returns TRUE if the range is entirely inside a hole of the input file and
+ * can be produced without reading it. A range that extends past the end of
+ * the file is clipped to it.
+ */
+BOOL is_hole(HANDLE file,
+             struct allocated_ranges *map,
+             ULONGLONG offset,
+             DWORD *size);
+
+/* Returns the size that every write but the last must be a multiple of:
+ * the sector size for drives and unbuffered output, 1 for anything else.
+ */
+DWORD get_write_alignment(HANDLE file,
+                          const char *filename,
+                          BOOL direct);
+
+#endif
@@ -0,0 +1,327 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <windows.h>
+#include "flash.h"
+#include "wdd.h"
+#include "zero.h"
+
+#define FLASH_STALL_TIMEOUT 30000000
+#define FLASH_SLOW_TIMEOUT 30000000
+#define FLASH_SLOW_RATIO 2
+
+/* Gives up on a target of wdd flash, whether it failed or fell behind.
+ * Whatever it still has in flight is cancelled. The copy only fails once
+ * there are no targets left.
+ */
+static void drop_output(struct program_state *s,
+                        struct tee_output *output,
+                        DWORD error) {
+    if (InterlockedCompareExchange(&output->dropped, TRUE, FALSE) != FALSE) {
+        return;
+    }
+    output->error = error;
+    output->end_time = get_time_usec();
+    ring_detach(&s->ring, output->index);
+    CancelIoEx(output->file, NULL);
+    if (InterlockedDecrement(&s->num_live_outputs) == 0) {
+        abort_copy(s, error, "All targets failed");
+    }
+}
+
+DWORD WINAPI tee_writer_thread_proc(LPVOID param) {
+    struct tee_output *output = param;
+    struct program_state *s = output->s;
+    struct io_queue queue;
+    LONGLONG next_seq = 0;
+    BOOL end_of_input = FALSE;
+    const char *data = NULL;
+    DWORD write_size = 0;
+    BOOL writing_slot = FALSE;
+    DWORD partial_pos = 0;
+    DWORD tail_written = 0;
+
+    ZeroMemory(&queue, sizeof(queue));
+    if (!io_queue_init(
+            &queue,
+            output->file,
+            output->is_synchronous,
+            s->io_depth)) {
+        abort_copy(s, GetLastError(), "Failed to create I/O queue");
+        return 1;
+    }
+
+    while (!s->aborted && !output->dropped) {
+        struct ring_slot *slot;
+        DWORD size;
+        DWORD piece_size;
+        DWORD num_bytes;
+        DWORD error;
+        ULONGLONG wait_start_time;
+
+        while (!end_of_input && !io_queue_is_full(&queue)) {
+            if (writing_slot) {
+                piece_size = min(s->out_unit, write_size - partial_pos);
+                slot = &s->ring.slots[next_seq % s->ring.depth];
+                if (s->sparse
+                    && (slot->hole
+                        || is_zero_block(data + partial_pos, piece_size))) {
+                    io_queue_skip(&queue, piece_size);
+                } else {
+                    io_queue_submit(
+                        &queue,
+                        IO_WRITE,
+                        (char *)data + partial_pos,
+                        piece_size,
+                        output->offset + partial_pos);
+                }
+                partial_pos += piece_size;
+                if (partial_pos == write_size) {
+                    output->offset += slot->size;
+                    next_seq++;
+                    writing_slot = FALSE;
+                }
+                continue;
+            }
+
+            slot = ring_acquire_unhashed_at(
+                &s->ring,
+                output->index,
+                next_seq,
+                queue.num_pending == 0,
+                &s->aborted);
+            if (slot == NULL || output->dropped) {
+                break;
+            }
+            if (slot->size == 0) {
+                end_of_input = TRUE;
+                break;
+            }
+
+            /* Only the last block may be padded: there is a single pad
+             * buffer, and the padding would shift everything after it.
+             */
+            if (output->padding > 0) {
+                if (s->flash) {
+                    drop_output(s, output, ERROR_INVALID_PARAMETER);
+                } else {
+                    abort_copy(
+                        s,
+                        ERROR_INVALID_PARAMETER,
+                        "Block is not a multiple of the sector size");
+                }
+                break;
+            }
+            data = slot->data;
+            write_size = slot->size;
+            if (write_size % output->alignment != 0) {
+                write_size = (write_size / output->alignment + 1)
+                    * output->alignment;
+                output->padding = write_size - slot->size;
+                CopyMemory(output->pad_buffer, slot->data, slot->size);
+                ZeroMemory(output->pad_buffer + slot->size, output->padding);
+                data = output->pad_buffer;
+            }
+            writing_slot = TRUE;
+            partial_pos = 0;
+        }
+
+        if (queue.num_pending == 0) {
+            break;
+        }
+
+        /* Time spent waiting for the drive, as opposed to the ring, tells
+         * how fast it writes on its own.
+         */
+        wait_start_time = get_time_usec();
+        error = io_queue_complete(&queue, &num_bytes);
+        add_to_counter(&output->busy_time, get_time_usec() - wait_start_time);
+        if (error != ERROR_SUCCESS) {
+            if (s->flash) {
+                drop_output(s, output, error);
+            } else {
+                abort_copy(s, error, "Error writing to file");
+            }
+            break;
+        }
+
+        /* The oldest slot in flight is only padded if it's the last. */
+        slot = &s->ring.slots[s->ring.hashed[output->index] % s->ring.depth];
+        size = slot->size;
+        if (size % output->alignment != 0) {
+            size = (size / output->alignment + 1) * output->alignment;
+        }
+        tail_written += min(s->out_unit, size - tail_written);
+        if (tail_written < size) {
+            continue;
+        }
+        tail_written = 0;
+        size = slot->size;
+        if (!ring_release_attached(&s->ring, output->index)) {
+            break;
+        }
+        add_to_counter(&output->num_bytes_out, size);
+    }
+
+    io_queue_cancel(&queue);
+    io_queue_free(&queue);
+    if (!output->dropped) {
+        output->end_time = get_time_usec();
+    }
+    return 0;
+}
+
+static int compare_rates(const void *a, const void *b) {
+    double rate_a = *(const double *)a;
+    double rate_b = *(const double *)b;
+
+    if (rate_a < rate_b) {
+        return -1;
+    }
+    return rate_a > rate_b;
+}
+
+/* The speed at which a target of wdd flash writes when it isn't waiting for
+ * the others, in bytes per microsecond.
+ */
+static double get_write_rate(struct tee_output *output) {
+    ULONGLONG busy_time = load_counter(&output->busy_time);
+
+    if (busy_time == 0) {
+        return 0;
+    }
+    return (double)load_counter(&output->num_bytes_out) / busy_time;
+}
+
+void check_flash_targets(struct program_state *s,
+                         ULONGLONG current_time) {
+    double rates[MAX_OUTPUTS - 1];
+    double median_rate;
+    LONGLONG max_seq = 0;
+    int num_rates = 0;
+    int i;
+
+    for (i = 0; i < s->num_tee_outputs; i++) {
+        if (!s->tee_outputs[i].dropped) {
+            max_seq = max(
+                max_seq,
+                ring_load(&s->ring.hashed[s->tee_outputs[i].index]));
+            rates[num_rates++] = get_write_rate(&s->tee_outputs[i]);
+        }
+    }
+    if (num_rates == 0) {
+        return;
+    }
+    qsort(rates, num_rates, sizeof(*rates), compare_rates);
+    median_rate = rates[num_rates / 2];
+
+    for (i = 0; i < s->num_tee_outputs; i++) {
+        struct tee_output *output = &s->tee_outputs[i];
+        LONGLONG seq = ring_load(&s->ring.hashed[output->index]);
+
+        if (output->dropped) {
+            continue;
+        }
+        if (seq != output->last_seq || seq == max_seq) {
+            output->last_seq = seq;
+            output->last_progress_time = current_time;
+        } else if (current_time - output->last_progress_time
+                >= FLASH_STALL_TIMEOUT) {
+            drop_output(s, output, ERROR_TIMEOUT);
+            continue;
+        }
+        if (get_write_rate(output) * FLASH_SLOW_RATIO >= median_rate) {
+            output->slow_start_time = current_time;
+        } else if (current_time - output->slow_start_time
+                >= FLASH_SLOW_TIMEOUT) {
+            drop_output(s, output, ERROR_TIMEOUT);
+        }
+    }
+}
+
+ULONGLONG get_flash_progress(struct program_state *s) {
+    ULONGLONG num_bytes = (ULONGLONG)-1;
+    int i;
+
+    for (i = 0; i < s->num_tee_outputs; i++) {
+        if (!s->tee_outputs[i].dropped) {
+            num_bytes = min(
+                num_bytes,
+                load_counter(&s->tee_outputs[i].num_bytes_out));
+        }
+    }
+    return num_bytes == (ULONGLONG)-1 ? 0 : num_bytes;
+}
+
+BOOL print_flash_report(const struct program_state *s) {
+    BOOL ok = TRUE;
+    int i;
+
+    for (i = 0; i < s->num_tee_outputs; i++) {
+        const struct tee_output *output = &s->tee_outputs[i];
+        const struct verifier *v = &output->verifier;
+        ULONGLONG end_time = output->end_time;
+        ULONGLONG elapsed_time;
+        char size_str[32];
+        char speed_str[32];
+
+        if (end_time == 0) {
+            end_time = get_time_usec();
+        }
+        elapsed_time = max(end_time - output->start_time, 1);
+        format_size(size_str, sizeof(size_str), output->num_bytes_out);
+        format_speed(
+            speed_str,
+            sizeof(speed_str),
+            output->num_bytes_out / ((double)elapsed_time / 1000000));
+        fprintf(stderr, "%s: %s written in %0.1f s, %s, ",
+                output->filename,
+                size_str,
+                (double)elapsed_time / 1000000.0,
+                speed_str);
+
+        if (output->dropped || v->error != ERROR_SUCCESS) {
+            char *reason = get_error_message(
+                output->dropped ? output->error : v->error);
+
+            reason[strlen(reason) - 2] = '\0';
+            fprintf(stderr, "%s: %s\n",
+                    output->dropped ? "dropped" : "could not read back",
+                    reason);
+            LocalFree(reason);
+            ok = FALSE;
+        } else if (v->num_bad_chunks > 0) {
+            fprintf(stderr, "verification failed: %llu chunks of %d MB "
+                            "differ, the first one at offset %llu\n",
+                    v->num_bad_chunks,
+                    VERIFY_CHUNK_SIZE / MB,
+                    v->first_bad_offset);
+            ok = FALSE;
+        } else if (s->verify) {
+            fprintf(stderr, "verified\n");
+        } else {
+            fprintf(stderr, "done\n");
+        }
+    }
+    return ok;
+}
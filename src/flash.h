@@ -0,0 +1,55 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_FLASH_H
+#define WDD_FLASH_H
+
+#include <windows.h>
+#include "wdd.h"
+
+/* Writes the slots to an extra output, the same way writer_thread_proc()
+ * does for the main one but without the journal, index and compression.
+ */
+DWORD WINAPI tee_writer_thread_proc(LPVOID param);
+
+/* Drops any target of wdd flash that has had nothing written for
+ * FLASH_STALL_TIMEOUT while another one got further. Targets that are all
+ * waiting for the input are left alone.
+ *
+ * All targets share the ring, so one that writes much more slowly than the
+ * rest holds every other one back to its speed. Cards of the same kind
+ * differ a little, so a target is only dropped for this if its own write
+ * rate has stayed below 1/FLASH_SLOW_RATIO of the batch median for
+ * FLASH_SLOW_TIMEOUT.
+ */
+void check_flash_targets(struct program_state *s,
+                         ULONGLONG current_time);
+
+/* The progress of wdd flash is that of the slowest target left. */
+ULONGLONG get_flash_progress(struct program_state *s);
+
+/* Prints a line for every target of wdd flash. Returns FALSE if any of them
+ * was dropped or failed verification.
+ */
+BOOL print_flash_report(const struct program_state *s);
+
+#endif
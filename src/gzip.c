@@ -0,0 +1,1448 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "gzip.h"
+#include "huffman.h"
+
+#define CRC32_POLYNOMIAL 0xEDB88320U
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define TOO_FAR 4096
+#define NUM_LITLEN_SYMBOLS 286
+#define NUM_DISTANCE_SYMBOLS 30
+#define NUM_CODELEN_SYMBOLS 19
+#define MAX_CODE_LENGTH 15
+#define MAX_CODELEN_CODE_LENGTH 7
+#define END_OF_BLOCK 256
+#define MAX_STORED_SIZE 65535
+#define HEADER_SIZE 10
+#define TRAILER_SIZE 8
+#define NUM_FIXED_LITLEN_SYMBOLS 288
+#define NUM_FIXED_DISTANCE_SYMBOLS 32
+#define LITLEN_ROOT_BITS 10
+#define DISTANCE_ROOT_BITS 8
+#define CODELEN_ROOT_BITS 7
+#define REFILL_THRESHOLD 48
+
+#define FLAG_HEADER_CRC 0x02
+#define FLAG_EXTRA 0x04
+#define FLAG_NAME 0x08
+#define FLAG_COMMENT 0x10
+#define FLAG_RESERVED 0xE0
+
+/* Decoding table entries hold the symbol in the upper half and the code
+ * length in the low byte. Codes longer than the root bits continue in a
+ * subtable, whose entry holds its offset and index bits instead.
+ */
+#define ENTRY_SUBTABLE 0x100
+#define ENTRY_INVALID 0x200
+
+enum block_type {
+    BLOCK_STORED,
+    BLOCK_FIXED,
+    BLOCK_DYNAMIC
+};
+
+/* How hard the match finder tries at each level, as in zlib. */
+static const struct {
+    int max_chain;
+    int nice_length;
+    int lazy;
+} levels[10] = {
+    {0, 0, 0},
+    {4, 8, 0},
+    {8, 16, 0},
+    {16, 32, 0},
+    {16, 32, 1},
+    {32, 64, 1},
+    {128, 128, 1},
+    {256, 128, 1},
+    {1024, 258, 1},
+    {4096, 258, 1}
+};
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+
+static const uint8_t distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static const uint8_t codelen_order[NUM_CODELEN_SYMBOLS] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static uint32_t crc_table[8][256];
+static uint8_t length_codes[MAX_MATCH + 1];
+static uint8_t distance_codes[512];
+static int tables_ready;
+
+static void init_tables(void) {
+    uint32_t i;
+    int j;
+
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (CRC32_POLYNOMIAL & (0 - (crc & 1)));
+        }
+        crc_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8)
+                ^ crc_table[0][crc_table[j - 1][i] & 0xFF];
+        }
+    }
+
+    /* Distances up to 256 are looked up directly, longer ones by their
+     * upper bits.
+     */
+    for (j = 0; j < 29; j++) {
+        for (i = length_base[j]; i < length_base[j] + (1U << length_extra[j])
+                && i <= MAX_MATCH; i++) {
+            length_codes[i] = (uint8_t)j;
+        }
+    }
+    length_codes[MAX_MATCH] = 28;
+    for (j = 0; j < 30; j++) {
+        for (i = distance_base[j];
+             i < distance_base[j] + (1U << distance_extra[j]);
+             i++) {
+            if (i <= 256) {
+                distance_codes[i - 1] = (uint8_t)j;
+            } else {
+                distance_codes[256 + ((i - 1) >> 7)] = (uint8_t)j;
+            }
+        }
+    }
+    tables_ready = 1;
+}
+
+static int distance_code(unsigned int distance) {
+    return distance <= 256
+        ? distance_codes[distance - 1]
+        : distance_codes[256 + ((distance - 1) >> 7)];
+}
+
+static uint32_t crc32_update(uint32_t crc,
+                             const unsigned char *p,
+                             size_t size) {
+    crc = ~crc;
+    while (size >= 8) {
+        uint32_t low;
+        uint32_t high;
+
+        memcpy(&low, p, sizeof(low));
+        memcpy(&high, p + 4, sizeof(high));
+        low ^= crc;
+        crc = crc_table[7][low & 0xFF]
+            ^ crc_table[6][(low >> 8) & 0xFF]
+            ^ crc_table[5][(low >> 16) & 0xFF]
+            ^ crc_table[4][low >> 24]
+            ^ crc_table[3][high & 0xFF]
+            ^ crc_table[2][(high >> 8) & 0xFF]
+            ^ crc_table[1][(high >> 16) & 0xFF]
+            ^ crc_table[0][high >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p) & 0xFF];
+        p++;
+        size--;
+    }
+    return ~crc;
+}
+
+uint32_t gzip_crc32(uint32_t crc, const void *data, size_t size) {
+    if (!tables_ready) {
+        init_tables();
+    }
+    return crc32_update(crc, data, size);
+}
+
+/* Deflate packs bits starting from the least significant one. */
+struct bit_writer {
+    unsigned char *p;
+    uint64_t bits;
+    int num_bits;
+};
+
+static void put_bits(struct bit_writer *writer, uint32_t value, int count) {
+    writer->bits |= (uint64_t)value << writer->num_bits;
+    writer->num_bits += count;
+    while (writer->num_bits >= 8) {
+        *writer->p++ = (unsigned char)writer->bits;
+        writer->bits >>= 8;
+        writer->num_bits -= 8;
+    }
+}
+
+static void align_to_byte(struct bit_writer *writer) {
+    if (writer->num_bits > 0) {
+        put_bits(writer, 0, 8 - writer->num_bits);
+    }
+}
+
+/* Assigns canonical codes, bit-reversed for writing LSB first. */
+static void assign_codes(const uint8_t *lengths,
+                         int num_symbols,
+                         uint16_t *codes) {
+    uint16_t counts[MAX_CODE_LENGTH + 1];
+    uint16_t next_code[MAX_CODE_LENGTH + 1];
+    uint16_t code = 0;
+    int i;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < num_symbols; i++) {
+        counts[lengths[i]]++;
+    }
+    counts[0] = 0;
+    for (i = 1; i <= MAX_CODE_LENGTH; i++) {
+        code = (uint16_t)((code + counts[i - 1]) << 1);
+        next_code[i] = code;
+    }
+    for (i = 0; i < num_symbols; i++) {
+        int length = lengths[i];
+        uint16_t reversed = 0;
+        int j;
+
+        if (length == 0) {
+            continue;
+        }
+        code = next_code[length]++;
+        for (j = 0; j < length; j++) {
+            reversed = (uint16_t)((reversed << 1) | ((code >> j) & 1));
+        }
+        codes[i] = reversed;
+    }
+}
+
+/* Code lengths of a dynamic block header, run-length encoded with the
+ * repeat symbols 16, 17 and 18.
+ */
+struct codelen_run {
+    uint8_t symbol;
+    uint8_t extra;
+};
+
+static int encode_code_lengths(const uint8_t *lengths,
+                               int count,
+                               struct codelen_run *runs) {
+    int num_runs = 0;
+    int i = 0;
+
+    while (i < count) {
+        int length = lengths[i];
+        int run = 1;
+
+        while (i + run < count && lengths[i + run] == length) {
+            run++;
+        }
+        i += run;
+
+        if (length == 0) {
+            while (run >= 11) {
+                int n = run < 138 ? run : 138;
+                runs[num_runs].symbol = 18;
+                runs[num_runs++].extra = (uint8_t)(n - 11);
+                run -= n;
+            }
+            if (run >= 3) {
+                runs[num_runs].symbol = 17;
+                runs[num_runs++].extra = (uint8_t)(run - 3);
+                run = 0;
+            }
+        } else {
+            runs[num_runs].symbol = (uint8_t)length;
+            runs[num_runs++].extra = 0;
+            run--;
+            while (run >= 3) {
+                int n = run < 6 ? run : 6;
+                runs[num_runs].symbol = 16;
+                runs[num_runs++].extra = (uint8_t)(n - 3);
+                run -= n;
+            }
+        }
+        while (run > 0) {
+            runs[num_runs].symbol = (uint8_t)length;
+            runs[num_runs++].extra = 0;
+            run--;
+        }
+    }
+    return num_runs;
+}
+
+static int codelen_extra_bits(int symbol) {
+    switch (symbol) {
+        case 16:
+            return 2;
+        case 17:
+            return 3;
+        case 18:
+            return 7;
+        default:
+            return 0;
+    }
+}
+
+/* The codes of one block and what it costs to write it with them. */
+struct block_codes {
+    uint8_t litlen_lengths[NUM_LITLEN_SYMBOLS + 2];
+    uint8_t distance_lengths[NUM_DISTANCE_SYMBOLS];
+    uint16_t litlen_codes[NUM_LITLEN_SYMBOLS + 2];
+    uint16_t distance_codes[NUM_DISTANCE_SYMBOLS];
+    uint8_t codelen_lengths[NUM_CODELEN_SYMBOLS];
+    uint16_t codelen_codes[NUM_CODELEN_SYMBOLS];
+    struct codelen_run runs[NUM_LITLEN_SYMBOLS + NUM_DISTANCE_SYMBOLS];
+    int num_runs;
+    int num_litlen_codes;
+    int num_distance_codes;
+    int num_codelen_codes;
+};
+
+static uint64_t symbols_cost(const uint32_t *litlen_freqs,
+                             const uint32_t *distance_freqs,
+                             const uint8_t *litlen_lengths,
+                             const uint8_t *distance_lengths) {
+    uint64_t cost = 0;
+    int i;
+
+    for (i = 0; i < NUM_LITLEN_SYMBOLS; i++) {
+        cost += (uint64_t)litlen_freqs[i] * litlen_lengths[i];
+        if (i > END_OF_BLOCK) {
+            cost += (uint64_t)litlen_freqs[i] * length_extra[i - 257];
+        }
+    }
+    for (i = 0; i < NUM_DISTANCE_SYMBOLS; i++) {
+        cost += (uint64_t)distance_freqs[i]
+            * (distance_lengths[i] + distance_extra[i]);
+    }
+    return cost;
+}
+
+static void set_fixed_codes(struct block_codes *codes) {
+    int i;
+
+    for (i = 0; i < NUM_LITLEN_SYMBOLS + 2; i++) {
+        codes->litlen_lengths[i] =
+            i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+    memset(codes->distance_lengths, 5, NUM_DISTANCE_SYMBOLS);
+    assign_codes(codes->litlen_lengths,
+                 NUM_LITLEN_SYMBOLS + 2,
+                 codes->litlen_codes);
+    assign_codes(codes->distance_lengths,
+                 NUM_DISTANCE_SYMBOLS,
+                 codes->distance_codes);
+}
+
+static uint64_t set_dynamic_codes(struct block_codes *codes,
+                                  const uint32_t *litlen_freqs,
+                                  const uint32_t *distance_freqs) {
+    uint8_t all_lengths[NUM_LITLEN_SYMBOLS + NUM_DISTANCE_SYMBOLS];
+    uint32_t codelen_freqs[NUM_CODELEN_SYMBOLS];
+    uint64_t cost;
+    int i;
+
+    huffman_build_lengths(
+        litlen_freqs,
+        NUM_LITLEN_SYMBOLS,
+        MAX_CODE_LENGTH,
+        codes->litlen_lengths);
+    huffman_build_lengths(
+        distance_freqs,
+        NUM_DISTANCE_SYMBOLS,
+        MAX_CODE_LENGTH,
+        codes->distance_lengths);
+    assign_codes(codes->litlen_lengths,
+                 NUM_LITLEN_SYMBOLS,
+                 codes->litlen_codes);
+    assign_codes(codes->distance_lengths,
+                 NUM_DISTANCE_SYMBOLS,
+                 codes->distance_codes);
+
+    codes->num_litlen_codes = NUM_LITLEN_SYMBOLS;
+    while (codes->num_litlen_codes > 257
+           && codes->litlen_lengths[codes->num_litlen_codes - 1] == 0) {
+        codes->num_litlen_codes--;
+    }
+    codes->num_distance_codes = NUM_DISTANCE_SYMBOLS;
+    while (codes->num_distance_codes > 1
+           && codes->distance_lengths[codes->num_distance_codes - 1] == 0) {
+        codes->num_distance_codes--;
+    }
+
+    memcpy(all_lengths, codes->litlen_lengths, codes->num_litlen_codes);
+    memcpy(all_lengths + codes->num_litlen_codes,
+           codes->distance_lengths,
+           codes->num_distance_codes);
+    codes->num_runs = encode_code_lengths(
+        all_lengths,
+        codes->num_litlen_codes + codes->num_distance_codes,
+        codes->runs);
+
+    memset(codelen_freqs, 0, sizeof(codelen_freqs));
+    for (i = 0; i < codes->num_runs; i++) {
+        codelen_freqs[codes->runs[i].symbol]++;
+    }
+    huffman_build_lengths(
+        codelen_freqs,
+        NUM_CODELEN_SYMBOLS,
+        MAX_CODELEN_CODE_LENGTH,
+        codes->codelen_lengths);
+    assign_codes(codes->codelen_lengths,
+                 NUM_CODELEN_SYMBOLS,
+                 codes->codelen_codes);
+
+    codes->num_codelen_codes = NUM_CODELEN_SYMBOLS;
+    while (codes->num_codelen_codes > 4
+           && codes->codelen_lengths[
+                codelen_order[codes->num_codelen_codes - 1]] == 0) {
+        codes->num_codelen_codes--;
+    }
+
+    cost = 5 + 5 + 4 + 3 * codes->num_codelen_codes;
+    for (i = 0; i < codes->num_runs; i++) {
+        int symbol = codes->runs[i].symbol;
+        cost += codes->codelen_lengths[symbol] + codelen_extra_bits(symbol);
+    }
+    return cost
+        + symbols_cost(
+            litlen_freqs,
+            distance_freqs,
+            codes->litlen_lengths,
+            codes->distance_lengths);
+}
+
+static void write_dynamic_header(struct bit_writer *writer,
+                                 const struct block_codes *codes) {
+    int i;
+
+    put_bits(writer, codes->num_litlen_codes - 257, 5);
+    put_bits(writer, codes->num_distance_codes - 1, 5);
+    put_bits(writer, codes->num_codelen_codes - 4, 4);
+    for (i = 0; i < codes->num_codelen_codes; i++) {
+        put_bits(writer, codes->codelen_lengths[codelen_order[i]], 3);
+    }
+    for (i = 0; i < codes->num_runs; i++) {
+        int symbol = codes->runs[i].symbol;
+
+        put_bits(writer,
+                 codes->codelen_codes[symbol],
+                 codes->codelen_lengths[symbol]);
+        put_bits(writer, codes->runs[i].extra, codelen_extra_bits(symbol));
+    }
+}
+
+static void write_symbols(struct bit_writer *writer,
+                          const struct gzip_state *state,
+                          int num_symbols,
+                          const struct block_codes *codes) {
+    int i;
+
+    for (i = 0; i < num_symbols; i++) {
+        unsigned int length = state->lengths[i];
+        unsigned int distance = state->distances[i];
+
+        if (distance == 0) {
+            put_bits(writer,
+                     codes->litlen_codes[length],
+                     codes->litlen_lengths[length]);
+        } else {
+            int code = length_codes[length];
+            int distance_symbol = distance_code(distance);
+
+            put_bits(writer,
+                     codes->litlen_codes[257 + code],
+                     codes->litlen_lengths[257 + code]);
+            put_bits(writer, length - length_base[code], length_extra[code]);
+            put_bits(writer,
+                     codes->distance_codes[distance_symbol],
+                     codes->distance_lengths[distance_symbol]);
+            put_bits(writer,
+                     distance - distance_base[distance_symbol],
+                     distance_extra[distance_symbol]);
+        }
+    }
+    put_bits(writer,
+             codes->litlen_codes[END_OF_BLOCK],
+             codes->litlen_lengths[END_OF_BLOCK]);
+}
+
+static void write_stored(struct bit_writer *writer,
+                         const unsigned char *data,
+                         size_t size,
+                         int final) {
+    do {
+        size_t block_size = size < MAX_STORED_SIZE ? size : MAX_STORED_SIZE;
+        int last = final && block_size == size;
+
+        put_bits(writer, last, 1);
+        put_bits(writer, BLOCK_STORED, 2);
+        align_to_byte(writer);
+        put_bits(writer, (uint32_t)block_size, 16);
+        put_bits(writer, (uint32_t)~block_size & 0xFFFF, 16);
+        memcpy(writer->p, data, block_size);
+        writer->p += block_size;
+        data += block_size;
+        size -= block_size;
+    } while (size > 0);
+}
+
+/* Writes the buffered symbols, which cover data[0..size), as whichever
+ * kind of block comes out smallest.
+ */
+static void flush_block(struct bit_writer *writer,
+                        const struct gzip_state *state,
+                        int num_symbols,
+                        const unsigned char *data,
+                        size_t size,
+                        int final) {
+    struct block_codes dynamic_codes;
+    struct block_codes fixed_codes;
+    uint32_t litlen_freqs[NUM_LITLEN_SYMBOLS];
+    uint32_t distance_freqs[NUM_DISTANCE_SYMBOLS];
+    uint64_t dynamic_cost;
+    uint64_t fixed_cost;
+    uint64_t stored_cost;
+    int i;
+
+    memset(litlen_freqs, 0, sizeof(litlen_freqs));
+    memset(distance_freqs, 0, sizeof(distance_freqs));
+    for (i = 0; i < num_symbols; i++) {
+        if (state->distances[i] == 0) {
+            litlen_freqs[state->lengths[i]]++;
+        } else {
+            litlen_freqs[257 + length_codes[state->lengths[i]]]++;
+            distance_freqs[distance_code(state->distances[i])]++;
+        }
+    }
+    litlen_freqs[END_OF_BLOCK] = 1;
+
+    dynamic_cost = set_dynamic_codes(
+        &dynamic_codes,
+        litlen_freqs,
+        distance_freqs);
+    set_fixed_codes(&fixed_codes);
+    fixed_cost = symbols_cost(
+        litlen_freqs,
+        distance_freqs,
+        fixed_codes.litlen_lengths,
+        fixed_codes.distance_lengths);
+    stored_cost = (size / MAX_STORED_SIZE + 1) * (3 + 7 + 32) + size * 8;
+
+    if (stored_cost <= dynamic_cost && stored_cost <= fixed_cost) {
+        write_stored(writer, data, size, final);
+    } else if (fixed_cost <= dynamic_cost) {
+        put_bits(writer, final, 1);
+        put_bits(writer, BLOCK_FIXED, 2);
+        write_symbols(writer, state, num_symbols, &fixed_codes);
+    } else {
+        put_bits(writer, final, 1);
+        put_bits(writer, BLOCK_DYNAMIC, 2);
+        write_dynamic_header(writer, &dynamic_codes);
+        write_symbols(writer, state, num_symbols, &dynamic_codes);
+    }
+}
+
+static uint32_t hash3(const unsigned char *p) {
+    uint32_t value = p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16);
+    return (value * 2654435761U) >> (32 - GZIP_HASH_BITS);
+}
+
+static void insert_position(struct gzip_state *state,
+                            const unsigned char *data,
+                            size_t size,
+                            size_t pos) {
+    if (pos + MIN_MATCH <= size) {
+        uint32_t hash = hash3(data + pos);
+        state->prev[pos % GZIP_WINDOW_SIZE] = state->head[hash];
+        state->head[hash] = (int32_t)pos;
+    }
+}
+
+/* Follows the hash chain of pos and returns the longest match found, or 0
+ * if there is none. Entries of the chain that were overwritten by newer
+ * positions stop the search.
+ */
+static unsigned int find_match(const struct gzip_state *state,
+                               int level,
+                               const unsigned char *data,
+                               size_t size,
+                               size_t pos,
+                               unsigned int *distance) {
+    const unsigned char *p = data + pos;
+    unsigned int max_length = MAX_MATCH;
+    unsigned int best_length = MIN_MATCH - 1;
+    int chain = levels[level].max_chain;
+    int32_t candidate;
+
+    if (size - pos < MIN_MATCH) {
+        return 0;
+    }
+    if (size - pos < max_length) {
+        max_length = (unsigned int)(size - pos);
+    }
+
+    candidate = state->head[hash3(p)];
+    while (candidate >= 0
+           && pos - (size_t)candidate <= GZIP_WINDOW_SIZE
+           && chain-- > 0) {
+        const unsigned char *match = data + candidate;
+        int32_t next;
+
+        if (match[best_length] == p[best_length] && match[0] == p[0]) {
+            unsigned int length = 1;
+
+            while (length < max_length && match[length] == p[length]) {
+                length++;
+            }
+            if (length > best_length) {
+                best_length = length;
+                *distance = (unsigned int)(pos - (size_t)candidate);
+                if (length >= (unsigned int)levels[level].nice_length
+                    || length == max_length) {
+                    break;
+                }
+            }
+        }
+
+        next = state->prev[candidate % GZIP_WINDOW_SIZE];
+        if (next >= candidate) {
+            break;
+        }
+        candidate = next;
+    }
+
+    if (best_length < MIN_MATCH
+        || (best_length == MIN_MATCH && *distance > TOO_FAR)) {
+        return 0;
+    }
+    return best_length;
+}
+
+static void deflate(struct gzip_state *state,
+                    int level,
+                    const unsigned char *data,
+                    size_t size,
+                    struct bit_writer *writer) {
+    size_t pos = 0;
+    size_t block_start = 0;
+    int num_symbols = 0;
+
+    memset(state->head, 0xFF, sizeof(state->head));
+
+    while (pos < size) {
+        unsigned int distance = 0;
+        unsigned int length = find_match(state, level, data, size, pos,
+                                         &distance);
+
+        insert_position(state, data, size, pos);
+
+        /* With lazy matching a literal is emitted instead if the next
+         * position has a longer match.
+         */
+        if (levels[level].lazy
+            && length > 0
+            && length < (unsigned int)levels[level].nice_length) {
+            unsigned int next_distance = 0;
+            unsigned int next_length = find_match(
+                state, level, data, size, pos + 1, &next_distance);
+
+            if (next_length > length) {
+                state->lengths[num_symbols] = data[pos];
+                state->distances[num_symbols] = 0;
+                num_symbols++;
+                pos++;
+                insert_position(state, data, size, pos);
+                length = next_length;
+                distance = next_distance;
+            }
+        }
+
+        if (length > 0) {
+            size_t i;
+
+            state->lengths[num_symbols] = (uint16_t)length;
+            state->distances[num_symbols] = (uint16_t)distance;
+            for (i = 1; i < length; i++) {
+                insert_position(state, data, size, pos + i);
+            }
+            pos += length;
+        } else {
+            state->lengths[num_symbols] = data[pos];
+            state->distances[num_symbols] = 0;
+            pos++;
+        }
+        num_symbols++;
+
+        if (num_symbols >= GZIP_BLOCK_SYMBOLS - 1 && pos < size) {
+            flush_block(writer, state, num_symbols, data + block_start,
+                        pos - block_start, 0);
+            block_start = pos;
+            num_symbols = 0;
+        }
+    }
+
+    flush_block(writer, state, num_symbols, data + block_start,
+                size - block_start, 1);
+    align_to_byte(writer);
+}
+
+size_t gzip_compress_bound(size_t size) {
+    return size + size / 1024 + 64;
+}
+
+size_t gzip_compress_member(struct gzip_state *state,
+                            int level,
+                            const void *data,
+                            size_t size,
+                            void *member) {
+    static const unsigned char header[HEADER_SIZE] = {
+        0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 11
+    };
+    struct bit_writer writer;
+    uint32_t crc;
+    uint32_t original_size = (uint32_t)size;
+
+    if (!tables_ready) {
+        init_tables();
+    }
+    if (level < 1 || level > 9) {
+        level = GZIP_DEFAULT_LEVEL;
+    }
+
+    memcpy(member, header, HEADER_SIZE);
+    writer.p = (unsigned char *)member + HEADER_SIZE;
+    writer.bits = 0;
+    writer.num_bits = 0;
+    deflate(state, level, data, size, &writer);
+
+    crc = crc32_update(0, data, size);
+    memcpy(writer.p, &crc, sizeof(crc));
+    memcpy(writer.p + 4, &original_size, sizeof(original_size));
+    writer.p += TRAILER_SIZE;
+    return (size_t)(writer.p - (unsigned char *)member);
+}
+
+enum decoder_state {
+    STATE_MEMBER_HEADER,
+    STATE_BLOCK_HEADER,
+    STATE_STORED,
+    STATE_HUFFMAN,
+    STATE_TRAILER
+};
+
+static size_t fill(struct in_stream *in, size_t size) {
+    size_t available = (size_t)(in->end - in->p);
+
+    if (available >= size || in->fill == NULL) {
+        return available;
+    }
+    return in->fill(in, size);
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/* The bit buffer may hold bytes past num_bits that are still at in->p.
+ * They are the same bytes that will be added next, so they do no harm
+ * as long as the buffer is cleared before in->p is moved any other way.
+ */
+static int need_bits(struct gzip_decoder *decoder,
+                     struct in_stream *in,
+                     int count) {
+    while (decoder->num_bits < count) {
+        if (in->p == in->end && fill(in, 8) == 0) {
+            return 0;
+        }
+        decoder->bits |= (uint64_t)*in->p++ << decoder->num_bits;
+        decoder->num_bits += 8;
+    }
+    return 1;
+}
+
+static uint32_t get_bits(struct gzip_decoder *decoder, int count) {
+    uint32_t value = (uint32_t)decoder->bits & ((1U << count) - 1);
+
+    decoder->bits >>= count;
+    decoder->num_bits -= count;
+    return value;
+}
+
+static int read_bytes(struct gzip_decoder *decoder,
+                      struct in_stream *in,
+                      unsigned char *bytes,
+                      size_t count) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (!need_bits(decoder, in, 8)) {
+            return 0;
+        }
+        bytes[i] = (unsigned char)get_bits(decoder, 8);
+    }
+    return 1;
+}
+
+static int skip_string(struct gzip_decoder *decoder, struct in_stream *in) {
+    unsigned char c;
+
+    do {
+        if (!read_bytes(decoder, in, &c, 1)) {
+            return 0;
+        }
+    } while (c != 0);
+    return 1;
+}
+
+static void skip_to_byte(struct gzip_decoder *decoder) {
+    get_bits(decoder, decoder->num_bits & 7);
+}
+
+static uint32_t reverse_bits(uint32_t code, int length) {
+    uint32_t result = 0;
+
+    while (length-- > 0) {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+    return result;
+}
+
+/* Builds a decoding table from canonical code lengths. Incomplete codes
+ * are allowed, and their unused entries are marked invalid.
+ */
+static int build_decode_table(uint32_t *table,
+                              size_t table_size,
+                              int root_bits,
+                              const uint8_t *lengths,
+                              int num_symbols) {
+    uint16_t counts[MAX_CODE_LENGTH + 1];
+    uint16_t offsets[MAX_CODE_LENGTH + 2];
+    uint16_t sorted[NUM_FIXED_LITLEN_SYMBOLS];
+    size_t root_size = (size_t)1 << root_bits;
+    size_t next_subtable = root_size;
+    size_t subtable = 0;
+    uint32_t subtable_prefix = (uint32_t)-1;
+    int subtable_bits = 0;
+    uint32_t code = 0;
+    int num_codes;
+    int left = 1;
+    int length;
+    int i;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < num_symbols; i++) {
+        counts[lengths[i]]++;
+    }
+    counts[0] = 0;
+    for (length = 1; length <= MAX_CODE_LENGTH; length++) {
+        left = (left << 1) - counts[length];
+        if (left < 0) {
+            return 0;
+        }
+    }
+    offsets[1] = 0;
+    for (length = 1; length <= MAX_CODE_LENGTH; length++) {
+        offsets[length + 1] = (uint16_t)(offsets[length] + counts[length]);
+    }
+    num_codes = offsets[MAX_CODE_LENGTH + 1];
+    for (i = 0; i < num_symbols; i++) {
+        if (lengths[i] != 0) {
+            sorted[offsets[lengths[i]]++] = (uint16_t)i;
+        }
+    }
+
+    for (i = 0; i < (int)root_size; i++) {
+        table[i] = ENTRY_INVALID;
+    }
+
+    for (i = 0; i < num_codes; i++) {
+        int symbol = sorted[i];
+        int code_length = lengths[symbol];
+        uint32_t reversed = reverse_bits(code, code_length);
+        size_t j;
+
+        if (code_length <= root_bits) {
+            uint32_t entry = ((uint32_t)symbol << 16) | code_length;
+
+            for (j = reversed; j < root_size; j += (size_t)1 << code_length) {
+                table[j] = entry;
+            }
+        } else {
+            uint32_t prefix = reversed & (uint32_t)(root_size - 1);
+            uint32_t entry = ((uint32_t)symbol << 16)
+                | (uint32_t)(code_length - root_bits);
+            size_t subtable_size;
+
+            /* A subtable is as big as the longest code sharing its prefix
+             * requires, counting the codes that are yet to come.
+             */
+            if (prefix != subtable_prefix) {
+                int slots;
+
+                subtable_bits = code_length - root_bits;
+                slots = 1 << subtable_bits;
+                while (subtable_bits + root_bits < MAX_CODE_LENGTH) {
+                    slots -= counts[subtable_bits + root_bits];
+                    if (slots <= 0) {
+                        break;
+                    }
+                    subtable_bits++;
+                    slots <<= 1;
+                }
+                subtable_size = (size_t)1 << subtable_bits;
+                if (next_subtable + subtable_size > table_size) {
+                    return 0;
+                }
+                for (j = 0; j < subtable_size; j++) {
+                    table[next_subtable + j] = ENTRY_INVALID;
+                }
+                table[prefix] = ((uint32_t)next_subtable << 16)
+                    | ENTRY_SUBTABLE
+                    | (uint32_t)subtable_bits;
+                subtable = next_subtable;
+                subtable_prefix = prefix;
+                next_subtable += subtable_size;
+            }
+            for (j = reversed >> root_bits;
+                 j < (size_t)1 << subtable_bits;
+                 j += (size_t)1 << (code_length - root_bits)) {
+                table[subtable + j] = entry;
+            }
+        }
+
+        counts[code_length]--;
+        code++;
+        if (i + 1 < num_codes) {
+            code <<= lengths[sorted[i + 1]] - code_length;
+        }
+    }
+    return 1;
+}
+
+/* Decodes a symbol with the bits already in the buffer. Returns -1 if the
+ * code is invalid or the buffer runs short.
+ */
+static int decode_symbol(struct gzip_decoder *decoder,
+                         const uint32_t *table,
+                         int root_bits) {
+    uint32_t entry = table[decoder->bits & ((1U << root_bits) - 1)];
+
+    if (entry & ENTRY_SUBTABLE) {
+        decoder->bits >>= root_bits;
+        decoder->num_bits -= root_bits;
+        entry = table[(entry >> 16)
+            + (decoder->bits & ((1U << (entry & 0xFF)) - 1))];
+    }
+    decoder->bits >>= entry & 0xFF;
+    decoder->num_bits -= entry & 0xFF;
+    if ((entry & ENTRY_INVALID) || decoder->num_bits < 0) {
+        return -1;
+    }
+    return (int)(entry >> 16);
+}
+
+static int set_fixed_tables(struct gzip_decoder *decoder) {
+    uint8_t lengths[NUM_FIXED_LITLEN_SYMBOLS];
+    int i;
+
+    for (i = 0; i < NUM_FIXED_LITLEN_SYMBOLS; i++) {
+        if (i < 144) {
+            lengths[i] = 8;
+        } else if (i < 256) {
+            lengths[i] = 9;
+        } else if (i < 280) {
+            lengths[i] = 7;
+        } else {
+            lengths[i] = 8;
+        }
+    }
+    if (!build_decode_table(decoder->litlen_table, GZIP_LITLEN_TABLE_SIZE,
+                            LITLEN_ROOT_BITS, lengths,
+                            NUM_FIXED_LITLEN_SYMBOLS)) {
+        return 0;
+    }
+    memset(lengths, 5, NUM_FIXED_DISTANCE_SYMBOLS);
+    return build_decode_table(decoder->distance_table,
+                              GZIP_DISTANCE_TABLE_SIZE, DISTANCE_ROOT_BITS,
+                              lengths, NUM_FIXED_DISTANCE_SYMBOLS);
+}
+
+static int read_dynamic_tables(struct gzip_decoder *decoder,
+                               struct in_stream *in) {
+    uint8_t lengths[NUM_LITLEN_SYMBOLS + NUM_DISTANCE_SYMBOLS];
+    uint8_t codelen_lengths[NUM_CODELEN_SYMBOLS];
+    int num_litlen;
+    int num_distance;
+    int num_codelen;
+    int i;
+
+    if (!need_bits(decoder, in, 14)) {
+        return 0;
+    }
+    num_litlen = (int)get_bits(decoder, 5) + 257;
+    num_distance = (int)get_bits(decoder, 5) + 1;
+    num_codelen = (int)get_bits(decoder, 4) + 4;
+    if (num_litlen > NUM_LITLEN_SYMBOLS
+        || num_distance > NUM_DISTANCE_SYMBOLS) {
+        return 0;
+    }
+
+    memset(codelen_lengths, 0, sizeof(codelen_lengths));
+    for (i = 0; i < num_codelen; i++) {
+        if (!need_bits(decoder, in, 3)) {
+            return 0;
+        }
+        codelen_lengths[codelen_order[i]] = (uint8_t)get_bits(decoder, 3);
+    }
+    /* The code length code is only needed here, so the literal/length
+     * table can hold it for now.
+     */
+    if (!build_decode_table(decoder->litlen_table, GZIP_LITLEN_TABLE_SIZE,
+                            CODELEN_ROOT_BITS, codelen_lengths,
+                            NUM_CODELEN_SYMBOLS)) {
+        return 0;
+    }
+
+    i = 0;
+    while (i < num_litlen + num_distance) {
+        int symbol;
+        int repeat;
+        uint8_t value = 0;
+
+        if (!need_bits(decoder, in, MAX_CODELEN_CODE_LENGTH)) {
+            need_bits(decoder, in, 1);
+        }
+        symbol = decode_symbol(decoder, decoder->litlen_table,
+                               CODELEN_ROOT_BITS);
+        if (symbol < 0) {
+            return 0;
+        }
+        if (symbol < 16) {
+            lengths[i++] = (uint8_t)symbol;
+            continue;
+        }
+        if (symbol == 16) {
+            if (i == 0 || !need_bits(decoder, in, 2)) {
+                return 0;
+            }
+            value = lengths[i - 1];
+            repeat = 3 + (int)get_bits(decoder, 2);
+        } else if (symbol == 17) {
+            if (!need_bits(decoder, in, 3)) {
+                return 0;
+            }
+            repeat = 3 + (int)get_bits(decoder, 3);
+        } else {
+            if (!need_bits(decoder, in, 7)) {
+                return 0;
+            }
+            repeat = 11 + (int)get_bits(decoder, 7);
+        }
+        if (i + repeat > num_litlen + num_distance) {
+            return 0;
+        }
+        while (repeat-- > 0) {
+            lengths[i++] = value;
+        }
+    }
+
+    if (lengths[END_OF_BLOCK] == 0) {
+        return 0;
+    }
+    return build_decode_table(decoder->litlen_table, GZIP_LITLEN_TABLE_SIZE,
+                              LITLEN_ROOT_BITS, lengths, num_litlen)
+        && build_decode_table(decoder->distance_table,
+                              GZIP_DISTANCE_TABLE_SIZE, DISTANCE_ROOT_BITS,
+                              lengths + num_litlen, num_distance);
+}
+
+static void copy_match(unsigned char *out, size_t distance, size_t length) {
+    const unsigned char *match = out - distance;
+
+    if (distance >= length) {
+        memcpy(out, match, length);
+    } else if (distance >= 8) {
+        while (length >= 8) {
+            memcpy(out, match, 8);
+            out += 8;
+            match += 8;
+            length -= 8;
+        }
+        while (length-- > 0) {
+            *out++ = *match++;
+        }
+    } else {
+        while (length-- > 0) {
+            *out++ = *match++;
+        }
+    }
+}
+
+/* Decodes symbols until the end of the block or until a match might not
+ * fit. The bit buffer lives in locals here, since stores to the output
+ * could otherwise alias it.
+ */
+static enum decode_status decode_huffman(struct gzip_decoder *decoder,
+                                         struct in_stream *in,
+                                         unsigned char **out,
+                                         unsigned char *out_end,
+                                         const unsigned char *history) {
+    const uint32_t *litlen_table = decoder->litlen_table;
+    const uint32_t *distance_table = decoder->distance_table;
+    const unsigned char *p = in->p;
+    const unsigned char *in_end = in->end;
+    unsigned char *o = *out;
+    uint64_t bits = decoder->bits;
+    int num_bits = decoder->num_bits;
+    enum decode_status status = DECODE_OK;
+
+    while (out_end - o >= MAX_MATCH) {
+        uint32_t entry;
+        unsigned int symbol;
+        unsigned int length;
+        unsigned int distance;
+        int extra;
+
+        if (num_bits < REFILL_THRESHOLD) {
+            if (in_end - p >= 8) {
+                bits |= read64(p) << num_bits;
+                p += (63 - num_bits) >> 3;
+                num_bits |= 56;
+            } else {
+                in->p = p;
+                fill(in, 8);
+                p = in->p;
+                in_end = in->end;
+                while (num_bits <= 56 && p < in_end) {
+                    bits |= (uint64_t)*p++ << num_bits;
+                    num_bits += 8;
+                }
+            }
+        }
+
+        entry = litlen_table[bits & ((1U << LITLEN_ROOT_BITS) - 1)];
+        if (entry & ENTRY_SUBTABLE) {
+            bits >>= LITLEN_ROOT_BITS;
+            num_bits -= LITLEN_ROOT_BITS;
+            entry = litlen_table[(entry >> 16)
+                + (bits & ((1U << (entry & 0xFF)) - 1))];
+        }
+        bits >>= entry & 0xFF;
+        num_bits -= entry & 0xFF;
+        if (entry & ENTRY_INVALID) {
+            status = DECODE_CORRUPT;
+            break;
+        }
+        symbol = entry >> 16;
+        if (symbol < END_OF_BLOCK) {
+            *o++ = (unsigned char)symbol;
+            continue;
+        }
+        if (symbol == END_OF_BLOCK) {
+            status = DECODE_END;
+            break;
+        }
+
+        symbol -= END_OF_BLOCK + 1;
+        if (symbol >= 29) {
+            status = DECODE_CORRUPT;
+            break;
+        }
+        extra = length_extra[symbol];
+        length = length_base[symbol] + ((uint32_t)bits & ((1U << extra) - 1));
+        bits >>= extra;
+        num_bits -= extra;
+
+        entry = distance_table[bits & ((1U << DISTANCE_ROOT_BITS) - 1)];
+        if (entry & ENTRY_SUBTABLE) {
+            bits >>= DISTANCE_ROOT_BITS;
+            num_bits -= DISTANCE_ROOT_BITS;
+            entry = distance_table[(entry >> 16)
+                + (bits & ((1U << (entry & 0xFF)) - 1))];
+        }
+        bits >>= entry & 0xFF;
+        num_bits -= entry & 0xFF;
+        symbol = entry >> 16;
+        if ((entry & ENTRY_INVALID) || symbol >= NUM_DISTANCE_SYMBOLS) {
+            status = DECODE_CORRUPT;
+            break;
+        }
+        extra = distance_extra[symbol];
+        distance = distance_base[symbol]
+            + ((uint32_t)bits & ((1U << extra) - 1));
+        bits >>= extra;
+        num_bits -= extra;
+
+        if (num_bits < 0 || distance > (size_t)(o - history)) {
+            status = DECODE_CORRUPT;
+            break;
+        }
+        copy_match(o, distance, length);
+        o += length;
+    }
+
+    if (num_bits < 0) {
+        status = DECODE_CORRUPT;
+    }
+    in->p = p;
+    decoder->bits = bits;
+    decoder->num_bits = num_bits;
+    *out = o;
+    return status;
+}
+
+static enum decode_status read_member_header(struct gzip_decoder *decoder,
+                                             struct in_stream *in) {
+    unsigned char header[HEADER_SIZE];
+    int flags;
+
+    if (decoder->num_bits == 0 && fill(in, 1) == 0) {
+        return DECODE_END;
+    }
+    if (!read_bytes(decoder, in, header, HEADER_SIZE)
+        || header[0] != 0x1F
+        || header[1] != 0x8B
+        || header[2] != 8
+        || (header[3] & FLAG_RESERVED) != 0) {
+        return DECODE_CORRUPT;
+    }
+    flags = header[3];
+    if (flags & FLAG_EXTRA) {
+        unsigned char extra_size[2];
+        unsigned char c;
+        size_t i;
+
+        if (!read_bytes(decoder, in, extra_size, 2)) {
+            return DECODE_CORRUPT;
+        }
+        for (i = extra_size[0] | (extra_size[1] << 8); i > 0; i--) {
+            if (!read_bytes(decoder, in, &c, 1)) {
+                return DECODE_CORRUPT;
+            }
+        }
+    }
+    if (((flags & FLAG_NAME) && !skip_string(decoder, in))
+        || ((flags & FLAG_COMMENT) && !skip_string(decoder, in))) {
+        return DECODE_CORRUPT;
+    }
+    if (flags & FLAG_HEADER_CRC) {
+        unsigned char crc[2];
+
+        if (!read_bytes(decoder, in, crc, 2)) {
+            return DECODE_CORRUPT;
+        }
+    }
+    return DECODE_OK;
+}
+
+static enum decode_status read_block_header(struct gzip_decoder *decoder,
+                                            struct in_stream *in) {
+    unsigned char sizes[4];
+
+    if (!need_bits(decoder, in, 3)) {
+        return DECODE_CORRUPT;
+    }
+    decoder->last_block = (int)get_bits(decoder, 1);
+    switch (get_bits(decoder, 2)) {
+        case BLOCK_STORED:
+            skip_to_byte(decoder);
+            if (!read_bytes(decoder, in, sizes, 4)
+                || (sizes[0] ^ sizes[2]) != 0xFF
+                || (sizes[1] ^ sizes[3]) != 0xFF) {
+                return DECODE_CORRUPT;
+            }
+            decoder->stored_size = sizes[0] | ((size_t)sizes[1] << 8);
+            decoder->state = STATE_STORED;
+            return DECODE_OK;
+        case BLOCK_FIXED:
+            if (!set_fixed_tables(decoder)) {
+                return DECODE_CORRUPT;
+            }
+            break;
+        case BLOCK_DYNAMIC:
+            if (!read_dynamic_tables(decoder, in)) {
+                return DECODE_CORRUPT;
+            }
+            break;
+        default:
+            return DECODE_CORRUPT;
+    }
+    decoder->state = STATE_HUFFMAN;
+    return DECODE_OK;
+}
+
+/* Stored bytes still in the bit buffer go first, then the rest is copied
+ * straight from the input.
+ */
+static enum decode_status copy_stored(struct gzip_decoder *decoder,
+                                      struct in_stream *in,
+                                      unsigned char **out,
+                                      unsigned char *out_end) {
+    unsigned char *o = *out;
+
+    while (decoder->stored_size > 0 && o < out_end) {
+        size_t n;
+
+        if (decoder->num_bits >= 8) {
+            *o++ = (unsigned char)get_bits(decoder, 8);
+            decoder->stored_size--;
+            continue;
+        }
+        decoder->bits = 0;
+        n = decoder->stored_size;
+        if (n > (size_t)(out_end - o)) {
+            n = (size_t)(out_end - o);
+        }
+        n = fill(in, n) < n ? (size_t)(in->end - in->p) : n;
+        if (n == 0) {
+            return DECODE_CORRUPT;
+        }
+        memcpy(o, in->p, n);
+        o += n;
+        in->p += n;
+        decoder->stored_size -= n;
+    }
+    *out = o;
+    return DECODE_OK;
+}
+
+static enum decode_status check_trailer(struct gzip_decoder *decoder,
+                                        struct in_stream *in) {
+    unsigned char trailer[TRAILER_SIZE];
+    uint32_t crc;
+    uint32_t size;
+
+    skip_to_byte(decoder);
+    if (!read_bytes(decoder, in, trailer, TRAILER_SIZE)) {
+        return DECODE_CORRUPT;
+    }
+    memcpy(&crc, trailer, sizeof(crc));
+    memcpy(&size, trailer + 4, sizeof(size));
+    if (crc != decoder->crc || size != (uint32_t)decoder->member_size) {
+        return DECODE_CORRUPT;
+    }
+    return DECODE_OK;
+}
+
+void gzip_decoder_init(struct gzip_decoder *decoder) {
+    if (!tables_ready) {
+        init_tables();
+    }
+    decoder->state = STATE_MEMBER_HEADER;
+    decoder->bits = 0;
+    decoder->num_bits = 0;
+}
+
+enum decode_status gzip_decode(struct gzip_decoder *decoder,
+                               struct in_stream *in,
+                               struct out_window *out) {
+    unsigned char *start = out->p;
+    unsigned char *out_end = out->end;
+    const unsigned char *history = out->start;
+    enum decode_status status = DECODE_OK;
+
+    if ((size_t)(out_end - start) > GZIP_DECODE_SIZE) {
+        out_end = start + GZIP_DECODE_SIZE;
+    }
+    if (decoder->member_size < (uint64_t)(start - out->start)
+        && decoder->state != STATE_MEMBER_HEADER) {
+        history = start - decoder->member_size;
+    }
+
+    while (status == DECODE_OK) {
+        switch (decoder->state) {
+            case STATE_MEMBER_HEADER:
+                status = read_member_header(decoder, in);
+                if (status != DECODE_OK) {
+                    return status;
+                }
+                decoder->crc = 0;
+                decoder->member_size = 0;
+                history = start;
+                decoder->state = STATE_BLOCK_HEADER;
+                break;
+            case STATE_BLOCK_HEADER:
+                status = read_block_header(decoder, in);
+                break;
+            case STATE_STORED:
+                status = copy_stored(decoder, in, &out->p, out_end);
+                if (status == DECODE_OK && decoder->stored_size > 0) {
+                    goto done;
+                }
+                decoder->state = decoder->last_block
+                    ? STATE_TRAILER
+                    : STATE_BLOCK_HEADER;
+                break;
+            case STATE_HUFFMAN:
+                status = decode_huffman(decoder, in, &out->p, out_end,
+                                        history);
+                if (status == DECODE_OK) {
+                    goto done;
+                }
+                if (status == DECODE_END) {
+                    decoder->state = decoder->last_block
+                        ? STATE_TRAILER
+                        : STATE_BLOCK_HEADER;
+                    status = DECODE_OK;
+                }
+                break;
+            case STATE_TRAILER:
+                decoder->crc = crc32_update(decoder->crc, start,
+                                            (size_t)(out->p - start));
+                decoder->member_size += (uint64_t)(out->p - start);
+                decoder->state = STATE_MEMBER_HEADER;
+                return check_trailer(decoder, in);
+        }
+    }
+    if (status != DECODE_OK) {
+        return status;
+    }
+
+done:
+    decoder->crc = crc32_update(decoder->crc, start,
+                                (size_t)(out->p - start));
+    decoder->member_size += (uint64_t)(out->p - start);
+    return DECODE_OK;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_GZIP_H
+#define WDD_GZIP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "stream.h"
+
+#define GZIP_HASH_BITS 15
+#define GZIP_WINDOW_SIZE 32768
+#define GZIP_BLOCK_SYMBOLS 32768
+#define GZIP_DEFAULT_LEVEL 6
+#define GZIP_DECODE_SIZE (64 << 10)
+#define GZIP_LITLEN_TABLE_SIZE 2048
+#define GZIP_DISTANCE_TABLE_SIZE 1024
+
+/* Match finder and symbol buffer of the deflate compressor. */
+struct gzip_state {
+    int32_t head[1 << GZIP_HASH_BITS];
+    int32_t prev[GZIP_WINDOW_SIZE];
+    uint16_t lengths[GZIP_BLOCK_SYMBOLS];
+    uint16_t distances[GZIP_BLOCK_SYMBOLS];
+};
+
+/* Inflate state, kept between calls so that decoding can stop anywhere in
+ * a block once the output has no more room.
+ */
+struct gzip_decoder {
+    int state;
+    int last_block;
+    uint64_t bits;
+    int num_bits;
+    size_t stored_size;
+    uint32_t crc;
+    uint64_t member_size;
+    uint32_t litlen_table[GZIP_LITLEN_TABLE_SIZE];
+    uint32_t distance_table[GZIP_DISTANCE_TABLE_SIZE];
+};
+
+/* Returns the most space a member of size bytes can take. */
+size_t gzip_compress_bound(size_t size);
+
+/* Compresses data as a single gzip member at level 1-9. Members can be
+ * concatenated and gzip reads them back as one stream. Returns the size of
+ * the member.
+ */
+size_t gzip_compress_member(struct gzip_state *state,
+                            int level,
+                            const void *data,
+                            size_t size,
+                            void *member);
+
+/* Updates a CRC-32 as used by gzip and xz. */
+uint32_t gzip_crc32(uint32_t crc, const void *data, size_t size);
+
+void gzip_decoder_init(struct gzip_decoder *decoder);
+
+/* Decodes up to GZIP_DECODE_SIZE bytes, which out must have room for, and
+ * stops at the end of each member. Returns DECODE_END once input runs out
+ * between members.
+ */
+enum decode_status gzip_decode(struct gzip_decoder *decoder,
+                               struct in_stream *in,
+                               struct out_window *out);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "crc32c.h"
+#include "hash.h"
+
+static const struct {
+    const char *name;
+    const char *tag;
+} hash_names[NUM_HASH_TYPES] = {
+    {"sha256", "SHA256"},
+    {"blake3", "BLAKE3"},
+    {"xxh3", "XXH3"},
+    {"crc32c", "CRC32C"}
+};
+
+BOOL hash_parse(const char *name, enum hash_type *type) {
+    int i;
+
+    for (i = 0; i < NUM_HASH_TYPES; i++) {
+        if (strcmp(name, hash_names[i].name) == 0) {
+            *type = (enum hash_type)i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+const char *hash_tag(enum hash_type type) {
+    return hash_names[type].tag;
+}
+
+BOOL hash_init(struct hash_context *context, enum hash_type type) {
+    NTSTATUS status;
+
+    ZeroMemory(context, sizeof(*context));
+    context->type = type;
+
+    switch (type) {
+        case HASH_SHA256:
+            status = BCryptOpenAlgorithmProvider(
+                &context->u.sha256.algorithm,
+                BCRYPT_SHA256_ALGORITHM,
+                NULL,
+                0);
+            if (!BCRYPT_SUCCESS(status)) {
+                SetLastError(ERROR_NOT_SUPPORTED);
+                return FALSE;
+            }
+            status = BCryptCreateHash(
+                context->u.sha256.algorithm,
+                &context->u.sha256.hash,
+                NULL,
+                0,
+                NULL,
+                0,
+                0);
+            if (!BCRYPT_SUCCESS(status)) {
+                BCryptCloseAlgorithmProvider(context->u.sha256.algorithm, 0);
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                return FALSE;
+            }
+            break;
+        case HASH_BLAKE3:
+            blake3_init(&context->u.blake3);
+            break;
+        case HASH_XXH3:
+            xxh3_init(&context->u.xxh3);
+            break;
+        case HASH_CRC32C:
+            context->u.crc32c = 0;
+            break;
+        default:
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+    }
+    return TRUE;
+}
+
+void hash_update(struct hash_context *context, const void *data, DWORD size) {
+    switch (context->type) {
+        case HASH_SHA256:
+            BCryptHashData(context->u.sha256.hash, (PUCHAR)data, size, 0);
+            break;
+        case HASH_BLAKE3:
+            blake3_update(&context->u.blake3, data, size);
+            break;
+        case HASH_XXH3:
+            xxh3_update(&context->u.xxh3, data, size);
+            break;
+        case HASH_CRC32C:
+            context->u.crc32c = crc32c_update(context->u.crc32c, data, size);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Digests are stored big-endian, the way they are usually printed. */
+static void store_be(unsigned char *p, ULONGLONG value, int size) {
+    int i;
+
+    for (i = size - 1; i >= 0; i--) {
+        p[i] = (unsigned char)value;
+        value >>= 8;
+    }
+}
+
+DWORD hash_final(struct hash_context *context,
+                 unsigned char digest[MAX_DIGEST_SIZE]) {
+    switch (context->type) {
+        case HASH_SHA256:
+            BCryptFinishHash(context->u.sha256.hash, digest, 32, 0);
+            BCryptDestroyHash(context->u.sha256.hash);
+            BCryptCloseAlgorithmProvider(context->u.sha256.algorithm, 0);
+            return 32;
+        case HASH_BLAKE3:
+            blake3_final(&context->u.blake3, digest);
+            return BLAKE3_OUT_SIZE;
+        case HASH_XXH3:
+            store_be(digest, xxh3_digest(&context->u.xxh3), 8);
+            return 8;
+        case HASH_CRC32C:
+            store_be(digest, context->u.crc32c, 4);
+            return 4;
+        default:
+            return 0;
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_HASH_H
+#define WDD_HASH_H
+
+#include <windows.h>
+#include <bcrypt.h>
+#include "blake3.h"
+#include "xxh3.h"
+
+#define MAX_DIGEST_SIZE 32
+
+enum hash_type {
+    HASH_SHA256,
+    HASH_BLAKE3,
+    HASH_XXH3,
+    HASH_CRC32C,
+    NUM_HASH_TYPES
+};
+
+/* SHA-256 comes from CNG, which uses the SHA instructions of the CPU when
+ * there are any. The other hashes are built in.
+ */
+struct hash_context {
+    enum hash_type type;
+    union {
+        struct {
+            BCRYPT_ALG_HANDLE algorithm;
+            BCRYPT_HASH_HANDLE hash;
+        } sha256;
+        struct blake3_hasher blake3;
+        struct xxh3_state xxh3;
+        uint32_t crc32c;
+    } u;
+};
+
+/* Looks up a hash by the name used in hash=. */
+BOOL hash_parse(const char *name, enum hash_type *type);
+
+/* Returns the tag used for the hash in BSD-style checksum lines. */
+const char *hash_tag(enum hash_type type);
+
+BOOL hash_init(struct hash_context *context, enum hash_type type);
+void hash_update(struct hash_context *context, const void *data, DWORD size);
+
+/* Writes the digest and frees the context. Returns the digest size. */
+DWORD hash_final(struct hash_context *context,
+                 unsigned char digest[MAX_DIGEST_SIZE]);
+
+#endif
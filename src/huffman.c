@@ -0,0 +1,138 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "huffman.h"
+
+struct huffman_node {
+    uint32_t weight;
+    int symbol;
+    int parent;
+};
+
+static int compare_nodes(const void *a, const void *b) {
+    const struct huffman_node *node_a = a;
+    const struct huffman_node *node_b = b;
+
+    if (node_a->weight != node_b->weight) {
+        return node_a->weight < node_b->weight ? -1 : 1;
+    }
+    return node_a->symbol - node_b->symbol;
+}
+
+/* When the optimal code is too deep the frequencies are flattened and it's
+ * built again, which costs little compression in practice.
+ */
+void huffman_build_lengths(const uint32_t *freqs,
+                           int num_symbols,
+                           int max_length,
+                           uint8_t *lengths) {
+    struct huffman_node nodes[2 * HUFFMAN_MAX_SYMBOLS];
+    uint8_t depths[2 * HUFFMAN_MAX_SYMBOLS];
+    uint32_t weights[HUFFMAN_MAX_SYMBOLS];
+    int num_leaves = 0;
+    int i;
+
+    /* Two codes can't be made out of fewer symbols. */
+    if (num_symbols < 2) {
+        if (num_symbols == 1) {
+            lengths[0] = 1;
+        }
+        return;
+    }
+
+    memcpy(weights, freqs, sizeof(*weights) * num_symbols);
+    for (i = 0; i < num_symbols; i++) {
+        num_leaves += weights[i] != 0;
+    }
+    for (i = 0; i < num_symbols && num_leaves < 2; i++) {
+        if (weights[i] == 0) {
+            weights[i] = 1;
+            num_leaves++;
+        }
+    }
+
+    for (;;) {
+        int next_leaf = 0;
+        int next_node;
+        int num_nodes;
+        int max_depth = 0;
+
+        num_leaves = 0;
+        for (i = 0; i < num_symbols; i++) {
+            if (weights[i] != 0) {
+                nodes[num_leaves].weight = weights[i];
+                nodes[num_leaves].symbol = i;
+                num_leaves++;
+            }
+        }
+        qsort(nodes, num_leaves, sizeof(*nodes), compare_nodes);
+        next_node = num_leaves;
+
+        /* Leaves and new nodes both come out in increasing order of weight,
+         * so the two smallest are always at the front of one of them.
+         */
+        for (num_nodes = num_leaves; num_nodes < 2 * num_leaves - 1;
+             num_nodes++) {
+            int pair[2];
+            int j;
+
+            for (j = 0; j < 2; j++) {
+                if (next_leaf < num_leaves
+                    && (next_node >= num_nodes
+                        || nodes[next_leaf].weight
+                            <= nodes[next_node].weight)) {
+                    pair[j] = next_leaf++;
+                } else {
+                    pair[j] = next_node++;
+                }
+            }
+            nodes[num_nodes].weight =
+                nodes[pair[0]].weight + nodes[pair[1]].weight;
+            nodes[num_nodes].symbol = -1;
+            nodes[pair[0]].parent = num_nodes;
+            nodes[pair[1]].parent = num_nodes;
+        }
+
+        depths[num_nodes - 1] = 0;
+        for (i = num_nodes - 2; i >= 0; i--) {
+            depths[i] = depths[nodes[i].parent] + 1;
+            if (depths[i] > max_depth) {
+                max_depth = depths[i];
+            }
+        }
+
+        if (max_depth <= max_length) {
+            memset(lengths, 0, num_symbols);
+            for (i = 0; i < num_leaves; i++) {
+                lengths[nodes[i].symbol] = depths[i];
+            }
+            return;
+        }
+        for (i = 0; i < num_symbols; i++) {
+            if (weights[i] != 0) {
+                weights[i] = (weights[i] + 1) / 2;
+            }
+        }
+    }
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_HUFFMAN_H
+#define WDD_HUFFMAN_H
+
+#include <stdint.h>
+
+#define HUFFMAN_MAX_SYMBOLS 288
+
+/* Builds the code lengths of a Huffman code for the given frequencies with
+ * no code longer than max_length. Symbols that don't occur get a length of
+ * 0. There are always at least two codes, and the code is complete, so that
+ * every decoder accepts it. The only exception is a single symbol, which
+ * gets a length of 1.
+ */
+void huffman_build_lengths(const uint32_t *freqs,
+                           int num_symbols,
+                           int max_length,
+                           uint8_t *lengths);
+
+#endif
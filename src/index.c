@@ -0,0 +1,293 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "index.h"
+#include "xxh3.h"
+
+static ULONGLONG count_blocks(ULONGLONG size, ULONGLONG block_size) {
+    return size / block_size + (size % block_size != 0);
+}
+
+static BOOL read_header(HANDLE file, struct index_header *header) {
+    DWORD num_bytes;
+
+    return ReadFile(file, header, sizeof(*header), &num_bytes, NULL)
+        && num_bytes == sizeof(*header)
+        && memcmp(header->signature,
+                  INDEX_SIGNATURE,
+                  sizeof(INDEX_SIGNATURE)) == 0;
+}
+
+/* Adds the range of the image from offset to the hash, widened to whole
+ * units of alignment. The image may be opened for overlapped unbuffered
+ * I/O, so it's read the same way. Reads past the end of a file come back
+ * short.
+ */
+static BOOL hash_image_range(struct block_index *index,
+                             struct xxh3_state *state,
+                             char *buffer,
+                             ULONGLONG offset,
+                             ULONGLONG size) {
+    ULONGLONG end = offset + size;
+    OVERLAPPED overlapped;
+    DWORD num_bytes = 0;
+    BOOL result;
+
+    offset -= offset % index->alignment;
+    end = (end + index->alignment - 1) / index->alignment * index->alignment;
+
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL) {
+        return FALSE;
+    }
+    result = ReadFile(
+        index->image,
+        buffer,
+        (DWORD)(end - offset),
+        NULL,
+        &overlapped);
+    if (result || GetLastError() == ERROR_IO_PENDING) {
+        result = GetOverlappedResult(
+            index->image,
+            &overlapped,
+            &num_bytes,
+            TRUE);
+    }
+    if (!result && GetLastError() == ERROR_HANDLE_EOF) {
+        result = TRUE;
+    }
+    CloseHandle(overlapped.hEvent);
+
+    if (result) {
+        xxh3_update(state, buffer, num_bytes);
+    }
+    return result;
+}
+
+/* Hashes the first and last blocks of size bytes of the image. */
+static BOOL get_image_identity(struct block_index *index,
+                               ULONGLONG size,
+                               ULONGLONG *identity) {
+    struct xxh3_state state;
+    ULONGLONG last_block = count_blocks(size, index->block_size) - 1;
+    ULONGLONG last_offset = last_block * index->block_size;
+    char *buffer;
+    BOOL result;
+
+    buffer = VirtualAlloc(
+        NULL,
+        (SIZE_T)(index->block_size + 2 * index->alignment),
+        MEM_COMMIT | MEM_RESERVE,
+        PAGE_READWRITE);
+    if (buffer == NULL) {
+        return FALSE;
+    }
+
+    xxh3_init(&state);
+    result = hash_image_range(
+            index,
+            &state,
+            buffer,
+            index->start,
+            min(size, index->block_size))
+        && hash_image_range(
+            index,
+            &state,
+            buffer,
+            index->start + last_offset,
+            size - last_offset);
+    *identity = xxh3_digest(&state);
+
+    VirtualFree(buffer, 0, MEM_RELEASE);
+    return result;
+}
+
+static void unmap_index(struct block_index *index) {
+    if (index->header != NULL) {
+        UnmapViewOfFile(index->header);
+        index->header = NULL;
+        index->hashes = NULL;
+    }
+    if (index->mapping != NULL) {
+        CloseHandle(index->mapping);
+        index->mapping = NULL;
+    }
+}
+
+BOOL index_open(struct block_index *index,
+                const char *filename,
+                ULONGLONG block_size,
+                ULONGLONG start,
+                ULONGLONG size,
+                HANDLE image,
+                DWORD alignment,
+                ULONGLONG image_size) {
+    struct index_header header;
+    LARGE_INTEGER file_size;
+    ULONGLONG mapping_size;
+    ULONGLONG identity;
+
+    ZeroMemory(index, sizeof(*index));
+    index->block_size = block_size;
+    index->start = start;
+    index->image = image;
+    index->alignment = alignment;
+
+    index->file = CreateFileA(
+        filename,
+        GENERIC_READ | GENERIC_WRITE,
+        0,
+        NULL,
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+    if (index->file == INVALID_HANDLE_VALUE) {
+        index->file = NULL;
+        return FALSE;
+    }
+    if (!GetFileSizeEx(index->file, &file_size)) {
+        return FALSE;
+    }
+
+    /* The old hashes can only be trusted if the last run went all the way
+     * with the same layout and left the image the way it found it. A drive
+     * or file that was written by something else, or swapped for another
+     * one, gives a different identity.
+     */
+    if (read_header(index->file, &header)
+        && header.block_size == block_size
+        && header.start == start
+        && header.size > 0
+        && header.complete
+        && (image_size == (ULONGLONG)-1
+            || image_size == start + header.size)
+        && get_image_identity(index, header.size, &identity)
+        && identity == header.identity) {
+        index->num_old_blocks = count_blocks(header.size, block_size);
+        if ((ULONGLONG)file_size.QuadPart
+                < sizeof(header)
+                    + index->num_old_blocks * sizeof(*index->hashes)) {
+            index->num_old_blocks = 0;
+        }
+    }
+
+    index->num_blocks =
+        max(index->num_old_blocks, count_blocks(size, block_size));
+    mapping_size =
+        sizeof(header) + index->num_blocks * sizeof(*index->hashes);
+    if (mapping_size > (SIZE_T)-1) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+
+    index->mapping = CreateFileMappingA(
+        index->file,
+        NULL,
+        PAGE_READWRITE,
+        (DWORD)(mapping_size >> 32),
+        (DWORD)mapping_size,
+        NULL);
+    if (index->mapping == NULL) {
+        return FALSE;
+    }
+    index->header = MapViewOfFile(
+        index->mapping,
+        FILE_MAP_WRITE,
+        0,
+        0,
+        (SIZE_T)mapping_size);
+    if (index->header == NULL) {
+        return FALSE;
+    }
+    index->hashes = (ULONGLONG *)(index->header + 1);
+
+    if (index->num_old_blocks == 0) {
+        ZeroMemory(index->header, sizeof(*index->header));
+        memcpy(index->header->signature,
+               INDEX_SIGNATURE,
+               sizeof(INDEX_SIGNATURE));
+        index->header->block_size = block_size;
+        index->header->start = start;
+    }
+    index->header->complete = FALSE;
+
+    /* The index must be marked incomplete on disk before anything is
+     * written to the image.
+     */
+    return FlushViewOfFile(index->header, sizeof(*index->header))
+        && FlushFileBuffers(index->file);
+}
+
+BOOL index_update(struct block_index *index,
+                  ULONGLONG block,
+                  ULONGLONG hash) {
+    if (block >= index->num_blocks) {
+        return FALSE;
+    }
+    if (block < index->num_old_blocks
+        && hash != 0
+        && index->hashes[block] == hash) {
+        return TRUE;
+    }
+    index->hashes[block] = hash;
+    return FALSE;
+}
+
+void index_forget(struct block_index *index, ULONGLONG offset, DWORD size) {
+    ULONGLONG block = (offset - index->start) / index->block_size;
+    ULONGLONG end = offset - index->start + size;
+
+    while (block < index->num_blocks && block * index->block_size < end) {
+        index->hashes[block] = 0;
+        block++;
+    }
+}
+
+BOOL index_close(struct block_index *index, ULONGLONG size) {
+    LARGE_INTEGER file_size;
+    BOOL result;
+
+    size = min(size, index->num_blocks * index->block_size);
+    index->header->size = size;
+    result = size == 0
+        || get_image_identity(index, size, &index->header->identity);
+    index->header->complete = result;
+
+    result = FlushViewOfFile(index->header, 0) && result;
+    unmap_index(index);
+
+    /* Hashes of blocks past the end of a shorter image are dropped. */
+    file_size.QuadPart = (LONGLONG)(sizeof(struct index_header)
+        + count_blocks(size, index->block_size) * sizeof(*index->hashes));
+    result = result
+        && SetFilePointerEx(index->file, file_size, NULL, FILE_BEGIN)
+        && SetEndOfFile(index->file)
+        && FlushFileBuffers(index->file);
+
+    CloseHandle(index->file);
+    index->file = NULL;
+    return result;
+}
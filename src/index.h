@@ -0,0 +1,94 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_INDEX_H
+#define WDD_INDEX_H
+
+#include <windows.h>
+
+#define INDEX_SIGNATURE "wdd index 2"
+
+/* The index file starts with this header and is followed by one 64-bit
+ * XXH3 hash per block. Blocks are numbered from start, the output offset
+ * of the copy, and size is the number of bytes the last run wrote from
+ * there. complete is cleared while a run is in progress, so an interrupted
+ * run leaves an index that won't be trusted. identity is a hash of the
+ * first and last blocks of the image as they were read back at the end of
+ * the last run.
+ */
+struct index_header {
+    char signature[16];
+    ULONGLONG block_size;
+    ULONGLONG start;
+    ULONGLONG size;
+    ULONGLONG complete;
+    ULONGLONG identity;
+};
+
+/* A block index mapped into memory as a whole. Hashes of the last run are
+ * valid for the first num_old_blocks blocks. A hash of zero means the block
+ * has to be written anyway.
+ */
+struct block_index {
+    HANDLE file;
+    HANDLE image;
+    DWORD alignment;
+    HANDLE mapping;
+    struct index_header *header;
+    ULONGLONG *hashes;
+    ULONGLONG block_size;
+    ULONGLONG start;
+    ULONGLONG num_blocks;
+    ULONGLONG num_old_blocks;
+};
+
+/* Opens or creates the index for up to size bytes written at start to
+ * image, which is read in multiples of alignment bytes. image_size is the
+ * current size of the output if it's a file, or -1 for drives. Together
+ * with the identity they tell whether it's still the image the index was
+ * made for.
+ */
+BOOL index_open(struct block_index *index,
+                const char *filename,
+                ULONGLONG block_size,
+                ULONGLONG start,
+                ULONGLONG size,
+                HANDLE image,
+                DWORD alignment,
+                ULONGLONG image_size);
+
+/* Records the hash of a block that is about to be written. Returns TRUE if
+ * the last run wrote the same data there, in which case it can be skipped.
+ */
+BOOL index_update(struct block_index *index,
+                  ULONGLONG block,
+                  ULONGLONG hash);
+
+/* Marks the blocks overlapping a range as unknown. */
+void index_forget(struct block_index *index, ULONGLONG offset, DWORD size);
+
+/* Marks the index complete for an image of size bytes and closes it. The
+ * image must have been flushed, as its identity is read back from it.
+ */
+BOOL index_close(struct block_index *index, ULONGLONG size);
+
+#endif
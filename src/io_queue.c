@@ -0,0 +1,170 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <windows.h>
+#include "io_queue.h"
+
+static void set_overlapped_offset(OVERLAPPED *overlapped,
+                                  ULONGLONG offset) {
+    overlapped->Offset = (DWORD)offset;
+    overlapped->OffsetHigh = (DWORD)(offset >> 32);
+}
+
+void io_queue_free(struct io_queue *queue) {
+    int i;
+
+    if (queue->requests == NULL) {
+        return;
+    }
+    for (i = 0; i < queue->depth; i++) {
+        if (queue->requests[i].overlapped.hEvent != NULL) {
+            CloseHandle(queue->requests[i].overlapped.hEvent);
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, queue->requests);
+    queue->requests = NULL;
+}
+
+BOOL io_queue_init(struct io_queue *queue,
+                   HANDLE file,
+                   BOOL synchronous,
+                   int depth) {
+    int i;
+
+    queue->file = file;
+    queue->synchronous = synchronous;
+    queue->depth = synchronous ? 1 : depth;
+    queue->first = 0;
+    queue->num_pending = 0;
+    queue->requests = HeapAlloc(
+        GetProcessHeap(),
+        HEAP_ZERO_MEMORY,
+        sizeof(*queue->requests) * queue->depth);
+    if (queue->requests == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+
+    if (!synchronous) {
+        for (i = 0; i < queue->depth; i++) {
+            HANDLE event = CreateEvent(NULL, TRUE, FALSE, NULL);
+            if (event == NULL) {
+                io_queue_free(queue);
+                return FALSE;
+            }
+            queue->requests[i].overlapped.hEvent = event;
+        }
+    }
+
+    return TRUE;
+}
+
+BOOL io_queue_is_full(const struct io_queue *queue) {
+    return queue->num_pending == queue->depth;
+}
+
+void io_queue_submit(struct io_queue *queue,
+                     enum io_operation operation,
+                     char *buffer,
+                     DWORD size,
+                     ULONGLONG offset) {
+    struct io_request *request;
+    OVERLAPPED *overlapped = NULL;
+    BOOL result;
+
+    request =
+        &queue->requests[(queue->first + queue->num_pending) % queue->depth];
+    request->done = queue->synchronous;
+    request->error = ERROR_SUCCESS;
+    request->num_bytes = 0;
+    queue->num_pending++;
+
+    if (!queue->synchronous) {
+        overlapped = &request->overlapped;
+        set_overlapped_offset(overlapped, offset);
+    }
+
+    if (operation == IO_READ) {
+        result = ReadFile(
+            queue->file,
+            buffer,
+            size,
+            queue->synchronous ? &request->num_bytes : NULL,
+            overlapped);
+    } else {
+        result = WriteFile(
+            queue->file,
+            buffer,
+            size,
+            queue->synchronous ? &request->num_bytes : NULL,
+            overlapped);
+    }
+
+    if (!result) {
+        DWORD error = GetLastError();
+        if (queue->synchronous || error != ERROR_IO_PENDING) {
+            request->error = error;
+        }
+    }
+}
+
+void io_queue_skip(struct io_queue *queue, DWORD size) {
+    struct io_request *request;
+
+    request =
+        &queue->requests[(queue->first + queue->num_pending) % queue->depth];
+    request->done = TRUE;
+    request->error = ERROR_SUCCESS;
+    request->num_bytes = size;
+    queue->num_pending++;
+}
+
+DWORD io_queue_complete(struct io_queue *queue, DWORD *num_bytes) {
+    struct io_request *request = &queue->requests[queue->first];
+    DWORD error = request->error;
+
+    queue->first = (queue->first + 1) % queue->depth;
+    queue->num_pending--;
+
+    *num_bytes = request->num_bytes;
+    if (error == ERROR_SUCCESS && !request->done) {
+        if (!GetOverlappedResult(
+                queue->file,
+                &request->overlapped,
+                num_bytes,
+                TRUE)) {
+            error = GetLastError();
+        }
+    }
+    return error;
+}
+
+void io_queue_cancel(struct io_queue *queue) {
+    DWORD num_bytes;
+
+    if (queue->num_pending > 0) {
+        CancelIo(queue->file);
+    }
+    while (queue->num_pending > 0) {
+        io_queue_complete(queue, &num_bytes);
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_IO_QUEUE_H
+#define WDD_IO_QUEUE_H
+
+#include <windows.h>
+
+enum io_operation {
+    IO_READ,
+    IO_WRITE
+};
+
+struct io_request {
+    OVERLAPPED overlapped;
+    BOOL done;
+    DWORD error;
+    DWORD num_bytes;
+};
+
+/* Up to depth outstanding requests on a file, completed in the order they
+ * were submitted. Handles that can't do positioned overlapped I/O (pipes,
+ * consoles and other character devices) are served synchronously instead.
+ */
+struct io_queue {
+    HANDLE file;
+    BOOL synchronous;
+    int depth;
+    int first;
+    int num_pending;
+    struct io_request *requests;
+};
+
+/* Closes the events of the queue. Pending requests must be completed or
+ * cancelled first.
+ */
+void io_queue_free(struct io_queue *queue);
+
+/* Prepares a queue of up to depth requests on file. A synchronous queue
+ * has room for one request at a time.
+ */
+BOOL io_queue_init(struct io_queue *queue,
+                   HANDLE file,
+                   BOOL synchronous,
+                   int depth);
+
+/* Returns TRUE if the oldest request must be completed before another one
+ * can be submitted.
+ */
+BOOL io_queue_is_full(const struct io_queue *queue);
+
+/* Submits a read or write at the given offset. Synchronous queues perform
+ * the request right away at the current file position. Errors are reported
+ * when the request is completed.
+ */
+void io_queue_submit(struct io_queue *queue,
+                     enum io_operation operation,
+                     char *buffer,
+                     DWORD size,
+                     ULONGLONG offset);
+
+/* Queues a request that is already complete, for blocks that don't need to
+ * be written but must still be accounted for in order.
+ */
+void io_queue_skip(struct io_queue *queue, DWORD size);
+
+/* Waits for the oldest pending request to complete. Returns its error code
+ * or ERROR_SUCCESS.
+ */
+DWORD io_queue_complete(struct io_queue *queue, DWORD *num_bytes);
+
+/* Cancels outstanding requests and waits for them to finish, so that their
+ * buffers can be reused or freed. Must be called on the thread that
+ * submitted them.
+ */
+void io_queue_cancel(struct io_queue *queue);
+
+#endif
@@ -0,0 +1,403 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <windows.h>
+#include "file.h"
+#include "journal.h"
+#include "options.h"
+#include "wdd.h"
+
+#define JOURNAL_SIGNATURE "wdd journal 1"
+
+BOOL add_region(struct program_state *s,
+                struct region_list *list,
+                ULONGLONG offset,
+                ULONGLONG size) {
+    struct region *last;
+    BOOL result = TRUE;
+
+    AcquireSRWLockExclusive(&s->regions_lock);
+
+    last = list->count > 0 ? &list->items[list->count - 1] : NULL;
+    if (last != NULL && last->offset + last->size == offset) {
+        last->size += size;
+    } else {
+        if (list->count == list->capacity) {
+            SIZE_T capacity = max(list->capacity * 2, 64);
+            struct region *items = list->items == NULL
+                ? HeapAlloc(
+                    GetProcessHeap(),
+                    0,
+                    sizeof(*items) * capacity)
+                : HeapReAlloc(
+                    GetProcessHeap(),
+                    0,
+                    list->items,
+                    sizeof(*items) * capacity);
+            if (items == NULL) {
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                result = FALSE;
+            } else {
+                list->items = items;
+                list->capacity = capacity;
+            }
+        }
+        if (result) {
+            list->items[list->count].offset = offset;
+            list->items[list->count].size = size;
+            list->count++;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&s->regions_lock);
+    return result;
+}
+
+static int compare_regions(const void *a, const void *b) {
+    const struct region *region_a = a;
+    const struct region *region_b = b;
+
+    if (region_a->offset < region_b->offset) {
+        return -1;
+    }
+    return region_a->offset > region_b->offset;
+}
+
+/* Recovers what can be read of a range of the input that failed to read as
+ * a whole. The range is split in halves until the failing parts are single
+ * sectors, which are tried s->retries more times and then left as zeros
+ * and added to the bad regions.
+ */
+static BOOL read_bad_range(struct program_state *s,
+                           struct io_queue *queue,
+                           char *buffer,
+                           ULONGLONG offset,
+                           DWORD size) {
+    BOOL is_sector = size <= s->in_sector_size;
+    int num_attempts = is_sector ? s->retries + 1 : 1;
+    DWORD half;
+    int i;
+
+    for (i = 0; i < num_attempts && !s->aborted; i++) {
+        DWORD num_bytes;
+        DWORD error;
+
+        io_queue_submit(queue, IO_READ, buffer, size, offset);
+        error = io_queue_complete(queue, &num_bytes);
+        if (error == ERROR_SUCCESS) {
+            ZeroMemory(buffer + num_bytes, size - num_bytes);
+            return TRUE;
+        }
+        if (error == ERROR_HANDLE_EOF || error == ERROR_SECTOR_NOT_FOUND) {
+            ZeroMemory(buffer, size);
+            return TRUE;
+        }
+    }
+
+    if (is_sector) {
+        ZeroMemory(buffer, size);
+        return add_region(s, &s->bad_regions, offset, size);
+    }
+
+    half = (DWORD)round_to_sector_size(size / 2, s->in_sector_size);
+    return read_bad_range(s, queue, buffer, offset, half)
+        && read_bad_range(
+            s,
+            queue,
+            buffer + half,
+            offset + half,
+            size - half);
+}
+
+BOOL skip_bad_block(struct program_state *s,
+                    struct io_queue *retry_queue,
+                    char *buffer,
+                    ULONGLONG offset,
+                    DWORD size) {
+    ZeroMemory(buffer, size);
+    if (!s->retry_later) {
+        return read_bad_range(s, retry_queue, buffer, offset, size);
+    }
+    return add_region(s, &s->unread_regions, offset, size);
+}
+
+DWORD retry_unread_regions(struct program_state *s) {
+    struct io_queue in_queue;
+    struct io_queue out_queue;
+    SIZE_T i;
+    DWORD error = ERROR_SUCCESS;
+
+    ZeroMemory(&in_queue, sizeof(in_queue));
+    ZeroMemory(&out_queue, sizeof(out_queue));
+    if (!io_queue_init(&in_queue, s->in_file, FALSE, 1)
+        || !io_queue_init(&out_queue, s->out_file, FALSE, 1)) {
+        error = GetLastError();
+        io_queue_free(&in_queue);
+        return error;
+    }
+
+    /* Workers of jobs=N add their blocks in no particular order. */
+    qsort(
+        s->unread_regions.items,
+        s->unread_regions.count,
+        sizeof(*s->unread_regions.items),
+        compare_regions);
+
+    for (i = 0; i < s->unread_regions.count && error == ERROR_SUCCESS; i++) {
+        ULONGLONG offset = s->unread_regions.items[i].offset;
+        ULONGLONG end = offset + s->unread_regions.items[i].size;
+
+        while (offset < end) {
+            DWORD size = (DWORD)min(s->buffer_size, end - offset);
+            DWORD write_size = size;
+            DWORD num_bytes;
+
+            if (write_size % s->out_alignment != 0) {
+                write_size =
+                    (write_size / s->out_alignment + 1) * s->out_alignment;
+            }
+            ZeroMemory(s->buffer, write_size);
+            if (!read_bad_range(s, &in_queue, s->buffer, offset, size)) {
+                error = GetLastError();
+                break;
+            }
+
+            io_queue_submit(
+                &out_queue,
+                IO_WRITE,
+                s->buffer,
+                write_size,
+                offset + s->out_shift);
+            error = io_queue_complete(&out_queue, &num_bytes);
+            if (error != ERROR_SUCCESS) {
+                break;
+            }
+            offset += size;
+        }
+    }
+
+    io_queue_free(&in_queue);
+    io_queue_free(&out_queue);
+    return error;
+}
+
+BOOL write_region_map(const struct program_state *s,
+                      const char *filename) {
+    FILE *file;
+    SIZE_T i;
+
+    file = fopen(filename, "w");
+    if (file == NULL) {
+        return FALSE;
+    }
+    fprintf(file, "# offset size\n");
+    for (i = 0; i < s->bad_regions.count; i++) {
+        fprintf(
+            file,
+            "0x%016llX 0x%016llX\n",
+            s->bad_regions.items[i].offset,
+            s->bad_regions.items[i].size);
+    }
+    return fclose(file) == 0;
+}
+
+/* 64-bit FNV-1a. It only has to tell whether the output still holds what
+ * was written there.
+ */
+static ULONGLONG checksum_block(const char *data, DWORD size) {
+    ULONGLONG hash = 0xCBF29CE484222325ULL;
+    DWORD i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/* Reads back up to JOURNAL_CHECK_SIZE bytes that were written to the output
+ * right before end and checksums them. With conv=sparse the trailing zero
+ * blocks are skipped and the file only gets its full size at the end, so
+ * anything past the end of the file is read as zeros.
+ */
+static BOOL checksum_output(struct program_state *s,
+                            ULONGLONG end,
+                            DWORD *size,
+                            ULONGLONG *checksum) {
+    struct io_queue queue;
+    DWORD num_bytes;
+    DWORD error;
+
+    *size = (DWORD)min(JOURNAL_CHECK_SIZE, end - s->journal_base);
+    *checksum = 0;
+    if (*size == 0) {
+        return TRUE;
+    }
+
+    ZeroMemory(&queue, sizeof(queue));
+    if (!io_queue_init(&queue, s->out_file, FALSE, 1)) {
+        return FALSE;
+    }
+    io_queue_submit(
+        &queue,
+        IO_READ,
+        s->journal_buffer,
+        *size,
+        end - *size);
+    error = io_queue_complete(&queue, &num_bytes);
+    io_queue_free(&queue);
+
+    if (error == ERROR_HANDLE_EOF) {
+        error = ERROR_SUCCESS;
+        num_bytes = 0;
+    }
+    if (error != ERROR_SUCCESS) {
+        SetLastError(error);
+        return FALSE;
+    }
+    ZeroMemory(s->journal_buffer + num_bytes, *size - num_bytes);
+    *checksum = checksum_block(s->journal_buffer, *size);
+    return TRUE;
+}
+
+BOOL save_journal(struct program_state *s,
+                  const struct program_options *options) {
+    ULONGLONG committed = load_counter(&s->out_committed);
+    ULONGLONG checksum;
+    DWORD size;
+    char temp_filename[MAX_PATH];
+    char text[2 * MAX_PATH + 128];
+    int length;
+    HANDLE file;
+    DWORD num_bytes;
+    BOOL result;
+
+    /* Blocks skipped by conv=noerror are filled in at the end, so they must
+     * not be counted as done.
+     */
+    AcquireSRWLockExclusive(&s->regions_lock);
+    if (s->unread_regions.count > 0) {
+        committed = min(
+            committed,
+            s->unread_regions.items[0].offset + s->out_shift);
+    }
+    ReleaseSRWLockExclusive(&s->regions_lock);
+
+    if (!FlushFileBuffers(s->out_file)
+        || !checksum_output(s, committed, &size, &checksum)) {
+        return FALSE;
+    }
+
+    length = snprintf(
+        text,
+        sizeof(text),
+        "%s\nif=%s\nof=%s\ndone=%llu\ncheck=%lu %016llX\n",
+        JOURNAL_SIGNATURE,
+        options->filename_in,
+        options->filename_out,
+        committed - s->journal_base,
+        size,
+        checksum);
+    if (length < 0
+        || length >= (int)sizeof(text)
+        || snprintf(
+            temp_filename,
+            sizeof(temp_filename),
+            "%s.tmp",
+            s->journal_filename) >= (int)sizeof(temp_filename)) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return FALSE;
+    }
+
+    file = CreateFileA(
+        temp_filename,
+        GENERIC_WRITE,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_FLAG_WRITE_THROUGH,
+        NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+    result = WriteFile(file, text, (DWORD)length, &num_bytes, NULL);
+    CloseHandle(file);
+
+    return result && MoveFileExA(
+        temp_filename,
+        s->journal_filename,
+        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+}
+
+BOOL load_journal(struct program_state *s,
+                  const struct program_options *options,
+                  ULONGLONG *done) {
+    FILE *file;
+    char line[MAX_PATH + 16];
+    BOOL valid = FALSE;
+    BOOL same_files = TRUE;
+    ULONGLONG saved_checksum = 0;
+    DWORD saved_size = 0;
+    ULONGLONG checksum;
+    DWORD size;
+
+    *done = 0;
+    file = fopen(s->journal_filename, "r");
+    if (file == NULL) {
+        return TRUE;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strcmp(line, JOURNAL_SIGNATURE) == 0) {
+            valid = TRUE;
+        } else if (strncmp(line, "if=", 3) == 0) {
+            same_files &= lstrcmpiA(line + 3, options->filename_in) == 0;
+        } else if (strncmp(line, "of=", 3) == 0) {
+            same_files &= lstrcmpiA(line + 3, options->filename_out) == 0;
+        } else if (strncmp(line, "done=", 5) == 0) {
+            *done = (ULONGLONG)strtoll(line + 5, NULL, 10);
+        } else if (strncmp(line, "check=", 6) == 0) {
+            char *end = NULL;
+
+            saved_size = strtoul(line + 6, &end, 10);
+            saved_checksum = (ULONGLONG)_strtoui64(end, NULL, 16);
+        }
+    }
+    fclose(file);
+
+    if (!valid || !same_files) {
+        *done = 0;
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+    if (!checksum_output(s, s->journal_base + *done, &size, &checksum)) {
+        return FALSE;
+    }
+    if (size != saved_size || checksum != saved_checksum) {
+        *done = 0;
+        SetLastError(ERROR_CRC);
+        return FALSE;
+    }
+    return TRUE;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_JOURNAL_H
+#define WDD_JOURNAL_H
+
+#include <windows.h>
+#include "options.h"
+#include "wdd.h"
+
+/* Appends a region to the list, merging it into the last one if they are
+ * adjacent. Safe to call from any thread.
+ */
+BOOL add_region(struct program_state *s,
+                struct region_list *list,
+                ULONGLONG offset,
+                ULONGLONG size);
+
+/* Deals with a block of the input that failed to read with conv=noerror.
+ * The block is replaced with zeros so that everything after it stays in
+ * place. If the output can be written out of order, the block is only
+ * remembered and read sector by sector once the rest of the input has been
+ * copied, while the drive is still in a good enough shape to give us the
+ * easy data. Otherwise it has to be done right away.
+ */
+BOOL skip_bad_block(struct program_state *s,
+                    struct io_queue *retry_queue,
+                    char *buffer,
+                    ULONGLONG offset,
+                    DWORD size);
+
+/* The second pass of conv=noerror: reads the blocks that failed or were
+ * skipped during the copy and writes whatever could be recovered to the
+ * output.
+ */
+DWORD retry_unread_regions(struct program_state *s);
+
+/* Writes the regions that couldn't be read to a text file, one per line as
+ * hexadecimal offset and size.
+ */
+BOOL write_region_map(const struct program_state *s,
+                      const char *filename);
+
+/* Records how much of the output is known to be written. The output is
+ * flushed first so that the journal never gets ahead of the disk, and the
+ * journal itself is replaced in one step so that a crash in the middle
+ * leaves the previous one intact.
+ */
+BOOL save_journal(struct program_state *s,
+                  const struct program_options *options);
+
+/* Reads the journal left by an earlier run, if any, and checks that the
+ * output still ends with the data it was checksummed with. Returns the
+ * number of bytes that don't have to be copied again.
+ */
+BOOL load_journal(struct program_state *s,
+                  const struct program_options *options,
+                  ULONGLONG *done);
+
+#endif
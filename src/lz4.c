@@ -0,0 +1,601 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "lz4.h"
+
+#define FRAME_FLAGS 0x68 /* version 1, independent blocks, content size */
+#define BLOCK_MAX_SIZE_ID 7
+#define BLOCK_UNCOMPRESSED 0x80000000U
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_FIND_LIMIT 12
+#define MAX_OFFSET 65535
+#define SKIP_TRIGGER 6
+#define SKIPPABLE_MAGIC 0x184D2A50U
+#define SKIPPABLE_MAGIC_MASK 0xFFFFFFF0U
+#define MAX_SKIP_CHUNK (64 << 10)
+
+#define FLAG_VERSION_MASK 0xC0
+#define FLAG_VERSION 0x40
+#define FLAG_INDEPENDENT_BLOCKS 0x20
+#define FLAG_BLOCK_CHECKSUM 0x10
+#define FLAG_CONTENT_SIZE 0x08
+#define FLAG_CONTENT_CHECKSUM 0x04
+#define FLAG_RESERVED 0x02
+#define FLAG_DICTIONARY_ID 0x01
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME32_4 0x27D4EB2FU
+#define PRIME32_5 0x165667B1U
+
+/* Windows only runs on little-endian CPUs, so plain loads will do. */
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static void write32(unsigned char *p, uint32_t value) {
+    memcpy(p, &value, sizeof(value));
+}
+
+static uint32_t rotl32(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+/* XXH32 with a seed of 0, for the header, block and content checksums. */
+static uint32_t xxh32_round(uint32_t acc, uint32_t input) {
+    acc += input * PRIME32_2;
+    acc = rotl32(acc, 13);
+    return acc * PRIME32_1;
+}
+
+static void hash_init(struct lz4_hash *hash) {
+    hash->v[0] = PRIME32_1 + PRIME32_2;
+    hash->v[1] = PRIME32_2;
+    hash->v[2] = 0;
+    hash->v[3] = 0 - PRIME32_1;
+    hash->size = 0;
+    hash->buffered = 0;
+}
+
+static void hash_stripe(uint32_t *v, const unsigned char *p) {
+    v[0] = xxh32_round(v[0], read32(p));
+    v[1] = xxh32_round(v[1], read32(p + 4));
+    v[2] = xxh32_round(v[2], read32(p + 8));
+    v[3] = xxh32_round(v[3], read32(p + 12));
+}
+
+static void hash_update(struct lz4_hash *hash,
+                        const unsigned char *p,
+                        size_t size) {
+    hash->size += size;
+    if (hash->buffered > 0) {
+        size_t n = 16 - hash->buffered;
+
+        if (n > size) {
+            n = size;
+        }
+        memcpy(hash->buffer + hash->buffered, p, n);
+        hash->buffered += n;
+        p += n;
+        size -= n;
+        if (hash->buffered < 16) {
+            return;
+        }
+        hash_stripe(hash->v, hash->buffer);
+        hash->buffered = 0;
+    }
+    while (size >= 16) {
+        hash_stripe(hash->v, p);
+        p += 16;
+        size -= 16;
+    }
+    memcpy(hash->buffer, p, size);
+    hash->buffered = size;
+}
+
+static uint32_t hash_digest(const struct lz4_hash *hash) {
+    const unsigned char *p = hash->buffer;
+    size_t size = hash->buffered;
+    uint32_t value;
+
+    if (hash->size >= 16) {
+        value = rotl32(hash->v[0], 1) + rotl32(hash->v[1], 7)
+            + rotl32(hash->v[2], 12) + rotl32(hash->v[3], 18);
+    } else {
+        value = PRIME32_5;
+    }
+    value += (uint32_t)hash->size;
+
+    while (size >= 4) {
+        value += read32(p) * PRIME32_3;
+        value = rotl32(value, 17) * PRIME32_4;
+        p += 4;
+        size -= 4;
+    }
+    while (size > 0) {
+        value += *p * PRIME32_5;
+        value = rotl32(value, 11) * PRIME32_1;
+        p++;
+        size--;
+    }
+    value ^= value >> 15;
+    value *= PRIME32_2;
+    value ^= value >> 13;
+    value *= PRIME32_3;
+    value ^= value >> 16;
+    return value;
+}
+
+static uint32_t xxh32(const unsigned char *p, size_t size) {
+    struct lz4_hash hash;
+
+    hash_init(&hash);
+    hash_update(&hash, p, size);
+    return hash_digest(&hash);
+}
+
+static uint32_t hash_sequence(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+static unsigned char *write_length(unsigned char *p, size_t length) {
+    while (length >= 255) {
+        *p++ = 255;
+        length -= 255;
+    }
+    *p++ = (unsigned char)length;
+    return p;
+}
+
+static unsigned char *write_sequence(unsigned char *p,
+                                     const unsigned char *literals,
+                                     size_t num_literals,
+                                     size_t offset,
+                                     size_t match_length) {
+    unsigned char *token = p++;
+
+    if (num_literals >= 15) {
+        *token = 15 << 4;
+        p = write_length(p, num_literals - 15);
+    } else {
+        *token = (unsigned char)(num_literals << 4);
+    }
+    memcpy(p, literals, num_literals);
+    p += num_literals;
+
+    /* The last sequence has literals only. */
+    if (match_length == 0) {
+        return p;
+    }
+    *p++ = (unsigned char)offset;
+    *p++ = (unsigned char)(offset >> 8);
+    match_length -= MIN_MATCH;
+    if (match_length >= 15) {
+        *token |= 15;
+        p = write_length(p, match_length - 15);
+    } else {
+        *token |= (unsigned char)match_length;
+    }
+    return p;
+}
+
+/* Greedy single-probe match search, like the default LZ4 level. The step
+ * grows while no matches are found so that incompressible data passes
+ * through quickly.
+ */
+static size_t compress_block(struct lz4_state *state,
+                             const unsigned char *src,
+                             size_t size,
+                             unsigned char *dst) {
+    const unsigned char *p = src;
+    const unsigned char *anchor = src;
+    const unsigned char *end = src + size;
+    unsigned char *out = dst;
+    unsigned int num_misses = 0;
+
+    memset(state->table, 0, sizeof(state->table));
+
+    if (size > MATCH_FIND_LIMIT) {
+        const unsigned char *match_limit = end - LAST_LITERALS;
+        const unsigned char *find_limit = end - MATCH_FIND_LIMIT;
+
+        while (p <= find_limit) {
+            uint32_t sequence = read32(p);
+            uint32_t hash = hash_sequence(sequence);
+            const unsigned char *match = src + state->table[hash];
+            const unsigned char *match_end;
+
+            state->table[hash] = (uint32_t)(p - src);
+            if (match >= p
+                || p - match > MAX_OFFSET
+                || read32(match) != sequence) {
+                p += 1 + (num_misses++ >> SKIP_TRIGGER);
+                continue;
+            }
+            num_misses = 0;
+
+            while (p > anchor && match > src && p[-1] == match[-1]) {
+                p--;
+                match--;
+            }
+            match_end = p + MIN_MATCH;
+            while (match_end < match_limit
+                   && *match_end == match[match_end - p]) {
+                match_end++;
+            }
+
+            out = write_sequence(
+                out,
+                anchor,
+                (size_t)(p - anchor),
+                (size_t)(p - match),
+                (size_t)(match_end - p));
+            p = match_end;
+            anchor = p;
+            if (p <= find_limit) {
+                state->table[hash_sequence(read32(p - 2))] =
+                    (uint32_t)(p - 2 - src);
+            }
+        }
+    }
+
+    out = write_sequence(out, anchor, (size_t)(end - anchor), 0, 0);
+    return (size_t)(out - dst);
+}
+
+size_t lz4_compress_bound(size_t size) {
+    size_t num_blocks = size / LZ4_MAX_BLOCK_SIZE + 1;
+    return size + size / 255 + num_blocks * 24 + 32;
+}
+
+size_t lz4_compress_frame(struct lz4_state *state,
+                          const void *data,
+                          size_t size,
+                          void *frame) {
+    const unsigned char *src = data;
+    unsigned char *out = frame;
+    unsigned char *descriptor;
+    uint64_t content_size = size;
+
+    write32(out, LZ4_MAGIC);
+    out += 4;
+    descriptor = out;
+    *out++ = FRAME_FLAGS;
+    *out++ = BLOCK_MAX_SIZE_ID << 4;
+    memcpy(out, &content_size, sizeof(content_size));
+    out += sizeof(content_size);
+    *out = (unsigned char)(xxh32(descriptor, out - descriptor) >> 8);
+    out++;
+
+    /* Blocks that don't get any smaller are stored as they are. */
+    while (size > 0) {
+        size_t block_size = size < LZ4_MAX_BLOCK_SIZE ? size : LZ4_MAX_BLOCK_SIZE;
+        size_t compressed_size = compress_block(state, src, block_size, out + 4);
+
+        if (compressed_size >= block_size) {
+            write32(out, (uint32_t)block_size | BLOCK_UNCOMPRESSED);
+            memcpy(out + 4, src, block_size);
+            compressed_size = block_size;
+        } else {
+            write32(out, (uint32_t)compressed_size);
+        }
+        out += 4 + compressed_size;
+        src += block_size;
+        size -= block_size;
+    }
+
+    write32(out, 0);
+    out += 4;
+    return (size_t)(out - (unsigned char *)frame);
+}
+
+static size_t fill(struct in_stream *in, size_t size) {
+    size_t available = (size_t)(in->end - in->p);
+
+    if (available >= size || in->fill == NULL) {
+        return available;
+    }
+    return in->fill(in, size);
+}
+
+static int read_length(const unsigned char **p,
+                       const unsigned char *end,
+                       size_t *length) {
+    unsigned char byte;
+
+    do {
+        if (*p >= end) {
+            return 0;
+        }
+        byte = *(*p)++;
+        *length += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+static void copy_match(unsigned char *out, size_t offset, size_t length) {
+    const unsigned char *match = out - offset;
+
+    if (offset >= length) {
+        memcpy(out, match, length);
+    } else if (offset >= 8) {
+        while (length >= 8) {
+            memcpy(out, match, 8);
+            out += 8;
+            match += 8;
+            length -= 8;
+        }
+        while (length-- > 0) {
+            *out++ = *match++;
+        }
+    } else {
+        while (length-- > 0) {
+            *out++ = *match++;
+        }
+    }
+}
+
+/* Decodes a compressed block into out, where history bytes before it may
+ * be referenced. Returns the decoded size, or (size_t)-1 if it's invalid.
+ */
+static size_t decompress_block(const unsigned char *src,
+                               size_t size,
+                               unsigned char *dst,
+                               size_t capacity,
+                               size_t history) {
+    const unsigned char *p = src;
+    const unsigned char *end = src + size;
+    unsigned char *out = dst;
+    unsigned char *out_end = dst + capacity;
+
+    for (;;) {
+        unsigned int token;
+        size_t num_literals;
+        size_t match_length;
+        size_t offset;
+
+        if (p >= end) {
+            return (size_t)-1;
+        }
+        token = *p++;
+        num_literals = token >> 4;
+        if (num_literals == 15 && !read_length(&p, end, &num_literals)) {
+            return (size_t)-1;
+        }
+        if (num_literals > (size_t)(end - p)
+            || num_literals > (size_t)(out_end - out)) {
+            return (size_t)-1;
+        }
+        memcpy(out, p, num_literals);
+        out += num_literals;
+        p += num_literals;
+
+        /* The last sequence has literals only. */
+        if (p == end) {
+            break;
+        }
+        if (end - p < 2) {
+            return (size_t)-1;
+        }
+        offset = p[0] | ((size_t)p[1] << 8);
+        p += 2;
+        match_length = token & 15;
+        if (match_length == 15 && !read_length(&p, end, &match_length)) {
+            return (size_t)-1;
+        }
+        match_length += MIN_MATCH;
+        if (offset == 0
+            || offset > history + (size_t)(out - dst)
+            || match_length > (size_t)(out_end - out)) {
+            return (size_t)-1;
+        }
+        copy_match(out, offset, match_length);
+        out += match_length;
+    }
+    return (size_t)(out - dst);
+}
+
+void lz4_decoder_init(struct lz4_decoder *decoder) {
+    decoder->in_frame = 0;
+}
+
+static enum decode_status start_frame(struct lz4_decoder *decoder,
+                                      struct in_stream *in) {
+    for (;;) {
+        size_t available = fill(in, 8);
+        uint32_t magic;
+        size_t header_size;
+        int flags;
+        int block_size_id;
+
+        if (available == 0) {
+            return DECODE_END;
+        }
+        if (available < 4) {
+            return DECODE_CORRUPT;
+        }
+        magic = read32(in->p);
+
+        if ((magic & SKIPPABLE_MAGIC_MASK) == SKIPPABLE_MAGIC) {
+            uint64_t skip;
+
+            if (available < 8) {
+                return DECODE_CORRUPT;
+            }
+            skip = read32(in->p + 4);
+            in->p += 8;
+            while (skip > 0) {
+                size_t n = fill(in, skip < MAX_SKIP_CHUNK
+                                    ? (size_t)skip
+                                    : MAX_SKIP_CHUNK);
+                if (n == 0) {
+                    return DECODE_CORRUPT;
+                }
+                if (n > skip) {
+                    n = (size_t)skip;
+                }
+                in->p += n;
+                skip -= n;
+            }
+            continue;
+        }
+
+        if (magic != LZ4_MAGIC || available < 7) {
+            return DECODE_CORRUPT;
+        }
+        flags = in->p[4];
+        if ((flags & FLAG_VERSION_MASK) != FLAG_VERSION
+            || (flags & FLAG_RESERVED) != 0
+            || (in->p[5] & 0x8F) != 0) {
+            return DECODE_CORRUPT;
+        }
+        block_size_id = (in->p[5] >> 4) & 7;
+        if (block_size_id < 4) {
+            return DECODE_CORRUPT;
+        }
+        header_size = 7;
+        if (flags & FLAG_CONTENT_SIZE) {
+            header_size += 8;
+        }
+        if (flags & FLAG_DICTIONARY_ID) {
+            header_size += 4;
+        }
+        if (fill(in, header_size) < header_size) {
+            return DECODE_CORRUPT;
+        }
+        if (in->p[header_size - 1]
+                != (unsigned char)(xxh32(in->p + 4, header_size - 5) >> 8)) {
+            return DECODE_CORRUPT;
+        }
+        if (flags & FLAG_DICTIONARY_ID) {
+            return DECODE_UNSUPPORTED;
+        }
+
+        decoder->flags = flags;
+        decoder->block_max_size = (size_t)1 << (8 + 2 * block_size_id);
+        decoder->content_size = (uint64_t)-1;
+        if (flags & FLAG_CONTENT_SIZE) {
+            memcpy(&decoder->content_size, in->p + 6, 8);
+        }
+        in->p += header_size;
+        break;
+    }
+
+    decoder->in_frame = 1;
+    decoder->frame_size = 0;
+    hash_init(&decoder->hash);
+    return DECODE_OK;
+}
+
+static enum decode_status end_frame(struct lz4_decoder *decoder,
+                                    struct in_stream *in) {
+    if (decoder->content_size != (uint64_t)-1
+        && decoder->frame_size != decoder->content_size) {
+        return DECODE_CORRUPT;
+    }
+    if (decoder->flags & FLAG_CONTENT_CHECKSUM) {
+        if (fill(in, 4) < 4
+            || read32(in->p) != hash_digest(&decoder->hash)) {
+            return DECODE_CORRUPT;
+        }
+        in->p += 4;
+    }
+    decoder->in_frame = 0;
+    return DECODE_OK;
+}
+
+enum decode_status lz4_decode(struct lz4_decoder *decoder,
+                              struct in_stream *in,
+                              struct out_window *out) {
+    enum decode_status status;
+    size_t checksum_size;
+    uint32_t block_header;
+    size_t size;
+    size_t decoded_size;
+    size_t capacity;
+
+    if (!decoder->in_frame) {
+        status = start_frame(decoder, in);
+        if (status != DECODE_OK) {
+            return status;
+        }
+    }
+
+    if (fill(in, 4) < 4) {
+        return DECODE_CORRUPT;
+    }
+    block_header = read32(in->p);
+    if (block_header == 0) {
+        in->p += 4;
+        return end_frame(decoder, in);
+    }
+
+    size = block_header & ~BLOCK_UNCOMPRESSED;
+    checksum_size = decoder->flags & FLAG_BLOCK_CHECKSUM ? 4 : 0;
+    if (size > decoder->block_max_size
+        || fill(in, 4 + size + checksum_size) < 4 + size + checksum_size) {
+        return DECODE_CORRUPT;
+    }
+    if (checksum_size > 0
+        && read32(in->p + 4 + size) != xxh32(in->p + 4, size)) {
+        return DECODE_CORRUPT;
+    }
+
+    capacity = (size_t)(out->end - out->p);
+    if (capacity > decoder->block_max_size) {
+        capacity = decoder->block_max_size;
+    }
+    if (block_header & BLOCK_UNCOMPRESSED) {
+        if (size > capacity) {
+            return DECODE_CORRUPT;
+        }
+        memcpy(out->p, in->p + 4, size);
+        decoded_size = size;
+    } else {
+        size_t history = 0;
+
+        if (!(decoder->flags & FLAG_INDEPENDENT_BLOCKS)) {
+            history = (size_t)(out->p - out->start);
+            if (history > decoder->frame_size) {
+                history = (size_t)decoder->frame_size;
+            }
+        }
+        decoded_size = decompress_block(in->p + 4, size, out->p, capacity,
+                                        history);
+        if (decoded_size == (size_t)-1) {
+            return DECODE_CORRUPT;
+        }
+    }
+
+    if (decoder->flags & FLAG_CONTENT_CHECKSUM) {
+        hash_update(&decoder->hash, out->p, decoded_size);
+    }
+    out->p += decoded_size;
+    decoder->frame_size += decoded_size;
+    in->p += 4 + size + checksum_size;
+    return DECODE_OK;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_LZ4_H
+#define WDD_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "stream.h"
+
+#define LZ4_HASH_BITS 16
+#define LZ4_MAGIC 0x184D2204U
+#define LZ4_WINDOW_SIZE (64 << 10)
+#define LZ4_MAX_BLOCK_SIZE (4 << 20)
+
+/* Match finder of the compressor, big enough not to live on the stack. */
+struct lz4_state {
+    uint32_t table[1 << LZ4_HASH_BITS];
+};
+
+/* Running XXH32 of the decompressed content or of a block. */
+struct lz4_hash {
+    uint32_t v[4];
+    unsigned char buffer[16];
+    size_t buffered;
+    uint64_t size;
+};
+
+struct lz4_decoder {
+    int in_frame;
+    int flags;
+    size_t block_max_size;
+    uint64_t content_size;
+    uint64_t frame_size;
+    struct lz4_hash hash;
+};
+
+/* Returns the most space a frame of size bytes can take. */
+size_t lz4_compress_bound(size_t size);
+
+/* Compresses data as a single LZ4 frame with independent blocks and the
+ * content size in the header. Returns the size of the frame.
+ */
+size_t lz4_compress_frame(struct lz4_state *state,
+                          const void *data,
+                          size_t size,
+                          void *frame);
+
+void lz4_decoder_init(struct lz4_decoder *decoder);
+
+/* Decodes one block of a frame, with room for LZ4_MAX_BLOCK_SIZE bytes in
+ * out. Linked blocks need LZ4_WINDOW_SIZE bytes of history. Returns
+ * DECODE_END once input runs out between frames.
+ */
+enum decode_status lz4_decode(struct lz4_decoder *decoder,
+                              struct in_stream *in,
+                              struct out_window *out);
+
+#endif
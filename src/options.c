@@ -0,0 +1,343 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <windows.h>
+#include "compress.h"
+#include "hash.h"
+#include "options.h"
+#include "wdd.h"
+
+#define DEFAULT_RETRIES 2
+
+void print_usage(void) {
+    fprintf(stderr, "Usage: wdd if=<in_file> of=<out_file> "
+                               "[of=<out_file>...] [bs=N|auto] [ibs=N] "
+                               "[obs=N] [count=N] "
+                               "[skip=N] [seek=N] "
+                               "[qd=N] [iodepth=N] [jobs=N] [iflag=FLAGS] "
+                               "[oflag=FLAGS] [retries=N] [mapfile=FILE] "
+                               "[journal=FILE] [hash=HASHES] [hashfile=FILE] "
+                               "[verify=yes] [base=FILE] [index=FILE] "
+                               "[compress=zstd[:N]|lz4|gzip[:N]] "
+                               "[decompress=yes|no] "
+                               "[window=N] [conv=CONVS] [status=progress]\n"
+                    "       wdd flash if=<image> of=<drive> "
+                               "[of=<drive>...] [bs=N] [qd=N] "
+                               "[hash=HASHES] [verify=yes] "
+                               "[status=progress]\n"
+                    "       wdd list [format=json]\n");
+}
+
+static ULONGLONG parse_size(const char *str) {
+    char *end = NULL;
+    ULONGLONG size = (ULONGLONG)strtoll(str, &end, 10);
+
+    if (end != NULL && *end != '\0') {
+        switch (*end) {
+            case 'k':
+            case 'K':
+                size <<= 10;
+                break;
+            case 'm':
+            case 'M':
+                size <<= 20;
+                break;
+            case 'g':
+            case 'G':
+                size <<= 30;
+                break;
+            case 't':
+            case 'T':
+                size <<= 40;
+                break;
+        }
+    }
+    return size;
+}
+
+/* Parses the value of iflag= or oflag=. Flags that don't belong to the
+ * direction given by allowed_flags are rejected rather than ignored.
+ */
+static BOOL parse_flags(char *str, DWORD allowed_flags, DWORD *flags) {
+    char *context = NULL;
+    char *flag;
+
+    for (flag = strtok_r(str, ",", &context);
+            flag != NULL;
+            flag = strtok_r(NULL, ",", &context)) {
+        DWORD value;
+
+        if (strcmp(flag, "direct") == 0) {
+            value = FLAG_DIRECT;
+        } else if (strcmp(flag, "mmap") == 0) {
+            value = FLAG_MMAP;
+        } else if (strcmp(flag, "skip_bytes") == 0) {
+            value = FLAG_SKIP_BYTES;
+        } else if (strcmp(flag, "count_bytes") == 0) {
+            value = FLAG_COUNT_BYTES;
+        } else if (strcmp(flag, "seek_bytes") == 0) {
+            value = FLAG_SEEK_BYTES;
+        } else if (strcmp(flag, "discard") == 0) {
+            value = FLAG_DISCARD;
+        } else {
+            value = 0;
+        }
+        if ((value & allowed_flags) == 0) {
+            fprintf(stderr, "Invalid flag: %s\n", flag);
+            return FALSE;
+        }
+        *flags |= value;
+    }
+    return TRUE;
+}
+
+static BOOL parse_conversions(char *str, DWORD *conversions) {
+    char *context = NULL;
+    char *conversion;
+
+    for (conversion = strtok_r(str, ",", &context);
+            conversion != NULL;
+            conversion = strtok_r(NULL, ",", &context)) {
+        if (strcmp(conversion, "sparse") == 0) {
+            *conversions |= CONV_SPARSE;
+        } else if (strcmp(conversion, "noerror") == 0) {
+            *conversions |= CONV_NOERROR;
+        } else if (strcmp(conversion, "sync") == 0) {
+            *conversions |= CONV_SYNC;
+        } else {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static BOOL parse_hashes(char *str, DWORD *hashes) {
+    char *context = NULL;
+    char *name;
+
+    for (name = strtok_r(str, ",", &context);
+            name != NULL;
+            name = strtok_r(NULL, ",", &context)) {
+        enum hash_type type;
+
+        if (!hash_parse(name, &type)) {
+            return FALSE;
+        }
+        *hashes |= 1 << type;
+    }
+    return TRUE;
+}
+
+static BOOL is_empty_string(const char *s) {
+    return s == NULL || *s == '\0';
+}
+
+BOOL parse_options(int argc,
+                   char **argv,
+                   struct program_options *options) {
+    int i;
+
+    options->filename_in = NULL;
+    options->filename_out = NULL;
+    options->block_size = 0;
+    options->count = -1;
+    options->queue_depth = 0;
+    options->io_depth = 0;
+    options->jobs = 1;
+    options->retries = DEFAULT_RETRIES;
+    options->map_filename = NULL;
+    options->journal_filename = NULL;
+    options->hash_filename = NULL;
+    options->status = NULL;
+
+    for (i = 1; i < argc; i++) {
+        char *value = NULL;
+        char *name = strtok_r(argv[i], "=", &value);
+
+        if (strcmp(name, "list") == 0) {
+            options->print_drive_list = TRUE;
+        } else if (strcmp(name, "format") == 0) {
+            if (value != NULL && strcmp(value, "json") == 0) {
+                options->json = TRUE;
+            } else if (value != NULL && strcmp(value, "text") == 0) {
+                options->json = FALSE;
+            } else {
+                return FALSE;
+            }
+        } else if (strcmp(name, "flash") == 0 && i == 1) {
+            options->flash = TRUE;
+        } else if (strcmp(name, "if") == 0) {
+            options->filename_in = strdup(value);
+        } else if (strcmp(name, "of") == 0) {
+            if (options->filename_out == NULL) {
+                options->filename_out = strdup(value);
+            } else if (options->num_tee_outputs < MAX_OUTPUTS - 1) {
+                options->tee_filenames[options->num_tee_outputs++] =
+                    strdup(value);
+            } else {
+                return FALSE;
+            }
+        } else if (strcmp(name, "bs") == 0) {
+            if (value != NULL && strcmp(value, "auto") == 0) {
+                options->auto_block_size = TRUE;
+            } else {
+                options->block_size = parse_size(value);
+            }
+        } else if (strcmp(name, "ibs") == 0) {
+            options->in_block_size = parse_size(value);
+        } else if (strcmp(name, "obs") == 0) {
+            options->out_block_size = parse_size(value);
+        } else if (strcmp(name, "count") == 0) {
+            options->count = parse_size(value);
+        } else if (strcmp(name, "skip") == 0
+                || strcmp(name, "iseek") == 0) {
+            options->skip = parse_size(value);
+        } else if (strcmp(name, "seek") == 0
+                || strcmp(name, "oseek") == 0) {
+            options->seek = parse_size(value);
+        } else if (strcmp(name, "qd") == 0) {
+            options->queue_depth = atoi(value);
+            if (options->queue_depth < 2) {
+                return FALSE;
+            }
+        } else if (strcmp(name, "jobs") == 0) {
+            options->jobs = atoi(value);
+            if (options->jobs < 1 || options->jobs > MAX_THREADS) {
+                return FALSE;
+            }
+        } else if (strcmp(name, "iodepth") == 0) {
+            options->io_depth = atoi(value);
+            if (options->io_depth < 1) {
+                return FALSE;
+            }
+        } else if (strcmp(name, "iflag") == 0) {
+            if (value == NULL
+                || !parse_flags(value, IN_FLAGS, &options->in_flags)) {
+                return FALSE;
+            }
+        } else if (strcmp(name, "oflag") == 0) {
+            if (value == NULL
+                || !parse_flags(value, OUT_FLAGS, &options->out_flags)) {
+                return FALSE;
+            }
+        } else if (strcmp(name, "window") == 0) {
+            options->mmap_window_size = parse_size(value);
+        } else if (strcmp(name, "conv") == 0) {
+            if (value == NULL
+                || !parse_conversions(value, &options->conversions)) {
+                return FALSE;
+            }
+        } else if (strcmp(name, "retries") == 0) {
+            options->retries = atoi(value);
+            if (options->retries < 0) {
+                return FALSE;
+            }
+        } else if (strcmp(name, "mapfile") == 0) {
+            options->map_filename = strdup(value);
+        } else if (strcmp(name, "hash") == 0) {
+            if (value == NULL || !parse_hashes(value, &options->hashes)) {
+                return FALSE;
+            }
+        } else if (strcmp(name, "hashfile") == 0) {
+            options->hash_filename = strdup(value);
+        } else if (strcmp(name, "verify") == 0) {
+            if (value != NULL && strcmp(value, "yes") == 0) {
+                options->verify = TRUE;
+            } else if (value != NULL && strcmp(value, "no") == 0) {
+                options->verify = FALSE;
+            } else {
+                return FALSE;
+            }
+        } else if (strcmp(name, "base") == 0) {
+            options->base_filename = strdup(value);
+        } else if (strcmp(name, "index") == 0) {
+            options->index_filename = strdup(value);
+        } else if (strcmp(name, "compress") == 0) {
+            if (value == NULL
+                || !compress_parse(
+                    value,
+                    &options->compress,
+                    &options->compress_level)) {
+                return FALSE;
+            }
+        } else if (strcmp(name, "decompress") == 0) {
+            if (value != NULL && strcmp(value, "yes") == 0) {
+                options->decompress = DECOMPRESS_MODE_YES;
+            } else if (value != NULL && strcmp(value, "no") == 0) {
+                options->decompress = DECOMPRESS_MODE_NO;
+            } else {
+                return FALSE;
+            }
+        } else if (strcmp(name, "journal") == 0) {
+            options->journal_filename = strdup(value);
+        } else if (strcmp(name, "status") == 0) {
+            options->status = strdup(value);
+        } else {
+            return FALSE;
+        }
+    }
+
+    if (options->print_drive_list) {
+        return TRUE;
+    }
+
+    /* Blocks have no fixed size while bs=auto is tuning. */
+    if (options->auto_block_size) {
+        if (options->in_block_size > 0
+            || options->out_block_size > 0
+            || (options->count != (ULONGLONG)-1
+                && !(options->in_flags & FLAG_COUNT_BYTES))
+            || (options->skip > 0
+                && !(options->in_flags & FLAG_SKIP_BYTES))
+            || (options->seek > 0
+                && !(options->out_flags & FLAG_SEEK_BYTES))) {
+            return FALSE;
+        }
+    }
+
+    /* A base image is only useful with the index that goes with it. */
+    if (options->base_filename != NULL && options->index_filename == NULL) {
+        return FALSE;
+    }
+
+    /* wdd flash has no main output, every target is written like an extra
+     * one so that any of them can be dropped.
+     */
+    if (options->flash && options->filename_out != NULL) {
+        if (options->num_tee_outputs == MAX_OUTPUTS - 1
+            || options->base_filename != NULL) {
+            return FALSE;
+        }
+        MoveMemory(
+            &options->tee_filenames[1],
+            &options->tee_filenames[0],
+            sizeof(options->tee_filenames[0]) * options->num_tee_outputs);
+        options->tee_filenames[0] = options->filename_out;
+        options->num_tee_outputs++;
+        options->filename_out = NULL;
+        return !is_empty_string(options->filename_in);
+    }
+
+    return !is_empty_string(options->filename_in)
+        && !is_empty_string(options->filename_out);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_OPTIONS_H
+#define WDD_OPTIONS_H
+
+#include <windows.h>
+#include "wdd.h"
+
+#define FLAG_DIRECT 0x1
+#define FLAG_MMAP 0x2
+#define FLAG_SKIP_BYTES 0x4
+#define FLAG_COUNT_BYTES 0x8
+#define FLAG_SEEK_BYTES 0x10
+#define FLAG_DISCARD 0x20
+/* Flags that make sense for iflag= and oflag= respectively. */
+#define IN_FLAGS \
+    (FLAG_DIRECT | FLAG_MMAP | FLAG_SKIP_BYTES | FLAG_COUNT_BYTES)
+#define OUT_FLAGS (FLAG_DIRECT | FLAG_SEEK_BYTES | FLAG_DISCARD)
+#define CONV_SPARSE 0x1
+#define CONV_NOERROR 0x2
+#define CONV_SYNC 0x4
+
+/* decompress= is left at auto unless given, which decompresses input with
+ * a matching name and header only when writing to drives.
+ */
+enum decompress_mode {
+    DECOMPRESS_MODE_AUTO,
+    DECOMPRESS_MODE_YES,
+    DECOMPRESS_MODE_NO
+};
+
+struct program_options {
+    BOOL print_drive_list;
+    BOOL json;
+    BOOL flash;
+    const char *filename_in;
+    const char *filename_out;
+    const char *tee_filenames[MAX_OUTPUTS - 1];
+    int num_tee_outputs;
+    ULONGLONG block_size;
+    ULONGLONG in_block_size;
+    ULONGLONG out_block_size;
+    BOOL auto_block_size;
+    ULONGLONG count;
+    ULONGLONG skip;
+    ULONGLONG seek;
+    int queue_depth;
+    int io_depth;
+    int jobs;
+    DWORD in_flags;
+    DWORD out_flags;
+    ULONGLONG mmap_window_size;
+    DWORD conversions;
+    int retries;
+    const char *map_filename;
+    const char *journal_filename;
+    DWORD hashes;
+    const char *hash_filename;
+    BOOL verify;
+    const char *base_filename;
+    const char *index_filename;
+    enum compress_type compress;
+    int compress_level;
+    enum decompress_mode decompress;
+    const char *status;
+};
+
+/* Prints the command line syntax and the list of operands. */
+void print_usage(void);
+
+/* Parses the operands of the command line. Prints an error and returns
+ * FALSE if any of them is invalid.
+ */
+BOOL parse_options(int argc,
+                   char **argv,
+                   struct program_options *options);
+
+#endif
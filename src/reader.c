@@ -0,0 +1,1050 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <windows.h>
+#include "compress.h"
+#include "decompress.h"
+#include "file.h"
+#include "journal.h"
+#include "reader.h"
+#include "wdd.h"
+#include "xz.h"
+
+#define MAX_BAD_SKIP_SIZE (64 * MB)
+#define SEEK_TABLE_CHECKSUM_FLAG 0x80
+#define DECOMPRESS_CHUNK_SIZE MB
+#define MAX_DECOMPRESS_WINDOW_SIZE GB
+
+/* Compressed input for the decompressing reader. Chunks of
+ * DECOMPRESS_CHUNK_SIZE are read ahead through the queue and appended to
+ * the buffer whenever the decoder asks for more than is left in it. in
+ * comes first so that fill_input_stream() can get to the rest.
+ */
+struct input_stream {
+    struct in_stream in;
+    struct program_state *s;
+    struct io_queue queue;
+    unsigned char *buffer;
+    SIZE_T buffer_size;
+    char *chunks;
+    LONGLONG num_submitted;
+    LONGLONG num_completed;
+    ULONGLONG offset;
+    BOOL end_of_input;
+};
+
+struct input_mapping {
+    HANDLE handle;
+    SIZE_T window_size;
+    struct mapped_window *window;
+};
+
+typedef BOOL (WINAPI *PrefetchVirtualMemoryFunc)(
+    HANDLE,
+    ULONG_PTR,
+    PWIN32_MEMORY_RANGE_ENTRY,
+    ULONG);
+
+static void unmap_input(struct input_mapping *mapping) {
+    if (mapping->window != NULL) {
+        release_window(mapping->window);
+        mapping->window = NULL;
+    }
+    if (mapping->handle != NULL) {
+        CloseHandle(mapping->handle);
+        mapping->handle = NULL;
+    }
+}
+
+/* Maps the window of the input file that contains offset, unless it's
+ * already mapped. If there isn't enough address space for it, smaller
+ * windows are tried before giving up on mapping altogether.
+ */
+static BOOL map_input_window(struct program_state *s,
+                             struct input_mapping *mapping,
+                             ULONGLONG offset) {
+    static PrefetchVirtualMemoryFunc prefetch_virtual_memory;
+    struct mapped_window *window;
+    WIN32_MEMORY_RANGE_ENTRY range;
+    ULONGLONG window_offset;
+
+    if (mapping->window != NULL
+        && offset >= mapping->window->offset
+        && offset < mapping->window->offset + mapping->window->size) {
+        return TRUE;
+    }
+    if (mapping->window != NULL) {
+        release_window(mapping->window);
+        mapping->window = NULL;
+    }
+
+    window = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*window));
+    if (window == NULL) {
+        return FALSE;
+    }
+
+    for (;;) {
+        window_offset = offset - offset % mapping->window_size;
+        window->offset = window_offset;
+        window->size = (SIZE_T)min(
+            mapping->window_size,
+            s->in_file_size - window_offset);
+        window->base = MapViewOfFile(
+            mapping->handle,
+            FILE_MAP_READ,
+            (DWORD)(window_offset >> 32),
+            (DWORD)window_offset,
+            window->size);
+        if (window->base != NULL) {
+            break;
+        }
+        if (mapping->window_size / 2 < MIN_MMAP_WINDOW_SIZE) {
+            HeapFree(GetProcessHeap(), 0, window);
+            return FALSE;
+        }
+        mapping->window_size /= 2;
+    }
+
+    window->num_refs = 1;
+    mapping->window = window;
+
+    /* Ask the memory manager to read the whole window in large requests
+     * rather than fault it in page by page (Windows 8 and later).
+     */
+    if (prefetch_virtual_memory == NULL) {
+        prefetch_virtual_memory = (PrefetchVirtualMemoryFunc)GetProcAddress(
+            GetModuleHandleA("kernel32.dll"),
+            "PrefetchVirtualMemory");
+    }
+    if (prefetch_virtual_memory != NULL) {
+        range.VirtualAddress = window->base;
+        range.NumberOfBytes = window->size;
+        prefetch_virtual_memory(GetCurrentProcess(), 1, &range, 0);
+    }
+
+    return TRUE;
+}
+
+/* Points the slot at the input data in the mapped window, clipping the
+ * block at the end of the window. Returns FALSE if the data has to be read
+ * normally.
+ */
+static BOOL map_input(struct program_state *s,
+                      struct input_mapping *mapping,
+                      struct ring_slot *slot,
+                      ULONGLONG offset) {
+    struct mapped_window *window;
+    ULONGLONG window_end;
+
+    if (mapping->handle == NULL || offset >= s->in_file_size) {
+        return FALSE;
+    }
+    if (!map_input_window(s, mapping, offset)) {
+        unmap_input(mapping);
+        return FALSE;
+    }
+
+    window = mapping->window;
+    window_end = window->offset + window->size;
+    if (offset + slot->size > window_end) {
+        slot->size = (DWORD)(window_end - offset);
+    }
+
+    slot->data = window->base + (offset - window->offset);
+    slot->window = window;
+    InterlockedIncrement(&window->num_refs);
+
+    /* Each hash thread keeps the window mapped until it's done too. */
+    if (s->ring.num_hashers > 0) {
+        InterlockedExchangeAdd(&window->num_refs, s->ring.num_hashers);
+        slot->hash_window = window;
+    }
+    return TRUE;
+}
+
+/* Pipes and consoles return whatever is available, so a short read from
+ * them doesn't mean the input has ended. Keeps reading after the first
+ * num_bytes until the piece is full or a read returns nothing. A broken pipe
+ * is the writer closing its end and ends the input like a 0-byte read.
+ */
+static DWORD read_rest(HANDLE file,
+                       char *buffer,
+                       DWORD size,
+                       DWORD *num_bytes) {
+    while (*num_bytes < size) {
+        DWORD n;
+
+        if (!ReadFile(
+                file,
+                buffer + *num_bytes,
+                size - *num_bytes,
+                &n,
+                NULL)) {
+            DWORD error = GetLastError();
+            return error == ERROR_BROKEN_PIPE ? ERROR_SUCCESS : error;
+        }
+        if (n == 0) {
+            break;
+        }
+        *num_bytes += n;
+    }
+    return ERROR_SUCCESS;
+}
+
+DWORD WINAPI reader_thread_proc(LPVOID param) {
+    struct program_state *s = param;
+    struct io_queue queue;
+    LONGLONG next_seq = 0;
+    ULONGLONG offset = s->in_offset;
+    ULONGLONG num_bytes_submitted = 0;
+    struct allocated_ranges map;
+    struct input_mapping mapping;
+    BOOL end_of_input = FALSE;
+    BOOL sent_end = FALSE;
+    struct ring_slot *partial_slot = NULL;
+    DWORD partial_pos = 0;
+    DWORD head_filled = 0;
+    struct io_queue retry_queue;
+    ULONGLONG bad_skip_end = 0;
+    ULONGLONG bad_skip_size = 0;
+
+    ZeroMemory(&map, sizeof(map));
+    map.file_size = s->in_file_size;
+
+    ZeroMemory(&mapping, sizeof(mapping));
+    if (s->mmap_window_size > 0) {
+        mapping.window_size = s->mmap_window_size;
+        mapping.handle = CreateFileMappingA(
+            s->in_file,
+            NULL,
+            PAGE_READONLY,
+            0,
+            0,
+            NULL);
+    }
+
+    ZeroMemory(&queue, sizeof(queue));
+    ZeroMemory(&retry_queue, sizeof(retry_queue));
+    if (!io_queue_init(
+            &queue,
+            s->in_file,
+            s->in_file_is_synchronous,
+            s->io_depth)
+        || (s->noerror
+            && !io_queue_init(&retry_queue, s->in_file, FALSE, 1))) {
+        abort_copy(s, GetLastError(), "Failed to create I/O queue");
+        io_queue_free(&queue);
+        return 1;
+    }
+
+    /* Reads are submitted into the free slots past head as long as there is
+     * room in the queue and completed in order. With ibs= a slot is filled
+     * by several reads of in_unit bytes. An empty slot marks the end of
+     * input for the writer.
+     */
+    while (!s->aborted) {
+        struct ring_slot *slot;
+        DWORD piece_size;
+        DWORD num_bytes;
+        DWORD error;
+
+        while (!end_of_input && !io_queue_is_full(&queue)) {
+            if (partial_slot != NULL) {
+                slot = partial_slot;
+                piece_size = min(s->in_unit, slot->size - partial_pos);
+                if (slot->hole || slot->data != slot->buffer) {
+                    io_queue_skip(&queue, piece_size);
+                } else {
+                    io_queue_submit(
+                        &queue,
+                        IO_READ,
+                        slot->buffer + partial_pos,
+                        piece_size,
+                        offset + partial_pos);
+                }
+                partial_pos += piece_size;
+                if (partial_pos == slot->size) {
+                    offset += slot->size;
+                    next_seq++;
+                    num_bytes_submitted += slot->size;
+                    partial_slot = NULL;
+                }
+                continue;
+            }
+
+            if (num_bytes_submitted >= s->max_bytes_in) {
+                break;
+            }
+            slot = ring_acquire_free(
+                &s->ring,
+                next_seq,
+                queue.num_pending == 0,
+                &s->aborted);
+            if (slot == NULL) {
+                break;
+            }
+            slot->size = (DWORD)min(
+                s->transfer_size,
+                s->max_bytes_in - num_bytes_submitted);
+            slot->data = slot->buffer;
+            slot->hash_window = NULL;
+            slot->hole = s->in_file_has_holes
+                && is_hole(s->in_file, &map, offset, &slot->size);
+
+            /* Right after a bad block the drive is likely to fail again,
+             * so with conv=noerror a growing area after it is left for the
+             * second pass and treated like a hole for now.
+             */
+            if (!slot->hole
+                && offset < bad_skip_end
+                && offset + slot->size <= s->in_file_size) {
+                if (!add_region(
+                        s,
+                        &s->unread_regions,
+                        offset,
+                        slot->size)) {
+                    abort_copy(s, GetLastError(), "Failed to skip block");
+                    break;
+                }
+                slot->hole = TRUE;
+            }
+
+            /* Holes read as zeros. Buffers that already hold zeros from an
+             * earlier hole don't need to be cleared again. Mapped input is
+             * read when the writer touches it. Either way the slot's pieces
+             * complete right away.
+             */
+            if (slot->hole) {
+                if (!slot->zeroed) {
+                    ZeroMemory(slot->buffer, s->buffer_size);
+                    slot->zeroed = TRUE;
+                }
+            } else if (!map_input(s, &mapping, slot, offset)) {
+                slot->zeroed = FALSE;
+            }
+            partial_slot = slot;
+            partial_pos = 0;
+        }
+
+        if (queue.num_pending == 0) {
+            if (!sent_end) {
+                slot = ring_acquire_free(
+                    &s->ring,
+                    s->ring.head,
+                    TRUE,
+                    &s->aborted);
+                if (slot != NULL) {
+                    slot->size = 0;
+                    ring_publish(&s->ring);
+                }
+            }
+            break;
+        }
+
+        error = io_queue_complete(&queue, &num_bytes);
+
+        /* Reads that were submitted past the end of input are dropped. */
+        if (end_of_input) {
+            continue;
+        }
+        slot = &s->ring.slots[s->ring.head % s->ring.depth];
+        piece_size = min(s->in_unit, slot->size - head_filled);
+        if (error == ERROR_SUCCESS
+            && s->in_file_is_synchronous
+            && num_bytes > 0
+            && num_bytes < piece_size) {
+            error = read_rest(
+                s->in_file,
+                slot->buffer + head_filled,
+                piece_size,
+                &num_bytes);
+        }
+        if (error == ERROR_HANDLE_EOF
+            || error == ERROR_SECTOR_NOT_FOUND
+            || error == ERROR_BROKEN_PIPE) {
+            num_bytes = 0;
+        } else if (error != ERROR_SUCCESS) {
+            if (!s->noerror || s->in_file_is_synchronous) {
+                abort_copy(s, error, "Error reading from file");
+                break;
+            }
+            if (!skip_bad_block(
+                    s,
+                    &retry_queue,
+                    slot->buffer + head_filled,
+                    s->in_offset,
+                    piece_size)) {
+                abort_copy(s, GetLastError(), "Failed to skip bad block");
+                break;
+            }
+            num_bytes = piece_size;
+            slot->zeroed = FALSE;
+            if (s->retry_later && s->in_file_size_known) {
+                bad_skip_size = min(
+                    max(bad_skip_size * 2, s->buffer_size),
+                    MAX_BAD_SKIP_SIZE);
+                bad_skip_end = s->in_offset + piece_size + bad_skip_size;
+            }
+        } else {
+            bad_skip_size = 0;
+        }
+
+        s->in_offset += num_bytes;
+        add_to_counter(&s->num_bytes_in, num_bytes);
+        head_filled += num_bytes;
+        if (num_bytes < piece_size) {
+            end_of_input = TRUE;
+
+            /* conv=sync pads the last input block to full size. */
+            if (s->sync && num_bytes > 0) {
+                ZeroMemory(
+                    slot->buffer + head_filled,
+                    piece_size - num_bytes);
+                head_filled += piece_size - num_bytes;
+            }
+            sent_end = head_filled == 0;
+        } else if (head_filled < slot->size) {
+            continue;
+        }
+        slot->size = head_filled;
+        head_filled = 0;
+        ring_publish(&s->ring);
+    }
+
+    io_queue_cancel(&queue);
+    io_queue_free(&queue);
+    io_queue_free(&retry_queue);
+    unmap_input(&mapping);
+    return 0;
+}
+
+/* Appends the next chunks of compressed input to the buffer until at least
+ * size bytes are available or the input ends. Pipes may return less than a
+ * whole chunk at any time, other inputs only at the end.
+ */
+static size_t fill_input_stream(struct in_stream *in, size_t size) {
+    struct input_stream *stream = (struct input_stream *)in;
+    struct program_state *s = stream->s;
+    size_t available = (size_t)(in->end - in->p);
+
+    if (available >= size) {
+        return available;
+    }
+    size = min(size, stream->buffer_size - DECOMPRESS_CHUNK_SIZE);
+    MoveMemory(stream->buffer, in->p, available);
+    in->p = stream->buffer;
+    in->end = stream->buffer + available;
+
+    while (available < size && !stream->end_of_input && !s->aborted) {
+        char *chunk;
+        DWORD num_bytes;
+        DWORD error;
+
+        while (!io_queue_is_full(&stream->queue)) {
+            io_queue_submit(
+                &stream->queue,
+                IO_READ,
+                stream->chunks
+                    + (SIZE_T)(stream->num_submitted % stream->queue.depth)
+                        * DECOMPRESS_CHUNK_SIZE,
+                DECOMPRESS_CHUNK_SIZE,
+                stream->offset);
+            stream->offset += DECOMPRESS_CHUNK_SIZE;
+            stream->num_submitted++;
+        }
+
+        error = io_queue_complete(&stream->queue, &num_bytes);
+        chunk = stream->chunks
+            + (SIZE_T)(stream->num_completed % stream->queue.depth)
+                * DECOMPRESS_CHUNK_SIZE;
+        stream->num_completed++;
+        if (error == ERROR_HANDLE_EOF || error == ERROR_BROKEN_PIPE) {
+            num_bytes = 0;
+        } else if (error != ERROR_SUCCESS) {
+            abort_copy(s, error, "Error reading from file");
+            break;
+        }
+
+        CopyMemory((unsigned char *)in->end, chunk, num_bytes);
+        in->end += num_bytes;
+        available += num_bytes;
+        s->in_offset += num_bytes;
+        add_to_counter(&s->num_bytes_in, num_bytes);
+        if (num_bytes == 0
+            || (num_bytes < DECOMPRESS_CHUNK_SIZE
+                && !stream->queue.synchronous)) {
+            stream->end_of_input = TRUE;
+        }
+    }
+    return available;
+}
+
+static void abort_decompression(struct program_state *s,
+                                enum decode_status status) {
+    if (status == DECODE_UNSUPPORTED) {
+        abort_copy(
+            s,
+            ERROR_NOT_SUPPORTED,
+            "Compressed input uses an unsupported feature");
+    } else {
+        abort_copy(s, ERROR_INVALID_DATA, "Compressed input is corrupt");
+    }
+}
+
+DWORD WINAPI decompress_reader_thread_proc(LPVOID param) {
+    struct program_state *s = param;
+    struct input_stream stream;
+    struct out_window out;
+    unsigned char *window = NULL;
+    unsigned char *copied;
+    SIZE_T window_size;
+    SIZE_T step_size = decompress_step_size(s->decompress);
+    SIZE_T buffer_size;
+    ULONGLONG num_bytes_left = s->max_bytes_in;
+    struct ring_slot *slot = NULL;
+
+    ZeroMemory(&stream, sizeof(stream));
+    stream.s = s;
+    stream.offset = s->in_offset;
+    stream.buffer_size = DECOMPRESS_MAX_INPUT_SIZE + DECOMPRESS_CHUNK_SIZE;
+    if (!io_queue_init(
+            &stream.queue,
+            s->in_file,
+            s->in_file_is_synchronous,
+            s->io_depth)) {
+        abort_copy(s, GetLastError(), "Failed to create I/O queue");
+        return 1;
+    }
+    stream.buffer = VirtualAlloc(
+        NULL,
+        stream.buffer_size,
+        MEM_COMMIT | MEM_RESERVE,
+        PAGE_READWRITE);
+    stream.chunks = VirtualAlloc(
+        NULL,
+        (SIZE_T)DECOMPRESS_CHUNK_SIZE * stream.queue.depth,
+        MEM_COMMIT | MEM_RESERVE,
+        PAGE_READWRITE);
+    if (stream.buffer == NULL || stream.chunks == NULL) {
+        abort_copy(s, GetLastError(), "Failed to allocate input buffer");
+        goto done;
+    }
+    stream.in.p = stream.buffer;
+    stream.in.end = stream.buffer;
+    stream.in.fill = fill_input_stream;
+
+    /* The window is whatever the first frame asks for, later frames that
+     * need more are rejected by the decoder.
+     */
+    fill_input_stream(&stream.in, DECOMPRESS_HEADER_SIZE);
+    window_size = decompress_window_size(
+        s->decompress,
+        stream.in.p,
+        (DWORD)(stream.in.end - stream.in.p));
+    if (window_size > MAX_DECOMPRESS_WINDOW_SIZE) {
+        abort_decompression(s, DECODE_UNSUPPORTED);
+        goto done;
+    }
+    buffer_size = 2 * window_size + step_size;
+    window = VirtualAlloc(
+        NULL,
+        buffer_size,
+        MEM_COMMIT | MEM_RESERVE,
+        PAGE_READWRITE);
+    if (window == NULL) {
+        abort_copy(s, GetLastError(), "Failed to allocate window");
+        goto done;
+    }
+    out.start = window;
+    out.p = window;
+    out.end = window + buffer_size;
+    out.window_size = window_size;
+    copied = window;
+
+    while (!s->aborted && num_bytes_left > 0) {
+        enum decode_status status;
+
+        /* Everything before copied is in the slots already, so only the
+         * window has to stay.
+         */
+        if ((SIZE_T)(out.end - out.p) < step_size) {
+            SIZE_T keep = min(window_size, (SIZE_T)(out.p - window));
+
+            MoveMemory(window, out.p - keep, keep);
+            out.p = window + keep;
+            copied = out.p;
+        }
+
+        status = decompress_step(&s->decompressor, &stream.in, &out);
+        if (status == DECODE_CORRUPT || status == DECODE_UNSUPPORTED) {
+            abort_decompression(s, status);
+            break;
+        }
+
+        while (copied < out.p && num_bytes_left > 0) {
+            DWORD size;
+
+            if (slot == NULL) {
+                slot = ring_acquire_free(
+                    &s->ring,
+                    s->ring.head,
+                    TRUE,
+                    &s->aborted);
+                if (slot == NULL) {
+                    break;
+                }
+                slot->data = slot->buffer;
+                slot->size = 0;
+                slot->hole = FALSE;
+                slot->zeroed = FALSE;
+                slot->hash_window = NULL;
+            }
+            size = (DWORD)min(
+                min((SIZE_T)(out.p - copied), s->buffer_size - slot->size),
+                num_bytes_left);
+            CopyMemory(slot->buffer + slot->size, copied, size);
+            slot->size += size;
+            copied += size;
+            num_bytes_left -= size;
+            add_to_counter(&s->num_bytes_decompressed, size);
+            if (slot->size == s->buffer_size || num_bytes_left == 0) {
+                ring_publish(&s->ring);
+                slot = NULL;
+            }
+        }
+        if (status == DECODE_END) {
+            break;
+        }
+    }
+
+    if (!s->aborted) {
+        if (slot != NULL) {
+            ring_publish(&s->ring);
+        }
+        slot = ring_acquire_free(&s->ring, s->ring.head, TRUE, &s->aborted);
+        if (slot != NULL) {
+            slot->size = 0;
+            ring_publish(&s->ring);
+        }
+    }
+
+done:
+    io_queue_cancel(&stream.queue);
+    io_queue_free(&stream.queue);
+    if (window != NULL) {
+        VirtualFree(window, 0, MEM_RELEASE);
+    }
+    if (stream.chunks != NULL) {
+        VirtualFree(stream.chunks, 0, MEM_RELEASE);
+    }
+    if (stream.buffer != NULL) {
+        VirtualFree(stream.buffer, 0, MEM_RELEASE);
+    }
+    return 0;
+}
+
+DWORD WINAPI frame_reader_thread_proc(LPVOID param) {
+    struct program_state *s = param;
+    struct io_queue queue;
+    LONGLONG next_seq = 0;
+    ULONGLONG num_bytes_submitted = 0;
+    ULONGLONG num_bytes_published = 0;
+    int i;
+
+    ZeroMemory(&queue, sizeof(queue));
+    if (!io_queue_init(&queue, s->in_file, FALSE, s->io_depth)) {
+        abort_copy(s, GetLastError(), "Failed to create I/O queue");
+        return 1;
+    }
+
+    while (!s->aborted) {
+        struct ring_slot *slot;
+        LONGLONG head = s->ring.head;
+        DWORD num_bytes;
+        DWORD error;
+
+        /* Only wait for the writer if there is nothing else to do. */
+        while (next_seq < s->frames_end
+               && num_bytes_submitted < s->max_bytes_in
+               && !io_queue_is_full(&queue)) {
+            const struct input_frame *frame = &s->frames.items[next_seq];
+
+            slot = ring_acquire_free(
+                &s->ring,
+                next_seq,
+                next_seq == head,
+                &s->aborted);
+            if (slot == NULL) {
+                break;
+            }
+            slot->data = slot->buffer;
+            slot->size = frame->size;
+            slot->packed_size = frame->compressed_size;
+            slot->hole = FALSE;
+            slot->zeroed = FALSE;
+            slot->hash_window = NULL;
+            io_queue_submit(
+                &queue,
+                IO_READ,
+                slot->packed,
+                frame->compressed_size,
+                frame->offset);
+            num_bytes_submitted += frame->size;
+            next_seq++;
+        }
+
+        if (head < s->frames_read) {
+            struct decompress_worker *worker =
+                &s->decompress_workers[head % s->num_decompress_workers];
+
+            if (ring_load(&worker->done) > head) {
+                slot = &s->ring.slots[head % s->ring.depth];
+                slot->size = (DWORD)min(
+                    slot->size,
+                    s->max_bytes_in - num_bytes_published);
+                num_bytes_published += slot->size;
+                add_to_counter(&s->num_bytes_decompressed, slot->size);
+                ring_publish(&s->ring);
+                continue;
+            }
+            if (queue.num_pending == 0) {
+                WaitForSingleObject(s->decompressed, INFINITE);
+                continue;
+            }
+        }
+
+        if (queue.num_pending == 0) {
+            break;
+        }
+
+        error = io_queue_complete(&queue, &num_bytes);
+        if (error == ERROR_SUCCESS
+            && num_bytes < s->frames.items[s->frames_read].compressed_size) {
+            error = ERROR_HANDLE_EOF;
+        }
+        if (error != ERROR_SUCCESS) {
+            abort_copy(s, error, "Error reading from file");
+            break;
+        }
+        s->in_offset += num_bytes;
+        add_to_counter(&s->num_bytes_in, num_bytes);
+        InterlockedIncrement64(&s->frames_read);
+        SetEvent(s->decompress_workers[
+            (s->frames_read - 1) % s->num_decompress_workers].ready);
+    }
+
+    /* Let the workers know that no more frames are coming. */
+    InterlockedExchange64(&s->frames_end, next_seq);
+    for (i = 0; i < s->num_decompress_workers; i++) {
+        SetEvent(s->decompress_workers[i].ready);
+    }
+
+    if (!s->aborted) {
+        struct ring_slot *slot = ring_acquire_free(
+            &s->ring,
+            s->ring.head,
+            TRUE,
+            &s->aborted);
+        if (slot != NULL) {
+            slot->size = 0;
+            ring_publish(&s->ring);
+        }
+    }
+
+    io_queue_cancel(&queue);
+    io_queue_free(&queue);
+    return 0;
+}
+
+static DWORD get_le32(const unsigned char *p) {
+    return (DWORD)p[0]
+        | (DWORD)p[1] << 8
+        | (DWORD)p[2] << 16
+        | (DWORD)p[3] << 24;
+}
+
+BOOL read_input_at(struct program_state *s,
+                   void *buffer,
+                   DWORD size,
+                   ULONGLONG offset) {
+    struct io_queue queue;
+    DWORD num_bytes;
+    DWORD error;
+
+    ZeroMemory(&queue, sizeof(queue));
+    if (!io_queue_init(&queue, s->in_file, FALSE, 1)) {
+        return FALSE;
+    }
+    io_queue_submit(&queue, IO_READ, buffer, size, offset);
+    error = io_queue_complete(&queue, &num_bytes);
+    io_queue_free(&queue);
+
+    if (error == ERROR_SUCCESS && num_bytes != size) {
+        error = ERROR_HANDLE_EOF;
+    }
+    if (error != ERROR_SUCCESS) {
+        SetLastError(error);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL add_input_frame(struct frame_list *list,
+                            ULONGLONG offset,
+                            ULONGLONG compressed_size,
+                            ULONGLONG size) {
+    struct input_frame *frame;
+
+    if (compressed_size > MAX_TRANSFER_SIZE || size > MAX_TRANSFER_SIZE) {
+        return FALSE;
+    }
+    if (list->count == list->capacity) {
+        SIZE_T capacity = max(list->capacity * 2, 1024);
+        struct input_frame *items = list->items == NULL
+            ? HeapAlloc(
+                GetProcessHeap(),
+                0,
+                sizeof(*items) * capacity)
+            : HeapReAlloc(
+                GetProcessHeap(),
+                0,
+                list->items,
+                sizeof(*items) * capacity);
+        if (items == NULL) {
+            return FALSE;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    frame = &list->items[list->count++];
+    frame->offset = offset;
+    frame->compressed_size = (DWORD)compressed_size;
+    frame->size = (DWORD)size;
+    list->max_compressed_size =
+        max(list->max_compressed_size, frame->compressed_size);
+    list->max_size = max(list->max_size, frame->size);
+    list->total_size += size;
+    return TRUE;
+}
+
+BOOL read_seek_table(struct program_state *s) {
+    unsigned char footer[SEEK_TABLE_FOOTER_SIZE];
+    unsigned char *table;
+    ULONGLONG frame_size;
+    ULONGLONG offset = 0;
+    DWORD entry_size;
+    DWORD count;
+    DWORD i;
+    BOOL result = FALSE;
+
+    if (s->in_file_size < SEEK_TABLE_FOOTER_SIZE + 8
+        || !read_input_at(
+            s,
+            footer,
+            SEEK_TABLE_FOOTER_SIZE,
+            s->in_file_size - SEEK_TABLE_FOOTER_SIZE)
+        || get_le32(footer + 5) != SEEK_TABLE_FOOTER_MAGIC) {
+        return FALSE;
+    }
+
+    count = get_le32(footer);
+    entry_size = SEEK_TABLE_ENTRY_SIZE;
+    if (footer[4] & SEEK_TABLE_CHECKSUM_FLAG) {
+        entry_size += 4;
+    }
+    frame_size = (ULONGLONG)count * entry_size + SEEK_TABLE_FOOTER_SIZE;
+    if (frame_size > MAX_TRANSFER_SIZE
+        || frame_size + 8 > s->in_file_size) {
+        return FALSE;
+    }
+    table = HeapAlloc(GetProcessHeap(), 0, (SIZE_T)frame_size + 8);
+    if (table == NULL) {
+        return FALSE;
+    }
+
+    if (read_input_at(
+            s,
+            table,
+            (DWORD)frame_size + 8,
+            s->in_file_size - frame_size - 8)
+        && get_le32(table) == SEEK_TABLE_MAGIC
+        && get_le32(table + 4) == frame_size) {
+        result = TRUE;
+        for (i = 0; i < count && result; i++) {
+            const unsigned char *entry = table + 8 + (SIZE_T)i * entry_size;
+
+            result = add_input_frame(
+                &s->frames,
+                offset,
+                get_le32(entry),
+                get_le32(entry + 4));
+            offset += get_le32(entry);
+        }
+        result = result && offset == s->in_file_size - frame_size - 8;
+    }
+
+    HeapFree(GetProcessHeap(), 0, table);
+    return result;
+}
+
+BOOL read_xz_index(struct program_state *s) {
+    unsigned char footer[XZ_FOOTER_SIZE];
+    unsigned char *index;
+    struct xz_block_record *records;
+    ULONGLONG index_size;
+    ULONGLONG offset = XZ_HEADER_SIZE;
+    size_t num_records;
+    size_t i;
+    BOOL result = FALSE;
+
+    if (s->in_file_size < XZ_HEADER_SIZE + XZ_FOOTER_SIZE
+        || !read_input_at(
+            s,
+            footer,
+            XZ_FOOTER_SIZE,
+            s->in_file_size - XZ_FOOTER_SIZE)) {
+        return FALSE;
+    }
+    index_size = xz_index_size(footer, &s->xz_check_type);
+    if (index_size == 0
+        || index_size > MAX_TRANSFER_SIZE
+        || index_size > s->in_file_size - XZ_HEADER_SIZE - XZ_FOOTER_SIZE) {
+        return FALSE;
+    }
+
+    index = HeapAlloc(GetProcessHeap(), 0, (SIZE_T)index_size);
+    records = HeapAlloc(
+        GetProcessHeap(),
+        0,
+        sizeof(*records) * (SIZE_T)(index_size / 2));
+    if (index != NULL
+        && records != NULL
+        && read_input_at(
+            s,
+            index,
+            (DWORD)index_size,
+            s->in_file_size - XZ_FOOTER_SIZE - index_size)
+        && xz_parse_index(index, (size_t)index_size, records, &num_records)) {
+        result = TRUE;
+        for (i = 0; i < num_records && result; i++) {
+            ULONGLONG block_size = (records[i].unpadded_size + 3) & ~3ULL;
+
+            result = add_input_frame(
+                &s->frames,
+                offset,
+                block_size,
+                records[i].size);
+            offset += block_size;
+        }
+        result = result
+            && offset + index_size + XZ_FOOTER_SIZE == s->in_file_size;
+    }
+
+    HeapFree(GetProcessHeap(), 0, records);
+    HeapFree(GetProcessHeap(), 0, index);
+    return result;
+}
+
+BOOL are_frames_aligned(const struct frame_list *list,
+                        DWORD alignment) {
+    SIZE_T i;
+
+    for (i = 0; i + 1 < list->count; i++) {
+        if (list->items[i].size % alignment != 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+DWORD WINAPI decompress_thread_proc(LPVOID param) {
+    struct decompress_worker *worker = param;
+    struct program_state *s = worker->s;
+    LONGLONG seq = worker->number;
+
+    while (!s->aborted) {
+        struct ring_slot *slot;
+        struct in_stream in;
+        struct out_window out;
+        enum decode_status status;
+
+        while (ring_load(&s->frames_read) <= seq) {
+            if (s->aborted || seq >= ring_load(&s->frames_end)) {
+                return 0;
+            }
+            WaitForSingleObject(worker->ready, INFINITE);
+        }
+
+        slot = &s->ring.slots[seq % s->ring.depth];
+        in.p = (const unsigned char *)slot->packed;
+        in.end = in.p + slot->packed_size;
+        in.fill = NULL;
+        out.start = (unsigned char *)slot->buffer;
+        out.p = out.start;
+        out.end = out.start + s->frames.items[seq].size;
+        out.window_size = (size_t)-1;
+
+        decompress_reset(&worker->decompressor, s->xz_check_type);
+        do {
+            status = decompress_step(&worker->decompressor, &in, &out);
+        } while (status == DECODE_OK);
+        if (status == DECODE_END && out.p != out.end) {
+            status = DECODE_CORRUPT;
+        }
+        if (status != DECODE_END) {
+            abort_decompression(s, status);
+            break;
+        }
+
+        InterlockedExchange64(&worker->done, seq + 1);
+        SetEvent(s->decompressed);
+        seq += s->num_decompress_workers;
+    }
+    return 0;
+}
+
+BOOL discard_input(struct program_state *s, ULONGLONG size) {
+    char *buffer;
+    DWORD num_bytes;
+    BOOL result = TRUE;
+
+    buffer = HeapAlloc(GetProcessHeap(), 0, BUFFER_SIZE);
+    if (buffer == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    while (size > 0) {
+        result = ReadFile(
+            s->in_file,
+            buffer,
+            (DWORD)min(size, BUFFER_SIZE),
+            &num_bytes,
+            NULL);
+        if (!result || num_bytes == 0) {
+            break;
+        }
+        size -= num_bytes;
+    }
+    HeapFree(GetProcessHeap(), 0, buffer);
+    return result;
+}
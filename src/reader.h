@@ -0,0 +1,83 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_READER_H
+#define WDD_READER_H
+
+#include <windows.h>
+#include "wdd.h"
+
+/* Reads the input block by block into free slots of the ring, from a mapped
+ * view with iflag=mmap, and hands them to the writer in order.
+ */
+DWORD WINAPI reader_thread_proc(LPVOID param);
+
+/* Reads compressed input that can only be decompressed from start to end.
+ * The decoder writes into a buffer that keeps the last window_size bytes of
+ * output for matches to refer back to, and the data is copied from there
+ * into the slots.
+ */
+DWORD WINAPI decompress_reader_thread_proc(LPVOID param);
+
+/* Reads the frames of compressed input with a seek table or an xz index.
+ * Frames are read ahead into free slots and decompressed by the workers,
+ * and the slots go to the writer in order as soon as their frames are
+ * done. With count= the last frame is cut short.
+ */
+DWORD WINAPI frame_reader_thread_proc(LPVOID param);
+
+/* Reads from the input before the copy starts, for the seek table or index
+ * of compressed input.
+ */
+BOOL read_input_at(struct program_state *s,
+                   void *buffer,
+                   DWORD size,
+                   ULONGLONG offset);
+
+/* Reads the seek table at the end of Zstandard or LZ4 input, like the one
+ * compress= writes, into s->frames. Returns FALSE if there is none or if it
+ * doesn't match the size of the input.
+ */
+BOOL read_seek_table(struct program_state *s);
+
+/* Reads the index of a single xz stream into s->frames. Every block is a
+ * frame, padding and check included. Returns FALSE if the input is more
+ * than one stream.
+ */
+BOOL read_xz_index(struct program_state *s);
+
+/* Slots are written whole, so all of them but the last must be a multiple
+ * of the write alignment of every output.
+ */
+BOOL are_frames_aligned(const struct frame_list *list,
+                        DWORD alignment);
+
+/* Decompresses the frames of worker number k for frame_reader_thread_proc()
+ * straight into their slots. A frame must come out at exactly the size its
+ * seek table or index gives.
+ */
+DWORD WINAPI decompress_thread_proc(LPVOID param);
+
+/* Pipes can't seek, so skip= has to read its way through them. */
+BOOL discard_input(struct program_state *s, ULONGLONG size);
+
+#endif
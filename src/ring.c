@@ -0,0 +1,227 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <windows.h>
+#include "ring.h"
+
+BOOL ring_init(struct buffer_ring *ring,
+               char *buffer,
+               DWORD buffer_size,
+               int depth,
+               int num_hashers) {
+    int i;
+
+    ring->slots = HeapAlloc(
+        GetProcessHeap(),
+        HEAP_ZERO_MEMORY,
+        sizeof(*ring->slots) * depth);
+    if (ring->slots == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    for (i = 0; i < depth; i++) {
+        ring->slots[i].buffer = buffer + (SIZE_T)buffer_size * i;
+    }
+
+    ring->depth = depth;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->not_empty = CreateEvent(NULL, FALSE, FALSE, NULL);
+    ring->not_full = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (ring->not_empty == NULL || ring->not_full == NULL) {
+        return FALSE;
+    }
+
+    ring->hashed = HeapAlloc(
+        GetProcessHeap(),
+        HEAP_ZERO_MEMORY,
+        sizeof(*ring->hashed) * max(num_hashers, 1));
+    ring->hash_ready = HeapAlloc(
+        GetProcessHeap(),
+        HEAP_ZERO_MEMORY,
+        sizeof(*ring->hash_ready) * max(num_hashers, 1));
+    if (ring->hashed == NULL || ring->hash_ready == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+
+    ring->num_hashers = num_hashers;
+    for (i = 0; i < num_hashers; i++) {
+        ring->hash_ready[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (ring->hash_ready[i] == NULL) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+LONGLONG ring_load(volatile LONGLONG *counter) {
+    return InterlockedCompareExchange64(counter, 0, 0);
+}
+
+/* Returns the oldest slot that any consumer still needs. */
+static LONGLONG ring_load_tail(struct buffer_ring *ring) {
+    LONGLONG tail = ring_load(&ring->tail);
+    int i;
+
+    for (i = 0; i < ring->num_hashers; i++) {
+        tail = min(tail, ring_load(&ring->hashed[i]));
+    }
+    return tail;
+}
+
+struct ring_slot *ring_acquire_free(struct buffer_ring *ring,
+                                    LONGLONG seq,
+                                    BOOL wait,
+                                    volatile LONG *aborted) {
+    while (seq - ring_load_tail(ring) >= ring->depth) {
+        if (*aborted || !wait) {
+            return NULL;
+        }
+        WaitForSingleObject(ring->not_full, INFINITE);
+    }
+    return *aborted ? NULL : &ring->slots[seq % ring->depth];
+}
+
+void ring_publish(struct buffer_ring *ring) {
+    int i;
+
+    InterlockedIncrement64(&ring->head);
+    SetEvent(ring->not_empty);
+    for (i = 0; i < ring->num_hashers; i++) {
+        SetEvent(ring->hash_ready[i]);
+    }
+}
+
+struct ring_slot *ring_acquire_filled(struct buffer_ring *ring,
+                                      LONGLONG seq,
+                                      BOOL wait,
+                                      volatile LONG *aborted) {
+    while (seq >= ring_load(&ring->head)) {
+        if (*aborted || !wait) {
+            return NULL;
+        }
+        WaitForSingleObject(ring->not_empty, INFINITE);
+    }
+    return *aborted ? NULL : &ring->slots[seq % ring->depth];
+}
+
+struct ring_slot *ring_acquire_unhashed_at(struct buffer_ring *ring,
+                                           int index,
+                                           LONGLONG seq,
+                                           BOOL wait,
+                                           volatile LONG *aborted) {
+    while (seq >= ring_load(&ring->head)) {
+        if (*aborted || !wait) {
+            return NULL;
+        }
+        WaitForSingleObject(ring->hash_ready[index], INFINITE);
+    }
+    return *aborted ? NULL : &ring->slots[seq % ring->depth];
+}
+
+struct ring_slot *ring_acquire_unhashed(struct buffer_ring *ring,
+                                        int index,
+                                        volatile LONG *aborted) {
+    return ring_acquire_unhashed_at(
+        ring,
+        index,
+        ring->hashed[index],
+        TRUE,
+        aborted);
+}
+
+void release_window(struct mapped_window *window) {
+    if (InterlockedDecrement(&window->num_refs) == 0) {
+        UnmapViewOfFile(window->base);
+        HeapFree(GetProcessHeap(), 0, window);
+    }
+}
+
+void ring_release_hashed(struct buffer_ring *ring, int index) {
+    struct ring_slot *slot = &ring->slots[ring->hashed[index] % ring->depth];
+
+    if (slot->hash_window != NULL) {
+        release_window(slot->hash_window);
+    }
+    InterlockedIncrement64(&ring->hashed[index]);
+    SetEvent(ring->not_full);
+}
+
+BOOL ring_release_attached(struct buffer_ring *ring, int index) {
+    LONGLONG seq = ring_load(&ring->hashed[index]);
+    struct mapped_window *window;
+
+    if (seq == MAXLONGLONG) {
+        return FALSE;
+    }
+
+    /* The slot can only be reused once the counter has moved past it, so
+     * the window read here is still the right one if the exchange wins.
+     */
+    window = ring->slots[seq % ring->depth].hash_window;
+    if (InterlockedCompareExchange64(&ring->hashed[index], seq + 1, seq)
+            != seq) {
+        return FALSE;
+    }
+    if (window != NULL) {
+        release_window(window);
+    }
+    SetEvent(ring->not_full);
+    return TRUE;
+}
+
+void ring_detach(struct buffer_ring *ring, int index) {
+    InterlockedExchange64(&ring->hashed[index], MAXLONGLONG);
+    SetEvent(ring->not_full);
+    SetEvent(ring->hash_ready[index]);
+}
+
+void ring_release(struct buffer_ring *ring) {
+    struct ring_slot *slot = &ring->slots[ring->tail % ring->depth];
+
+    if (slot->window != NULL) {
+        release_window(slot->window);
+        slot->window = NULL;
+    }
+    InterlockedIncrement64(&ring->tail);
+    SetEvent(ring->not_full);
+}
+
+void ring_free(const struct buffer_ring *ring) {
+    int i;
+
+    if (ring->not_empty != NULL) {
+        CloseHandle(ring->not_empty);
+    }
+    if (ring->not_full != NULL) {
+        CloseHandle(ring->not_full);
+    }
+    for (i = 0; i < ring->num_hashers; i++) {
+        if (ring->hash_ready[i] != NULL) {
+            CloseHandle(ring->hash_ready[i]);
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, ring->hash_ready);
+    HeapFree(GetProcessHeap(), 0, (LONGLONG *)ring->hashed);
+    HeapFree(GetProcessHeap(), 0, ring->slots);
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_RING_H
+#define WDD_RING_H
+
+#include <windows.h>
+
+/* A view of the input file for iflag=mmap. Slots that point into the view
+ * hold a reference to it, so it's unmapped only after the last of them has
+ * been written out and the reader has moved on.
+ */
+struct mapped_window {
+    char *base;
+    ULONGLONG offset;
+    SIZE_T size;
+    volatile LONG num_refs;
+};
+
+/* The data of a slot is normally in its own buffer, but it may also be in
+ * a mapped view of the input file. The writer writes out_size bytes at
+ * out_data, which is the data itself unless it's compressed. write_size is
+ * out_size padded for unbuffered output. When compressed input is
+ * decompressed in parallel, packed holds the frame the data comes from.
+ */
+struct ring_slot {
+    char *buffer;
+    char *data;
+    DWORD size;
+    char *packed;
+    DWORD packed_size;
+    char *compressed;
+    DWORD compressed_size;
+    char *out_data;
+    DWORD out_size;
+    DWORD write_size;
+    BOOL hole;
+    BOOL zeroed;
+    struct mapped_window *window;
+    struct mapped_window *hash_window;
+};
+
+/* Bounded single-producer/single-consumer ring of preallocated buffers. The
+ * reader thread fills slots at head and the writer thread drains them at
+ * tail; both counters only ever grow and are updated with interlocked
+ * operations, so no lock is needed. The events are only used to sleep when
+ * the ring is full or empty.
+ *
+ * Hash threads (and the one for verify=yes, the compression workers and
+ * the writers of extra outputs) read the same slots alongside the writer.
+ * Each has its own counter and event, and a slot is free again once all
+ * of them are past it, so every slot is read from the input only once.
+ */
+struct buffer_ring {
+    struct ring_slot *slots;
+    LONG depth;
+    volatile LONGLONG head;
+    volatile LONGLONG tail;
+    HANDLE not_empty;
+    HANDLE not_full;
+    int num_hashers;
+    volatile LONGLONG *hashed;
+    HANDLE *hash_ready;
+};
+
+/* Sets up depth slots over consecutive blocks of buffer_size bytes in
+ * buffer, with a counter and an event for each of num_hashers consumers.
+ */
+BOOL ring_init(struct buffer_ring *ring,
+               char *buffer,
+               DWORD buffer_size,
+               int depth,
+               int num_hashers);
+
+/* Reads a ring counter that other threads update. */
+LONGLONG ring_load(volatile LONGLONG *counter);
+
+/* Returns slot number seq (head or one of the slots past it that the reader
+ * has already reserved) once all consumers have released it. If wait is
+ * FALSE and the slot is still in use, or if the copy was aborted, returns
+ * NULL.
+ */
+struct ring_slot *ring_acquire_free(struct buffer_ring *ring,
+                                    LONGLONG seq,
+                                    BOOL wait,
+                                    volatile LONG *aborted);
+
+/* Hands the slot at head over to the consumers. */
+void ring_publish(struct buffer_ring *ring);
+
+/* Returns slot number seq (tail or one of the slots past it) once the reader
+ * has published it. If wait is FALSE and the slot is not filled yet, or if
+ * the copy was aborted, returns NULL.
+ */
+struct ring_slot *ring_acquire_filled(struct buffer_ring *ring,
+                                      LONGLONG seq,
+                                      BOOL wait,
+                                      volatile LONG *aborted);
+
+/* Same as ring_acquire_filled() for hash thread number index. Extra
+ * outputs also use this to get slots past the one they are done with.
+ */
+struct ring_slot *ring_acquire_unhashed_at(struct buffer_ring *ring,
+                                           int index,
+                                           LONGLONG seq,
+                                           BOOL wait,
+                                           volatile LONG *aborted);
+
+/* Returns the next slot for hash thread number index, waiting until the
+ * reader has published it. Returns NULL if the copy was aborted.
+ */
+struct ring_slot *ring_acquire_unhashed(struct buffer_ring *ring,
+                                        int index,
+                                        volatile LONG *aborted);
+
+/* Drops a reference to a mapped view of the input and unmaps it with the
+ * last one.
+ */
+void release_window(struct mapped_window *window);
+
+/* Lets go of the oldest slot of hash thread number index. */
+void ring_release_hashed(struct buffer_ring *ring, int index);
+
+/* Same as ring_release_hashed() for a consumer that ring_detach() may drop
+ * at any time. Returns FALSE if it has been dropped.
+ */
+BOOL ring_release_attached(struct buffer_ring *ring, int index);
+
+/* Stops the ring from waiting for consumer number index. Its counter is
+ * parked at the far end so that ring_load_tail() passes over it.
+ */
+void ring_detach(struct buffer_ring *ring, int index);
+
+/* Lets go of the slot at tail once the writer is done with it. */
+void ring_release(struct buffer_ring *ring);
+
+/* Closes the events of a ring and frees the memory allocated by
+ * ring_init(), which may have failed halfway. The buffers are not freed.
+ */
+void ring_free(const struct buffer_ring *ring);
+
+#endif
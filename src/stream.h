@@ -0,0 +1,58 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_STREAM_H
+#define WDD_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum decode_status {
+    DECODE_OK,
+    DECODE_END,
+    DECODE_CORRUPT,
+    DECODE_UNSUPPORTED
+};
+
+/* Compressed input of a decoder. p to end is what has been read so far.
+ * fill() makes at least size bytes available at p, moving them if needed,
+ * and returns how many there are, which is less than size only at the end
+ * of input. fill is NULL when all of the input is already there.
+ */
+struct in_stream {
+    const unsigned char *p;
+    const unsigned char *end;
+    size_t (*fill)(struct in_stream *in, size_t size);
+};
+
+/* Output of a decoder. Matches may refer back to anything from start to p,
+ * but never more than window_size bytes back. Decoders don't write past
+ * end.
+ */
+struct out_window {
+    unsigned char *start;
+    unsigned char *p;
+    unsigned char *end;
+    size_t window_size;
+};
+
+#endif
@@ -0,0 +1,360 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <windows.h>
+#include "file.h"
+#include "verify.h"
+#include "wdd.h"
+#include "xxh3.h"
+
+#define VERIFY_BATCH_SIZE (64 * MB)
+#define VERIFY_QUEUE_DEPTH 4
+
+static BOOL add_verify_chunk(struct verifier *v,
+                             ULONGLONG hash,
+                             DWORD size) {
+    BOOL result = TRUE;
+
+    AcquireSRWLockExclusive(&v->lock);
+
+    if (v->num_chunks == v->capacity) {
+        SIZE_T capacity = max(v->capacity * 2, 1024);
+        struct verify_chunk *chunks = v->chunks == NULL
+            ? HeapAlloc(
+                GetProcessHeap(),
+                0,
+                sizeof(*chunks) * capacity)
+            : HeapReAlloc(
+                GetProcessHeap(),
+                0,
+                v->chunks,
+                sizeof(*chunks) * capacity);
+        if (chunks == NULL) {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            result = FALSE;
+        } else {
+            v->chunks = chunks;
+            v->capacity = capacity;
+        }
+    }
+    if (result) {
+        v->chunks[v->num_chunks].hash = hash;
+        v->chunks[v->num_chunks].size = size;
+        v->num_chunks++;
+    }
+
+    ReleaseSRWLockExclusive(&v->lock);
+    return result;
+}
+
+static struct verify_chunk get_verify_chunk(struct verifier *v,
+                                            SIZE_T index) {
+    struct verify_chunk chunk;
+
+    AcquireSRWLockShared(&v->lock);
+    chunk = v->chunks[index];
+    ReleaseSRWLockShared(&v->lock);
+    return chunk;
+}
+
+DWORD WINAPI verify_hash_thread_proc(LPVOID param) {
+    struct verifier *v = param;
+    struct program_state *s = v->s;
+    struct xxh3_state state;
+    DWORD chunk_size = 0;
+
+    xxh3_init(&state);
+    while (!s->aborted) {
+        struct ring_slot *slot;
+        DWORD pos = 0;
+
+        slot = ring_acquire_unhashed(&s->ring, v->index, &s->aborted);
+        if (slot == NULL) {
+            break;
+        }
+        if (slot->size == 0) {
+            if (chunk_size > 0
+                && !add_verify_chunk(v, xxh3_digest(&state), chunk_size)) {
+                abort_copy(s, GetLastError(), "Failed to record hashes");
+            }
+            break;
+        }
+        while (pos < slot->size) {
+            DWORD size = min(slot->size - pos, VERIFY_CHUNK_SIZE - chunk_size);
+
+            xxh3_update(&state, slot->data + pos, size);
+            pos += size;
+            chunk_size += size;
+            if (chunk_size == VERIFY_CHUNK_SIZE) {
+                if (!add_verify_chunk(v, xxh3_digest(&state), chunk_size)) {
+                    abort_copy(s, GetLastError(), "Failed to record hashes");
+                    break;
+                }
+                xxh3_init(&state);
+                chunk_size = 0;
+            }
+        }
+        ring_release_hashed(&s->ring, v->index);
+    }
+    return 0;
+}
+
+/* Reads back the recorded chunks that end at or before end and compares
+ * their hashes. Reads are made in whole sectors, so a chunk that doesn't
+ * start on a sector boundary is read together with the sectors around it.
+ * Until the copy is over a chunk that reads back short may simply not be in
+ * the file yet; it's left for the next call instead of counted as bad.
+ */
+static DWORD verify_chunks(struct verifier *v, ULONGLONG end, BOOL final) {
+    struct io_queue queue;
+    SIZE_T num_chunks;
+    SIZE_T next_chunk = v->num_checked;
+    DWORD error = ERROR_SUCCESS;
+
+    AcquireSRWLockShared(&v->lock);
+    num_chunks = v->num_chunks;
+    ReleaseSRWLockShared(&v->lock);
+
+    /* Only the last chunk can be shorter than VERIFY_CHUNK_SIZE. */
+    if (end - v->start < (ULONGLONG)num_chunks * VERIFY_CHUNK_SIZE) {
+        SIZE_T num_whole = (SIZE_T)((end - v->start) / VERIFY_CHUNK_SIZE);
+        DWORD rest = (DWORD)((end - v->start) % VERIFY_CHUNK_SIZE);
+
+        if (num_whole + 1 == num_chunks
+            && get_verify_chunk(v, num_whole).size <= rest) {
+            num_whole++;
+        }
+        num_chunks = num_whole;
+    }
+    if (num_chunks == v->num_checked) {
+        return ERROR_SUCCESS;
+    }
+
+    ZeroMemory(&queue, sizeof(queue));
+    if (!io_queue_init(&queue, v->file, FALSE, VERIFY_QUEUE_DEPTH)) {
+        return GetLastError();
+    }
+
+    while (v->num_checked < num_chunks) {
+        struct verify_chunk chunk;
+        ULONGLONG offset;
+        DWORD skip;
+        DWORD num_bytes;
+        char *data;
+
+        while (next_chunk < num_chunks && !io_queue_is_full(&queue)) {
+            DWORD size;
+
+            offset = v->start + (ULONGLONG)next_chunk * VERIFY_CHUNK_SIZE;
+            skip = (DWORD)(offset % v->alignment);
+            size = skip + get_verify_chunk(v, next_chunk).size;
+            if (size % v->alignment != 0) {
+                size = (size / v->alignment + 1) * v->alignment;
+            }
+            io_queue_submit(
+                &queue,
+                IO_READ,
+                v->buffer
+                    + (SIZE_T)v->buffer_stride
+                        * (next_chunk % VERIFY_QUEUE_DEPTH),
+                size,
+                offset - skip);
+            next_chunk++;
+        }
+
+        error = io_queue_complete(&queue, &num_bytes);
+        if (error == ERROR_HANDLE_EOF) {
+            error = ERROR_SUCCESS;
+            num_bytes = 0;
+        }
+        if (error != ERROR_SUCCESS) {
+            break;
+        }
+
+        chunk = get_verify_chunk(v, v->num_checked);
+        offset = v->start + (ULONGLONG)v->num_checked * VERIFY_CHUNK_SIZE;
+        skip = (DWORD)(offset % v->alignment);
+        data = v->buffer
+            + (SIZE_T)v->buffer_stride * (v->num_checked % VERIFY_QUEUE_DEPTH)
+            + skip;
+        if (num_bytes < skip + chunk.size && !final) {
+            break;
+        }
+        if (num_bytes < skip + chunk.size
+            || xxh3_64(data, chunk.size) != chunk.hash) {
+            if (v->num_bad_chunks == 0) {
+                v->first_bad_offset = offset;
+            }
+            v->num_bad_chunks++;
+        }
+        v->num_checked++;
+    }
+
+    io_queue_cancel(&queue);
+    io_queue_free(&queue);
+    return error;
+}
+
+/* Verifies the output in batches of at least VERIFY_BATCH_SIZE as the
+ * writer gets through it. The output is flushed first so that what's read
+ * back comes from the media and not from the drive's write cache.
+ */
+static DWORD WINAPI verifier_thread_proc(LPVOID param) {
+    struct verifier *v = param;
+    ULONGLONG checked_end = v->start;
+
+    while (WaitForSingleObject(v->stop, UPDATE_INTERVAL / 1000)
+            == WAIT_TIMEOUT) {
+        ULONGLONG committed = load_counter(&v->s->out_committed);
+
+        if (committed - checked_end < VERIFY_BATCH_SIZE) {
+            continue;
+        }
+        if (!FlushFileBuffers(v->s->out_file)) {
+            v->error = GetLastError();
+            break;
+        }
+        v->error = verify_chunks(v, committed, FALSE);
+        if (v->error != ERROR_SUCCESS) {
+            break;
+        }
+        checked_end = committed;
+    }
+    return 0;
+}
+
+BOOL start_verifier(struct program_state *s, const char *filename) {
+    struct verifier *v = &s->verifier;
+
+    v->s = s;
+    v->index = s->num_hashers;
+    v->start = s->out_offset;
+    v->alignment = get_sector_size(s->out_file, filename);
+
+    if (s->out_file_is_device) {
+        v->file = s->out_file;
+    } else {
+        v->file = ReOpenFile(
+            s->out_file,
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED);
+        if (v->file == INVALID_HANDLE_VALUE) {
+            v->file = NULL;
+            return FALSE;
+        }
+    }
+
+    v->buffer_stride = VERIFY_CHUNK_SIZE + v->alignment;
+    v->buffer = VirtualAlloc(
+        NULL,
+        (SIZE_T)v->buffer_stride * VERIFY_QUEUE_DEPTH,
+        MEM_COMMIT | MEM_RESERVE,
+        PAGE_READWRITE);
+    if (v->buffer == NULL) {
+        return FALSE;
+    }
+
+    v->stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (v->stop == NULL) {
+        return FALSE;
+    }
+    v->thread = CreateThread(NULL, 0, verifier_thread_proc, v, 0, NULL);
+    return v->thread != NULL;
+}
+
+DWORD finish_verify(struct program_state *s) {
+    struct verifier *v = &s->verifier;
+
+    SetEvent(v->stop);
+    WaitForSingleObject(v->thread, INFINITE);
+    if (v->error != ERROR_SUCCESS) {
+        return v->error;
+    }
+    if (!FlushFileBuffers(s->out_file)) {
+        return GetLastError();
+    }
+    return verify_chunks(v, (ULONGLONG)-1, TRUE);
+}
+
+/* Reads back one target of wdd flash. */
+static DWORD WINAPI verify_target_thread_proc(LPVOID param) {
+    struct tee_output *output = param;
+    struct verifier *v = &output->verifier;
+
+    if (!FlushFileBuffers(output->file)) {
+        v->error = GetLastError();
+        return 0;
+    }
+    v->error = verify_chunks(v, (ULONGLONG)-1, TRUE);
+    return 0;
+}
+
+void verify_targets(struct program_state *s) {
+    HANDLE threads[MAX_OUTPUTS - 1];
+    DWORD num_threads = 0;
+    DWORD i;
+
+    for (i = 0; i < (DWORD)s->num_tee_outputs; i++) {
+        struct tee_output *output = &s->tee_outputs[i];
+        struct verifier *v = &output->verifier;
+
+        if (output->dropped) {
+            continue;
+        }
+        v->s = s;
+        v->file = output->file;
+        v->start = s->verifier.start;
+        v->alignment = get_sector_size(output->file, output->filename);
+        v->chunks = s->verifier.chunks;
+        v->num_chunks = s->verifier.num_chunks;
+        v->buffer_stride = VERIFY_CHUNK_SIZE + v->alignment;
+        v->buffer = VirtualAlloc(
+            NULL,
+            (SIZE_T)v->buffer_stride * VERIFY_QUEUE_DEPTH,
+            MEM_COMMIT | MEM_RESERVE,
+            PAGE_READWRITE);
+        if (v->buffer == NULL) {
+            v->error = GetLastError();
+            continue;
+        }
+        threads[num_threads] = CreateThread(
+            NULL,
+            0,
+            verify_target_thread_proc,
+            output,
+            0,
+            NULL);
+        if (threads[num_threads] == NULL) {
+            v->error = GetLastError();
+            continue;
+        }
+        num_threads++;
+    }
+
+    if (num_threads > 0) {
+        WaitForMultipleObjects(num_threads, threads, TRUE, INFINITE);
+    }
+    for (i = 0; i < num_threads; i++) {
+        CloseHandle(threads[i]);
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_VERIFY_H
+#define WDD_VERIFY_H
+
+#include <windows.h>
+#include "wdd.h"
+
+/* Hashes the output in chunks of VERIFY_CHUNK_SIZE for verify=yes. The last
+ * chunk may be shorter.
+ */
+DWORD WINAPI verify_hash_thread_proc(LPVOID param);
+
+/* Sets up verify=yes for output written from the current output offset.
+ * Files are read back through a second handle that bypasses the file cache.
+ * Drives aren't cached, and they are locked, so their own handle is used.
+ */
+BOOL start_verifier(struct program_state *s, const char *filename);
+
+/* Stops the verifier thread and checks whatever it hasn't got to yet, now
+ * that the output has its final size.
+ */
+DWORD finish_verify(struct program_state *s);
+
+/* Verifies the targets of wdd flash that are left, all at once, against
+ * the chunk hashes recorded while they were written. The targets are
+ * drives, which aren't cached, so they are read through their own handles.
+ */
+void verify_targets(struct program_state *s);
+
+#endif
@@ -22,47 +22,50 @@
 
 #include <stdio.h>
 #include <windows.h>
+#include "compress.h"
+#include "copy.h"
+#include "decompress.h"
+#include "drive.h"
+#include "file.h"
+#include "flash.h"
+#include "hash.h"
+#include "index.h"
+#include "io_queue.h"
+#include "journal.h"
+#include "options.h"
+#include "reader.h"
+#include "ring.h"
+#include "verify.h"
+#include "wdd.h"
+#include "writer.h"
 
-#define KB (1 << 10)
-#define MB (1 << 20)
-#define GB (1 << 30)
-#define BUFFER_SIZE 4096
-#define UPDATE_INTERVAL 1000000
-
-#ifdef _MSC_VER
-    #define strdup _strdup
-    #define strtoll _strtoi64
-    #define strtok_r strtok_s
-#endif
-
-struct program_options {
-    BOOL print_drive_list;
-    const char *filename_in;
-    const char *filename_out;
-    size_t block_size;
-    size_t count;
-    const char *status;
-};
+#define DEFAULT_QUEUE_DEPTH 4
+#define DEFAULT_IO_DEPTH 2
+#define AUTO_BLOCK_SIZE_MIN (64 * KB)
+#define AUTO_BLOCK_SIZE_MAX (16 * MB)
+#define AUTO_TUNE_INTERVAL 300000
+#define JOURNAL_INTERVAL 10000000
+#define DEFAULT_MMAP_WINDOW_SIZE GB
+#define DEFAULT_MMAP_WINDOW_SIZE_32 (64 * MB)
+#define MAX_DECOMPRESS_MEMORY GB
+#define DEFAULT_DRIVE_BLOCK_SIZE MB
+#define DRIVE_BLOCK_SIZE_MIN (64 * KB)
+#define DRIVE_BLOCK_SIZE_MAX (2 * MB)
+#define SSD_BYTES_IN_FLIGHT (8 * MB)
+#define SSD_IO_DEPTH_MAX 16
 
-struct program_state {
-    HANDLE in_file;
-    HANDLE out_file;
-    DWORD buffer_size;
-    char *buffer;
-    BOOL out_file_is_device;
-    BOOL started_copying;
-    ULONGLONG start_time;
-    size_t num_bytes_in;
-    size_t num_bytes_out;
-    size_t num_blocks_copied;
+/* Finds the fastest block size for bs=auto by doubling the transfer size
+ * every AUTO_TUNE_INTERVAL and measuring how much gets written meanwhile.
+ */
+struct block_size_tuner {
+    BOOL active;
+    DWORD best_size;
+    double best_speed;
+    ULONGLONG step_start_time;
+    ULONGLONG step_start_bytes;
 };
 
-static void print_usage(void) {
-    fprintf(stderr, "Usage: wdd if=<in_file> of=<out_file> [bs=N] [count=N] "
-                               "[status=progress]\n");
-}
-
-static ULONGLONG get_time_usec(void) {
+ULONGLONG get_time_usec(void) {
     FILETIME filetime;
     ULARGE_INTEGER time;
 
@@ -72,7 +75,7 @@ static ULONGLONG get_time_usec(void) {
     return time.QuadPart / 10;
 }
 
-static void format_size(char *buffer, size_t buffer_size, size_t size) {
+void format_size(char *buffer, size_t buffer_size, ULONGLONG size) {
     if (size >= GB) {
         snprintf(buffer, buffer_size, "%0.1f GB", (double)size / (double)GB);
     } else if (size >= MB) {
@@ -80,11 +83,11 @@ static void format_size(char *buffer, size_t buffer_size, size_t size) {
     } else if (size >= KB) {
         snprintf(buffer, buffer_size, "%0.1f KB", (double)size / (double)KB);
     } else {
-        snprintf(buffer, buffer_size, "%zu bytes", size);
+        snprintf(buffer, buffer_size, "%llu bytes", size);
     }
 }
 
-static void format_speed(char *buffer, size_t buffer_size, double speed) {
+void format_speed(char *buffer, size_t buffer_size, double speed) {
     if (speed >= (double)GB) {
         snprintf(buffer, buffer_size, "%0.1f GB/s", speed / (double)GB);
     } else if (speed >= (double)MB) {
@@ -96,8 +99,8 @@ static void format_speed(char *buffer, size_t buffer_size, double speed) {
     }
 }
 
-static void print_progress(size_t num_bytes_copied,
-                           size_t last_bytes_copied,
+static void print_progress(ULONGLONG num_bytes_copied,
+                           ULONGLONG last_bytes_copied,
                            ULONGLONG start_time,
                            ULONGLONG last_time) {
     ULONGLONG current_time;
@@ -118,14 +121,14 @@ static void print_progress(size_t num_bytes_copied,
     format_size(bytes_str, sizeof(bytes_str), num_bytes_copied);
     format_speed(speed_str, sizeof(speed_str), speed);
 
-    printf("%zu bytes (%s) copied, %0.1f s, %s\n",
+    printf("%llu bytes (%s) copied, %0.1f s, %s\n",
         num_bytes_copied,
         bytes_str,
         (double)elapsed_time / 1000000.0,
         speed_str);
 }
 
-static void print_status(size_t num_bytes_copied, ULONGLONG start_time) {
+static void print_status(ULONGLONG num_bytes_copied, ULONGLONG start_time) {
     print_progress(
         num_bytes_copied,
         num_bytes_copied,
@@ -133,6 +136,17 @@ static void print_status(size_t num_bytes_copied, ULONGLONG start_time) {
         start_time);
 }
 
+ULONGLONG load_counter(volatile ULONGLONG *counter) {
+    return (ULONGLONG)InterlockedCompareExchange64(
+        (volatile LONGLONG *)counter,
+        0,
+        0);
+}
+
+void add_to_counter(volatile ULONGLONG *counter, ULONGLONG value) {
+    InterlockedExchangeAdd64((volatile LONGLONG *)counter, (LONGLONG)value);
+}
+
 static void clear_output(void) {
     HANDLE console;
     COORD start_coord = {0, 0};
@@ -151,7 +165,7 @@ static void clear_output(void) {
     SetConsoleCursorPosition(console, start_coord);
 }
 
-static char *get_error_message(DWORD error) {
+char *get_error_message(DWORD error) {
     char *buffer = NULL;
 
     FormatMessageA(
@@ -166,11 +180,81 @@ static char *get_error_message(DWORD error) {
 }
 
 static void cleanup(const struct program_state *s) {
+    DWORD i;
+
+    for (i = 0; i < s->num_threads; i++) {
+        CloseHandle(s->threads[i]);
+    }
+    if (s->verifier.thread != NULL) {
+        SetEvent(s->verifier.stop);
+        WaitForSingleObject(s->verifier.thread, INFINITE);
+        CloseHandle(s->verifier.thread);
+    }
+    if (s->verifier.stop != NULL) {
+        CloseHandle(s->verifier.stop);
+    }
+    if (s->verifier.file != NULL && s->verifier.file != s->out_file) {
+        CloseHandle(s->verifier.file);
+    }
+    if (s->verifier.buffer != NULL) {
+        VirtualFree(s->verifier.buffer, 0, MEM_RELEASE);
+    }
+    HeapFree(GetProcessHeap(), 0, s->verifier.chunks);
+    for (i = 0; i < (DWORD)s->num_compress_workers; i++) {
+        compress_free(&s->compress_workers[i].compressor);
+    }
+    if (s->compressed != NULL) {
+        CloseHandle(s->compressed);
+    }
+    if (s->compressed_buffer != NULL) {
+        VirtualFree(s->compressed_buffer, 0, MEM_RELEASE);
+    }
+    HeapFree(GetProcessHeap(), 0, s->seek_table.entries);
+    decompress_free(&s->decompressor);
+    for (i = 0; i < (DWORD)s->num_decompress_workers; i++) {
+        decompress_free(&s->decompress_workers[i].decompressor);
+        if (s->decompress_workers[i].ready != NULL) {
+            CloseHandle(s->decompress_workers[i].ready);
+        }
+    }
+    if (s->decompressed != NULL) {
+        CloseHandle(s->decompressed);
+    }
+    if (s->packed_buffer != NULL) {
+        VirtualFree(s->packed_buffer, 0, MEM_RELEASE);
+    }
+    HeapFree(GetProcessHeap(), 0, s->frames.items);
+    ring_free(&s->ring);
+    HeapFree(GetProcessHeap(), 0, s->unread_regions.items);
+    HeapFree(GetProcessHeap(), 0, s->bad_regions.items);
+
     VirtualFree(s->buffer, 0, MEM_RELEASE);
+    if (s->pad_buffer != NULL) {
+        VirtualFree(s->pad_buffer, 0, MEM_RELEASE);
+    }
+    if (s->journal_buffer != NULL) {
+        VirtualFree(s->journal_buffer, 0, MEM_RELEASE);
+    }
 
     if (s->out_file_is_device) {
-        DeviceIoControl(s->out_file, FSCTL_UNLOCK_VOLUME,
-            NULL, 0, NULL, 0, NULL, NULL);
+        control_device(s->out_file, FSCTL_UNLOCK_VOLUME,
+            NULL, 0, NULL, 0, NULL);
+    }
+
+    for (i = 0; i < (DWORD)s->num_tee_outputs; i++) {
+        const struct tee_output *output = &s->tee_outputs[i];
+
+        if (output->verifier.buffer != NULL) {
+            VirtualFree(output->verifier.buffer, 0, MEM_RELEASE);
+        }
+        if (output->is_device) {
+            control_device(output->file, FSCTL_UNLOCK_VOLUME,
+                NULL, 0, NULL, 0, NULL);
+        }
+        if (output->pad_buffer != NULL) {
+            VirtualFree(output->pad_buffer, 0, MEM_RELEASE);
+        }
+        CloseHandle(output->file);
     }
 
     if (s->in_file != INVALID_HANDLE_VALUE) {
@@ -198,7 +282,7 @@ static void exit_on_error(const struct program_state *s,
     fprintf(stderr, "%s\n", reason);
     LocalFree(reason);
 
-    if (s->started_copying) {
+    if (s->started_copying && !s->flash) {
         print_status(s->num_bytes_out, s->start_time);
     }
 
@@ -206,262 +290,1988 @@ static void exit_on_error(const struct program_state *s,
     exit(EXIT_FAILURE);
 }
 
-static size_t parse_size(const char *str) {
-    char *end = NULL;
-    size_t size = (size_t)strtoll(str, &end, 10);
+void abort_copy(struct program_state *s,
+                DWORD error,
+                const char *message) {
+    int i;
+
+    if (InterlockedCompareExchange(&s->aborted, TRUE, FALSE) == FALSE) {
+        s->error = error;
+        s->error_message = message;
+    }
+    SetEvent(s->ring.not_empty);
+    SetEvent(s->ring.not_full);
+    for (i = 0; i < s->ring.num_hashers; i++) {
+        SetEvent(s->ring.hash_ready[i]);
+    }
+    if (s->compressed != NULL) {
+        SetEvent(s->compressed);
+    }
+    if (s->decompressed != NULL) {
+        SetEvent(s->decompressed);
+    }
+    for (i = 0; i < s->num_decompress_workers; i++) {
+        SetEvent(s->decompress_workers[i].ready);
+    }
+}
+
+/* Starts one of the copy threads. If that fails, the threads that are already
+ * running are stopped and the program exits.
+ */
+static void start_thread(struct program_state *s,
+                         LPTHREAD_START_ROUTINE thread_proc,
+                         LPVOID param) {
+    HANDLE thread;
 
-    if (end != NULL && *end != '\0') {
-        switch (*end) {
-            case 'k':
-            case 'K':
-                size *= 1 << 10;
-                break;
-            case 'm':
-            case 'M':
-                size *= 1 << 20;
-                break;
-            case 'g':
-            case 'G':
-                size *= 1 << 30;
-                break;
-        }
+    thread = CreateThread(NULL, 0, thread_proc, param, 0, NULL);
+    if (thread == NULL) {
+        abort_copy(s, GetLastError(), "Failed to create thread");
+        WaitForMultipleObjects(s->num_threads, s->threads, TRUE, INFINITE);
+        exit_on_error(s, s->error, "%s", s->error_message);
     }
-    return size;
+    s->threads[s->num_threads++] = thread;
 }
 
-static BOOL is_empty_string(const char *s) {
-    return s == NULL || *s == '\0';
+static void start_block_size_tuner(struct program_state *s,
+                                   struct block_size_tuner *tuner) {
+    tuner->active = TRUE;
+    tuner->best_size = AUTO_BLOCK_SIZE_MIN;
+    tuner->best_speed = 0;
+    tuner->step_start_time = get_time_usec();
+    tuner->step_start_bytes = load_counter(&s->num_bytes_out);
+    s->transfer_size = AUTO_BLOCK_SIZE_MIN;
 }
 
-static BOOL parse_options(int argc,
-                          char **argv,
-                          struct program_options *options) {
+static void tune_block_size(struct program_state *s,
+                            struct block_size_tuner *tuner,
+                            ULONGLONG current_time) {
+    ULONGLONG num_bytes = load_counter(&s->num_bytes_out);
+    double speed;
+
+    if (current_time - tuner->step_start_time < AUTO_TUNE_INTERVAL) {
+        return;
+    }
+
+    speed = (double)(num_bytes - tuner->step_start_bytes)
+        / ((double)(current_time - tuner->step_start_time) / 1000000);
+    if (speed > tuner->best_speed) {
+        tuner->best_speed = speed;
+        tuner->best_size = s->transfer_size;
+    }
+
+    if (s->transfer_size < AUTO_BLOCK_SIZE_MAX) {
+        s->transfer_size *= 2;
+    } else {
+        s->transfer_size = tuner->best_size;
+        tuner->active = FALSE;
+    }
+
+    tuner->step_start_time = current_time;
+    tuner->step_start_bytes = num_bytes;
+}
+
+/* Prints the digests in the BSD format that sha256sum -c and similar tools
+ * understand.
+ */
+static void print_digests(FILE *file,
+                          const struct program_state *s,
+                          const char *filename) {
     int i;
+    DWORD j;
 
-    options->filename_in = NULL;
-    options->filename_out = NULL;
-    options->block_size = 0;
-    options->count = -1;
-    options->status = NULL;
-
-    for (i = 1; i < argc; i++) {
-        char *value = NULL;
-        char *name = strtok_r(argv[i], "=", &value);
-
-        if (strcmp(name, "list") == 0) {
-            options->print_drive_list = TRUE;
-            return TRUE;
-        } else if (strcmp(name, "if") == 0) {
-            options->filename_in = strdup(value);
-        } else if (strcmp(name, "of") == 0) {
-            options->filename_out = strdup(value);
-        } else if (strcmp(name, "bs") == 0) {
-            options->block_size = parse_size(value);
-        } else if (strcmp(name, "count") == 0) {
-            options->count = (size_t)strtoll(value, NULL, 10);
-        } else if (strcmp(name, "status") == 0) {
-            options->status = strdup(value);
-        } else {
-            return FALSE;
+    for (i = 0; i < s->num_hashers; i++) {
+        const struct hasher *hasher = &s->hashers[i];
+
+        fprintf(file, "%s (%s) = ", hash_tag(hasher->context.type), filename);
+        for (j = 0; j < hasher->digest_size; j++) {
+            fprintf(file, "%02x", hasher->digest[j]);
         }
+        fprintf(file, "\n");
     }
+}
 
-    return !is_empty_string(options->filename_in)
-        && !is_empty_string(options->filename_out);
+static void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            printf("\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            printf("\\u%04x", (unsigned char)*s);
+        } else {
+            putchar(*s);
+        }
+    }
+    putchar('"');
 }
 
-int main(int argc, char **argv) {
-    struct program_options options;
-    struct program_state s;
-    size_t num_blocks_copied = 0;
-    BOOL show_progress = FALSE;
-    size_t last_bytes_copied = 0;
-    ULONGLONG last_time = 0;
-    DISK_GEOMETRY_EX disk_geometry;
+/* Prints the drives for wdd list, either as a table or as a JSON array with
+ * sizes in bytes. Unknown values are null in JSON.
+ */
+static int list_drives(BOOL json) {
+    struct drive_info *drives;
+    SIZE_T count;
+    SIZE_T i;
 
-    ZeroMemory(&options, sizeof(options));
+    if (!drive_enumerate(&drives, &count)) {
+        char *reason = get_error_message(GetLastError());
 
-    if (!parse_options(argc, argv, &options)) {
-        print_usage();
+        fprintf(stderr, "Failed to list drives: %s", reason);
+        LocalFree(reason);
         return EXIT_FAILURE;
     }
 
-    if (options.print_drive_list) {
-        return system("wmic diskdrive list brief");
+    if (json) {
+        printf("[");
+    } else {
+        printf("%-20s %-10s %-7s %-8s %-9s %-7s %-5s %-9s %s\n",
+               "Drive", "Size", "Sector", "Physical", "Max I/O", "Bus",
+               "Media", "Removable", "Model");
     }
+    for (i = 0; i < count; i++) {
+        const struct drive_info *drive = &drives[i];
+        char path[32];
+        char model[sizeof(drive->vendor) + sizeof(drive->model)];
 
-    ZeroMemory(&s, sizeof(s));
-    s.in_file = INVALID_HANDLE_VALUE;
-    s.out_file = INVALID_HANDLE_VALUE;
-    s.start_time = get_time_usec();
-    s.out_file_is_device = FALSE;
-    s.started_copying = FALSE;
-    s.num_bytes_in = 0;
-    s.num_bytes_out = 0;
-    s.num_blocks_copied = 0;
+        snprintf(path, sizeof(path), "\\\\.\\PhysicalDrive%lu",
+                 (unsigned long)drive->number);
+        snprintf(model, sizeof(model), "%s%s%s",
+                 drive->vendor,
+                 drive->vendor[0] != '\0' ? " " : "",
+                 drive->model);
+
+        if (json) {
+            printf("%s\n  {\"path\": ", i > 0 ? "," : "");
+            print_json_string(path);
+            printf(", \"number\": %lu, \"model\": ",
+                   (unsigned long)drive->number);
+            print_json_string(model);
+            printf(", \"serial\": ");
+            print_json_string(drive->serial);
+            printf(", \"size\": %llu, \"logical_sector_size\": %lu, "
+                   "\"physical_sector_size\": %lu, \"max_transfer_size\": ",
+                   drive->size,
+                   (unsigned long)drive->logical_sector_size,
+                   (unsigned long)drive->physical_sector_size);
+            if (drive->max_transfer_size > 0) {
+                printf("%lu", (unsigned long)drive->max_transfer_size);
+            } else {
+                printf("null");
+            }
+            printf(", \"rotational\": %s, \"removable\": %s, "
+                   "\"bus\": \"%s\", \"trim\": %s, "
+                   "\"zeros_after_trim\": %s}",
+                   drive->is_rotational < 0 ? "null"
+                       : drive->is_rotational ? "true" : "false",
+                   drive->is_removable ? "true" : "false",
+                   drive_bus_name(drive->bus_type),
+                   drive->trim_enabled ? "true" : "false",
+                   drive->zeros_after_trim ? "true" : "false");
+        } else {
+            char size_str[32];
+            char transfer_str[32] = "-";
+
+            format_size(size_str, sizeof(size_str), drive->size);
+            if (drive->max_transfer_size > 0) {
+                format_size(
+                    transfer_str,
+                    sizeof(transfer_str),
+                    drive->max_transfer_size);
+            }
+            printf("%-20s %-10s %-7lu %-8lu %-9s %-7s %-5s %-9s %s\n",
+                   path,
+                   size_str,
+                   (unsigned long)drive->logical_sector_size,
+                   (unsigned long)drive->physical_sector_size,
+                   transfer_str,
+                   drive_bus_name(drive->bus_type),
+                   drive->is_rotational < 0 ? "-"
+                       : drive->is_rotational ? "HDD" : "SSD",
+                   drive->is_removable ? "yes" : "no",
+                   model);
+        }
+    }
+    if (json) {
+        printf("%s]\n", count > 0 ? "\n" : "");
+    }
+
+    HeapFree(GetProcessHeap(), 0, drives);
+    return EXIT_SUCCESS;
+}
+
+/* What main() works out about the copy before starting it, handed from one
+ * setup step to the next. The alignments are the ones that the offsets and
+ * block sizes have to respect on either end.
+ */
+struct copy_setup {
+    ULONGLONG in_block_size;
+    ULONGLONG out_block_size;
+    ULONGLONG block_size;
+    BOOL default_block_size;
+    ULONGLONG journal_done;
+    DWORD in_alignment;
+    DWORD out_alignment;
+    DWORD direct_alignment;
+};
 
-    s.in_file = CreateFileA(
-        options.filename_in,
+static void open_files(struct program_state *s,
+                       const struct program_options *options) {
+    DWORD in_file_flags;
+    DWORD out_file_flags;
+    DWORD out_file_access;
+    DWORD tee_access;
+    int i;
+
+    in_file_flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN;
+    if (options->in_flags & FLAG_DIRECT) {
+        in_file_flags |= FILE_FLAG_NO_BUFFERING;
+    }
+    out_file_flags = FILE_ATTRIBUTE_NORMAL;
+    if (options->out_flags & FLAG_DIRECT) {
+        out_file_flags |= FILE_FLAG_NO_BUFFERING;
+    }
+
+    s->in_file = CreateFileA(
+        options->filename_in,
         GENERIC_READ,
         FILE_SHARE_READ | FILE_SHARE_WRITE,
         NULL,
         OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+        in_file_flags | FILE_FLAG_OVERLAPPED,
         NULL);
-    if (s.in_file == INVALID_HANDLE_VALUE) {
+    if (s->in_file == INVALID_HANDLE_VALUE) {
         exit_on_error(
-            &s,
+            s,
             GetLastError(),
             "Could not open input file or device %s for reading",
-            options.filename_in);
+            options->filename_in);
     }
+    s->in_file = reopen_if_not_disk(
+        s->in_file,
+        GENERIC_READ,
+        in_file_flags,
+        &s->in_file_is_synchronous);
 
-    /* First try to open as an existing file, thne as a new file. We can't
-     * use OPEN_ALWAYS because it fails when out_file is a physical drive
-     * (no idea why).
+    /* With base= the output starts out as a copy of the previous image and
+     * only blocks that changed are written over it. CopyFile() clones the
+     * data instead of copying it where the file system supports that.
      */
-    s.out_file = CreateFileA(
-        options.filename_out,
-        GENERIC_WRITE,
-        FILE_SHARE_READ | FILE_SHARE_WRITE,
-        NULL,
-        OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL);
-    if (s.out_file == INVALID_HANDLE_VALUE) {
-        s.out_file = CreateFileA(
-            options.filename_out,
-            GENERIC_WRITE,
-            FILE_SHARE_READ | FILE_SHARE_WRITE,
-            NULL,
-            CREATE_ALWAYS,
-            FILE_ATTRIBUTE_NORMAL,
-            NULL);
-    }
-    if (s.out_file == INVALID_HANDLE_VALUE) {
+    if (options->base_filename != NULL
+        && !CopyFileA(options->base_filename, options->filename_out, FALSE)) {
         exit_on_error(
-            &s,
+            s,
             GetLastError(),
-            "Could not open output file or device %s for writing",
-            options.filename_out);
+            "Failed to copy %s to %s",
+            options->base_filename,
+            options->filename_out);
     }
 
-    s.buffer_size = BUFFER_SIZE;
-    s.out_file_is_device = DeviceIoControl(
-        s.out_file,
-        IOCTL_DISK_GET_DRIVE_GEOMETRY,
-        NULL,
-        0,
-        &disk_geometry,
-        sizeof(disk_geometry),
-        NULL,
-        NULL);
-
-    if (s.out_file_is_device) {
-        DWORD sector_size;
+    /* The journal and verify=yes check the output, so it needs to be read. */
+    out_file_access = GENERIC_WRITE;
+    if (options->journal_filename != NULL || options->verify) {
+        out_file_access |= GENERIC_READ;
+    }
 
-        if (!DeviceIoControl(s.out_file, FSCTL_DISMOUNT_VOLUME,
-                NULL, 0, NULL, 0, NULL, NULL)) {
+    if (!options->flash) {
+        s->out_file = open_output_file(
+            options->filename_out,
+            out_file_access,
+            out_file_flags);
+        if (s->out_file == INVALID_HANDLE_VALUE) {
             exit_on_error(
-                &s,
+                s,
                 GetLastError(),
-                "Failed to dismount output volume");
+                "Could not open output file or device %s for writing",
+                options->filename_out);
         }
-        if (!DeviceIoControl(s.out_file, FSCTL_LOCK_VOLUME,
-                NULL, 0, NULL, 0, NULL, NULL)) {
+        s->out_file = reopen_if_not_disk(
+            s->out_file,
+            out_file_access,
+            out_file_flags,
+            &s->out_file_is_synchronous);
+    }
+
+    /* Targets of wdd flash are read back through the same handle. */
+    s->flash = options->flash;
+    tee_access = GENERIC_WRITE;
+    if (s->flash && options->verify) {
+        tee_access |= GENERIC_READ;
+    }
+
+    for (i = 0; i < options->num_tee_outputs; i++) {
+        struct tee_output *output = &s->tee_outputs[i];
+
+        output->s = s;
+        output->filename = options->tee_filenames[i];
+        output->file = open_output_file(
+            output->filename,
+            tee_access,
+            out_file_flags);
+        if (output->file == INVALID_HANDLE_VALUE) {
             exit_on_error(
-                &s,
+                s,
                 GetLastError(),
-                "Failed to lock output volume");
+                "Could not open output file or device %s for writing",
+                output->filename);
+        }
+        s->num_tee_outputs++;
+        output->file = reopen_if_not_disk(
+            output->file,
+            tee_access,
+            out_file_flags,
+            &output->is_synchronous);
+        output->is_regular = is_regular_file(output->file);
+    }
+
+    s->in_file_is_regular = is_regular_file(s->in_file);
+    s->out_file_is_regular = is_regular_file(s->out_file);
+}
+
+static void choose_block_sizes(const struct program_options *options,
+                               struct copy_setup *setup) {
+    /* As in GNU dd, bs= sets both ibs= and obs=. */
+    setup->in_block_size = BUFFER_SIZE;
+    setup->out_block_size = BUFFER_SIZE;
+    if (options->auto_block_size) {
+        setup->in_block_size = AUTO_BLOCK_SIZE_MAX;
+        setup->out_block_size = AUTO_BLOCK_SIZE_MAX;
+    } else if (options->block_size > 0) {
+        setup->in_block_size = options->block_size;
+        setup->out_block_size = options->block_size;
+    } else {
+        if (options->in_block_size > 0) {
+            setup->in_block_size = options->in_block_size;
         }
+        if (options->out_block_size > 0) {
+            setup->out_block_size = options->out_block_size;
+        }
+    }
+
+    /* Without any block size given, drives get one that suits them, unless
+     * it would change what count, skip or seek mean.
+     */
+    setup->default_block_size = !options->auto_block_size
+        && options->block_size == 0
+        && options->in_block_size == 0
+        && options->out_block_size == 0
+        && (options->count == (ULONGLONG)-1
+            || (options->in_flags & FLAG_COUNT_BYTES))
+        && (options->skip == 0 || (options->in_flags & FLAG_SKIP_BYTES))
+        && (options->seek == 0 || (options->out_flags & FLAG_SEEK_BYTES));
+}
+
+static void apply_skip_and_seek(struct program_state *s,
+                                const struct program_options *options,
+                                struct copy_setup *setup) {
+    ULONGLONG skip_unit;
+    ULONGLONG seek_unit;
+    int i;
 
-        sector_size = disk_geometry.Geometry.BytesPerSector;
-        if (options.block_size < sector_size) {
-            s.buffer_size = sector_size;
+    /* skip= and seek= count in blocks unless the byte flags are given, like
+     * in GNU dd. Both ends are read and written at an offset anyway, so
+     * they just move the starting offsets.
+     */
+    skip_unit = setup->in_block_size;
+    if (options->in_flags & FLAG_SKIP_BYTES) {
+        skip_unit = 1;
+    }
+    seek_unit = setup->out_block_size;
+    if (options->out_flags & FLAG_SEEK_BYTES) {
+        seek_unit = 1;
+    }
+    if (options->skip > (ULONGLONG)-1 / skip_unit
+        || options->seek > (ULONGLONG)-1 / seek_unit) {
+        exit_on_error(s, ERROR_INVALID_PARAMETER, "Invalid skip or seek");
+    }
+    if (options->skip > 0) {
+        if (s->in_file_is_synchronous) {
+            if (!discard_input(s, options->skip * skip_unit)) {
+                exit_on_error(s, GetLastError(), "Failed to skip input");
+            }
         } else {
-            s.buffer_size = (s.buffer_size / sector_size) * sector_size;
+            s->in_offset = options->skip * skip_unit;
         }
-    } else {
-        if (options.block_size > 0) {
-            s.buffer_size = (DWORD)options.block_size; // TODO: Possible bug with bs > 4GB
+    }
+    if (options->seek > 0) {
+        if (s->out_file_is_synchronous) {
+            exit_on_error(
+                s,
+                ERROR_SEEK,
+                "Can't seek in %s",
+                options->filename_out);
+        }
+        s->out_offset = options->seek * seek_unit;
+        for (i = 0; i < s->num_tee_outputs; i++) {
+            if (s->tee_outputs[i].is_synchronous) {
+                exit_on_error(
+                    s,
+                    ERROR_SEEK,
+                    "Can't seek in %s",
+                    s->tee_outputs[i].filename);
+            }
         }
     }
+}
 
-    s.buffer = VirtualAlloc(
-        NULL,
-        s.buffer_size,
-        MEM_COMMIT | MEM_RESERVE,
-        PAGE_READWRITE);
-    if (s.buffer == NULL) {
-        exit_on_error(&s, GetLastError(), "Failed to allocate buffer");
+static void open_journal(struct program_state *s,
+                         struct program_options *options,
+                         struct copy_setup *setup) {
+    /* A rerun with the same journal continues where the last checkpoint
+     * left off.
+     */
+    if (options->journal_filename != NULL) {
+        if (s->out_file_is_synchronous) {
+            exit_on_error(
+                s,
+                ERROR_INVALID_FUNCTION,
+                "Can't use a journal when writing to %s",
+                options->filename_out);
+        }
+        s->journal_filename = options->journal_filename;
+        s->journal_base = s->out_offset;
+        s->journal_buffer = VirtualAlloc(
+            NULL,
+            JOURNAL_CHECK_SIZE,
+            MEM_COMMIT | MEM_RESERVE,
+            PAGE_READWRITE);
+        if (s->journal_buffer == NULL) {
+            exit_on_error(
+                s,
+                GetLastError(),
+                "Failed to allocate journal buffer");
+        }
+        if (!load_journal(s, options, &setup->journal_done)) {
+            exit_on_error(
+                s,
+                GetLastError(),
+                "Journal %s doesn't match this copy",
+                options->journal_filename);
+        }
+        if (setup->journal_done > 0) {
+            char size_str[32];
+
+            format_size(size_str, sizeof(size_str), setup->journal_done);
+            fprintf(stderr, "Resuming after %s\n", size_str);
+            s->in_offset += setup->journal_done;
+            s->out_offset += setup->journal_done;
+        }
+        if (options->jobs > 1) {
+            fprintf(stderr, "jobs=%d can't be used with a journal, "
+                            "copying sequentially\n", options->jobs);
+            options->jobs = 1;
+        }
     }
+}
 
-    show_progress =
-        (options.status != NULL && strcmp(options.status, "progress") == 0);
-    s.started_copying = TRUE;
+static void check_index_options(struct program_state *s,
+                                struct program_options *options) {
+    /* With index= the writer compares every block with the index in order,
+     * and the output must keep the blocks that haven't changed.
+     */
+    if (options->index_filename != NULL) {
+        if (s->out_file_is_synchronous) {
+            exit_on_error(
+                s,
+                ERROR_INVALID_FUNCTION,
+                "Can't use an index when writing to %s",
+                options->filename_out);
+        }
+        if ((options->conversions & CONV_SPARSE)
+            || s->journal_filename != NULL) {
+            exit_on_error(
+                s,
+                ERROR_INVALID_PARAMETER,
+                "An index can't be used with conv=sparse or a journal");
+        }
+        s->use_index = TRUE;
+        if (options->jobs > 1) {
+            fprintf(stderr, "jobs=%d can't be used with an index, "
+                            "copying sequentially\n", options->jobs);
+            options->jobs = 1;
+        }
+    }
+}
 
-    for (;;) {
-        DWORD num_block_bytes_in;
-        DWORD num_block_bytes_out;
-        BOOL result;
-        ULONGLONG current_time;
+static void start_sparse_output(struct program_state *s,
+                                const struct program_options *options,
+                                struct copy_setup *setup) {
+    int i;
 
-        if (options.count >= 0 && s.num_blocks_copied >= options.count) {
-            break;
+    /* Zero blocks are skipped in sparse mode, so whatever was in an existing
+     * output file in their place has to go. Files are truncated at the seek
+     * offset, keeping what comes before it like GNU dd does, and marked as
+     * sparse so that the skipped ranges don't take up disk space. Drives
+     * simply keep their old contents there, like with GNU dd.
+     */
+    if (options->conversions & CONV_SPARSE) {
+        s->sparse = TRUE;
+        if (s->out_file_is_regular && setup->journal_done == 0) {
+            if (!set_end_of_file(s->out_file, s->out_offset)) {
+                exit_on_error(
+                    s,
+                    GetLastError(),
+                    "Failed to truncate output file");
+            }
+            control_device(s->out_file, FSCTL_SET_SPARSE,
+                NULL, 0, NULL, 0, NULL);
         }
+        for (i = 0; i < s->num_tee_outputs; i++) {
+            struct tee_output *output = &s->tee_outputs[i];
 
-        if (show_progress) {
-            current_time = get_time_usec();
-            if (last_time == 0) {
-                last_time = current_time;
-            } else {
-                if (current_time - last_time >= UPDATE_INTERVAL) {
-                    clear_output();
-                    print_progress(
-                        s.num_bytes_out,
-                        s.num_bytes_out - last_bytes_copied,
-                        s.start_time,
-                        last_time);
-                    last_time = current_time;
-                    last_bytes_copied = s.num_bytes_out;
+            if (output->is_regular) {
+                if (!set_end_of_file(output->file, s->out_offset)) {
+                    exit_on_error(
+                        s,
+                        GetLastError(),
+                        "Failed to truncate %s",
+                        output->filename);
                 }
+                control_device(output->file, FSCTL_SET_SPARSE,
+                    NULL, 0, NULL, 0, NULL);
             }
         }
+    }
+}
 
-        result = ReadFile(
-            s.in_file,
-            s.buffer,
-            s.buffer_size,
-            &num_block_bytes_in,
-            NULL);
-        if (num_block_bytes_in == 0
-            || (!result && GetLastError() == ERROR_SECTOR_NOT_FOUND)) {
-            break;
+static void init_hashers(struct program_state *s,
+                         const struct program_options *options) {
+    int i;
+
+    /* Digests are computed over the data as it goes to the output, so
+     * anything that skips the reader and writer can't be used with them.
+     */
+    for (i = 0; i < NUM_HASH_TYPES; i++) {
+        if (options->hashes & (1 << i)) {
+            struct hasher *hasher = &s->hashers[s->num_hashers];
+
+            hasher->s = s;
+            hasher->index = s->num_hashers;
+            if (!hash_init(&hasher->context, (enum hash_type)i)) {
+                exit_on_error(s, GetLastError(), "Failed to start hashing");
+            }
+            s->num_hashers++;
         }
-        if (!result) {
-            exit_on_error(&s, GetLastError(), "Error reading from file");
+    }
+}
+
+static void check_output_modes(struct program_state *s,
+                               struct program_options *options,
+                               struct copy_setup *setup) {
+    /* Verification is done by reading the output back, which only works
+     * with files and drives.
+     */
+    if (options->verify) {
+        if (s->out_file_is_synchronous) {
+            exit_on_error(
+                s,
+                ERROR_INVALID_FUNCTION,
+                "Can't verify %s",
+                options->filename_out);
+        }
+        s->verify = TRUE;
+        if (options->jobs > 1) {
+            fprintf(stderr, "jobs=%d can't be used with verify, "
+                            "copying sequentially\n", options->jobs);
+            options->jobs = 1;
+        }
+    }
+
+    /* Compressed frames have no fixed place in the output, so nothing that
+     * writes blocks at their input offsets can be used with compress=.
+     */
+    if (options->compress != COMPRESS_NONE) {
+        if (!s->out_file_is_regular && !s->out_file_is_synchronous) {
+            exit_on_error(
+                s,
+                ERROR_INVALID_FUNCTION,
+                "Can't compress to %s",
+                options->filename_out);
+        }
+        if ((options->conversions & CONV_SPARSE)
+            || (options->out_flags & FLAG_DIRECT)
+            || s->journal_filename != NULL
+            || s->use_index
+            || s->verify) {
+            exit_on_error(
+                s,
+                ERROR_INVALID_PARAMETER,
+                "compress can't be used with conv=sparse, oflag=direct, "
+                "a journal, an index or verify");
+        }
+        s->compress = options->compress;
+        if (options->jobs > 1) {
+            fprintf(stderr, "jobs=%d can't be used with compress, "
+                            "compressing on all processors instead\n",
+                    options->jobs);
+            options->jobs = 1;
         }
+    }
 
-        s.num_bytes_in += num_block_bytes_in;
+    /* Extra outputs get the same blocks as the main one, so nothing that
+     * keeps track of the main output alone can be used with them.
+     */
+    if (s->num_tee_outputs > 0) {
+        if (s->journal_filename != NULL
+            || s->use_index
+            || (s->verify && !s->flash)
+            || s->compress != COMPRESS_NONE) {
+            exit_on_error(
+                s,
+                ERROR_INVALID_PARAMETER,
+                "More than one output can't be used with a journal, "
+                "an index, verify or compress");
+        }
+        if (options->jobs > 1) {
+            fprintf(stderr, "jobs=%d can't be used with more than one "
+                            "output, copying sequentially\n", options->jobs);
+            options->jobs = 1;
+        }
+    }
 
-        result = WriteFile(
-            s.out_file,
-            s.buffer,
-            num_block_bytes_in,
-            &num_block_bytes_out,
-            NULL);
-        if (!result) {
-            exit_on_error(&s, GetLastError(), "Error writing to file");
+    if (s->num_hashers > 0) {
+        if (setup->journal_done > 0) {
+            exit_on_error(
+                s,
+                ERROR_INVALID_PARAMETER,
+                "Can't compute hashes when resuming from a journal");
+        }
+        if (options->jobs > 1) {
+            fprintf(stderr, "jobs=%d can't be used with hash, "
+                            "copying sequentially\n", options->jobs);
+            options->jobs = 1;
         }
+    }
+}
 
-        s.num_bytes_out += num_block_bytes_out;
-        s.num_blocks_copied++;
+static void setup_noerror(struct program_state *s,
+                          const struct program_options *options) {
+    s->sync = (options->conversions & CONV_SYNC) != 0;
+    if (options->conversions & CONV_NOERROR) {
+        s->noerror = TRUE;
+        s->retries = options->retries;
+        s->in_sector_size = get_sector_size(s->in_file, options->filename_in);
+
+        /* Bad blocks can only be left for later if they can be written out
+         * of order and don't have to be hashed in order.
+         */
+        s->retry_later = !s->out_file_is_synchronous
+            && s->num_hashers == 0
+            && !s->verify
+            && !s->use_index
+            && s->compress == COMPRESS_NONE
+            && s->num_tee_outputs == 0;
     }
+}
 
-    cleanup(&s);
-    clear_output();
-    print_status(s.num_bytes_out, s.start_time);
+static void get_input_size(struct program_state *s) {
+    LARGE_INTEGER file_size;
+    GET_LENGTH_INFORMATION length_info;
 
-    return EXIT_SUCCESS;
+    /* Holes in a sparse input file don't have to be read. This only works
+     * for files, FSCTL_QUERY_ALLOCATED_RANGES fails for anything else.
+     */
+    if (s->in_file_is_regular && GetFileSizeEx(s->in_file, &file_size)) {
+        struct allocated_ranges map;
+
+        ZeroMemory(&map, sizeof(map));
+        map.file_size = (ULONGLONG)file_size.QuadPart;
+        s->in_file_size = map.file_size;
+        s->in_file_size_known = TRUE;
+        s->in_file_has_holes =
+            map.file_size > 0
+            && query_allocated_ranges(s->in_file, &map, 0);
+    } else if (control_device(
+            s->in_file,
+            IOCTL_DISK_GET_LENGTH_INFO,
+            NULL,
+            0,
+            &length_info,
+            sizeof(length_info),
+            NULL)) {
+        s->in_file_size = (ULONGLONG)length_info.Length.QuadPart;
+        s->in_file_size_known = TRUE;
+    }
+}
+
+static void setup_decompression(struct program_state *s,
+                                struct program_options *options) {
+    DWORD frame_alignment;
+    int i;
+
+    /* Compressed input is decompressed on its own only when it's written
+     * to drives, which can't hold a compressed image in any useful way, and
+     * only if both its name and its first bytes (when it can be read twice)
+     * say so. decompress=yes goes by the first bytes alone, or by the name
+     * if they can't be read, and works for any output. skip= would count in
+     * the compressed file, so the header isn't looked at unless asked to.
+     * Input that comes in independent frames listed in a seek table or an
+     * xz index is decompressed in parallel, anything else is streamed
+     * through a single decoder. Either way the output size is unknown until
+     * the end, and the input has to be read from the start.
+     */
+    if (options->decompress == DECOMPRESS_MODE_AUTO && options->skip == 0) {
+        BOOL to_drives = s->flash || is_drive(s->out_file);
+
+        for (i = 0; i < s->num_tee_outputs; i++) {
+            to_drives &= is_drive(s->tee_outputs[i].file);
+        }
+        if (to_drives) {
+            s->decompress = decompress_type_from_name(options->filename_in);
+        }
+    } else if (options->decompress == DECOMPRESS_MODE_YES) {
+        s->decompress = decompress_type_from_name(options->filename_in);
+    }
+    if (options->decompress != DECOMPRESS_MODE_NO
+        && !s->in_file_is_synchronous
+        && s->in_file_size_known
+        && (s->decompress != COMPRESS_NONE
+            || options->decompress == DECOMPRESS_MODE_YES)) {
+        enum compress_type named_type = s->decompress;
+        DWORD size = (DWORD)min(s->in_file_size, BUFFER_SIZE);
+        char *header = VirtualAlloc(
+            NULL,
+            BUFFER_SIZE,
+            MEM_COMMIT | MEM_RESERVE,
+            PAGE_READWRITE);
+
+        s->decompress = COMPRESS_NONE;
+        if (header != NULL
+            && size > 0
+            && read_input_at(s, header, size, 0)) {
+            s->decompress = decompress_detect(header, size);
+        }
+        if (header != NULL) {
+            VirtualFree(header, 0, MEM_RELEASE);
+        }
+        if (options->decompress == DECOMPRESS_MODE_AUTO
+            && s->decompress != named_type) {
+            fprintf(stderr, "Input file %s is not compressed as its name "
+                            "says, copying it as is\n",
+                    options->filename_in);
+            s->decompress = COMPRESS_NONE;
+        }
+    }
+    if (options->decompress == DECOMPRESS_MODE_YES
+        && s->decompress == COMPRESS_NONE) {
+        exit_on_error(
+            s,
+            ERROR_INVALID_DATA,
+            "Input file %s is not compressed in a known format",
+            options->filename_in);
+    }
+    if (s->decompress != COMPRESS_NONE) {
+        if (options->skip > 0
+            || (options->conversions & (CONV_NOERROR | CONV_SYNC))
+            || s->journal_filename != NULL) {
+            exit_on_error(
+                s,
+                ERROR_INVALID_PARAMETER,
+                "Compressed input can't be used with skip, conv=noerror, "
+                "conv=sync or a journal");
+        }
+        if (options->jobs > 1) {
+            fprintf(stderr, "jobs=%d can't be used with compressed input, "
+                            "decompressing on all processors instead\n",
+                    options->jobs);
+            options->jobs = 1;
+        }
+
+        s->in_file_has_holes = FALSE;
+        s->xz_check_type = -1;
+        frame_alignment = 1;
+        if (!s->flash) {
+            frame_alignment = get_write_alignment(
+                s->out_file,
+                options->filename_out,
+                options->out_flags & FLAG_DIRECT);
+        }
+        for (i = 0; i < s->num_tee_outputs; i++) {
+            frame_alignment = max(
+                frame_alignment,
+                get_write_alignment(
+                    s->tee_outputs[i].file,
+                    s->tee_outputs[i].filename,
+                    options->out_flags & FLAG_DIRECT));
+        }
+        if (!s->in_file_is_synchronous
+            && !(options->in_flags & FLAG_DIRECT)
+            && s->in_file_size_known
+            && ((compress_has_seek_table(s->decompress)
+                    && read_seek_table(s))
+                || (s->decompress == COMPRESS_XZ && read_xz_index(s)))
+            && s->frames.count > 1
+            && are_frames_aligned(&s->frames, frame_alignment)) {
+            s->in_file_size = s->frames.total_size;
+        } else {
+            HeapFree(GetProcessHeap(), 0, s->frames.items);
+            ZeroMemory(&s->frames, sizeof(s->frames));
+            s->xz_check_type = -1;
+            s->in_file_size_known = FALSE;
+            if (!decompress_init(&s->decompressor, s->decompress)) {
+                exit_on_error(
+                    s,
+                    GetLastError(),
+                    "Failed to allocate decompressor");
+            }
+        }
+    }
 }
 
+static void tune_for_drives(struct program_state *s,
+                            struct program_options *options,
+                            struct copy_setup *setup) {
+    HANDLE drives[MAX_OUTPUTS + 1];
+    int num_drives = 0;
+    struct drive_info drive;
+    DWORD drive_transfer_size = 0;
+    BOOL has_drive = FALSE;
+    BOOL has_ssd = FALSE;
+    int i;
+
+    /* Drives tell how large a request their adapter takes in one piece and
+     * whether they are solid state. The default block size is the largest
+     * power of two that every drive involved takes at once, and SSDs get
+     * enough requests in flight to keep SSD_BYTES_IN_FLIGHT busy.
+     */
+    drives[num_drives++] = s->in_file;
+    if (s->out_file != INVALID_HANDLE_VALUE) {
+        drives[num_drives++] = s->out_file;
+    }
+    for (i = 0; i < s->num_tee_outputs; i++) {
+        drives[num_drives++] = s->tee_outputs[i].file;
+    }
+    for (i = 0; i < num_drives; i++) {
+        if (!drive_query(drives[i], &drive)) {
+            continue;
+        }
+        has_drive = TRUE;
+        if (drive.max_transfer_size > 0) {
+            drive_transfer_size = drive_transfer_size == 0
+                ? drive.max_transfer_size
+                : min(drive_transfer_size, drive.max_transfer_size);
+        }
+        if (drive.is_rotational == 0) {
+            has_ssd = TRUE;
+        }
+    }
+    if (has_drive && setup->default_block_size) {
+        DWORD size = DRIVE_BLOCK_SIZE_MIN;
+
+        if (drive_transfer_size == 0) {
+            drive_transfer_size = DEFAULT_DRIVE_BLOCK_SIZE;
+        }
+        while (size < DRIVE_BLOCK_SIZE_MAX
+               && size * 2 <= drive_transfer_size) {
+            size *= 2;
+        }
+        setup->in_block_size = size;
+        setup->out_block_size = size;
+    }
+    if (options->io_depth == 0) {
+        options->io_depth = DEFAULT_IO_DEPTH;
+        if (has_ssd) {
+            options->io_depth = (int)max(
+                options->io_depth,
+                min(SSD_BYTES_IN_FLIGHT
+                        / min(setup->in_block_size, setup->out_block_size),
+                    SSD_IO_DEPTH_MAX));
+        }
+    }
+    if (options->queue_depth == 0) {
+        options->queue_depth = max(DEFAULT_QUEUE_DEPTH, 2 * options->io_depth);
+    }
+}
+
+static void lock_output_drives(struct program_state *s,
+                               struct copy_setup *setup) {
+    DISK_GEOMETRY_EX disk_geometry;
+    int i;
+
+    /* Blocks larger than MAX_TRANSFER_SIZE are copied in several requests
+     * because ReadFile() and WriteFile() take a 32-bit size. The block size
+     * then only matters for count.
+     */
+    s->out_file_is_device = control_device(
+        s->out_file,
+        IOCTL_DISK_GET_DRIVE_GEOMETRY,
+        NULL,
+        0,
+        &disk_geometry,
+        sizeof(disk_geometry),
+        NULL);
+
+    if (s->out_file_is_device) {
+        if (!control_device(s->out_file, FSCTL_DISMOUNT_VOLUME,
+                NULL, 0, NULL, 0, NULL)) {
+            exit_on_error(
+                s,
+                GetLastError(),
+                "Failed to dismount output volume");
+        }
+        if (!control_device(s->out_file, FSCTL_LOCK_VOLUME,
+                NULL, 0, NULL, 0, NULL)) {
+            exit_on_error(
+                s,
+                GetLastError(),
+                "Failed to lock output volume");
+        }
+
+        setup->out_block_size = round_to_sector_size(
+            setup->out_block_size,
+            get_write_sector_size(
+                s->out_file,
+                disk_geometry.Geometry.BytesPerSector,
+                setup->out_block_size));
+        setup->out_alignment = disk_geometry.Geometry.BytesPerSector;
+    }
+
+    /* Sector sizes are powers of two, so a block that fits the largest one
+     * fits all of them.
+     */
+    for (i = 0; i < s->num_tee_outputs; i++) {
+        struct tee_output *output = &s->tee_outputs[i];
+
+        if (!control_device(
+                output->file,
+                IOCTL_DISK_GET_DRIVE_GEOMETRY,
+                NULL,
+                0,
+                &disk_geometry,
+                sizeof(disk_geometry),
+                NULL)) {
+            continue;
+        }
+        if (!control_device(output->file, FSCTL_DISMOUNT_VOLUME,
+                NULL, 0, NULL, 0, NULL)) {
+            exit_on_error(
+                s,
+                GetLastError(),
+                "Failed to dismount %s",
+                output->filename);
+        }
+        if (!control_device(output->file, FSCTL_LOCK_VOLUME,
+                NULL, 0, NULL, 0, NULL)) {
+            exit_on_error(
+                s,
+                GetLastError(),
+                "Failed to lock %s",
+                output->filename);
+        }
+        output->is_device = TRUE;
+
+        setup->out_block_size = round_to_sector_size(
+            setup->out_block_size,
+            get_write_sector_size(
+                output->file,
+                disk_geometry.Geometry.BytesPerSector,
+                setup->out_block_size));
+        setup->out_alignment = max(
+            setup->out_alignment,
+            disk_geometry.Geometry.BytesPerSector);
+    }
+}
+
+static void check_flash_drives(struct program_state *s,
+                               const struct program_options *options) {
+    GET_LENGTH_INFORMATION length_info;
+    int i;
+
+    /* wdd flash only writes to drives, and each of them must have room for
+     * the whole image where that is known up front.
+     */
+    if (s->flash) {
+        for (i = 0; i < s->num_tee_outputs; i++) {
+            struct tee_output *output = &s->tee_outputs[i];
+
+            if (!output->is_device) {
+                exit_on_error(
+                    s,
+                    ERROR_INVALID_FUNCTION,
+                    "%s is not a drive",
+                    output->filename);
+            }
+            if (s->in_file_size_known
+                && control_device(
+                    output->file,
+                    IOCTL_DISK_GET_LENGTH_INFO,
+                    NULL,
+                    0,
+                    &length_info,
+                    sizeof(length_info),
+                    NULL)
+                && (ULONGLONG)length_info.Length.QuadPart
+                    < s->out_offset
+                        + s->in_file_size
+                        - min(s->in_file_size, s->in_offset)) {
+                exit_on_error(
+                    s,
+                    ERROR_DISK_FULL,
+                    "%s is too small for %s",
+                    output->filename,
+                    options->filename_in);
+            }
+        }
+        s->num_live_outputs = s->num_tee_outputs;
+    }
+}
+
+static void setup_discard(struct program_state *s,
+                          struct program_options *options) {
+    struct drive_info drive;
+
+    /* With oflag=discard zero blocks are trimmed rather than written, which
+     * only leaves zeros behind on drives that promise to read trimmed
+     * sectors as zeros. Other drives simply get the zeros written.
+     */
+    if (options->out_flags & FLAG_DISCARD) {
+        if (!s->out_file_is_device || s->num_tee_outputs > 0) {
+            exit_on_error(
+                s,
+                ERROR_INVALID_FUNCTION,
+                "oflag=discard only works with a single drive as output");
+        }
+        if (drive_query(s->out_file, &drive)
+            && drive.trim_enabled
+            && drive.zeros_after_trim) {
+            s->discard = TRUE;
+            s->discard_granularity = (DWORD)max(
+                min(drive.unmap_granularity, MAX_TRANSFER_SIZE),
+                drive.logical_sector_size);
+            s->discard_alignment =
+                (DWORD)(drive.unmap_alignment % s->discard_granularity);
+        } else {
+            fprintf(stderr, "%s doesn't guarantee zeros after TRIM, "
+                            "writing zeros instead\n",
+                    options->filename_out);
+        }
+        if (options->jobs > 1) {
+            fprintf(stderr, "jobs=%d can't be used with oflag=discard, "
+                            "copying sequentially\n", options->jobs);
+            options->jobs = 1;
+        }
+    }
+}
+
+static void get_alignments(struct program_state *s,
+                           const struct program_options *options,
+                           struct copy_setup *setup) {
+    DISK_GEOMETRY_EX disk_geometry;
+    int i;
+
+    /* Physical drives can only be read in whole sectors too. */
+    if (control_device(
+            s->in_file,
+            IOCTL_DISK_GET_DRIVE_GEOMETRY,
+            NULL,
+            0,
+            &disk_geometry,
+            sizeof(disk_geometry),
+            NULL)) {
+        setup->in_block_size = round_to_sector_size(
+            setup->in_block_size,
+            disk_geometry.Geometry.BytesPerSector);
+        setup->in_alignment = disk_geometry.Geometry.BytesPerSector;
+    }
+
+    /* Unbuffered I/O needs sector-aligned buffers, transfer sizes and
+     * offsets. The buffers come from VirtualAlloc() and are page-aligned,
+     * so it's enough to make the block size a multiple of the sector size.
+     * Drives only take whole sectors even without oflag=direct, so a short
+     * last block is padded for them just the same.
+     */
+    s->out_alignment = 1;
+    if (!s->flash) {
+        s->out_alignment = get_write_alignment(
+            s->out_file,
+            options->filename_out,
+            options->out_flags & FLAG_DIRECT);
+        setup->out_alignment = max(setup->out_alignment, s->out_alignment);
+        if (options->out_flags & FLAG_DIRECT) {
+            setup->direct_alignment = s->out_alignment;
+        }
+    }
+    for (i = 0; i < s->num_tee_outputs; i++) {
+        struct tee_output *output = &s->tee_outputs[i];
+
+        output->alignment = get_write_alignment(
+            output->file,
+            output->filename,
+            options->out_flags & FLAG_DIRECT);
+        setup->out_alignment = max(setup->out_alignment, output->alignment);
+        if (options->out_flags & FLAG_DIRECT) {
+            setup->direct_alignment = max(
+                setup->direct_alignment,
+                output->alignment);
+        }
+    }
+    if (options->in_flags & FLAG_DIRECT) {
+        DWORD sector_size = get_sector_size(s->in_file, options->filename_in);
+
+        setup->direct_alignment = max(setup->direct_alignment, sector_size);
+        setup->in_alignment = max(setup->in_alignment, sector_size);
+    }
+
+    /* Unlike the block size, the starting offsets can't be rounded. */
+    if (s->in_offset % setup->in_alignment != 0
+        || s->out_offset % setup->out_alignment != 0) {
+        exit_on_error(
+            s,
+            ERROR_INVALID_PARAMETER,
+            "skip and seek must be a multiple of the sector size here");
+    }
+}
+
+static void round_block_sizes(struct program_state *s,
+                              struct copy_setup *setup) {
+    DWORD alignment = setup->direct_alignment;
+    ULONGLONG unit;
+
+    if (setup->in_block_size % alignment != 0) {
+        setup->in_block_size =
+            (setup->in_block_size / alignment + 1) * alignment;
+    }
+    if (setup->out_block_size % alignment != 0) {
+        setup->out_block_size =
+            (setup->out_block_size / alignment + 1) * alignment;
+    }
+
+    /* A slot holds a whole number of the smaller blocks and at least one of
+     * the larger ones, so that the reader and writer can both slice it
+     * instead of copying data between blocks of different sizes.
+     */
+    unit = min(setup->in_block_size, setup->out_block_size);
+    setup->block_size = max(setup->in_block_size, setup->out_block_size);
+    if (setup->block_size % unit != 0) {
+        setup->block_size = (setup->block_size / unit + 1) * unit;
+    }
+
+    /* Every slot is compressed as a frame of its own, and small frames
+     * compress poorly.
+     */
+    if (s->compress != COMPRESS_NONE
+        && setup->block_size < COMPRESS_FRAME_SIZE) {
+        setup->block_size = (COMPRESS_FRAME_SIZE + unit - 1) / unit * unit;
+    }
+
+    /* Frames of compressed input are decompressed into a slot each. */
+    if (s->frames.count > 0) {
+        setup->block_size = max(setup->block_size, s->frames.max_size);
+    }
+}
+
+static void check_striping(struct program_state *s,
+                           struct program_options *options,
+                           struct copy_setup *setup) {
+    /* Striped copying needs positioned I/O on both ends and has to know
+     * where the input ends.
+     */
+    if (options->jobs > 1) {
+        if (s->in_file_is_synchronous
+            || s->out_file_is_synchronous
+            || !s->in_file_size_known) {
+            fprintf(stderr, "jobs=%d needs files or drives on both ends, "
+                            "copying sequentially\n", options->jobs);
+            options->jobs = 1;
+        } else if (setup->in_block_size != setup->out_block_size) {
+            fprintf(stderr, "jobs=%d can't be used with different ibs and "
+                            "obs, copying sequentially\n", options->jobs);
+            options->jobs = 1;
+        }
+    }
+}
+
+static void count_workers(struct program_state *s,
+                          struct program_options *options,
+                          struct copy_setup *setup) {
+    /* Each compression worker needs a slot to work on and another one to
+     * be filled meanwhile.
+     */
+    if (s->compress != COMPRESS_NONE) {
+        SYSTEM_INFO system_info;
+
+        GetSystemInfo(&system_info);
+        s->num_compress_workers = (int)min(
+            system_info.dwNumberOfProcessors,
+            MAX_COMPRESS_WORKERS);
+        options->queue_depth = max(
+            options->queue_depth,
+            2 * s->num_compress_workers);
+    }
+
+    /* The same goes for decompression workers. Large frames get fewer of
+     * them so that the slots stay within MAX_DECOMPRESS_MEMORY, and there
+     * must be threads left for everything else.
+     */
+    if (s->frames.count > 0) {
+        SYSTEM_INFO system_info;
+        ULONGLONG slot_size = min(setup->block_size, MAX_TRANSFER_SIZE)
+            + s->frames.max_compressed_size;
+
+        GetSystemInfo(&system_info);
+        s->num_decompress_workers = (int)min(
+            min(system_info.dwNumberOfProcessors, MAX_DECOMPRESS_WORKERS),
+            min(s->frames.count, MAX_DECOMPRESS_MEMORY / (2 * slot_size)));
+        s->num_decompress_workers = min(
+            s->num_decompress_workers,
+            MAX_THREADS
+                - 3
+                - s->num_hashers
+                - s->num_compress_workers
+                - s->num_tee_outputs);
+        s->num_decompress_workers = max(s->num_decompress_workers, 1);
+        options->queue_depth = max(
+            options->queue_depth,
+            2 * s->num_decompress_workers);
+    }
+}
+
+static void allocate_buffers(struct program_state *s,
+                             const struct program_options *options,
+                             struct copy_setup *setup) {
+    int num_buffers;
+    SIZE_T buffer_pool_size;
+    int i;
+
+    num_buffers = max(options->queue_depth, options->jobs);
+    s->buffer_size = (DWORD)min(setup->block_size, MAX_TRANSFER_SIZE);
+    if (s->buffer_size > (SIZE_T)-1 / num_buffers) {
+        exit_on_error(
+            s,
+            ERROR_NOT_ENOUGH_MEMORY,
+            "Block size is too large for %d buffers",
+            num_buffers);
+    }
+    buffer_pool_size = (SIZE_T)s->buffer_size * num_buffers;
+
+    s->buffer = VirtualAlloc(
+        NULL,
+        buffer_pool_size,
+        MEM_COMMIT | MEM_RESERVE,
+        PAGE_READWRITE);
+    if (s->buffer == NULL) {
+        exit_on_error(s, GetLastError(), "Failed to allocate buffer");
+    }
+    if (!ring_init(
+            &s->ring,
+            s->buffer,
+            s->buffer_size,
+            options->queue_depth,
+            s->num_hashers
+                + s->verify
+                + s->num_compress_workers
+                + s->num_tee_outputs)) {
+        exit_on_error(s, GetLastError(), "Failed to create buffer ring");
+    }
+
+    /* Without a main writer, only the targets hold slots in the ring. */
+    if (s->flash) {
+        s->ring.tail = MAXLONGLONG;
+    }
+
+    if (s->out_alignment > 1) {
+        s->pad_buffer = VirtualAlloc(
+            NULL,
+            s->buffer_size,
+            MEM_COMMIT | MEM_RESERVE,
+            PAGE_READWRITE);
+        if (s->pad_buffer == NULL) {
+            exit_on_error(s, GetLastError(), "Failed to allocate buffer");
+        }
+    }
+
+    for (i = 0; i < s->num_tee_outputs; i++) {
+        struct tee_output *output = &s->tee_outputs[i];
+
+        output->index =
+            s->num_hashers + s->verify + s->num_compress_workers + i;
+        if (output->alignment > 1) {
+            output->pad_buffer = VirtualAlloc(
+                NULL,
+                s->buffer_size,
+                MEM_COMMIT | MEM_RESERVE,
+                PAGE_READWRITE);
+            if (output->pad_buffer == NULL) {
+                exit_on_error(s, GetLastError(), "Failed to allocate buffer");
+            }
+        }
+    }
+
+    /* Let the kernel lock the buffer pages once instead of probing and
+     * locking them for every request. This needs SeLockMemoryPrivilege, so
+     * it's fine if it fails.
+     */
+    if (!s->in_file_is_synchronous) {
+        SetFileIoOverlappedRange(
+            s->in_file,
+            (PUCHAR)s->buffer,
+            (ULONG)min(buffer_pool_size, MAXDWORD));
+    }
+    if (!s->out_file_is_synchronous && !s->flash) {
+        SetFileIoOverlappedRange(
+            s->out_file,
+            (PUCHAR)s->buffer,
+            (ULONG)min(buffer_pool_size, MAXDWORD));
+    }
+}
+
+static void setup_compression(struct program_state *s,
+                              const struct program_options *options) {
+    int i;
+
+    if (s->compress != COMPRESS_NONE) {
+        SIZE_T bound = compress_bound(s->compress, s->buffer_size);
+
+        if (bound > MAX_TRANSFER_SIZE
+            || bound > (SIZE_T)-1 / options->queue_depth) {
+            exit_on_error(
+                s,
+                ERROR_NOT_ENOUGH_MEMORY,
+                "Block size is too large to compress");
+        }
+        s->compressed_buffer = VirtualAlloc(
+            NULL,
+            bound * options->queue_depth,
+            MEM_COMMIT | MEM_RESERVE,
+            PAGE_READWRITE);
+        if (s->compressed_buffer == NULL) {
+            exit_on_error(
+                s,
+                GetLastError(),
+                "Failed to allocate compression buffer");
+        }
+        for (i = 0; i < options->queue_depth; i++) {
+            s->ring.slots[i].compressed = s->compressed_buffer + bound * i;
+        }
+
+        s->compressed = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (s->compressed == NULL) {
+            exit_on_error(s, GetLastError(), "Failed to create event");
+        }
+        for (i = 0; i < s->num_compress_workers; i++) {
+            struct compress_worker *worker = &s->compress_workers[i];
+
+            worker->s = s;
+            worker->index = s->num_hashers + s->verify + i;
+            worker->number = i;
+            if (!compress_init(
+                    &worker->compressor,
+                    s->compress,
+                    options->compress_level)) {
+                exit_on_error(
+                    s,
+                    GetLastError(),
+                    "Failed to allocate compressor");
+            }
+        }
+    }
+}
+
+static void setup_decompress_workers(struct program_state *s,
+                                     const struct program_options *options) {
+    int i;
+
+    /* Every slot gets room for the largest compressed frame next to its
+     * buffer.
+     */
+    if (s->frames.count > 0) {
+        SIZE_T packed_size = s->frames.max_compressed_size;
+
+        if (packed_size > (SIZE_T)-1 / options->queue_depth) {
+            exit_on_error(
+                s,
+                ERROR_NOT_ENOUGH_MEMORY,
+                "Compressed frames are too large");
+        }
+        s->packed_buffer = VirtualAlloc(
+            NULL,
+            packed_size * options->queue_depth,
+            MEM_COMMIT | MEM_RESERVE,
+            PAGE_READWRITE);
+        if (s->packed_buffer == NULL) {
+            exit_on_error(
+                s,
+                GetLastError(),
+                "Failed to allocate decompression buffer");
+        }
+        for (i = 0; i < options->queue_depth; i++) {
+            s->ring.slots[i].packed = s->packed_buffer + packed_size * i;
+        }
+
+        s->decompressed = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (s->decompressed == NULL) {
+            exit_on_error(s, GetLastError(), "Failed to create event");
+        }
+        s->frames_end = (LONGLONG)s->frames.count;
+        for (i = 0; i < s->num_decompress_workers; i++) {
+            struct decompress_worker *worker = &s->decompress_workers[i];
+
+            worker->s = s;
+            worker->number = i;
+            worker->ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+            if (worker->ready == NULL) {
+                exit_on_error(s, GetLastError(), "Failed to create event");
+            }
+            if (!decompress_init(&worker->decompressor, s->decompress)) {
+                exit_on_error(
+                    s,
+                    GetLastError(),
+                    "Failed to allocate decompressor");
+            }
+        }
+    }
+}
+
+static void set_copy_limits(struct program_state *s,
+                            const struct program_options *options,
+                            struct copy_setup *setup) {
+    s->max_bytes_in = (ULONGLONG)-1;
+    if (options->in_flags & FLAG_COUNT_BYTES) {
+        s->max_bytes_in = options->count;
+    } else if (options->count != (ULONGLONG)-1) {
+        if (options->count <= s->max_bytes_in / setup->in_block_size) {
+            s->max_bytes_in = options->count * setup->in_block_size;
+        }
+    }
+    if (s->max_bytes_in != (ULONGLONG)-1) {
+        s->max_bytes_in -= min(s->max_bytes_in, setup->journal_done);
+    }
+    s->transfer_size = s->buffer_size;
+    s->in_unit = (DWORD)min(setup->in_block_size, s->buffer_size);
+    s->out_unit = (DWORD)min(setup->out_block_size, s->buffer_size);
+    s->io_depth = min(options->io_depth, options->queue_depth);
+}
+
+static void open_index(struct program_state *s,
+                       const struct program_options *options) {
+    LARGE_INTEGER file_size;
+
+    /* The index has a block for every obs= bytes of output, including
+     * the padding conv=sync may add to the last block.
+     */
+    if (s->use_index) {
+        ULONGLONG index_size;
+        ULONGLONG image_size = (ULONGLONG)-1;
+
+        if (!s->in_file_size_known) {
+            exit_on_error(
+                s,
+                ERROR_INVALID_PARAMETER,
+                "Can't use an index when the input size is unknown");
+        }
+        index_size = s->in_file_size - min(s->in_file_size, s->in_offset);
+        index_size = min(index_size, s->max_bytes_in);
+        if (s->sync) {
+            index_size += s->in_unit;
+        }
+        if (s->out_file_is_regular && GetFileSizeEx(s->out_file, &file_size)) {
+            image_size = (ULONGLONG)file_size.QuadPart;
+        }
+        if (!index_open(
+                &s->index,
+                options->index_filename,
+                s->out_unit,
+                s->out_offset,
+                index_size,
+                s->out_file,
+                get_write_alignment(
+                    s->out_file,
+                    options->filename_out,
+                    options->out_flags & FLAG_DIRECT),
+                image_size)) {
+            exit_on_error(
+                s,
+                GetLastError(),
+                "Failed to open index %s",
+                options->index_filename);
+        }
+    }
+}
+
+static void setup_mmap(struct program_state *s,
+                       const struct program_options *options) {
+    /* Views of the input file must start at a multiple of the allocation
+     * granularity. 32-bit processes get smaller views by default because
+     * they have only 2 GB of address space for everything.
+     */
+    if ((options->in_flags & FLAG_MMAP)
+        && s->in_file_is_regular
+        && !s->noerror
+        && s->decompress == COMPRESS_NONE
+        && !s->flash) {
+        SYSTEM_INFO system_info;
+        ULONGLONG window_size = options->mmap_window_size;
+
+        GetSystemInfo(&system_info);
+        if (window_size == 0) {
+            window_size = sizeof(void *) >= 8
+                ? DEFAULT_MMAP_WINDOW_SIZE
+                : DEFAULT_MMAP_WINDOW_SIZE_32;
+        }
+        window_size = max(window_size, MIN_MMAP_WINDOW_SIZE);
+        window_size = min(window_size, (SIZE_T)-1 / 2);
+        window_size -= window_size % system_info.dwAllocationGranularity;
+        s->mmap_window_size = (SIZE_T)window_size;
+    }
+}
+
+static void start_copy(struct program_state *s,
+                       const struct program_options *options,
+                       struct block_size_tuner *tuner) {
+    int i;
+
+    if (s->in_file_is_regular
+        && s->out_file_is_regular
+        && s->num_hashers == 0
+        && !s->verify
+        && !s->use_index
+        && s->compress == COMPRESS_NONE
+        && s->decompress == COMPRESS_NONE
+        && s->num_tee_outputs == 0) {
+        copy_file_extents(s, options);
+    }
+
+    ZeroMemory(tuner, sizeof(*tuner));
+    if (options->auto_block_size
+        && options->jobs == 1
+        && !s->use_index
+        && s->compress == COMPRESS_NONE
+        && s->decompress == COMPRESS_NONE) {
+        start_block_size_tuner(s, tuner);
+    }
+
+    s->out_shift = (LONGLONG)(s->out_offset - s->in_offset);
+    s->out_committed = s->out_offset;
+    if (options->jobs > 1) {
+        /* Whatever is left after copy_file_extents() is split into stripes
+         * of one block each.
+         */
+        if (s->in_offset < s->in_file_size) {
+            s->stripe_length =
+                min(s->max_bytes_in, s->in_file_size - s->in_offset);
+        }
+        for (i = 0; i < options->jobs; i++) {
+            start_thread(s, stripe_thread_proc, s);
+        }
+    } else {
+        /* The reader and the writer run on their own threads so that a stall
+         * on one device doesn't hold up the other one for longer than it
+         * takes to fill or drain the ring. The main thread only reports
+         * progress.
+         */
+        if (s->frames.count > 0) {
+            start_thread(s, frame_reader_thread_proc, s);
+        } else if (s->decompress != COMPRESS_NONE) {
+            start_thread(s, decompress_reader_thread_proc, s);
+        } else {
+            start_thread(s, reader_thread_proc, s);
+        }
+        if (!s->flash) {
+            start_thread(s, writer_thread_proc, s);
+        }
+        for (i = 0; i < s->num_tee_outputs; i++) {
+            s->tee_outputs[i].offset = s->out_offset;
+            s->tee_outputs[i].start_time = get_time_usec();
+            s->tee_outputs[i].last_progress_time =
+                s->tee_outputs[i].start_time;
+            s->tee_outputs[i].slow_start_time = s->tee_outputs[i].start_time;
+            start_thread(s, tee_writer_thread_proc, &s->tee_outputs[i]);
+        }
+        for (i = 0; i < s->num_hashers; i++) {
+            start_thread(s, hash_thread_proc, &s->hashers[i]);
+        }
+        if (s->verify) {
+            if (s->flash) {
+                s->verifier.s = s;
+                s->verifier.index = s->num_hashers;
+                s->verifier.start = s->out_offset;
+            } else if (!start_verifier(s, options->filename_out)) {
+                abort_copy(s, GetLastError(), "Failed to start verifying");
+            }
+            start_thread(s, verify_hash_thread_proc, &s->verifier);
+        }
+        for (i = 0; i < s->num_compress_workers; i++) {
+            start_thread(s, compress_thread_proc, &s->compress_workers[i]);
+        }
+        for (i = 0; i < s->num_decompress_workers; i++) {
+            start_thread(
+                s,
+                decompress_thread_proc,
+                &s->decompress_workers[i]);
+        }
+    }
+}
+
+static void wait_for_copy(struct program_state *s,
+                          const struct program_options *options,
+                          struct block_size_tuner *tuner,
+                          BOOL show_progress) {
+    ULONGLONG last_bytes_copied = 0;
+    ULONGLONG last_time;
+    ULONGLONG last_journal_time;
+
+    last_time = get_time_usec();
+    last_journal_time = last_time;
+
+    for (;;) {
+        DWORD timeout = UPDATE_INTERVAL / 1000;
+        ULONGLONG current_time;
+
+        if (tuner->active) {
+            timeout = AUTO_TUNE_INTERVAL / 1000;
+        }
+        if (WaitForMultipleObjects(s->num_threads, s->threads, TRUE, timeout)
+                != WAIT_TIMEOUT) {
+            break;
+        }
+
+        current_time = get_time_usec();
+        if (tuner->active) {
+            tune_block_size(s, tuner, current_time);
+        }
+        if (s->flash) {
+            check_flash_targets(s, current_time);
+        }
+        if (show_progress && current_time - last_time >= UPDATE_INTERVAL) {
+            ULONGLONG num_bytes_copied = s->flash
+                ? get_flash_progress(s)
+                : load_counter(&s->num_bytes_out);
+
+            clear_output();
+            print_progress(
+                num_bytes_copied,
+                num_bytes_copied - last_bytes_copied,
+                s->start_time,
+                last_time);
+            last_time = current_time;
+            last_bytes_copied = num_bytes_copied;
+        }
+        if (s->journal_filename != NULL
+            && current_time - last_journal_time >= JOURNAL_INTERVAL) {
+            if (!save_journal(s, options)) {
+                abort_copy(s, GetLastError(), "Failed to update journal");
+            }
+            last_journal_time = current_time;
+        }
+    }
+
+    if (s->aborted) {
+        /* Save whatever made it to the output before the error. */
+        if (s->journal_filename != NULL) {
+            save_journal(s, options);
+        }
+        if (s->flash) {
+            print_flash_report(s);
+        }
+        exit_on_error(s, s->error, "%s", s->error_message);
+    }
+}
+
+static void finish_outputs(struct program_state *s,
+                           const struct program_options *options,
+                           BOOL show_progress) {
+    int i;
+
+    if (options->jobs > 1) {
+        s->in_offset += s->stripe_length;
+        s->out_offset += s->stripe_length + s->sync_padding;
+    }
+
+    if (s->unread_regions.count > 0) {
+        DWORD error;
+
+        if (show_progress) {
+            clear_output();
+            fprintf(stderr, "Retrying unreadable blocks...\n");
+        }
+        error = retry_unread_regions(s);
+        if (error != ERROR_SUCCESS) {
+            exit_on_error(s, error, "Failed to retry unreadable blocks");
+        }
+    }
+    if (options->map_filename != NULL && s->noerror) {
+        if (!write_region_map(s, options->map_filename)) {
+            exit_on_error(
+                s,
+                GetLastError(),
+                "Failed to write %s",
+                options->map_filename);
+        }
+    }
+
+    if (s->out_padding > 0 && !s->out_file_is_device) {
+        if (!set_end_of_file(s->out_file, s->out_offset)) {
+            exit_on_error(s, GetLastError(), "Failed to truncate output file");
+        }
+    }
+    if (s->sparse
+        && !s->out_file_is_device
+        && !s->out_file_is_synchronous
+        && !s->flash) {
+        if (!extend_file(s->out_file, s->out_offset)) {
+            exit_on_error(s, GetLastError(), "Failed to extend output file");
+        }
+    }
+    for (i = 0; i < s->num_tee_outputs; i++) {
+        const struct tee_output *output = &s->tee_outputs[i];
+
+        if (output->padding > 0 && !output->is_device) {
+            if (!set_end_of_file(output->file, output->offset)) {
+                exit_on_error(
+                    s,
+                    GetLastError(),
+                    "Failed to truncate %s",
+                    output->filename);
+            }
+        }
+        if (s->sparse && !output->is_device && !output->is_synchronous) {
+            if (!extend_file(output->file, output->offset)) {
+                exit_on_error(
+                    s,
+                    GetLastError(),
+                    "Failed to extend %s",
+                    output->filename);
+            }
+        }
+    }
+
+    /* Anything left over from an older file would look like another frame
+     * to the decompressor.
+     */
+    if (s->compress != COMPRESS_NONE && s->out_file_is_regular) {
+        if (!set_end_of_file(s->out_file, s->out_offset)) {
+            exit_on_error(s, GetLastError(), "Failed to truncate output file");
+        }
+    }
+}
+
+static void finish_verifying(struct program_state *s,
+                             BOOL show_progress,
+                             ULONGLONG *num_bad_chunks,
+                             ULONGLONG *first_bad_offset) {
+    if (s->verify) {
+        DWORD error;
+
+        if (show_progress) {
+            clear_output();
+            fprintf(stderr, "Verifying...\n");
+        }
+        if (s->flash) {
+            verify_targets(s);
+        } else {
+            error = finish_verify(s);
+            if (error != ERROR_SUCCESS) {
+                exit_on_error(s, error, "Failed to read back output");
+            }
+            *num_bad_chunks = s->verifier.num_bad_chunks;
+            *first_bad_offset = s->verifier.first_bad_offset;
+        }
+    }
+}
+
+static void close_index(struct program_state *s,
+                        const struct program_options *options,
+                        ULONGLONG num_bad_chunks) {
+    /* The image ends where this copy ended, even if the base was longer.
+     * If verification failed the index stays marked incomplete, so that the
+     * next run writes everything again.
+     */
+    if (s->use_index && num_bad_chunks == 0) {
+        if (s->out_file_is_regular
+            && !set_end_of_file(s->out_file, s->out_offset)) {
+            exit_on_error(s, GetLastError(), "Failed to truncate output file");
+        }
+        if (!FlushFileBuffers(s->out_file)
+            || !index_close(&s->index, s->out_offset - s->index.start)) {
+            exit_on_error(
+                s,
+                GetLastError(),
+                "Failed to update index %s",
+                options->index_filename);
+        }
+    }
+}
+
+static void write_digests(struct program_state *s,
+                          const struct program_options *options) {
+    int i;
+
+    for (i = 0; i < s->num_hashers; i++) {
+        s->hashers[i].digest_size =
+            hash_final(&s->hashers[i].context, s->hashers[i].digest);
+    }
+    if (options->hash_filename != NULL) {
+        FILE *hash_file = fopen(options->hash_filename, "w");
+
+        if (hash_file == NULL) {
+            exit_on_error(
+                s,
+                GetLastError(),
+                "Failed to write %s",
+                options->hash_filename);
+        }
+        print_digests(hash_file, s, options->filename_in);
+        fclose(hash_file);
+    }
+}
+
+static void print_summary(const struct program_state *s) {
+    if (s->use_index) {
+        char size_str[32];
+
+        format_size(size_str, sizeof(size_str), s->num_bytes_unchanged);
+        fprintf(stderr, "%s unchanged since the last run\n", size_str);
+    }
+    if (s->discard) {
+        char size_str[32];
+
+        format_size(size_str, sizeof(size_str), s->num_bytes_discarded);
+        fprintf(stderr, "%s discarded\n", size_str);
+    }
+    if (s->decompress != COMPRESS_NONE) {
+        char compressed_size_str[32];
+        char size_str[32];
+
+        format_size(
+            compressed_size_str,
+            sizeof(compressed_size_str),
+            s->num_bytes_in);
+        format_size(size_str, sizeof(size_str), s->num_bytes_decompressed);
+        fprintf(stderr, "%s decompressed to %s\n", compressed_size_str,
+                size_str);
+    }
+    if (s->compress != COMPRESS_NONE) {
+        char size_str[32];
+        char compressed_size_str[32];
+
+        format_size(
+            size_str,
+            sizeof(size_str),
+            s->decompress != COMPRESS_NONE ? s->num_bytes_decompressed
+                                          : s->num_bytes_in);
+        format_size(
+            compressed_size_str,
+            sizeof(compressed_size_str),
+            s->num_bytes_out);
+        fprintf(stderr, "%s compressed to %s\n", size_str,
+                compressed_size_str);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct program_options options;
+    struct program_state s;
+    struct copy_setup setup;
+    struct block_size_tuner tuner;
+    SIZE_T j;
+    ULONGLONG num_bad_bytes = 0;
+    ULONGLONG num_bad_chunks = 0;
+    ULONGLONG first_bad_offset = 0;
+    BOOL show_progress = FALSE;
+    BOOL flash_ok = TRUE;
+
+    ZeroMemory(&options, sizeof(options));
+
+    if (!parse_options(argc, argv, &options)) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (options.print_drive_list) {
+        return list_drives(options.json);
+    }
+
+    ZeroMemory(&s, sizeof(s));
+    s.in_file = INVALID_HANDLE_VALUE;
+    s.out_file = INVALID_HANDLE_VALUE;
+    s.start_time = get_time_usec();
+    s.out_file_is_device = FALSE;
+    s.started_copying = FALSE;
+    s.num_bytes_in = 0;
+    s.num_bytes_out = 0;
+    s.num_blocks_copied = 0;
+
+    ZeroMemory(&setup, sizeof(setup));
+    setup.in_alignment = 1;
+    setup.out_alignment = 1;
+    setup.direct_alignment = 1;
+
+    open_files(&s, &options);
+    choose_block_sizes(&options, &setup);
+    apply_skip_and_seek(&s, &options, &setup);
+    open_journal(&s, &options, &setup);
+    check_index_options(&s, &options);
+    start_sparse_output(&s, &options, &setup);
+    init_hashers(&s, &options);
+    check_output_modes(&s, &options, &setup);
+    setup_noerror(&s, &options);
+    get_input_size(&s);
+    setup_decompression(&s, &options);
+    tune_for_drives(&s, &options, &setup);
+    lock_output_drives(&s, &setup);
+    check_flash_drives(&s, &options);
+    setup_discard(&s, &options);
+    get_alignments(&s, &options, &setup);
+    round_block_sizes(&s, &setup);
+    check_striping(&s, &options, &setup);
+    count_workers(&s, &options, &setup);
+    allocate_buffers(&s, &options, &setup);
+    setup_compression(&s, &options);
+    setup_decompress_workers(&s, &options);
+
+    show_progress =
+        (options.status != NULL && strcmp(options.status, "progress") == 0);
+    set_copy_limits(&s, &options, &setup);
+    open_index(&s, &options);
+    setup_mmap(&s, &options);
+    s.started_copying = TRUE;
+
+    start_copy(&s, &options, &tuner);
+    wait_for_copy(&s, &options, &tuner, show_progress);
+    finish_outputs(&s, &options, show_progress);
+    finish_verifying(&s, show_progress, &num_bad_chunks, &first_bad_offset);
+    close_index(&s, &options, num_bad_chunks);
+
+    for (j = 0; j < s.bad_regions.count; j++) {
+        num_bad_bytes += s.bad_regions.items[j].size;
+    }
+
+    write_digests(&s, &options);
+
+    if (s.journal_filename != NULL) {
+        DeleteFileA(s.journal_filename);
+    }
+
+    cleanup(&s);
+    clear_output();
+    if (s.flash) {
+        flash_ok = print_flash_report(&s);
+    } else {
+        print_status(s.num_bytes_out, s.start_time);
+    }
+    print_digests(stderr, &s, options.filename_in);
+    print_summary(&s);
+
+    if (num_bad_chunks > 0) {
+        fprintf(stderr, "Verification failed: %llu chunks of %d MB differ, "
+                        "the first one at offset %llu\n",
+                num_bad_chunks,
+                VERIFY_CHUNK_SIZE / MB,
+                first_bad_offset);
+        return EXIT_FAILURE;
+    } else if (s.verify && !s.flash) {
+        fprintf(stderr, "Verified\n");
+    }
+    if (!flash_ok) {
+        return EXIT_FAILURE;
+    }
+
+    /* Like GNU dd, conv=noerror still reports failure if anything was lost. */
+    if (num_bad_bytes > 0) {
+        char size_str[32];
+
+        format_size(size_str, sizeof(size_str), num_bad_bytes);
+        fprintf(stderr, "%s could not be read\n", size_str);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,317 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_WDD_H
+#define WDD_WDD_H
+
+#include <windows.h>
+#include "compress.h"
+#include "decompress.h"
+#include "hash.h"
+#include "index.h"
+#include "io_queue.h"
+#include "ring.h"
+
+#ifdef _MSC_VER
+    #define strdup _strdup
+    #define strtoll _strtoi64
+    #define strtok_r strtok_s
+#endif
+
+#define KB (1 << 10)
+#define MB (1 << 20)
+#define GB (1 << 30)
+#define BUFFER_SIZE 4096
+#define MAX_TRANSFER_SIZE GB
+#define MAX_THREADS MAXIMUM_WAIT_OBJECTS
+#define UPDATE_INTERVAL 1000000
+#define JOURNAL_CHECK_SIZE (64 * KB)
+#define MIN_MMAP_WINDOW_SIZE MB
+#define VERIFY_CHUNK_SIZE MB
+#define MAX_COMPRESS_WORKERS 32
+#define MAX_OUTPUTS 16
+#define SEEK_TABLE_MAGIC 0x184D2A5EU
+#define SEEK_TABLE_FOOTER_MAGIC 0x8F92EAB1U
+#define SEEK_TABLE_ENTRY_SIZE 8
+#define SEEK_TABLE_FOOTER_SIZE 9
+#define MAX_DECOMPRESS_WORKERS 32
+
+struct region {
+    ULONGLONG offset;
+    ULONGLONG size;
+};
+
+/* Ranges of the input kept in the order they were added. Adjacent ranges
+ * are merged.
+ */
+struct region_list {
+    struct region *items;
+    SIZE_T count;
+    SIZE_T capacity;
+};
+
+struct hasher {
+    struct program_state *s;
+    int index;
+    struct hash_context context;
+    unsigned char digest[MAX_DIGEST_SIZE];
+    DWORD digest_size;
+};
+
+struct verify_chunk {
+    ULONGLONG hash;
+    DWORD size;
+};
+
+/* State of verify=yes. A hash thread records the XXH3 hash of every
+ * VERIFY_CHUNK_SIZE bytes as they go to the output, and the verifier thread
+ * reads back the chunks that have been written and flushed, bypassing the
+ * cache, to compare them while the rest of the copy is still going on.
+ * Chunk number i starts at start + i * VERIFY_CHUNK_SIZE.
+ */
+struct verifier {
+    struct program_state *s;
+    int index;
+    HANDLE file;
+    DWORD alignment;
+    char *buffer;
+    DWORD buffer_stride;
+    ULONGLONG start;
+    SRWLOCK lock;
+    struct verify_chunk *chunks;
+    SIZE_T num_chunks;
+    SIZE_T capacity;
+    SIZE_T num_checked;
+    ULONGLONG num_bad_chunks;
+    ULONGLONG first_bad_offset;
+    HANDLE stop;
+    HANDLE thread;
+    DWORD error;
+};
+
+/* A compression thread for compress=. Worker number k of n compresses
+ * every slot with seq % n == k and passes over the others.
+ */
+struct compress_worker {
+    struct program_state *s;
+    int index;
+    int number;
+    struct compressor compressor;
+};
+
+struct seek_table_entry {
+    DWORD compressed_size;
+    DWORD size;
+};
+
+/* Sizes of the compressed frames in the order they were written, for the
+ * seek table at the end of the output.
+ */
+struct seek_table {
+    struct seek_table_entry *entries;
+    SIZE_T count;
+    SIZE_T capacity;
+};
+
+/* An output given by a repeated of=. Its writer thread gets the same
+ * slots as the main writer through ring counter number index, and keeps
+ * its own offset. The last block is padded in pad_buffer rather than in
+ * the slot, which the other writers may still be reading.
+ *
+ * wdd flash writes every target this way and keeps per-target statistics.
+ * A target that fails or falls behind is dropped: its counter is detached
+ * from the ring and the others go on without it.
+ */
+struct tee_output {
+    struct program_state *s;
+    int index;
+    const char *filename;
+    HANDLE file;
+    BOOL is_synchronous;
+    BOOL is_regular;
+    BOOL is_device;
+    DWORD alignment;
+    DWORD padding;
+    char *pad_buffer;
+    ULONGLONG offset;
+    volatile ULONGLONG num_bytes_out;
+    volatile ULONGLONG busy_time;
+    ULONGLONG start_time;
+    ULONGLONG end_time;
+    volatile LONG dropped;
+    DWORD error;
+    LONGLONG last_seq;
+    ULONGLONG last_progress_time;
+    ULONGLONG slow_start_time;
+    struct verifier verifier;
+};
+
+/* A part of the compressed input that can be decompressed on its own, as
+ * listed in a seek table or an xz index.
+ */
+struct input_frame {
+    ULONGLONG offset;
+    DWORD compressed_size;
+    DWORD size;
+};
+
+struct frame_list {
+    struct input_frame *items;
+    SIZE_T count;
+    SIZE_T capacity;
+    DWORD max_compressed_size;
+    DWORD max_size;
+    ULONGLONG total_size;
+};
+
+/* A decompression thread for input that comes in independent frames.
+ * Worker number k of n decompresses every frame with seq % n == k once the
+ * reader has read it into its slot, and the reader passes the slots on to
+ * the writer in order. done is one past the last frame it finished.
+ */
+struct decompress_worker {
+    struct program_state *s;
+    int number;
+    struct decompressor decompressor;
+    HANDLE ready;
+    volatile LONGLONG done;
+};
+
+struct program_state {
+    HANDLE in_file;
+    HANDLE out_file;
+    BOOL in_file_is_synchronous;
+    BOOL out_file_is_synchronous;
+    BOOL in_file_is_regular;
+    BOOL out_file_is_regular;
+    BOOL in_file_has_holes;
+    BOOL in_file_size_known;
+    ULONGLONG in_file_size;
+    SIZE_T mmap_window_size;
+    int io_depth;
+    DWORD out_alignment;
+    DWORD out_padding;
+    char *pad_buffer;
+    BOOL sparse;
+    BOOL discard;
+    DWORD discard_granularity;
+    DWORD discard_alignment;
+    struct hasher hashers[NUM_HASH_TYPES];
+    int num_hashers;
+    BOOL verify;
+    struct verifier verifier;
+    BOOL use_index;
+    struct block_index index;
+    enum compress_type compress;
+    struct compress_worker compress_workers[MAX_COMPRESS_WORKERS];
+    int num_compress_workers;
+    HANDLE compressed;
+    char *compressed_buffer;
+    struct seek_table seek_table;
+    enum compress_type decompress;
+    struct decompressor decompressor;
+    struct frame_list frames;
+    int xz_check_type;
+    struct decompress_worker decompress_workers[MAX_DECOMPRESS_WORKERS];
+    int num_decompress_workers;
+    HANDLE decompressed;
+    char *packed_buffer;
+    struct tee_output tee_outputs[MAX_OUTPUTS - 1];
+    int num_tee_outputs;
+    BOOL flash;
+    volatile LONG num_live_outputs;
+    volatile LONGLONG frames_read;
+    volatile LONGLONG frames_end;
+    BOOL noerror;
+    BOOL retry_later;
+    BOOL sync;
+    int retries;
+    DWORD in_sector_size;
+    LONGLONG out_shift;
+    SRWLOCK regions_lock;
+    struct region_list unread_regions;
+    struct region_list bad_regions;
+    DWORD sync_padding;
+    const char *journal_filename;
+    ULONGLONG journal_base;
+    char *journal_buffer;
+    volatile ULONGLONG out_committed;
+    DWORD buffer_size;
+    DWORD in_unit;
+    DWORD out_unit;
+    volatile DWORD transfer_size;
+    char *buffer;
+    struct buffer_ring ring;
+    ULONGLONG max_bytes_in;
+    HANDLE threads[MAX_THREADS];
+    DWORD num_threads;
+    volatile LONG num_workers_started;
+    volatile ULONGLONG next_stripe;
+    ULONGLONG stripe_length;
+    volatile LONG aborted;
+    DWORD error;
+    const char *error_message;
+    ULONGLONG in_offset;
+    ULONGLONG out_offset;
+    BOOL out_file_is_device;
+    BOOL started_copying;
+    ULONGLONG start_time;
+    volatile ULONGLONG num_bytes_in;
+    volatile ULONGLONG num_bytes_decompressed;
+    volatile ULONGLONG num_bytes_out;
+    volatile ULONGLONG num_bytes_unchanged;
+    volatile ULONGLONG num_bytes_discarded;
+    volatile ULONGLONG num_blocks_copied;
+};
+
+/* Returns the system time in microseconds. */
+ULONGLONG get_time_usec(void);
+
+/* Formats a number of bytes in GB, MB or KB, whichever fits. */
+void format_size(char *buffer, size_t buffer_size, ULONGLONG size);
+
+/* Formats a speed given in bytes per second like format_size(). */
+void format_speed(char *buffer, size_t buffer_size, double speed);
+
+/* Counters that are updated by the copy threads and read by the main
+ * thread. 64-bit loads and stores are not atomic on 32-bit targets.
+ */
+ULONGLONG load_counter(volatile ULONGLONG *counter);
+
+/* Atomically adds to a counter that other threads read with
+ * load_counter().
+ */
+void add_to_counter(volatile ULONGLONG *counter, ULONGLONG value);
+
+/* Returns the system message for an error code. The caller frees it with
+ * LocalFree().
+ */
+char *get_error_message(DWORD error);
+
+/* Records the first error that occurs in one of the copy threads and wakes
+ * up the other one so that it can exit.
+ */
+void abort_copy(struct program_state *s,
+                DWORD error,
+                const char *message);
+
+#endif
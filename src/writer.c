@@ -0,0 +1,448 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <windows.h>
+#include "compress.h"
+#include "drive.h"
+#include "hash.h"
+#include "index.h"
+#include "wdd.h"
+#include "writer.h"
+#include "xxh3.h"
+#include "zero.h"
+
+/* For index=, returns TRUE if the last run wrote the same block at the
+ * same offset. Blocks that don't line up with the index because of a short
+ * read are always written, and the index forgets the blocks they touch.
+ */
+static BOOL is_unchanged_block(struct program_state *s,
+                               const char *data,
+                               DWORD size,
+                               ULONGLONG offset) {
+    ULONGLONG position = offset - s->index.start;
+
+    if (position % s->index.block_size != 0
+        || size > s->index.block_size) {
+        index_forget(&s->index, offset, size);
+        return FALSE;
+    }
+    return index_update(
+        &s->index,
+        position / s->index.block_size,
+        xxh3_64(data, size));
+}
+
+/* For compress=, waits until the worker of slot number seq has compressed
+ * it. If wait is FALSE and it hasn't yet, or if the copy was aborted,
+ * returns FALSE.
+ */
+static BOOL wait_for_compression(struct program_state *s,
+                                 LONGLONG seq,
+                                 BOOL wait) {
+    int index = s->compress_workers[seq % s->num_compress_workers].index;
+
+    while (ring_load(&s->ring.hashed[index]) <= seq) {
+        if (s->aborted || !wait) {
+            return FALSE;
+        }
+        WaitForSingleObject(s->compressed, INFINITE);
+    }
+    return !s->aborted;
+}
+
+static BOOL add_seek_table_entry(struct seek_table *table,
+                                 DWORD compressed_size,
+                                 DWORD size) {
+    if (table->count == table->capacity) {
+        SIZE_T capacity = max(table->capacity * 2, 1024);
+        struct seek_table_entry *entries = table->entries == NULL
+            ? HeapAlloc(
+                GetProcessHeap(),
+                0,
+                sizeof(*entries) * capacity)
+            : HeapReAlloc(
+                GetProcessHeap(),
+                0,
+                table->entries,
+                sizeof(*entries) * capacity);
+        if (entries == NULL) {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return FALSE;
+        }
+        table->entries = entries;
+        table->capacity = capacity;
+    }
+    table->entries[table->count].compressed_size = compressed_size;
+    table->entries[table->count].size = size;
+    table->count++;
+    return TRUE;
+}
+
+static unsigned char *put_le32(unsigned char *p, DWORD value) {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+    return p + 4;
+}
+
+/* Appends a seek table in the seekable Zstandard format: a skippable frame
+ * that lists the compressed and uncompressed size of every frame, so that
+ * a reader can start decompressing at any of them. Decoders that don't
+ * know about it just skip it. Frames have no checksums in the table.
+ */
+static DWORD write_seek_table(struct program_state *s,
+                              struct io_queue *queue) {
+    const struct seek_table *table = &s->seek_table;
+    ULONGLONG frame_size;
+    unsigned char *buffer;
+    unsigned char *p;
+    SIZE_T i;
+    DWORD num_bytes;
+    DWORD error;
+
+    frame_size = (ULONGLONG)table->count * SEEK_TABLE_ENTRY_SIZE
+        + SEEK_TABLE_FOOTER_SIZE;
+    if (table->count > MAXDWORD || frame_size > MAX_TRANSFER_SIZE) {
+        return ERROR_ARITHMETIC_OVERFLOW;
+    }
+    buffer = HeapAlloc(GetProcessHeap(), 0, (SIZE_T)frame_size + 8);
+    if (buffer == NULL) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    p = put_le32(buffer, SEEK_TABLE_MAGIC);
+    p = put_le32(p, (DWORD)frame_size);
+    for (i = 0; i < table->count; i++) {
+        p = put_le32(p, table->entries[i].compressed_size);
+        p = put_le32(p, table->entries[i].size);
+    }
+    p = put_le32(p, (DWORD)table->count);
+    *p++ = 0;
+    put_le32(p, SEEK_TABLE_FOOTER_MAGIC);
+
+    io_queue_submit(
+        queue,
+        IO_WRITE,
+        (char *)buffer,
+        (DWORD)frame_size + 8,
+        s->out_offset);
+    error = io_queue_complete(queue, &num_bytes);
+    if (error == ERROR_SUCCESS) {
+        s->out_offset += num_bytes;
+        add_to_counter(&s->num_bytes_out, num_bytes);
+    }
+
+    HeapFree(GetProcessHeap(), 0, buffer);
+    return error;
+}
+
+/* Tells whether a piece of a slot can be trimmed for oflag=discard: it must
+ * be all zeros and cover whole units of the drive's unmap granularity, so
+ * that none of it can stay mapped with old data.
+ */
+static BOOL is_discardable_block(const struct program_state *s,
+                                 const struct ring_slot *slot,
+                                 DWORD pos,
+                                 DWORD size) {
+    ULONGLONG offset = s->out_offset + pos;
+
+    return size % s->discard_granularity == 0
+        && (offset + s->discard_granularity - s->discard_alignment)
+            % s->discard_granularity == 0
+        && (slot->hole || is_zero_block(slot->out_data + pos, size));
+}
+
+static BOOL discard_blocks(struct program_state *s,
+                           ULONGLONG offset,
+                           ULONGLONG length) {
+    if (!drive_trim(s->out_file, offset, length)) {
+        abort_copy(s, GetLastError(), "Failed to discard blocks");
+        return FALSE;
+    }
+    add_to_counter(&s->num_bytes_discarded, length);
+    return TRUE;
+}
+
+DWORD WINAPI writer_thread_proc(LPVOID param) {
+    struct program_state *s = param;
+    struct io_queue queue;
+    LONGLONG next_seq = 0;
+    BOOL end_of_input = FALSE;
+    ULONGLONG committed = s->out_offset;
+    struct ring_slot *partial_slot = NULL;
+    DWORD partial_pos = 0;
+    DWORD tail_written = 0;
+    ULONGLONG discard_offset = 0;
+    ULONGLONG discard_length = 0;
+
+    ZeroMemory(&queue, sizeof(queue));
+    if (!io_queue_init(
+            &queue,
+            s->out_file,
+            s->out_file_is_synchronous,
+            s->io_depth)) {
+        abort_copy(s, GetLastError(), "Failed to create I/O queue");
+        return 1;
+    }
+
+    /* Writes are submitted for filled slots past tail and the slots are
+     * released back to the reader in order as the writes complete. With
+     * obs= each slot is written in pieces of out_unit bytes.
+     */
+    while (!s->aborted) {
+        struct ring_slot *slot;
+        DWORD size;
+        DWORD piece_size;
+        DWORD num_bytes;
+        DWORD error;
+
+        while (!end_of_input && !io_queue_is_full(&queue)) {
+            if (partial_slot != NULL) {
+                slot = partial_slot;
+                piece_size = min(s->out_unit, slot->write_size - partial_pos);
+
+                if (s->use_index
+                    && is_unchanged_block(
+                        s,
+                        slot->out_data + partial_pos,
+                        piece_size,
+                        s->out_offset + partial_pos)) {
+                    io_queue_skip(&queue, piece_size);
+                    add_to_counter(&s->num_bytes_unchanged, piece_size);
+
+                /* With oflag=discard runs of zero blocks are trimmed rather
+                 * than written. They are skipped in the queue, and the TRIM
+                 * goes out before the skipped requests are taken as done.
+                 */
+                } else if (s->discard
+                           && is_discardable_block(
+                               s,
+                               slot,
+                               partial_pos,
+                               piece_size)) {
+                    if (discard_length > 0
+                        && discard_offset + discard_length
+                            != s->out_offset + partial_pos) {
+                        if (!discard_blocks(
+                                s,
+                                discard_offset,
+                                discard_length)) {
+                            break;
+                        }
+                        discard_length = 0;
+                    }
+                    if (discard_length == 0) {
+                        discard_offset = s->out_offset + partial_pos;
+                    }
+                    discard_length += piece_size;
+                    io_queue_skip(&queue, piece_size);
+
+                /* With conv=sparse blocks of zeros are not written at all. */
+                } else if (s->sparse
+                    && (slot->hole
+                        || is_zero_block(
+                            slot->out_data + partial_pos,
+                            piece_size))) {
+                    io_queue_skip(&queue, piece_size);
+                } else {
+                    io_queue_submit(
+                        &queue,
+                        IO_WRITE,
+                        slot->out_data + partial_pos,
+                        piece_size,
+                        s->out_offset + partial_pos);
+                }
+                partial_pos += piece_size;
+                if (partial_pos == slot->write_size) {
+                    s->out_offset += slot->out_size;
+                    next_seq++;
+                    partial_slot = NULL;
+                }
+                continue;
+            }
+
+            slot = ring_acquire_filled(
+                &s->ring,
+                next_seq,
+                queue.num_pending == 0,
+                &s->aborted);
+            if (slot == NULL) {
+                break;
+            }
+            if (slot->size == 0) {
+                end_of_input = TRUE;
+                break;
+            }
+
+            /* Compressed slots are written in order as soon as their worker
+             * is done with them.
+             */
+            if (s->compress != COMPRESS_NONE) {
+                if (!wait_for_compression(
+                        s,
+                        next_seq,
+                        queue.num_pending == 0)) {
+                    break;
+                }
+                if (compress_has_seek_table(s->compress)
+                    && !add_seek_table_entry(
+                        &s->seek_table,
+                        slot->compressed_size,
+                        slot->size)) {
+                    abort_copy(s, GetLastError(), "Failed to record frame");
+                    break;
+                }
+                slot->out_data = slot->compressed;
+                slot->out_size = slot->compressed_size;
+            } else {
+                slot->out_data = slot->data;
+                slot->out_size = slot->size;
+            }
+
+            /* Unbuffered writes must be a multiple of the sector size.
+             * Only the last block may be shorter: it's padded with zeros in
+             * pad_buffer, since the hash threads and extra outputs may still
+             * be reading the slot, and the file is truncated to its real
+             * size later.
+             */
+            if (s->out_padding > 0) {
+                abort_copy(
+                    s,
+                    ERROR_INVALID_PARAMETER,
+                    "Block is not a multiple of the sector size");
+                break;
+            }
+            size = slot->out_size;
+            if (size % s->out_alignment != 0) {
+                size = (size / s->out_alignment + 1) * s->out_alignment;
+                s->out_padding = size - slot->out_size;
+                CopyMemory(s->pad_buffer, slot->out_data, slot->out_size);
+                ZeroMemory(s->pad_buffer + slot->out_size, s->out_padding);
+                slot->out_data = s->pad_buffer;
+            }
+            slot->write_size = size;
+            partial_slot = slot;
+            partial_pos = 0;
+        }
+
+        if (queue.num_pending == 0) {
+            break;
+        }
+
+        if (discard_length > 0) {
+            if (!discard_blocks(s, discard_offset, discard_length)) {
+                break;
+            }
+            discard_length = 0;
+        }
+
+        error = io_queue_complete(&queue, &num_bytes);
+        if (error != ERROR_SUCCESS) {
+            abort_copy(s, error, "Error writing to file");
+            break;
+        }
+
+        add_to_counter(&s->num_bytes_out, num_bytes);
+
+        slot = &s->ring.slots[s->ring.tail % s->ring.depth];
+        tail_written += min(s->out_unit, slot->write_size - tail_written);
+        if (tail_written < slot->write_size) {
+            continue;
+        }
+        tail_written = 0;
+        add_to_counter(&s->num_blocks_copied, 1);
+
+        /* Everything up to here is written, so the journal may point past
+         * this block.
+         */
+        committed += slot->out_size;
+        InterlockedExchange64(
+            (volatile LONGLONG *)&s->out_committed,
+            (LONGLONG)committed);
+        ring_release(&s->ring);
+    }
+
+    if (!s->aborted) {
+        add_to_counter(&s->num_bytes_out, (ULONGLONG)0 - s->out_padding);
+    }
+    if (!s->aborted && compress_has_seek_table(s->compress)) {
+        DWORD error = write_seek_table(s, &queue);
+        if (error != ERROR_SUCCESS) {
+            abort_copy(s, error, "Failed to write seek table");
+        }
+    }
+
+    io_queue_cancel(&queue);
+    io_queue_free(&queue);
+    return 0;
+}
+
+DWORD WINAPI hash_thread_proc(LPVOID param) {
+    struct hasher *hasher = param;
+    struct program_state *s = hasher->s;
+
+    while (!s->aborted) {
+        struct ring_slot *slot;
+        DWORD size;
+
+        slot = ring_acquire_unhashed(&s->ring, hasher->index, &s->aborted);
+        if (slot == NULL) {
+            break;
+        }
+        size = slot->size;
+        if (size == 0) {
+            break;
+        }
+        hash_update(&hasher->context, slot->data, size);
+        ring_release_hashed(&s->ring, hasher->index);
+    }
+    return 0;
+}
+
+DWORD WINAPI compress_thread_proc(LPVOID param) {
+    struct compress_worker *worker = param;
+    struct program_state *s = worker->s;
+
+    while (!s->aborted) {
+        struct ring_slot *slot;
+        LONGLONG seq = s->ring.hashed[worker->index];
+        BOOL is_own = seq % s->num_compress_workers == worker->number;
+
+        slot = ring_acquire_unhashed(&s->ring, worker->index, &s->aborted);
+        if (slot == NULL || slot->size == 0) {
+            break;
+        }
+        if (is_own) {
+            slot->compressed_size = compress_frame(
+                &worker->compressor,
+                slot->data,
+                slot->size,
+                slot->compressed);
+        }
+        ring_release_hashed(&s->ring, worker->index);
+        if (is_own) {
+            SetEvent(s->compressed);
+        }
+    }
+    return 0;
+}
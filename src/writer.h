@@ -0,0 +1,45 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_WRITER_H
+#define WDD_WRITER_H
+
+#include <windows.h>
+#include "wdd.h"
+
+/* Writes the slots of the ring to the main output in order, skipping
+ * blocks that are unchanged or can be left as holes.
+ */
+DWORD WINAPI writer_thread_proc(LPVOID param);
+
+/* Hashes every slot the reader publishes, in order, next to the writer.
+ * Slots of size 0 mark the end of input as usual.
+ */
+DWORD WINAPI hash_thread_proc(LPVOID param);
+
+/* Compresses the slots of one worker of compress= into their compressed
+ * buffers. The slot stays in the ring until the writer has written it, so
+ * the buffer can't be overwritten in the meantime.
+ */
+DWORD WINAPI compress_thread_proc(LPVOID param);
+
+#endif
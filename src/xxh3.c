@@ -0,0 +1,377 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "xxh3.h"
+
+#if defined(_MSC_VER) && defined(_M_X64)
+    #include <intrin.h>
+#endif
+
+#define STRIPE_SIZE 64
+#define SECRET_SIZE 192
+#define SECRET_CONSUME_RATE 8
+#define STRIPES_PER_BLOCK ((SECRET_SIZE - STRIPE_SIZE) / SECRET_CONSUME_RATE)
+#define BLOCK_SIZE (STRIPE_SIZE * STRIPES_PER_BLOCK)
+#define MIDSIZE_MAX 240
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+static const unsigned char secret[SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe,
+    0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+    0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78,
+    0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e,
+    0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+    0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e,
+    0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f,
+    0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+    0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3,
+    0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49,
+    0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+    0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28,
+    0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+/* Windows only runs on little-endian CPUs, so plain loads will do. */
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t rotl64(uint64_t x, int n) {
+    return (x << n) | (x >> (64 - n));
+}
+
+static uint64_t swap64(uint64_t x) {
+    return ((x << 56) & 0xff00000000000000ULL)
+        | ((x << 40) & 0x00ff000000000000ULL)
+        | ((x << 24) & 0x0000ff0000000000ULL)
+        | ((x << 8) & 0x000000ff00000000ULL)
+        | ((x >> 8) & 0x00000000ff000000ULL)
+        | ((x >> 24) & 0x0000000000ff0000ULL)
+        | ((x >> 40) & 0x000000000000ff00ULL)
+        | ((x >> 56) & 0x00000000000000ffULL);
+}
+
+/* Multiplies two 64-bit numbers and XORs the halves of the 128-bit
+ * product together.
+ */
+static uint64_t mul128_fold64(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    uint64_t high;
+    uint64_t low = _umul128(a, b, &high);
+    return low ^ high;
+#else
+    uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    uint64_t hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32);
+    uint64_t hi_hi = (a >> 32) * (b >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    uint64_t high = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    uint64_t low = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+    return low ^ high;
+#endif
+}
+
+static uint64_t xxh64_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t rrmxmx(uint64_t h, uint64_t size) {
+    h ^= rotl64(h, 49) ^ rotl64(h, 24);
+    h *= PRIME_MX2;
+    h ^= (h >> 35) + size;
+    h *= PRIME_MX2;
+    h ^= h >> 28;
+    return h;
+}
+
+static uint64_t mix16(const unsigned char *p, const unsigned char *key) {
+    return mul128_fold64(
+        read64(p) ^ read64(key),
+        read64(p + 8) ^ read64(key + 8));
+}
+
+static uint64_t hash_short(const unsigned char *p, size_t size) {
+    uint64_t acc;
+    size_t i;
+
+    if (size == 0) {
+        return xxh64_avalanche(read64(secret + 56) ^ read64(secret + 64));
+    }
+    if (size <= 3) {
+        uint32_t combined = ((uint32_t)p[0] << 16)
+            | ((uint32_t)p[size >> 1] << 24)
+            | (uint32_t)p[size - 1]
+            | ((uint32_t)size << 8);
+        return xxh64_avalanche(
+            (uint64_t)combined ^ (read32(secret) ^ read32(secret + 4)));
+    }
+    if (size <= 8) {
+        uint64_t input = read32(p + size - 4) + ((uint64_t)read32(p) << 32);
+        return rrmxmx(
+            input ^ (read64(secret + 8) ^ read64(secret + 16)),
+            size);
+    }
+    if (size <= 16) {
+        uint64_t low = read64(p) ^ read64(secret + 24) ^ read64(secret + 32);
+        uint64_t high =
+            read64(p + size - 8) ^ read64(secret + 40) ^ read64(secret + 48);
+        return avalanche(
+            size + swap64(low) + high + mul128_fold64(low, high));
+    }
+
+    acc = size * PRIME64_1;
+    if (size <= 128) {
+        if (size > 32) {
+            if (size > 64) {
+                if (size > 96) {
+                    acc += mix16(p + 48, secret + 96);
+                    acc += mix16(p + size - 64, secret + 112);
+                }
+                acc += mix16(p + 32, secret + 64);
+                acc += mix16(p + size - 48, secret + 80);
+            }
+            acc += mix16(p + 16, secret + 32);
+            acc += mix16(p + size - 32, secret + 48);
+        }
+        acc += mix16(p, secret);
+        acc += mix16(p + size - 16, secret + 16);
+        return avalanche(acc);
+    }
+
+    for (i = 0; i < 8; i++) {
+        acc += mix16(p + 16 * i, secret + 16 * i);
+    }
+    acc = avalanche(acc);
+    for (i = 8; i < size / 16; i++) {
+        acc += mix16(p + 16 * i, secret + 16 * (i - 8) + 3);
+    }
+    acc += mix16(p + size - 16, secret + 136 - 17);
+    return avalanche(acc);
+}
+
+static void accumulate_stripe(uint64_t acc[8],
+                              const unsigned char *p,
+                              const unsigned char *key) {
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        uint64_t value = read64(p + 8 * i);
+        uint64_t keyed = value ^ read64(key + 8 * i);
+        acc[i ^ 1] += value;
+        acc[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+    }
+}
+
+static void scramble(uint64_t acc[8]) {
+    const unsigned char *key = secret + SECRET_SIZE - STRIPE_SIZE;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= read64(key + 8 * i);
+        acc[i] = a * PRIME32_1;
+    }
+}
+
+/* Feeds stripes to the accumulators, scrambling them at the end of each
+ * block. num_stripes_in_block is how far into the current block we are.
+ */
+static void consume_stripes(uint64_t acc[8],
+                            size_t *num_stripes_in_block,
+                            const unsigned char *p,
+                            size_t num_stripes) {
+    while (num_stripes > 0) {
+        size_t n = STRIPES_PER_BLOCK - *num_stripes_in_block;
+        size_t i;
+
+        if (n > num_stripes) {
+            n = num_stripes;
+        }
+        for (i = 0; i < n; i++) {
+            accumulate_stripe(
+                acc,
+                p + i * STRIPE_SIZE,
+                secret + (*num_stripes_in_block + i) * SECRET_CONSUME_RATE);
+        }
+        p += n * STRIPE_SIZE;
+        num_stripes -= n;
+        *num_stripes_in_block += n;
+        if (*num_stripes_in_block == STRIPES_PER_BLOCK) {
+            scramble(acc);
+            *num_stripes_in_block = 0;
+        }
+    }
+}
+
+static uint64_t merge_accs(const uint64_t acc[8], uint64_t total_size) {
+    uint64_t result = total_size * PRIME64_1;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        result += mul128_fold64(
+            acc[2 * i] ^ read64(secret + 11 + 16 * i),
+            acc[2 * i + 1] ^ read64(secret + 11 + 16 * i + 8));
+    }
+    return avalanche(result);
+}
+
+void xxh3_init(struct xxh3_state *state) {
+    memset(state, 0, sizeof(*state));
+    state->acc[0] = PRIME32_3;
+    state->acc[1] = PRIME64_1;
+    state->acc[2] = PRIME64_2;
+    state->acc[3] = PRIME64_3;
+    state->acc[4] = PRIME64_4;
+    state->acc[5] = PRIME32_2;
+    state->acc[6] = PRIME64_5;
+    state->acc[7] = PRIME32_1;
+}
+
+/* The last bytes of input always stay in the buffer, because the final
+ * stripe is treated differently. The end of the buffer keeps the stripe
+ * that was consumed last in case it's needed for that.
+ */
+void xxh3_update(struct xxh3_state *state, const void *data, size_t size) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + size;
+
+    state->total_size += size;
+    if (state->buffered_size + size <= XXH3_BUFFER_SIZE) {
+        memcpy(state->buffer + state->buffered_size, p, size);
+        state->buffered_size += size;
+        return;
+    }
+
+    if (state->buffered_size > 0) {
+        size_t n = XXH3_BUFFER_SIZE - state->buffered_size;
+
+        memcpy(state->buffer + state->buffered_size, p, n);
+        p += n;
+        consume_stripes(
+            state->acc,
+            &state->num_stripes,
+            state->buffer,
+            XXH3_BUFFER_SIZE / STRIPE_SIZE);
+        state->buffered_size = 0;
+    }
+
+    if ((size_t)(end - p) > XXH3_BUFFER_SIZE) {
+        size_t num_stripes = (size_t)(end - p - 1) / STRIPE_SIZE;
+
+        consume_stripes(state->acc, &state->num_stripes, p, num_stripes);
+        p += num_stripes * STRIPE_SIZE;
+        memcpy(
+            state->buffer + XXH3_BUFFER_SIZE - STRIPE_SIZE,
+            p - STRIPE_SIZE,
+            STRIPE_SIZE);
+    }
+
+    memcpy(state->buffer, p, (size_t)(end - p));
+    state->buffered_size = (size_t)(end - p);
+}
+
+uint64_t xxh3_digest(const struct xxh3_state *state) {
+    uint64_t acc[8];
+    unsigned char last_stripe[STRIPE_SIZE];
+    const unsigned char *last;
+
+    if (state->total_size <= MIDSIZE_MAX) {
+        return hash_short(state->buffer, (size_t)state->total_size);
+    }
+
+    memcpy(acc, state->acc, sizeof(acc));
+    if (state->buffered_size >= STRIPE_SIZE) {
+        size_t num_stripes = state->num_stripes;
+
+        consume_stripes(
+            acc,
+            &num_stripes,
+            state->buffer,
+            (state->buffered_size - 1) / STRIPE_SIZE);
+        last = state->buffer + state->buffered_size - STRIPE_SIZE;
+    } else {
+        size_t n = STRIPE_SIZE - state->buffered_size;
+
+        memcpy(last_stripe, state->buffer + XXH3_BUFFER_SIZE - n, n);
+        memcpy(last_stripe + n, state->buffer, state->buffered_size);
+        last = last_stripe;
+    }
+    accumulate_stripe(acc, last, secret + SECRET_SIZE - STRIPE_SIZE - 7);
+    return merge_accs(acc, state->total_size);
+}
+
+uint64_t xxh3_64(const void *data, size_t size) {
+    struct xxh3_state state;
+
+    if (size <= MIDSIZE_MAX) {
+        return hash_short(data, size);
+    }
+    xxh3_init(&state);
+    xxh3_update(&state, data, size);
+    return xxh3_digest(&state);
+}
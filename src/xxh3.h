@@ -0,0 +1,49 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_XXH3_H
+#define WDD_XXH3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define XXH3_BUFFER_SIZE 256
+
+/* Streaming state of the 64-bit XXH3 hash with the default secret and a
+ * seed of zero.
+ */
+struct xxh3_state {
+    uint64_t acc[8];
+    unsigned char buffer[XXH3_BUFFER_SIZE];
+    size_t buffered_size;
+    size_t num_stripes;
+    uint64_t total_size;
+};
+
+void xxh3_init(struct xxh3_state *state);
+void xxh3_update(struct xxh3_state *state, const void *data, size_t size);
+uint64_t xxh3_digest(const struct xxh3_state *state);
+
+/* Hashes a whole buffer at once. */
+uint64_t xxh3_64(const void *data, size_t size);
+
+#endif
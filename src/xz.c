@@ -0,0 +1,945 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "gzip.h"
+#include "xz.h"
+
+#define CRC64_POLYNOMIAL 0xC96C5795D7870F42ULL
+#define FILTER_LZMA2 0x21
+#define MAX_VARINT_SIZE 9
+#define MAX_BLOCK_HEADER_SIZE 1024
+#define MAX_LZMA_HEADER_SIZE 6
+#define MAX_UNCOMPRESSED_CHUNK_SIZE (64 << 10)
+#define MAX_COMPRESSED_CHUNK_SIZE (64 << 10)
+
+#define CHECK_NONE 0
+#define CHECK_CRC32 1
+#define CHECK_CRC64 4
+
+#define BLOCK_FLAG_NUM_FILTERS 0x03
+#define BLOCK_FLAG_RESERVED 0x3C
+#define BLOCK_FLAG_COMPRESSED_SIZE 0x40
+#define BLOCK_FLAG_SIZE 0x80
+
+#define RC_TOP_VALUE (1U << 24)
+#define RC_MODEL_BITS 11
+#define RC_MOVE_BITS 5
+#define PROB_INIT (1 << (RC_MODEL_BITS - 1))
+
+#define NUM_STATES 12
+#define NUM_LITERAL_STATES 7
+#define MIN_MATCH_LENGTH 2
+#define DISTANCE_SLOT_BITS 6
+#define START_POS_MODEL_INDEX 4
+#define END_POS_MODEL_INDEX 14
+#define ALIGN_BITS 4
+#define LENGTH_LOW_OFFSET 2
+#define LENGTH_MID_OFFSET (2 + 16 * 8)
+#define LENGTH_HIGH_OFFSET (2 + 16 * 8 * 2)
+
+enum decoder_state {
+    STATE_STREAM_HEADER,
+    STATE_BLOCK_HEADER,
+    STATE_BLOCK_DATA,
+    STATE_BLOCK_END,
+    STATE_INDEX,
+    STATE_STREAM_FOOTER,
+    STATE_DONE
+};
+
+static const unsigned char header_magic[XZ_MAGIC_SIZE] = {
+    0xFD, '7', 'z', 'X', 'Z', 0x00
+};
+
+static const unsigned char footer_magic[2] = {'Y', 'Z'};
+
+static uint64_t crc64_table[256];
+static int tables_ready;
+
+static void init_tables(void) {
+    uint64_t crc;
+    int i;
+    int j;
+
+    for (i = 0; i < 256; i++) {
+        crc = (uint64_t)i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (CRC64_POLYNOMIAL & (0 - (crc & 1)));
+        }
+        crc64_table[i] = crc;
+    }
+    tables_ready = 1;
+}
+
+static uint64_t crc64_update(uint64_t crc,
+                             const unsigned char *p,
+                             size_t size) {
+    crc = ~crc;
+    while (size > 0) {
+        crc = (crc >> 8) ^ crc64_table[(crc ^ *p) & 0xFF];
+        p++;
+        size--;
+    }
+    return ~crc;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static size_t fill(struct in_stream *in, size_t size) {
+    size_t available = (size_t)(in->end - in->p);
+
+    if (available >= size || in->fill == NULL) {
+        return available;
+    }
+    return in->fill(in, size);
+}
+
+static size_t check_size(int check_type) {
+    return check_type == CHECK_NONE ? 0 : (size_t)4 << ((check_type - 1) / 3);
+}
+
+/* Reads a multibyte integer. Returns its size, or 0 if it's invalid. */
+static size_t read_varint(const unsigned char *p,
+                          const unsigned char *end,
+                          uint64_t *value) {
+    size_t i;
+
+    *value = 0;
+    for (i = 0; i < MAX_VARINT_SIZE && p + i < end; i++) {
+        *value |= (uint64_t)(p[i] & 0x7F) << (7 * i);
+        if ((p[i] & 0x80) == 0) {
+            if (i > 0 && p[i] == 0) {
+                return 0;
+            }
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t dictionary_size(int props) {
+    if (props == 40) {
+        return 0xFFFFFFFFU;
+    }
+    return (uint64_t)(2 | (props & 1)) << (props / 2 + 11);
+}
+
+static int parse_stream_flags(const unsigned char *flags, int *check_type) {
+    if (flags[0] != 0 || (flags[1] & 0xF0) != 0) {
+        return 0;
+    }
+    *check_type = flags[1];
+    return 1;
+}
+
+/* Parses a block header, which must be all there. Returns DECODE_OK if
+ * the block can be decoded.
+ */
+static enum decode_status parse_block_header(const unsigned char *p,
+                                             size_t header_size,
+                                             uint64_t *compressed_size,
+                                             uint64_t *size,
+                                             uint64_t *dict_size) {
+    const unsigned char *end = p + header_size - 4;
+    const unsigned char *q = p + 2;
+    int flags = p[1];
+    uint64_t filter_id;
+    uint64_t props_size;
+    size_t n;
+
+    if (gzip_crc32(0, p, header_size - 4) != read32(end)
+        || (flags & BLOCK_FLAG_RESERVED) != 0) {
+        return DECODE_CORRUPT;
+    }
+
+    *compressed_size = (uint64_t)-1;
+    *size = (uint64_t)-1;
+    if (flags & BLOCK_FLAG_COMPRESSED_SIZE) {
+        n = read_varint(q, end, compressed_size);
+        if (n == 0 || *compressed_size == 0) {
+            return DECODE_CORRUPT;
+        }
+        q += n;
+    }
+    if (flags & BLOCK_FLAG_SIZE) {
+        n = read_varint(q, end, size);
+        if (n == 0) {
+            return DECODE_CORRUPT;
+        }
+        q += n;
+    }
+
+    /* Other filters, such as the branch converters that may come before
+     * LZMA2, aren't supported.
+     */
+    if ((flags & BLOCK_FLAG_NUM_FILTERS) != 0) {
+        return DECODE_UNSUPPORTED;
+    }
+    n = read_varint(q, end, &filter_id);
+    if (n == 0) {
+        return DECODE_CORRUPT;
+    }
+    q += n;
+    if (filter_id != FILTER_LZMA2) {
+        return DECODE_UNSUPPORTED;
+    }
+    n = read_varint(q, end, &props_size);
+    if (n == 0 || props_size != 1 || q + n >= end || q[n] > 40) {
+        return DECODE_CORRUPT;
+    }
+    *dict_size = dictionary_size(q[n]);
+    q += n + 1;
+
+    while (q < end) {
+        if (*q++ != 0) {
+            return DECODE_CORRUPT;
+        }
+    }
+    return DECODE_OK;
+}
+
+uint64_t xz_dictionary_size(const void *data, size_t size) {
+    const unsigned char *p = data;
+    size_t header_size;
+    uint64_t compressed_size;
+    uint64_t block_size;
+    uint64_t dict_size;
+    int check_type;
+
+    if (size < XZ_HEADER_SIZE + 1
+        || memcmp(p, header_magic, XZ_MAGIC_SIZE) != 0
+        || !parse_stream_flags(p + XZ_MAGIC_SIZE, &check_type)) {
+        return 0;
+    }
+    p += XZ_HEADER_SIZE;
+    size -= XZ_HEADER_SIZE;
+    header_size = ((size_t)p[0] + 1) * 4;
+    if (p[0] == 0 || header_size > size
+        || parse_block_header(p, header_size, &compressed_size, &block_size,
+                              &dict_size) != DECODE_OK) {
+        return 0;
+    }
+    return dict_size;
+}
+
+uint64_t xz_index_size(const void *footer, int *check_type) {
+    const unsigned char *p = footer;
+
+    if (memcmp(p + 10, footer_magic, sizeof(footer_magic)) != 0
+        || gzip_crc32(0, p + 4, 6) != read32(p)
+        || !parse_stream_flags(p + 8, check_type)) {
+        return 0;
+    }
+    return ((uint64_t)read32(p + 4) + 1) * 4;
+}
+
+int xz_parse_index(const void *data,
+                   size_t size,
+                   struct xz_block_record *records,
+                   size_t *num_records) {
+    const unsigned char *start = data;
+    const unsigned char *p = start;
+    const unsigned char *end = start + size;
+    uint64_t count;
+    uint64_t i;
+    size_t n;
+
+    if (size < 8 || size % 4 != 0 || *p++ != 0
+        || gzip_crc32(0, start, size - 4) != read32(end - 4)) {
+        return 0;
+    }
+    end -= 4;
+    n = read_varint(p, end, &count);
+    if (n == 0 || count > size / 2) {
+        return 0;
+    }
+    p += n;
+    for (i = 0; i < count; i++) {
+        n = read_varint(p, end, &records[i].unpadded_size);
+        if (n == 0) {
+            return 0;
+        }
+        p += n;
+        n = read_varint(p, end, &records[i].size);
+        if (n == 0 || records[i].unpadded_size == 0) {
+            return 0;
+        }
+        p += n;
+    }
+    while (p < end) {
+        if (*p++ != 0) {
+            return 0;
+        }
+    }
+    *num_records = (size_t)count;
+    return 1;
+}
+
+/* The range decoder reads at most the compressed size of a chunk. Going
+ * past it is only noted, and the chunk is rejected at the end.
+ */
+struct range_decoder {
+    uint32_t range;
+    uint32_t code;
+    const unsigned char *p;
+    const unsigned char *end;
+    int overrun;
+};
+
+static void rc_normalize(struct range_decoder *rc) {
+    if (rc->range < RC_TOP_VALUE) {
+        rc->range <<= 8;
+        rc->code <<= 8;
+        if (rc->p < rc->end) {
+            rc->code |= *rc->p++;
+        } else {
+            rc->overrun = 1;
+        }
+    }
+}
+
+static int rc_bit(struct range_decoder *rc, uint16_t *prob) {
+    uint32_t bound;
+
+    rc_normalize(rc);
+    bound = (rc->range >> RC_MODEL_BITS) * *prob;
+    if (rc->code < bound) {
+        rc->range = bound;
+        *prob += ((1 << RC_MODEL_BITS) - *prob) >> RC_MOVE_BITS;
+        return 0;
+    }
+    rc->range -= bound;
+    rc->code -= bound;
+    *prob -= *prob >> RC_MOVE_BITS;
+    return 1;
+}
+
+static uint32_t rc_tree(struct range_decoder *rc,
+                        uint16_t *probs,
+                        int num_bits) {
+    uint32_t m = 1;
+    int i;
+
+    for (i = 0; i < num_bits; i++) {
+        m = (m << 1) | (uint32_t)rc_bit(rc, &probs[m]);
+    }
+    return m - (1U << num_bits);
+}
+
+static uint32_t rc_reverse_tree(struct range_decoder *rc,
+                                uint16_t *probs,
+                                int num_bits) {
+    uint32_t m = 1;
+    uint32_t result = 0;
+    int i;
+
+    for (i = 0; i < num_bits; i++) {
+        uint32_t bit = (uint32_t)rc_bit(rc, &probs[m]);
+
+        m = (m << 1) | bit;
+        result |= bit << i;
+    }
+    return result;
+}
+
+static uint32_t rc_direct(struct range_decoder *rc, int num_bits) {
+    uint32_t result = 0;
+
+    while (num_bits-- > 0) {
+        uint32_t mask;
+
+        rc_normalize(rc);
+        rc->range >>= 1;
+        rc->code -= rc->range;
+        mask = 0 - (rc->code >> 31);
+        rc->code += rc->range & mask;
+        result = (result << 1) + (mask + 1);
+    }
+    return result;
+}
+
+static uint32_t decode_length(struct range_decoder *rc,
+                              uint16_t *probs,
+                              uint32_t pos_state) {
+    if (!rc_bit(rc, &probs[0])) {
+        return rc_tree(rc, &probs[LENGTH_LOW_OFFSET + (pos_state << 3)], 3);
+    }
+    if (!rc_bit(rc, &probs[1])) {
+        return 8 + rc_tree(rc,
+                           &probs[LENGTH_MID_OFFSET + (pos_state << 3)],
+                           3);
+    }
+    return 16 + rc_tree(rc, &probs[LENGTH_HIGH_OFFSET], 8);
+}
+
+static void reset_lzma_state(struct xz_decoder *decoder) {
+    uint16_t *probs = (uint16_t *)&decoder->probs;
+    size_t num_probs = offsetof(struct xz_lzma_probs, literal)
+        / sizeof(uint16_t) + ((size_t)0x300 << (decoder->lc + decoder->lp));
+    size_t i;
+
+    for (i = 0; i < num_probs; i++) {
+        probs[i] = PROB_INIT;
+    }
+    decoder->lzma_state = 0;
+    decoder->reps[0] = 0;
+    decoder->reps[1] = 0;
+    decoder->reps[2] = 0;
+    decoder->reps[3] = 0;
+}
+
+static void copy_match(unsigned char *out, size_t distance, size_t length) {
+    const unsigned char *match = out - distance;
+
+    if (distance >= length) {
+        memcpy(out, match, length);
+    } else {
+        while (length-- > 0) {
+            *out++ = *match++;
+        }
+    }
+}
+
+/* Decodes an LZMA chunk of exactly out_size bytes. history is where the
+ * data that matches may refer to begins.
+ */
+static enum decode_status decode_lzma(struct xz_decoder *decoder,
+                                      const unsigned char *data,
+                                      size_t size,
+                                      unsigned char *out,
+                                      size_t out_size,
+                                      const unsigned char *history) {
+    struct xz_lzma_probs *probs = &decoder->probs;
+    struct range_decoder rc;
+    unsigned char *o = out;
+    unsigned char *end = out + out_size;
+    uint32_t pb_mask = (1U << decoder->pb) - 1;
+    uint32_t lp_mask = (1U << decoder->lp) - 1;
+    int lc = decoder->lc;
+    uint32_t state = (uint32_t)decoder->lzma_state;
+    uint32_t rep0 = decoder->reps[0];
+    uint32_t rep1 = decoder->reps[1];
+    uint32_t rep2 = decoder->reps[2];
+    uint32_t rep3 = decoder->reps[3];
+    uint32_t position = (uint32_t)decoder->position;
+
+    if (size < 5 || data[0] != 0) {
+        return DECODE_CORRUPT;
+    }
+    rc.range = 0xFFFFFFFFU;
+    rc.code = ((uint32_t)data[1] << 24) | ((uint32_t)data[2] << 16)
+        | ((uint32_t)data[3] << 8) | data[4];
+    rc.p = data + 5;
+    rc.end = data + size;
+    rc.overrun = 0;
+
+    while (o < end) {
+        uint32_t pos_state = position & pb_mask;
+        uint32_t length;
+
+        if (!rc_bit(&rc, &probs->is_match[(state << 4) + pos_state])) {
+            uint32_t previous = o > history ? o[-1] : 0;
+            uint16_t *literal = probs->literal + 0x300
+                * (((position & lp_mask) << lc) + (previous >> (8 - lc)));
+            uint32_t symbol = 1;
+
+            if (state >= NUM_LITERAL_STATES) {
+                uint32_t match_byte;
+
+                if (rep0 >= (size_t)(o - history)) {
+                    return DECODE_CORRUPT;
+                }
+                match_byte = o[-(ptrdiff_t)rep0 - 1];
+                do {
+                    uint32_t match_bit = (match_byte >> 7) & 1;
+                    uint32_t bit;
+
+                    match_byte <<= 1;
+                    bit = (uint32_t)rc_bit(
+                        &rc, &literal[0x100 + (match_bit << 8) + symbol]);
+                    symbol = (symbol << 1) | bit;
+                    if (match_bit != bit) {
+                        break;
+                    }
+                } while (symbol < 0x100);
+            }
+            while (symbol < 0x100) {
+                symbol = (symbol << 1) | (uint32_t)rc_bit(&rc, &literal[symbol]);
+            }
+            *o++ = (unsigned char)symbol;
+            position++;
+            state = state < 4 ? 0 : state < 10 ? state - 3 : state - 6;
+            continue;
+        }
+
+        if (rc_bit(&rc, &probs->is_rep[state])) {
+            if (!rc_bit(&rc, &probs->is_rep0[state])) {
+                if (!rc_bit(&rc,
+                            &probs->is_rep0_long[(state << 4) + pos_state])) {
+                    if (rep0 >= (size_t)(o - history)) {
+                        return DECODE_CORRUPT;
+                    }
+                    *o = o[-(ptrdiff_t)rep0 - 1];
+                    o++;
+                    position++;
+                    state = state < NUM_LITERAL_STATES ? 9 : 11;
+                    continue;
+                }
+            } else {
+                uint32_t distance;
+
+                if (!rc_bit(&rc, &probs->is_rep1[state])) {
+                    distance = rep1;
+                } else {
+                    if (!rc_bit(&rc, &probs->is_rep2[state])) {
+                        distance = rep2;
+                    } else {
+                        distance = rep3;
+                        rep3 = rep2;
+                    }
+                    rep2 = rep1;
+                }
+                rep1 = rep0;
+                rep0 = distance;
+            }
+            length = decode_length(&rc, probs->rep_length, pos_state);
+            state = state < NUM_LITERAL_STATES ? 8 : 11;
+        } else {
+            uint32_t slot;
+
+            rep3 = rep2;
+            rep2 = rep1;
+            rep1 = rep0;
+            length = decode_length(&rc, probs->match_length, pos_state);
+            state = state < NUM_LITERAL_STATES ? 7 : 10;
+
+            slot = rc_tree(&rc,
+                           probs->distance_slot[length < 3 ? length : 3],
+                           DISTANCE_SLOT_BITS);
+            if (slot < START_POS_MODEL_INDEX) {
+                rep0 = slot;
+            } else {
+                int num_direct_bits = (int)(slot >> 1) - 1;
+
+                rep0 = (2 | (slot & 1)) << num_direct_bits;
+                if (slot < END_POS_MODEL_INDEX) {
+                    rep0 += rc_reverse_tree(
+                        &rc,
+                        probs->distance_special + rep0 - slot - 1,
+                        num_direct_bits);
+                } else {
+                    rep0 += rc_direct(&rc, num_direct_bits - ALIGN_BITS)
+                        << ALIGN_BITS;
+                    rep0 += rc_reverse_tree(&rc, probs->align, ALIGN_BITS);
+                    if (rep0 == 0xFFFFFFFFU) {
+                        return DECODE_CORRUPT;
+                    }
+                }
+            }
+        }
+
+        length += MIN_MATCH_LENGTH;
+        if (rep0 >= (size_t)(o - history) || length > (size_t)(end - o)) {
+            return DECODE_CORRUPT;
+        }
+        copy_match(o, (size_t)rep0 + 1, length);
+        o += length;
+        position += length;
+    }
+
+    rc_normalize(&rc);
+    if (rc.overrun || rc.p != rc.end || rc.code != 0) {
+        return DECODE_CORRUPT;
+    }
+    decoder->lzma_state = (int)state;
+    decoder->reps[0] = rep0;
+    decoder->reps[1] = rep1;
+    decoder->reps[2] = rep2;
+    decoder->reps[3] = rep3;
+    decoder->position += out_size;
+    return DECODE_OK;
+}
+
+static enum decode_status decode_chunk(struct xz_decoder *decoder,
+                                       struct in_stream *in,
+                                       struct out_window *out) {
+    const unsigned char *history;
+    int control;
+    size_t header_size;
+    size_t compressed_size;
+    size_t size;
+    enum decode_status status;
+
+    if (fill(in, MAX_LZMA_HEADER_SIZE) < 1) {
+        return DECODE_CORRUPT;
+    }
+    control = in->p[0];
+    if (control == 0) {
+        in->p++;
+        decoder->block_compressed_size++;
+        decoder->state = STATE_BLOCK_END;
+        return DECODE_OK;
+    }
+    if (control >= 3 && control < 0x80) {
+        return DECODE_CORRUPT;
+    }
+
+    if (control >= 0xE0 || control == 1) {
+        decoder->need_properties = 1;
+        decoder->need_dictionary_reset = 0;
+        decoder->position = 0;
+    } else if (decoder->need_dictionary_reset) {
+        return DECODE_CORRUPT;
+    }
+
+    if (control < 0x80) {
+        if ((size_t)(in->end - in->p) < 3) {
+            return DECODE_CORRUPT;
+        }
+        size = (((size_t)in->p[1] << 8) | in->p[2]) + 1;
+        if (fill(in, 3 + size) < 3 + size
+            || size > (size_t)(out->end - out->p)) {
+            return DECODE_CORRUPT;
+        }
+        memcpy(out->p, in->p + 3, size);
+        out->p += size;
+        in->p += 3 + size;
+        decoder->position += size;
+        decoder->block_compressed_size += 3 + size;
+        return DECODE_OK;
+    }
+
+    header_size = control >= 0xC0 ? 6 : 5;
+    if ((size_t)(in->end - in->p) < header_size) {
+        return DECODE_CORRUPT;
+    }
+    size = ((((size_t)control & 0x1F) << 16) | ((size_t)in->p[1] << 8)
+        | in->p[2]) + 1;
+    compressed_size = (((size_t)in->p[3] << 8) | in->p[4]) + 1;
+
+    if (control >= 0xC0) {
+        int props = in->p[5];
+
+        if (props >= 9 * 5 * 5) {
+            return DECODE_CORRUPT;
+        }
+        decoder->lc = props % 9;
+        decoder->lp = (props / 9) % 5;
+        decoder->pb = props / 45;
+        if (decoder->lc + decoder->lp > 4) {
+            return DECODE_CORRUPT;
+        }
+        decoder->need_properties = 0;
+        reset_lzma_state(decoder);
+    } else if (decoder->need_properties) {
+        return DECODE_CORRUPT;
+    } else if (control >= 0xA0) {
+        reset_lzma_state(decoder);
+    }
+
+    if (fill(in, header_size + compressed_size)
+            < header_size + compressed_size
+        || size > (size_t)(out->end - out->p)) {
+        return DECODE_CORRUPT;
+    }
+    history = out->start;
+    if (decoder->position < (uint64_t)(out->p - out->start)) {
+        history = out->p - decoder->position;
+    }
+    status = decode_lzma(decoder, in->p + header_size, compressed_size,
+                         out->p, size, history);
+    if (status != DECODE_OK) {
+        return status;
+    }
+    out->p += size;
+    in->p += header_size + compressed_size;
+    decoder->block_compressed_size += header_size + compressed_size;
+    return DECODE_OK;
+}
+
+static enum decode_status read_stream_header(struct xz_decoder *decoder,
+                                             struct in_stream *in) {
+    size_t available = fill(in, XZ_HEADER_SIZE);
+
+    if (available == 0) {
+        return DECODE_END;
+    }
+    if (available < XZ_HEADER_SIZE
+        || memcmp(in->p, header_magic, XZ_MAGIC_SIZE) != 0
+        || gzip_crc32(0, in->p + XZ_MAGIC_SIZE, 2)
+            != read32(in->p + XZ_MAGIC_SIZE + 2)
+        || !parse_stream_flags(in->p + XZ_MAGIC_SIZE,
+                               &decoder->check_type)) {
+        return DECODE_CORRUPT;
+    }
+    decoder->stream_flags = in->p[XZ_MAGIC_SIZE + 1];
+    decoder->num_blocks = 0;
+    decoder->blocks_unpadded_size = 0;
+    decoder->blocks_size = 0;
+    in->p += XZ_HEADER_SIZE;
+    decoder->state = STATE_BLOCK_HEADER;
+    return DECODE_OK;
+}
+
+static enum decode_status read_block_header(struct xz_decoder *decoder,
+                                            struct in_stream *in,
+                                            struct out_window *out) {
+    size_t header_size;
+    enum decode_status status;
+
+    if (fill(in, 1) < 1) {
+        return DECODE_CORRUPT;
+    }
+    if (in->p[0] == 0) {
+        if (decoder->single_block) {
+            return DECODE_CORRUPT;
+        }
+        decoder->state = STATE_INDEX;
+        return DECODE_OK;
+    }
+    header_size = ((size_t)in->p[0] + 1) * 4;
+    if (fill(in, header_size) < header_size) {
+        return DECODE_CORRUPT;
+    }
+    status = parse_block_header(in->p, header_size,
+                                &decoder->declared_compressed_size,
+                                &decoder->declared_size,
+                                &decoder->dictionary_size);
+    if (status != DECODE_OK) {
+        return status;
+    }
+    if (decoder->dictionary_size > out->window_size) {
+        return DECODE_UNSUPPORTED;
+    }
+    in->p += header_size;
+
+    decoder->block_header_size = (uint32_t)header_size;
+    decoder->block_compressed_size = 0;
+    decoder->block_size = 0;
+    decoder->crc32 = 0;
+    decoder->crc64 = 0;
+    decoder->need_dictionary_reset = 1;
+    decoder->need_properties = 1;
+    decoder->state = STATE_BLOCK_DATA;
+    return DECODE_OK;
+}
+
+static enum decode_status read_block_end(struct xz_decoder *decoder,
+                                         struct in_stream *in) {
+    size_t padding = (size_t)(0 - decoder->block_compressed_size) & 3;
+    size_t size = check_size(decoder->check_type);
+    const unsigned char *p;
+    size_t i;
+
+    if ((decoder->declared_compressed_size != (uint64_t)-1
+            && decoder->declared_compressed_size
+                != decoder->block_compressed_size)
+        || (decoder->declared_size != (uint64_t)-1
+            && decoder->declared_size != decoder->block_size)) {
+        return DECODE_CORRUPT;
+    }
+    if (fill(in, padding + size) < padding + size) {
+        return DECODE_CORRUPT;
+    }
+    p = in->p;
+    for (i = 0; i < padding; i++) {
+        if (*p++ != 0) {
+            return DECODE_CORRUPT;
+        }
+    }
+
+    /* SHA-256 and the reserved check types are skipped. */
+    switch (decoder->check_type) {
+        case CHECK_CRC32:
+            if (read32(p) != decoder->crc32) {
+                return DECODE_CORRUPT;
+            }
+            break;
+        case CHECK_CRC64:
+            if (read64(p) != decoder->crc64) {
+                return DECODE_CORRUPT;
+            }
+            break;
+    }
+    in->p += padding + size;
+
+    decoder->num_blocks++;
+    decoder->blocks_unpadded_size += decoder->block_header_size
+        + decoder->block_compressed_size + size;
+    decoder->blocks_size += decoder->block_size;
+    decoder->state = decoder->single_block
+        ? STATE_DONE
+        : STATE_BLOCK_HEADER;
+    return DECODE_OK;
+}
+
+/* The index is checked against the blocks that came before it by the
+ * number of records and the sums of their sizes.
+ */
+static int read_index_varint(struct in_stream *in,
+                             uint32_t *crc,
+                             uint64_t *index_size,
+                             uint64_t *value) {
+    size_t n;
+
+    fill(in, MAX_VARINT_SIZE);
+    n = read_varint(in->p, in->end, value);
+    if (n == 0) {
+        return 0;
+    }
+    *crc = gzip_crc32(*crc, in->p, n);
+    *index_size += n;
+    in->p += n;
+    return 1;
+}
+
+static enum decode_status read_index(struct xz_decoder *decoder,
+                                     struct in_stream *in) {
+    uint32_t crc;
+    uint64_t count;
+    uint64_t unpadded_size = 0;
+    uint64_t size = 0;
+    uint64_t index_size = 1;
+    uint64_t i;
+
+    crc = gzip_crc32(0, in->p, 1);
+    in->p++;
+
+    if (!read_index_varint(in, &crc, &index_size, &count)
+        || count != decoder->num_blocks) {
+        return DECODE_CORRUPT;
+    }
+    for (i = 0; i < count; i++) {
+        uint64_t record_unpadded_size;
+        uint64_t record_size;
+
+        if (!read_index_varint(in, &crc, &index_size, &record_unpadded_size)
+            || !read_index_varint(in, &crc, &index_size, &record_size)) {
+            return DECODE_CORRUPT;
+        }
+        unpadded_size += record_unpadded_size;
+        size += record_size;
+    }
+    if (unpadded_size != decoder->blocks_unpadded_size
+        || size != decoder->blocks_size) {
+        return DECODE_CORRUPT;
+    }
+
+    while (index_size % 4 != 0) {
+        if (fill(in, 1) < 1 || in->p[0] != 0) {
+            return DECODE_CORRUPT;
+        }
+        crc = gzip_crc32(crc, in->p, 1);
+        in->p++;
+        index_size++;
+    }
+    if (fill(in, 4) < 4 || read32(in->p) != crc) {
+        return DECODE_CORRUPT;
+    }
+    in->p += 4;
+    decoder->index_size = index_size + 4;
+    decoder->state = STATE_STREAM_FOOTER;
+    return DECODE_OK;
+}
+
+static enum decode_status read_stream_footer(struct xz_decoder *decoder,
+                                             struct in_stream *in) {
+    int check_type;
+
+    if (fill(in, XZ_FOOTER_SIZE) < XZ_FOOTER_SIZE
+        || xz_index_size(in->p, &check_type) != decoder->index_size
+        || in->p[9] != decoder->stream_flags) {
+        return DECODE_CORRUPT;
+    }
+    in->p += XZ_FOOTER_SIZE;
+
+    /* Streams may be followed by padding of null bytes. */
+    while (fill(in, 4) >= 4 && read32(in->p) == 0) {
+        in->p += 4;
+    }
+    decoder->state = STATE_STREAM_HEADER;
+    return DECODE_OK;
+}
+
+void xz_decoder_init(struct xz_decoder *decoder) {
+    if (!tables_ready) {
+        init_tables();
+    }
+    /* Also sets up the CRC-32 tables while only one thread is here. */
+    gzip_crc32(0, NULL, 0);
+    decoder->state = STATE_STREAM_HEADER;
+    decoder->single_block = 0;
+}
+
+void xz_decoder_init_block(struct xz_decoder *decoder, int check_type) {
+    xz_decoder_init(decoder);
+    decoder->state = STATE_BLOCK_HEADER;
+    decoder->single_block = 1;
+    decoder->check_type = check_type;
+}
+
+enum decode_status xz_decode(struct xz_decoder *decoder,
+                             struct in_stream *in,
+                             struct out_window *out) {
+    unsigned char *start = out->p;
+    enum decode_status status;
+
+    switch (decoder->state) {
+        case STATE_STREAM_HEADER:
+            return read_stream_header(decoder, in);
+        case STATE_BLOCK_HEADER:
+            return read_block_header(decoder, in, out);
+        case STATE_BLOCK_DATA:
+            status = decode_chunk(decoder, in, out);
+            if (status == DECODE_OK && out->p > start) {
+                size_t size = (size_t)(out->p - start);
+
+                if (decoder->check_type == CHECK_CRC32) {
+                    decoder->crc32 = gzip_crc32(decoder->crc32, start, size);
+                } else if (decoder->check_type == CHECK_CRC64) {
+                    decoder->crc64 = crc64_update(decoder->crc64, start,
+                                                  size);
+                }
+                decoder->block_size += size;
+            }
+            return status;
+        case STATE_BLOCK_END:
+            return read_block_end(decoder, in);
+        case STATE_INDEX:
+            return read_index(decoder, in);
+        case STATE_STREAM_FOOTER:
+            return read_stream_footer(decoder, in);
+        default:
+            return DECODE_END;
+    }
+}
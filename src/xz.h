@@ -0,0 +1,119 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_XZ_H
+#define WDD_XZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "stream.h"
+
+#define XZ_MAGIC_SIZE 6
+#define XZ_HEADER_SIZE 12
+#define XZ_FOOTER_SIZE 12
+#define XZ_MAX_CHUNK_SIZE (2 << 20)
+#define XZ_LITERAL_PROBS (0x300 << 4)
+
+/* Probabilities of the LZMA decoder, reset along with its state. */
+struct xz_lzma_probs {
+    uint16_t is_match[12 << 4];
+    uint16_t is_rep[12];
+    uint16_t is_rep0[12];
+    uint16_t is_rep1[12];
+    uint16_t is_rep2[12];
+    uint16_t is_rep0_long[12 << 4];
+    uint16_t distance_slot[4][64];
+    uint16_t distance_special[114];
+    uint16_t align[16];
+    uint16_t match_length[2 + 16 * 8 * 2 + 256];
+    uint16_t rep_length[2 + 16 * 8 * 2 + 256];
+    uint16_t literal[XZ_LITERAL_PROBS];
+};
+
+struct xz_block_record {
+    uint64_t unpadded_size;
+    uint64_t size;
+};
+
+struct xz_decoder {
+    int state;
+    int single_block;
+    int check_type;
+    uint32_t stream_flags;
+    uint64_t dictionary_size;
+    uint64_t declared_compressed_size;
+    uint64_t declared_size;
+    uint64_t block_compressed_size;
+    uint64_t block_size;
+    uint32_t block_header_size;
+    uint32_t crc32;
+    uint64_t crc64;
+    uint64_t num_blocks;
+    uint64_t blocks_unpadded_size;
+    uint64_t blocks_size;
+    uint64_t index_size;
+    int need_dictionary_reset;
+    int need_properties;
+    int lc;
+    int lp;
+    int pb;
+    int lzma_state;
+    uint32_t reps[4];
+    uint64_t position;
+    struct xz_lzma_probs probs;
+};
+
+/* Decodes streams of .xz files whose blocks use the LZMA2 filter alone.
+ * Each call handles a header or an LZMA2 chunk, for which out needs room
+ * for XZ_MAX_CHUNK_SIZE bytes. Returns DECODE_END once input runs out
+ * between streams.
+ */
+void xz_decoder_init(struct xz_decoder *decoder);
+
+/* Makes the decoder take input that starts at a block header and ends
+ * with its check, as listed in the index. DECODE_END follows the block.
+ */
+void xz_decoder_init_block(struct xz_decoder *decoder, int check_type);
+
+enum decode_status xz_decode(struct xz_decoder *decoder,
+                             struct in_stream *in,
+                             struct out_window *out);
+
+/* Returns the dictionary size of the first block of a stream, or 0 if
+ * data doesn't start with one.
+ */
+uint64_t xz_dictionary_size(const void *data, size_t size);
+
+/* Checks the footer at the end of a stream. Returns the size of the index
+ * that precedes it, or 0 if the footer is invalid.
+ */
+uint64_t xz_index_size(const void *footer, int *check_type);
+
+/* Checks an index and reads its block records into records, which needs
+ * room for size / 2 of them. Returns 0 if the index is invalid.
+ */
+int xz_parse_index(const void *data,
+                   size_t size,
+                   struct xz_block_record *records,
+                   size_t *num_records);
+
+#endif
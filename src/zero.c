@@ -0,0 +1,137 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "cpu.h"
+#include "zero.h"
+
+#if defined(CPU_X86)
+    #include <emmintrin.h>
+    #include <immintrin.h>
+#elif defined(_M_ARM64)
+    #include <arm64_neon.h>
+#elif defined(CPU_ARM)
+    #include <arm_neon.h>
+#endif
+
+/* Each vectorized loop ORs 128 bytes together per iteration and bails out as
+ * soon as it sees a non-zero byte, so non-empty blocks are usually rejected
+ * within the first few bytes.
+ */
+#define CHUNK_SIZE 128
+
+static int is_zero_scalar(const unsigned char *p, size_t size) {
+    size_t i;
+
+    for (i = 0; i + sizeof(size_t) <= size; i += sizeof(size_t)) {
+        size_t word;
+        memcpy(&word, p + i, sizeof(word));
+        if (word != 0) {
+            return 0;
+        }
+    }
+    for (; i < size; i++) {
+        if (p[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#if defined(CPU_X86)
+
+TARGET_AVX2
+static size_t zero_prefix_avx2(const unsigned char *p, size_t size) {
+    size_t i;
+
+    for (i = 0; i + CHUNK_SIZE <= size; i += CHUNK_SIZE) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(p + i + 96));
+        __m256i x = _mm256_or_si256(_mm256_or_si256(a, b),
+                                    _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(x, x)) {
+            return (size_t)-1;
+        }
+    }
+    return i;
+}
+
+static size_t zero_prefix_sse2(const unsigned char *p, size_t size) {
+    __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i + CHUNK_SIZE <= size; i += CHUNK_SIZE) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        int j;
+        for (j = 16; j < CHUNK_SIZE; j += 16) {
+            x = _mm_or_si128(x, _mm_loadu_si128((const __m128i *)(p + i + j)));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xFFFF) {
+            return (size_t)-1;
+        }
+    }
+    return i;
+}
+
+#elif defined(CPU_ARM)
+
+static size_t zero_prefix_neon(const unsigned char *p, size_t size) {
+    size_t i;
+
+    for (i = 0; i + CHUNK_SIZE <= size; i += CHUNK_SIZE) {
+        uint8x16_t x = vld1q_u8(p + i);
+        uint64x2_t x64;
+        int j;
+        for (j = 16; j < CHUNK_SIZE; j += 16) {
+            x = vorrq_u8(x, vld1q_u8(p + i + j));
+        }
+        x64 = vreinterpretq_u64_u8(x);
+        if ((vgetq_lane_u64(x64, 0) | vgetq_lane_u64(x64, 1)) != 0) {
+            return (size_t)-1;
+        }
+    }
+    return i;
+}
+
+#endif
+
+int is_zero_block(const void *buffer, size_t size) {
+    const unsigned char *p = buffer;
+    size_t prefix = 0;
+
+#if defined(CPU_X86)
+    if (cpu_has_avx2()) {
+        prefix = zero_prefix_avx2(p, size);
+    } else {
+        prefix = zero_prefix_sse2(p, size);
+    }
+#elif defined(CPU_ARM)
+    prefix = zero_prefix_neon(p, size);
+#endif
+
+    if (prefix == (size_t)-1) {
+        return 0;
+    }
+    return is_zero_scalar(p + prefix, size - prefix);
+}
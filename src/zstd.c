@@ -0,0 +1,2322 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "huffman.h"
+#include "zstd.h"
+
+#define SINGLE_SEGMENT 0x20
+#define MIN_MATCH 4
+#define MIN_REPEAT_OFFSET_GAIN 1
+
+#define BLOCK_RAW 0
+#define BLOCK_RLE 1
+#define BLOCK_COMPRESSED 2
+
+#define LITERALS_RAW 0
+#define LITERALS_RLE 1
+#define LITERALS_COMPRESSED 2
+
+#define MODE_PREDEFINED 0
+#define MODE_RLE 1
+#define MODE_FSE 2
+
+#define HUFFMAN_MAX_BITS ZSTD_HUFFMAN_MAX_BITS
+#define HUFFMAN_WEIGHTS_TABLE_LOG 5
+#define MAX_SINGLE_STREAM_LITERALS 1023
+
+#define LL_MAX_SYMBOL 35
+#define ML_MAX_SYMBOL 52
+#define LL_MAX_TABLE_LOG 9
+#define ML_MAX_TABLE_LOG 9
+#define OF_MAX_TABLE_LOG 8
+#define FSE_MIN_TABLE_LOG 5
+#define FSE_MAX_SYMBOLS 64
+#define FSE_MAX_TABLE_SIZE 512
+#define MIN_SEQUENCES_FOR_FSE 64
+
+static const uint32_t ll_base[LL_MAX_SYMBOL + 1] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+    8192, 16384, 32768, 65536
+};
+
+static const uint8_t ll_bits[LL_MAX_SYMBOL + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+    13, 14, 15, 16
+};
+
+static const uint32_t ml_base[ML_MAX_SYMBOL + 1] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+    19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+    35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+    4099, 8195, 16387, 32771, 65539
+};
+
+static const uint8_t ml_bits[ML_MAX_SYMBOL + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+    12, 13, 14, 15, 16
+};
+
+/* Distributions of the predefined sequence codes. */
+static const int16_t ll_default_norm[LL_MAX_SYMBOL + 1] = {
+    4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+    -1, -1, -1, -1
+};
+
+static const int16_t ml_default_norm[ML_MAX_SYMBOL + 1] = {
+    1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+    -1, -1, -1, -1, -1
+};
+
+static const int16_t of_default_norm[29] = {
+    1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+#define LL_DEFAULT_TABLE_LOG 6
+#define ML_DEFAULT_TABLE_LOG 6
+#define OF_DEFAULT_TABLE_LOG 5
+#define OF_DEFAULT_MAX_SYMBOL 28
+
+/* How hard the match finder tries at each level. */
+static const struct {
+    int max_chain;
+    unsigned int nice_length;
+    int lazy;
+} levels[ZSTD_MAX_LEVEL + 1] = {
+    {0, 0, 0},
+    {2, 16, 0},
+    {4, 24, 0},
+    {8, 32, 1},
+    {16, 48, 1},
+    {24, 64, 1},
+    {32, 64, 1},
+    {48, 96, 1},
+    {64, 128, 1},
+    {96, 128, 1},
+    {128, 192, 1},
+    {192, 256, 1},
+    {256, 256, 1},
+    {384, 384, 1},
+    {512, 512, 1},
+    {768, 512, 1},
+    {1024, 768, 1},
+    {1536, 1024, 1},
+    {2048, 1024, 1},
+    {4096, 2048, 1}
+};
+
+static uint8_t ll_codes[64];
+static uint8_t ml_codes[128];
+static int tables_ready;
+
+static void init_tables(void) {
+    uint32_t i;
+    int code;
+
+    for (code = 0; code <= LL_MAX_SYMBOL; code++) {
+        for (i = ll_base[code];
+             i < ll_base[code] + (1U << ll_bits[code]) && i < 64;
+             i++) {
+            ll_codes[i] = (uint8_t)code;
+        }
+    }
+    for (code = 0; code <= ML_MAX_SYMBOL; code++) {
+        for (i = ml_base[code] - 3;
+             i < ml_base[code] - 3 + (1U << ml_bits[code]) && i < 128;
+             i++) {
+            ml_codes[i] = (uint8_t)code;
+        }
+    }
+    tables_ready = 1;
+}
+
+static int highest_bit(uint32_t value) {
+    int bit = 0;
+
+    while (value >>= 1) {
+        bit++;
+    }
+    return bit;
+}
+
+static int literal_length_code(uint32_t length) {
+    return length < 64 ? ll_codes[length] : highest_bit(length) + 19;
+}
+
+static int match_length_code(uint32_t length) {
+    uint32_t base = length - 3;
+    return base < 128 ? ml_codes[base] : highest_bit(base) + 36;
+}
+
+/* Windows only runs on little-endian CPUs, so plain loads will do. */
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static void write_le(unsigned char *p, uint64_t value, int size) {
+    int i;
+
+    for (i = 0; i < size; i++) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+/* Zstandard bitstreams are written forwards and read backwards, starting
+ * from the last bit set in the last byte.
+ */
+struct bit_writer {
+    unsigned char *p;
+    uint64_t bits;
+    int num_bits;
+};
+
+static void put_bits(struct bit_writer *writer, uint32_t value, int count) {
+    writer->bits |= (uint64_t)(value & ((1ULL << count) - 1))
+        << writer->num_bits;
+    writer->num_bits += count;
+    while (writer->num_bits >= 8) {
+        *writer->p++ = (unsigned char)writer->bits;
+        writer->bits >>= 8;
+        writer->num_bits -= 8;
+    }
+}
+
+static unsigned char *close_stream(struct bit_writer *writer) {
+    put_bits(writer, 1, 1);
+    if (writer->num_bits > 0) {
+        *writer->p++ = (unsigned char)writer->bits;
+    }
+    return writer->p;
+}
+
+/* Finite State Entropy coding, the way the reference encoder does it. */
+struct fse_symbol {
+    int32_t delta_find_state;
+    uint32_t delta_num_bits;
+};
+
+struct fse_table {
+    int table_log;
+    uint16_t states[FSE_MAX_TABLE_SIZE];
+    struct fse_symbol symbols[FSE_MAX_SYMBOLS];
+};
+
+static int fse_table_log(uint32_t num_values, int max_symbol, int max_log) {
+    int max_bits_src = highest_bit(num_values - 1) - 2;
+    int min_bits = highest_bit(num_values - 1) + 1;
+    int table_log = max_log;
+
+    if (highest_bit(max_symbol) + 2 < min_bits) {
+        min_bits = highest_bit(max_symbol) + 2;
+    }
+    if (max_bits_src < table_log) {
+        table_log = max_bits_src;
+    }
+    if (min_bits > table_log) {
+        table_log = min_bits;
+    }
+    if (table_log < FSE_MIN_TABLE_LOG) {
+        table_log = FSE_MIN_TABLE_LOG;
+    }
+    if (table_log > max_log) {
+        table_log = max_log;
+    }
+    return table_log;
+}
+
+/* Scales counts to a total of 1 << table_log. Symbols that would get less
+ * than one state are marked -1 and get one state anyway; the rest of the
+ * rounding error goes to the symbols where it costs the least.
+ */
+static void fse_normalize(const uint32_t *counts,
+                          int max_symbol,
+                          uint32_t total,
+                          int table_log,
+                          int16_t *norm) {
+    int table_size = 1 << table_log;
+    int used = 0;
+    int s;
+
+    for (s = 0; s <= max_symbol; s++) {
+        if (counts[s] == 0) {
+            norm[s] = 0;
+        } else {
+            int n = (int)(((uint64_t)counts[s] << table_log) / total);
+            norm[s] = (int16_t)(n > 0 ? n : -1);
+            used += n > 0 ? n : 1;
+        }
+    }
+    while (used < table_size) {
+        int best = -1;
+        for (s = 0; s <= max_symbol; s++) {
+            if (norm[s] > 0
+                && (best < 0
+                    || (uint64_t)counts[s] * norm[best]
+                        > (uint64_t)counts[best] * norm[s])) {
+                best = s;
+            }
+        }
+        norm[best]++;
+        used++;
+    }
+    while (used > table_size) {
+        int best = -1;
+        for (s = 0; s <= max_symbol; s++) {
+            if (norm[s] > 1
+                && (best < 0
+                    || (uint64_t)counts[s] * norm[best]
+                        < (uint64_t)counts[best] * norm[s])) {
+                best = s;
+            }
+        }
+        norm[best]--;
+        used--;
+    }
+}
+
+static unsigned char *fse_write_table(unsigned char *out,
+                                      const int16_t *norm,
+                                      int max_symbol,
+                                      int table_log) {
+    int table_size = 1 << table_log;
+    int num_bits = table_log + 1;
+    int remaining = table_size + 1;
+    int threshold = table_size;
+    int symbol = 0;
+    int previous_zero = 0;
+    uint32_t bits = (uint32_t)(table_log - FSE_MIN_TABLE_LOG);
+    int num_pending = 4;
+
+    while (symbol <= max_symbol && remaining > 1) {
+        int count;
+        int max;
+
+        /* Runs of zero probabilities are written as repeat counts. */
+        if (previous_zero) {
+            int start = symbol;
+
+            while (symbol <= max_symbol && norm[symbol] == 0) {
+                symbol++;
+            }
+            while (symbol >= start + 24) {
+                start += 24;
+                bits += 0xFFFFU << num_pending;
+                *out++ = (unsigned char)bits;
+                *out++ = (unsigned char)(bits >> 8);
+                bits >>= 16;
+            }
+            while (symbol >= start + 3) {
+                start += 3;
+                bits += 3U << num_pending;
+                num_pending += 2;
+            }
+            bits += (uint32_t)(symbol - start) << num_pending;
+            num_pending += 2;
+            if (num_pending > 16) {
+                *out++ = (unsigned char)bits;
+                *out++ = (unsigned char)(bits >> 8);
+                bits >>= 16;
+                num_pending -= 16;
+            }
+        }
+
+        count = norm[symbol++];
+        max = (2 * threshold - 1) - remaining;
+        remaining -= count < 0 ? -count : count;
+        count++;
+        if (count >= threshold) {
+            count += max;
+        }
+        bits += (uint32_t)count << num_pending;
+        num_pending += num_bits;
+        num_pending -= count < max;
+        previous_zero = count == 1;
+        while (remaining < threshold) {
+            num_bits--;
+            threshold >>= 1;
+        }
+        if (num_pending > 16) {
+            *out++ = (unsigned char)bits;
+            *out++ = (unsigned char)(bits >> 8);
+            bits >>= 16;
+            num_pending -= 16;
+        }
+    }
+
+    out[0] = (unsigned char)bits;
+    out[1] = (unsigned char)(bits >> 8);
+    return out + (num_pending + 7) / 8;
+}
+
+static void fse_build_table(struct fse_table *table,
+                            const int16_t *norm,
+                            int max_symbol,
+                            int table_log) {
+    uint8_t spread[FSE_MAX_TABLE_SIZE];
+    uint32_t cumulative[FSE_MAX_SYMBOLS + 1];
+    int table_size = 1 << table_log;
+    int high_threshold = table_size - 1;
+    int step = (table_size >> 1) + (table_size >> 3) + 3;
+    int position = 0;
+    int total = 0;
+    int s;
+    int u;
+
+    table->table_log = table_log;
+
+    cumulative[0] = 0;
+    for (s = 0; s <= max_symbol; s++) {
+        if (norm[s] == -1) {
+            cumulative[s + 1] = cumulative[s] + 1;
+            spread[high_threshold--] = (uint8_t)s;
+        } else {
+            cumulative[s + 1] = cumulative[s] + norm[s];
+        }
+    }
+
+    for (s = 0; s <= max_symbol; s++) {
+        int i;
+
+        for (i = 0; i < norm[s]; i++) {
+            spread[position] = (uint8_t)s;
+            do {
+                position = (position + step) & (table_size - 1);
+            } while (position > high_threshold);
+        }
+    }
+
+    for (u = 0; u < table_size; u++) {
+        s = spread[u];
+        table->states[cumulative[s]++] = (uint16_t)(table_size + u);
+    }
+
+    for (s = 0; s <= max_symbol; s++) {
+        struct fse_symbol *symbol = &table->symbols[s];
+
+        switch (norm[s]) {
+            case 0:
+                symbol->delta_num_bits =
+                    ((uint32_t)(table_log + 1) << 16) - table_size;
+                break;
+            case -1:
+            case 1:
+                symbol->delta_num_bits =
+                    ((uint32_t)table_log << 16) - table_size;
+                symbol->delta_find_state = total - 1;
+                total++;
+                break;
+            default: {
+                int max_bits_out = table_log - highest_bit(norm[s] - 1);
+                uint32_t min_state_plus = (uint32_t)norm[s] << max_bits_out;
+
+                symbol->delta_num_bits =
+                    ((uint32_t)max_bits_out << 16) - min_state_plus;
+                symbol->delta_find_state = total - norm[s];
+                total += norm[s];
+                break;
+            }
+        }
+    }
+}
+
+/* The first symbol coded (the last one decoded) only sets the state. */
+static uint32_t fse_init_state(const struct fse_table *table, int symbol) {
+    const struct fse_symbol *info = &table->symbols[symbol];
+    uint32_t num_bits = (info->delta_num_bits + (1 << 15)) >> 16;
+    uint32_t value = (num_bits << 16) - info->delta_num_bits;
+
+    return table->states[(value >> num_bits) + info->delta_find_state];
+}
+
+static void fse_encode(struct bit_writer *writer,
+                       const struct fse_table *table,
+                       uint32_t *state,
+                       int symbol) {
+    const struct fse_symbol *info = &table->symbols[symbol];
+    uint32_t num_bits = (*state + info->delta_num_bits) >> 16;
+
+    put_bits(writer, *state, (int)num_bits);
+    *state = table->states[(*state >> num_bits) + info->delta_find_state];
+}
+
+static void fse_flush_state(struct bit_writer *writer,
+                            const struct fse_table *table,
+                            uint32_t state) {
+    put_bits(writer, state, table->table_log);
+}
+
+/* Huffman weights are coded with two interleaved FSE states. Returns the
+ * size of the description, or 0 if it doesn't pay off.
+ */
+static size_t write_fse_weights(unsigned char *out,
+                                const uint8_t *weights,
+                                int num_weights) {
+    struct fse_table table;
+    struct bit_writer writer;
+    uint32_t counts[HUFFMAN_MAX_BITS + 1];
+    int16_t norm[HUFFMAN_MAX_BITS + 1];
+    uint32_t states[2];
+    int initialized[2] = {0, 0};
+    uint32_t max_count = 0;
+    int max_symbol = 0;
+    unsigned char *p;
+    int i;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < num_weights; i++) {
+        counts[weights[i]]++;
+        if (weights[i] > max_symbol) {
+            max_symbol = weights[i];
+        }
+    }
+    for (i = 0; i <= max_symbol; i++) {
+        if (counts[i] > max_count) {
+            max_count = counts[i];
+        }
+    }
+    if (max_count <= 1 || max_count == (uint32_t)num_weights) {
+        return 0;
+    }
+
+    fse_normalize(counts, max_symbol, num_weights,
+                  HUFFMAN_WEIGHTS_TABLE_LOG, norm);
+    p = fse_write_table(out + 1, norm, max_symbol, HUFFMAN_WEIGHTS_TABLE_LOG);
+    fse_build_table(&table, norm, max_symbol, HUFFMAN_WEIGHTS_TABLE_LOG);
+
+    writer.p = p;
+    writer.bits = 0;
+    writer.num_bits = 0;
+    for (i = num_weights - 1; i >= 0; i--) {
+        int n = i & 1;
+
+        if (!initialized[n]) {
+            states[n] = fse_init_state(&table, weights[i]);
+            initialized[n] = 1;
+        } else {
+            fse_encode(&writer, &table, &states[n], weights[i]);
+        }
+    }
+    fse_flush_state(&writer, &table, states[1]);
+    fse_flush_state(&writer, &table, states[0]);
+    p = close_stream(&writer);
+
+    if (p - out - 1 >= num_weights / 2) {
+        return 0;
+    }
+    out[0] = (unsigned char)(p - out - 1);
+    return (size_t)(p - out);
+}
+
+static unsigned char *write_huffman_stream(unsigned char *out,
+                                           const unsigned char *literals,
+                                           size_t num_literals,
+                                           const uint16_t *codes,
+                                           const uint8_t *lengths) {
+    struct bit_writer writer;
+    size_t i;
+
+    writer.p = out;
+    writer.bits = 0;
+    writer.num_bits = 0;
+    for (i = num_literals; i > 0; i--) {
+        put_bits(&writer, codes[literals[i - 1]], lengths[literals[i - 1]]);
+    }
+    return close_stream(&writer);
+}
+
+/* Writes the literals Huffman coded. Returns the size of the section, or 0
+ * if they are better off stored as they are.
+ */
+static size_t write_compressed_literals(unsigned char *out,
+                                        const unsigned char *literals,
+                                        size_t num_literals) {
+    uint32_t freqs[256];
+    uint8_t lengths[256];
+    uint8_t weights[256];
+    uint16_t codes[256];
+    unsigned char *p;
+    unsigned char *streams;
+    size_t header_size;
+    size_t tree_size;
+    size_t compressed_size;
+    int max_bits = 0;
+    int max_symbol = 0;
+    int size_format;
+    int num_bits;
+    uint16_t code = 0;
+    size_t i;
+    int s;
+
+    memset(freqs, 0, sizeof(freqs));
+    for (i = 0; i < num_literals; i++) {
+        freqs[literals[i]]++;
+    }
+    huffman_build_lengths(freqs, 256, HUFFMAN_MAX_BITS, lengths);
+    for (s = 0; s < 256; s++) {
+        if (lengths[s] > 0) {
+            max_symbol = s;
+            if (lengths[s] > max_bits) {
+                max_bits = lengths[s];
+            }
+        }
+    }
+
+    /* Longer codes come first, and within a length, lower symbols. */
+    for (num_bits = max_bits; num_bits > 0; num_bits--) {
+        for (s = 0; s <= max_symbol; s++) {
+            if (lengths[s] == num_bits) {
+                codes[s] = code++;
+            }
+        }
+        code >>= 1;
+    }
+    for (s = 0; s <= max_symbol; s++) {
+        weights[s] = (uint8_t)(lengths[s] > 0 ? max_bits + 1 - lengths[s] : 0);
+    }
+
+    if (num_literals <= MAX_SINGLE_STREAM_LITERALS) {
+        size_format = 0;
+        header_size = 3;
+    } else if (num_literals <= 16383) {
+        size_format = 2;
+        header_size = 4;
+    } else {
+        size_format = 3;
+        header_size = 5;
+    }
+
+    /* The weight of the last symbol is implied. */
+    p = out + header_size;
+    tree_size = write_fse_weights(p, weights, max_symbol);
+    if (tree_size == 0) {
+        if (max_symbol > 128) {
+            return 0;
+        }
+        p[0] = (unsigned char)(127 + max_symbol);
+        for (s = 0; s < max_symbol; s += 2) {
+            p[1 + s / 2] = (unsigned char)((weights[s] << 4)
+                | (s + 1 < max_symbol ? weights[s + 1] : 0));
+        }
+        tree_size = 1 + (size_t)(max_symbol + 1) / 2;
+    }
+    p += tree_size;
+
+    streams = p;
+    if (size_format == 0) {
+        p = write_huffman_stream(p, literals, num_literals, codes, lengths);
+    } else {
+        size_t segment_size = (num_literals + 3) / 4;
+        unsigned char *jump_table = p;
+
+        p += 6;
+        for (i = 0; i < 4; i++) {
+            size_t start = segment_size * i;
+            size_t size = i < 3 ? segment_size : num_literals - start;
+            unsigned char *stream = p;
+
+            p = write_huffman_stream(p, literals + start, size, codes, lengths);
+            if (i < 3) {
+                if (p - stream > 0xFFFF) {
+                    return 0;
+                }
+                write_le(jump_table + 2 * i, (uint64_t)(p - stream), 2);
+            }
+        }
+    }
+
+    compressed_size = tree_size + (size_t)(p - streams);
+    if (header_size + compressed_size >= num_literals
+        || (size_format == 0 && compressed_size > 1023)
+        || (size_format == 2 && compressed_size > 16383)) {
+        return 0;
+    }
+
+    switch (size_format) {
+        case 0:
+            write_le(out,
+                     LITERALS_COMPRESSED
+                        | ((uint64_t)num_literals << 4)
+                        | ((uint64_t)compressed_size << 14),
+                     3);
+            break;
+        case 2:
+            write_le(out,
+                     LITERALS_COMPRESSED
+                        | (2 << 2)
+                        | ((uint64_t)num_literals << 4)
+                        | ((uint64_t)compressed_size << 18),
+                     4);
+            break;
+        default:
+            write_le(out,
+                     LITERALS_COMPRESSED
+                        | (3 << 2)
+                        | ((uint64_t)num_literals << 4)
+                        | ((uint64_t)compressed_size << 22),
+                     5);
+            break;
+    }
+    return header_size + compressed_size;
+}
+
+static size_t write_literals(unsigned char *out,
+                             const unsigned char *literals,
+                             size_t num_literals) {
+    size_t header_size;
+    size_t i;
+    int type = LITERALS_RLE;
+
+    for (i = 1; i < num_literals; i++) {
+        if (literals[i] != literals[0]) {
+            type = LITERALS_RAW;
+            break;
+        }
+    }
+    if (num_literals == 0) {
+        type = LITERALS_RAW;
+    }
+    if (type == LITERALS_RAW && num_literals > 32) {
+        size_t size = write_compressed_literals(out, literals, num_literals);
+        if (size > 0) {
+            return size;
+        }
+    }
+
+    if (num_literals < 32) {
+        out[0] = (unsigned char)(type | (num_literals << 3));
+        header_size = 1;
+    } else if (num_literals < 4096) {
+        write_le(out, type | (1 << 2) | (num_literals << 4), 2);
+        header_size = 2;
+    } else {
+        write_le(out, type | (3 << 2) | (num_literals << 4), 3);
+        header_size = 3;
+    }
+    if (type == LITERALS_RLE) {
+        out[header_size] = literals[0];
+        return header_size + 1;
+    }
+    memcpy(out + header_size, literals, num_literals);
+    return header_size + num_literals;
+}
+
+/* Chooses how to code one kind of sequence codes and writes its table.
+ * Codes that are all the same are stored once, and few sequences aren't
+ * worth a table of their own.
+ */
+static unsigned char *write_sequence_table(unsigned char *out,
+                                           struct fse_table *table,
+                                           const uint8_t *codes,
+                                           uint32_t num_sequences,
+                                           const int16_t *default_norm,
+                                           int default_max_symbol,
+                                           int default_table_log,
+                                           int max_table_log,
+                                           int *mode) {
+    uint32_t counts[FSE_MAX_SYMBOLS];
+    int16_t norm[FSE_MAX_SYMBOLS];
+    int max_symbol = 0;
+    int num_present = 0;
+    int table_log;
+    uint32_t i;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < num_sequences; i++) {
+        counts[codes[i]]++;
+        if (codes[i] > max_symbol) {
+            max_symbol = codes[i];
+        }
+    }
+    for (i = 0; i <= (uint32_t)max_symbol; i++) {
+        num_present += counts[i] > 0;
+    }
+
+    if (num_present == 1) {
+        *mode = MODE_RLE;
+        *out = (unsigned char)max_symbol;
+        return out + 1;
+    }
+    if (num_sequences < MIN_SEQUENCES_FOR_FSE
+        && max_symbol <= default_max_symbol) {
+        *mode = MODE_PREDEFINED;
+        fse_build_table(table, default_norm, default_max_symbol,
+                        default_table_log);
+        return out;
+    }
+
+    *mode = MODE_FSE;
+    table_log = fse_table_log(num_sequences, max_symbol, max_table_log);
+    fse_normalize(counts, max_symbol, num_sequences, table_log, norm);
+    fse_build_table(table, norm, max_symbol, table_log);
+    return fse_write_table(out, norm, max_symbol, table_log);
+}
+
+static unsigned char *write_sequences(unsigned char *out,
+                                      struct zstd_state *state,
+                                      uint32_t num_sequences) {
+    const struct zstd_sequence *sequences = state->sequences;
+    struct fse_table ll_table;
+    struct fse_table ml_table;
+    struct fse_table of_table;
+    uint8_t *ll_symbols = state->codes[0];
+    uint8_t *ml_symbols = state->codes[1];
+    uint8_t *of_symbols = state->codes[2];
+    struct bit_writer writer;
+    uint32_t ll_state;
+    uint32_t ml_state;
+    uint32_t of_state;
+    unsigned char *modes;
+    int ll_mode;
+    int ml_mode;
+    int of_mode;
+    uint32_t i;
+
+    if (num_sequences < 128) {
+        *out++ = (unsigned char)num_sequences;
+    } else if (num_sequences < 0x7F00) {
+        *out++ = (unsigned char)((num_sequences >> 8) + 0x80);
+        *out++ = (unsigned char)num_sequences;
+    } else {
+        *out++ = 0xFF;
+        write_le(out, num_sequences - 0x7F00, 2);
+        out += 2;
+    }
+    if (num_sequences == 0) {
+        return out;
+    }
+
+    for (i = 0; i < num_sequences; i++) {
+        ll_symbols[i] = (uint8_t)literal_length_code(
+            sequences[i].literal_length);
+        ml_symbols[i] = (uint8_t)match_length_code(
+            sequences[i].match_length);
+        of_symbols[i] = (uint8_t)highest_bit(sequences[i].offset_base);
+    }
+
+    modes = out++;
+    out = write_sequence_table(out, &ll_table, ll_symbols, num_sequences,
+                               ll_default_norm, LL_MAX_SYMBOL,
+                               LL_DEFAULT_TABLE_LOG, LL_MAX_TABLE_LOG,
+                               &ll_mode);
+    out = write_sequence_table(out, &of_table, of_symbols, num_sequences,
+                               of_default_norm, OF_DEFAULT_MAX_SYMBOL,
+                               OF_DEFAULT_TABLE_LOG, OF_MAX_TABLE_LOG,
+                               &of_mode);
+    out = write_sequence_table(out, &ml_table, ml_symbols, num_sequences,
+                               ml_default_norm, ML_MAX_SYMBOL,
+                               ML_DEFAULT_TABLE_LOG, ML_MAX_TABLE_LOG,
+                               &ml_mode);
+    *modes = (unsigned char)((ll_mode << 6) | (of_mode << 4) | (ml_mode << 2));
+
+    /* Sequences are coded last to first so that they decode in order.
+     * States of tables in RLE mode carry no bits.
+     */
+    writer.p = out;
+    writer.bits = 0;
+    writer.num_bits = 0;
+    i = num_sequences - 1;
+    ll_state = ll_mode == MODE_RLE ? 0 : fse_init_state(&ll_table,
+                                                        ll_symbols[i]);
+    ml_state = ml_mode == MODE_RLE ? 0 : fse_init_state(&ml_table,
+                                                        ml_symbols[i]);
+    of_state = of_mode == MODE_RLE ? 0 : fse_init_state(&of_table,
+                                                        of_symbols[i]);
+    for (;;) {
+        const struct zstd_sequence *sequence = &sequences[i];
+
+        put_bits(&writer,
+                 sequence->literal_length - ll_base[ll_symbols[i]],
+                 ll_bits[ll_symbols[i]]);
+        put_bits(&writer,
+                 sequence->match_length - ml_base[ml_symbols[i]],
+                 ml_bits[ml_symbols[i]]);
+        put_bits(&writer,
+                 sequence->offset_base - (1U << of_symbols[i]),
+                 of_symbols[i]);
+        if (i == 0) {
+            break;
+        }
+        i--;
+        if (of_mode != MODE_RLE) {
+            fse_encode(&writer, &of_table, &of_state, of_symbols[i]);
+        }
+        if (ml_mode != MODE_RLE) {
+            fse_encode(&writer, &ml_table, &ml_state, ml_symbols[i]);
+        }
+        if (ll_mode != MODE_RLE) {
+            fse_encode(&writer, &ll_table, &ll_state, ll_symbols[i]);
+        }
+    }
+    if (ml_mode != MODE_RLE) {
+        fse_flush_state(&writer, &ml_table, ml_state);
+    }
+    if (of_mode != MODE_RLE) {
+        fse_flush_state(&writer, &of_table, of_state);
+    }
+    if (ll_mode != MODE_RLE) {
+        fse_flush_state(&writer, &ll_table, ll_state);
+    }
+    return close_stream(&writer);
+}
+
+static uint32_t hash4(const unsigned char *p) {
+    return (read32(p) * 2654435761U) >> (32 - ZSTD_HASH_BITS);
+}
+
+static void insert_position(struct zstd_state *state,
+                            const unsigned char *data,
+                            int32_t position) {
+    uint32_t hash = hash4(data + position);
+
+    state->prev[position & (ZSTD_WINDOW_SIZE - 1)] = state->head[hash];
+    state->head[hash] = position;
+}
+
+static uint32_t match_length(const unsigned char *p,
+                             const unsigned char *match,
+                             const unsigned char *end) {
+    const unsigned char *start = p;
+
+    while (p + 4 <= end && read32(p) == read32(match)) {
+        p += 4;
+        match += 4;
+    }
+    while (p < end && *p == *match) {
+        p++;
+        match++;
+    }
+    return (uint32_t)(p - start);
+}
+
+/* Walks the hash chain of position, which has already been inserted, and
+ * returns the length of the longest match that ends before end.
+ */
+static uint32_t find_match(const struct zstd_state *state,
+                           int level,
+                           const unsigned char *data,
+                           int32_t position,
+                           int32_t end,
+                           uint32_t *offset) {
+    int32_t candidate = state->prev[position & (ZSTD_WINDOW_SIZE - 1)];
+    int chain = levels[level].max_chain;
+    uint32_t best_length = 0;
+
+    while (candidate >= 0
+           && position - candidate < ZSTD_WINDOW_SIZE
+           && chain-- > 0) {
+        if (data[candidate + best_length] == data[position + best_length]) {
+            uint32_t length = match_length(data + position,
+                                           data + candidate,
+                                           data + end);
+            if (length > best_length) {
+                best_length = length;
+                *offset = (uint32_t)(position - candidate);
+                if (length >= levels[level].nice_length
+                    || position + (int32_t)length >= end) {
+                    break;
+                }
+            }
+        }
+        candidate = state->prev[candidate & (ZSTD_WINDOW_SIZE - 1)];
+    }
+    return best_length >= MIN_MATCH ? best_length : 0;
+}
+
+/* Splits the block into sequences and writes the literals and sequences
+ * sections to state->block. Returns the size of the block contents.
+ */
+static size_t compress_block(struct zstd_state *state,
+                             int level,
+                             const unsigned char *data,
+                             int32_t start,
+                             int32_t end,
+                             uint32_t *repeat_offsets) {
+    unsigned char *literals = state->literals;
+    size_t num_literals = 0;
+    uint32_t num_sequences = 0;
+    int32_t hash_end = end - MIN_MATCH;
+    int32_t anchor = start;
+    int32_t position = start;
+    int32_t next_insert = start;
+    unsigned char *p;
+
+    while (position < hash_end) {
+        uint32_t offset = 0;
+        uint32_t length;
+        struct zstd_sequence *sequence;
+
+        if (next_insert <= position) {
+            insert_position(state, data, position);
+            next_insert = position + 1;
+        }
+        length = find_match(state, level, data, position, end, &offset);
+
+        /* Repeating the last offset is cheaper than coding a new one. */
+        if (position > anchor
+            && (uint32_t)position >= repeat_offsets[0]) {
+            uint32_t repeat_length = match_length(
+                data + position,
+                data + position - repeat_offsets[0],
+                data + end);
+            if (repeat_length >= MIN_MATCH
+                && repeat_length + MIN_REPEAT_OFFSET_GAIN >= length) {
+                length = repeat_length;
+                offset = repeat_offsets[0];
+            }
+        }
+        if (length == 0) {
+            position++;
+            continue;
+        }
+
+        /* See if starting one byte later gives a longer match. */
+        if (levels[level].lazy
+            && length < levels[level].nice_length
+            && position + 1 < hash_end) {
+            uint32_t next_offset = 0;
+            uint32_t next_length;
+
+            insert_position(state, data, position + 1);
+            next_insert = position + 2;
+            next_length = find_match(state, level, data, position + 1, end,
+                                     &next_offset);
+            if (next_length > length + 1) {
+                position++;
+                length = next_length;
+                offset = next_offset;
+            }
+        }
+
+        sequence = &state->sequences[num_sequences++];
+        sequence->literal_length = (uint32_t)(position - anchor);
+        sequence->match_length = length;
+        if (position > anchor && offset == repeat_offsets[0]) {
+            sequence->offset_base = 1;
+        } else {
+            sequence->offset_base = offset + 3;
+            repeat_offsets[2] = repeat_offsets[1];
+            repeat_offsets[1] = repeat_offsets[0];
+            repeat_offsets[0] = offset;
+        }
+        memcpy(literals + num_literals, data + anchor,
+               (size_t)(position - anchor));
+        num_literals += (size_t)(position - anchor);
+
+        anchor = position + (int32_t)length;
+        while (next_insert < anchor && next_insert < hash_end) {
+            insert_position(state, data, next_insert++);
+        }
+        position = anchor;
+    }
+
+    memcpy(literals + num_literals, data + anchor, (size_t)(end - anchor));
+    num_literals += (size_t)(end - anchor);
+
+    p = state->block;
+    p += write_literals(p, literals, num_literals);
+    p = write_sequences(p, state, num_sequences);
+    return (size_t)(p - state->block);
+}
+
+size_t zstd_compress_bound(size_t size) {
+    return size + (size / ZSTD_BLOCK_SIZE + 1) * 3 + 16;
+}
+
+size_t zstd_compress_frame(struct zstd_state *state,
+                           int level,
+                           const void *data,
+                           size_t size,
+                           void *frame) {
+    const unsigned char *in = data;
+    unsigned char *out = frame;
+    uint32_t repeat_offsets[3] = {1, 4, 8};
+    size_t position;
+
+    if (!tables_ready) {
+        init_tables();
+    }
+    if (level < 1) {
+        level = 1;
+    } else if (level > ZSTD_MAX_LEVEL) {
+        level = ZSTD_MAX_LEVEL;
+    }
+
+    /* The whole frame is one segment, so its size is the window size. */
+    write_le(out, ZSTD_MAGIC, 4);
+    out += 4;
+    if (size < 256) {
+        *out++ = SINGLE_SEGMENT;
+        *out++ = (unsigned char)size;
+    } else if (size < 65536 + 256) {
+        *out++ = (1 << 6) | SINGLE_SEGMENT;
+        write_le(out, size - 256, 2);
+        out += 2;
+    } else if (size <= 0xFFFFFFFFU) {
+        *out++ = (2 << 6) | SINGLE_SEGMENT;
+        write_le(out, size, 4);
+        out += 4;
+    } else {
+        *out++ = (3 << 6) | SINGLE_SEGMENT;
+        write_le(out, size, 8);
+        out += 8;
+    }
+
+    if (size == 0) {
+        write_le(out, 1 | (BLOCK_RAW << 1), 3);
+        return (size_t)(out + 3 - (unsigned char *)frame);
+    }
+
+    memset(state->head, 0xFF, sizeof(state->head));
+
+    for (position = 0; position < size; position += ZSTD_BLOCK_SIZE) {
+        size_t block_size = size - position < ZSTD_BLOCK_SIZE
+            ? size - position
+            : ZSTD_BLOCK_SIZE;
+        uint32_t last = position + block_size == size;
+        uint32_t saved_offsets[3];
+        size_t compressed_size = 0;
+        size_t i;
+
+        for (i = 1; i < block_size; i++) {
+            if (in[position + i] != in[position]) {
+                break;
+            }
+        }
+        if (i == block_size && block_size > 1) {
+            write_le(out, last | (BLOCK_RLE << 1) | (block_size << 3), 3);
+            out[3] = in[position];
+            out += 4;
+            continue;
+        }
+
+        memcpy(saved_offsets, repeat_offsets, sizeof(saved_offsets));
+        if (block_size > MIN_MATCH) {
+            compressed_size = compress_block(state,
+                                             level,
+                                             in,
+                                             (int32_t)position,
+                                             (int32_t)(position + block_size),
+                                             repeat_offsets);
+        }
+        if (compressed_size > 0 && compressed_size < block_size) {
+            write_le(out,
+                     last | (BLOCK_COMPRESSED << 1) | (compressed_size << 3),
+                     3);
+            memcpy(out + 3, state->block, compressed_size);
+            out += 3 + compressed_size;
+        } else {
+            /* A raw block doesn't touch the repeat offsets. */
+            memcpy(repeat_offsets, saved_offsets, sizeof(saved_offsets));
+            write_le(out, last | (BLOCK_RAW << 1) | (block_size << 3), 3);
+            memcpy(out + 3, in + position, block_size);
+            out += 3 + block_size;
+        }
+    }
+
+    return (size_t)(out - (unsigned char *)frame);
+}
+
+#define SKIPPABLE_MAGIC 0x184D2A50U
+#define SKIPPABLE_MAGIC_MASK 0xFFFFFFF0U
+#define MAX_FRAME_HEADER_SIZE 18
+#define HUFFMAN_WEIGHTS_MAX_TABLE_LOG 6
+#define MAX_SKIP_CHUNK (64 << 10)
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t read_le(const unsigned char *p, int size) {
+    uint64_t value = 0;
+    int i;
+
+    for (i = size - 1; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static size_t fill(struct in_stream *in, size_t size) {
+    size_t available = (size_t)(in->end - in->p);
+
+    if (available >= size || in->fill == NULL) {
+        return available;
+    }
+    return in->fill(in, size);
+}
+
+/* XXH64 with a seed of 0, for the content checksum of a frame. */
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t value) {
+    acc ^= xxh64_round(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void hash_init(struct zstd_decoder *decoder) {
+    decoder->hash[0] = PRIME64_1 + PRIME64_2;
+    decoder->hash[1] = PRIME64_2;
+    decoder->hash[2] = 0;
+    decoder->hash[3] = 0 - PRIME64_1;
+    decoder->hash_buffered = 0;
+}
+
+static void hash_stripe(uint64_t *hash, const unsigned char *p) {
+    hash[0] = xxh64_round(hash[0], read64(p));
+    hash[1] = xxh64_round(hash[1], read64(p + 8));
+    hash[2] = xxh64_round(hash[2], read64(p + 16));
+    hash[3] = xxh64_round(hash[3], read64(p + 24));
+}
+
+static void hash_update(struct zstd_decoder *decoder,
+                        const unsigned char *p,
+                        size_t size) {
+    if (decoder->hash_buffered > 0) {
+        size_t n = 32 - decoder->hash_buffered;
+
+        if (n > size) {
+            n = size;
+        }
+        memcpy(decoder->hash_buffer + decoder->hash_buffered, p, n);
+        decoder->hash_buffered += n;
+        p += n;
+        size -= n;
+        if (decoder->hash_buffered < 32) {
+            return;
+        }
+        hash_stripe(decoder->hash, decoder->hash_buffer);
+        decoder->hash_buffered = 0;
+    }
+    while (size >= 32) {
+        hash_stripe(decoder->hash, p);
+        p += 32;
+        size -= 32;
+    }
+    memcpy(decoder->hash_buffer, p, size);
+    decoder->hash_buffered = size;
+}
+
+static uint64_t hash_digest(const struct zstd_decoder *decoder) {
+    const uint64_t *v = decoder->hash;
+    const unsigned char *p = decoder->hash_buffer;
+    size_t size = decoder->hash_buffered;
+    uint64_t hash;
+
+    if (decoder->frame_size >= 32) {
+        hash = rotl64(v[0], 1) + rotl64(v[1], 7)
+            + rotl64(v[2], 12) + rotl64(v[3], 18);
+        hash = xxh64_merge(hash, v[0]);
+        hash = xxh64_merge(hash, v[1]);
+        hash = xxh64_merge(hash, v[2]);
+        hash = xxh64_merge(hash, v[3]);
+    } else {
+        hash = PRIME64_5;
+    }
+    hash += decoder->frame_size;
+
+    while (size >= 8) {
+        hash ^= xxh64_round(0, read64(p));
+        hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+        size -= 8;
+    }
+    if (size >= 4) {
+        hash ^= (uint64_t)read32(p) * PRIME64_1;
+        hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        size -= 4;
+    }
+    while (size > 0) {
+        hash ^= *p * PRIME64_5;
+        hash = rotl64(hash, 11) * PRIME64_1;
+        p++;
+        size--;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/* Reads a bitstream from the end, the way it was written. bits holds the
+ * 8 bytes at p, and consumed counts the bits already read from the top.
+ */
+struct bit_reader {
+    const unsigned char *start;
+    const unsigned char *p;
+    uint64_t bits;
+    unsigned int consumed;
+};
+
+static int bits_init(struct bit_reader *reader,
+                     const unsigned char *data,
+                     size_t size) {
+    unsigned char last;
+
+    if (size == 0 || data[size - 1] == 0) {
+        return 0;
+    }
+    last = data[size - 1];
+    reader->start = data;
+    reader->consumed = 8 - highest_bit(last);
+    if (size >= 8) {
+        reader->p = data + size - 8;
+        reader->bits = read64(reader->p);
+    } else {
+        reader->p = data;
+        reader->bits = read_le(data, (int)size);
+        reader->consumed += (unsigned int)(8 - size) * 8;
+    }
+    return 1;
+}
+
+static uint64_t bits_peek(const struct bit_reader *reader, int count) {
+    return ((reader->bits << (reader->consumed & 63)) >> 1)
+        >> ((63 - count) & 63);
+}
+
+static uint64_t bits_read(struct bit_reader *reader, int count) {
+    uint64_t value = bits_peek(reader, count);
+
+    reader->consumed += count;
+    return value;
+}
+
+/* Moves back so that at least 56 bits can be read, unless the start of
+ * the stream is near. Returns 1 if more bits were read than there are.
+ */
+static int bits_reload(struct bit_reader *reader) {
+    size_t num_bytes;
+
+    if (reader->consumed > 64) {
+        return 1;
+    }
+    if (reader->p >= reader->start + 8) {
+        reader->p -= reader->consumed >> 3;
+        reader->consumed &= 7;
+        reader->bits = read64(reader->p);
+        return 0;
+    }
+    if (reader->p == reader->start) {
+        return 0;
+    }
+    num_bytes = reader->consumed >> 3;
+    if (num_bytes > (size_t)(reader->p - reader->start)) {
+        num_bytes = (size_t)(reader->p - reader->start);
+    }
+    reader->p -= num_bytes;
+    reader->consumed -= (unsigned int)num_bytes * 8;
+    reader->bits = read64(reader->p);
+    return 0;
+}
+
+static int bits_finished(const struct bit_reader *reader) {
+    return reader->p == reader->start && reader->consumed == 64;
+}
+
+/* Reads the normalized counts of an FSE table. Returns the size of the
+ * description, or 0 if it's invalid.
+ */
+static size_t read_fse_counts(int16_t *norm,
+                              int *max_symbol,
+                              int *table_log,
+                              int max_table_log,
+                              const unsigned char *data,
+                              size_t size) {
+    const unsigned char *p = data;
+    const unsigned char *end = data + size;
+    unsigned char padded[8];
+    int remaining;
+    int threshold;
+    int num_bits;
+    int bit_count;
+    int symbol = 0;
+    int previous_zero = 0;
+    uint32_t bits;
+
+    /* The reader below loads 4 bytes at a time. */
+    if (size < 8) {
+        size_t used;
+
+        memset(padded, 0, sizeof(padded));
+        memcpy(padded, data, size);
+        used = read_fse_counts(norm, max_symbol, table_log, max_table_log,
+                               padded, sizeof(padded));
+        return used <= size ? used : 0;
+    }
+
+    bits = read32(p);
+    num_bits = (bits & 0xF) + FSE_MIN_TABLE_LOG;
+    if (num_bits > max_table_log) {
+        return 0;
+    }
+    bits >>= 4;
+    bit_count = 4;
+    *table_log = num_bits;
+    remaining = (1 << num_bits) + 1;
+    threshold = 1 << num_bits;
+    num_bits++;
+
+    while (remaining > 1 && symbol <= *max_symbol) {
+        int max;
+        int count;
+
+        if (previous_zero) {
+            int n = symbol;
+
+            while ((bits & 0xFFFF) == 0xFFFF) {
+                n += 24;
+                if (p < end - 5) {
+                    p += 2;
+                    bits = read32(p) >> bit_count;
+                } else {
+                    bits >>= 16;
+                    bit_count += 16;
+                }
+            }
+            while ((bits & 3) == 3) {
+                n += 3;
+                bits >>= 2;
+                bit_count += 2;
+            }
+            n += bits & 3;
+            bit_count += 2;
+            if (n > *max_symbol) {
+                return 0;
+            }
+            while (symbol < n) {
+                norm[symbol++] = 0;
+            }
+            if (p <= end - 7 || p + (bit_count >> 3) <= end - 4) {
+                p += bit_count >> 3;
+                bit_count &= 7;
+                bits = read32(p) >> bit_count;
+            } else {
+                bits >>= 2;
+            }
+        }
+
+        max = (2 * threshold - 1) - remaining;
+        if ((int)(bits & (threshold - 1)) < max) {
+            count = bits & (threshold - 1);
+            bit_count += num_bits - 1;
+        } else {
+            count = bits & (2 * threshold - 1);
+            if (count >= threshold) {
+                count -= max;
+            }
+            bit_count += num_bits;
+        }
+        count--;
+        remaining -= count < 0 ? -count : count;
+        norm[symbol++] = (int16_t)count;
+        previous_zero = count == 0;
+        while (remaining < threshold) {
+            num_bits--;
+            threshold >>= 1;
+        }
+        if (p <= end - 7 || p + (bit_count >> 3) <= end - 4) {
+            p += bit_count >> 3;
+            bit_count &= 7;
+        } else {
+            bit_count -= (int)(8 * (end - 4 - p));
+            p = end - 4;
+        }
+        bits = read32(p) >> (bit_count & 31);
+    }
+
+    if (remaining != 1 || bit_count > 32) {
+        return 0;
+    }
+    *max_symbol = symbol - 1;
+    p += (bit_count + 7) >> 3;
+    return (size_t)(p - data);
+}
+
+static int build_fse_decode_table(struct zstd_fse_entry *table,
+                                  const int16_t *norm,
+                                  int max_symbol,
+                                  int table_log) {
+    uint16_t next[FSE_MAX_SYMBOLS];
+    int table_size = 1 << table_log;
+    int high_threshold = table_size - 1;
+    int step = (table_size >> 1) + (table_size >> 3) + 3;
+    int position = 0;
+    int s;
+    int u;
+
+    for (s = 0; s <= max_symbol; s++) {
+        if (norm[s] == -1) {
+            table[high_threshold--].symbol = (uint8_t)s;
+            next[s] = 1;
+        } else {
+            next[s] = (uint16_t)norm[s];
+        }
+    }
+    for (s = 0; s <= max_symbol; s++) {
+        int i;
+
+        for (i = 0; i < norm[s]; i++) {
+            table[position].symbol = (uint8_t)s;
+            do {
+                position = (position + step) & (table_size - 1);
+            } while (position > high_threshold);
+        }
+    }
+    if (position != 0) {
+        return 0;
+    }
+
+    for (u = 0; u < table_size; u++) {
+        int x = next[table[u].symbol]++;
+        int num_bits = table_log - highest_bit((uint32_t)x);
+
+        table[u].num_bits = (uint8_t)num_bits;
+        table[u].new_state = (uint16_t)((x << num_bits) - table_size);
+    }
+    return 1;
+}
+
+/* Decodes Huffman weights compressed with two interleaved FSE states.
+ * Returns the number of weights, or 0 if they are invalid.
+ */
+static int read_fse_weights(const unsigned char *data,
+                            size_t size,
+                            uint8_t *weights) {
+    struct zstd_fse_entry table[1 << HUFFMAN_WEIGHTS_MAX_TABLE_LOG];
+    struct bit_reader reader;
+    int16_t norm[HUFFMAN_MAX_BITS + 1];
+    int max_symbol = HUFFMAN_MAX_BITS;
+    int table_log;
+    uint32_t states[2];
+    int num_weights = 0;
+    int n = 0;
+    size_t header_size;
+
+    header_size = read_fse_counts(norm, &max_symbol, &table_log,
+                                  HUFFMAN_WEIGHTS_MAX_TABLE_LOG, data, size);
+    if (header_size == 0
+        || !build_fse_decode_table(table, norm, max_symbol, table_log)
+        || !bits_init(&reader, data + header_size, size - header_size)) {
+        return 0;
+    }
+    states[0] = (uint32_t)bits_read(&reader, table_log);
+    states[1] = (uint32_t)bits_read(&reader, table_log);
+    bits_reload(&reader);
+
+    /* The stream ends when reading goes past its start, and the other
+     * state still holds one more weight.
+     */
+    for (;;) {
+        const struct zstd_fse_entry *entry = &table[states[n]];
+
+        if (num_weights >= 255) {
+            return 0;
+        }
+        weights[num_weights++] = entry->symbol;
+        states[n] = entry->new_state
+            + (uint32_t)bits_read(&reader, entry->num_bits);
+        n ^= 1;
+        if (bits_reload(&reader)) {
+            if (num_weights >= 255) {
+                return 0;
+            }
+            weights[num_weights++] = table[states[n]].symbol;
+            break;
+        }
+    }
+    return num_weights;
+}
+
+/* Reads the Huffman tree description of the literals. Returns its size,
+ * or 0 if it's invalid.
+ */
+static size_t read_huffman_table(struct zstd_decoder *decoder,
+                                 const unsigned char *data,
+                                 size_t size) {
+    uint8_t weights[256];
+    int num_weights;
+    size_t used;
+    uint32_t total = 0;
+    uint32_t rest;
+    int max_bits;
+    int position = 0;
+    int weight;
+    int s;
+
+    if (size == 0) {
+        return 0;
+    }
+    if (data[0] >= 128) {
+        num_weights = data[0] - 127;
+        used = 1 + (size_t)(num_weights + 1) / 2;
+        if (used > size) {
+            return 0;
+        }
+        for (s = 0; s < num_weights; s++) {
+            weights[s] = (uint8_t)(s & 1 ? data[1 + s / 2] & 0xF
+                                         : data[1 + s / 2] >> 4);
+        }
+    } else {
+        used = 1 + (size_t)data[0];
+        if (used > size) {
+            return 0;
+        }
+        num_weights = read_fse_weights(data + 1, data[0], weights);
+        if (num_weights == 0) {
+            return 0;
+        }
+    }
+
+    for (s = 0; s < num_weights; s++) {
+        if (weights[s] > HUFFMAN_MAX_BITS) {
+            return 0;
+        }
+        if (weights[s] > 0) {
+            total += 1U << (weights[s] - 1);
+        }
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    /* The weight of the last symbol makes the total a power of 2. */
+    max_bits = highest_bit(total) + 1;
+    if (max_bits > HUFFMAN_MAX_BITS) {
+        return 0;
+    }
+    rest = (1U << max_bits) - total;
+    if ((rest & (rest - 1)) != 0) {
+        return 0;
+    }
+    weights[num_weights++] = (uint8_t)(highest_bit(rest) + 1);
+
+    for (weight = 1; weight <= max_bits; weight++) {
+        for (s = 0; s < num_weights; s++) {
+            if (weights[s] == weight) {
+                int n = 1 << (weight - 1);
+                uint16_t entry = (uint16_t)((s << 8) | (max_bits + 1 - weight));
+
+                while (n-- > 0) {
+                    decoder->huffman_table[position++] = entry;
+                }
+            }
+        }
+    }
+    decoder->huffman_bits = max_bits;
+    return used;
+}
+
+static int decode_huffman_stream(const struct zstd_decoder *decoder,
+                                 const unsigned char *data,
+                                 size_t size,
+                                 unsigned char *out,
+                                 size_t count) {
+    const uint16_t *table = decoder->huffman_table;
+    int num_bits = decoder->huffman_bits;
+    struct bit_reader reader;
+    size_t i;
+
+    if (!bits_init(&reader, data, size)) {
+        return 0;
+    }
+    for (i = 0; i + 4 <= count; i += 4) {
+        uint16_t entry;
+
+        entry = table[bits_peek(&reader, num_bits)];
+        out[i] = (unsigned char)(entry >> 8);
+        reader.consumed += entry & 0xFF;
+        entry = table[bits_peek(&reader, num_bits)];
+        out[i + 1] = (unsigned char)(entry >> 8);
+        reader.consumed += entry & 0xFF;
+        entry = table[bits_peek(&reader, num_bits)];
+        out[i + 2] = (unsigned char)(entry >> 8);
+        reader.consumed += entry & 0xFF;
+        entry = table[bits_peek(&reader, num_bits)];
+        out[i + 3] = (unsigned char)(entry >> 8);
+        reader.consumed += entry & 0xFF;
+        if (bits_reload(&reader)) {
+            return 0;
+        }
+    }
+    for (; i < count; i++) {
+        uint16_t entry = table[bits_peek(&reader, num_bits)];
+
+        out[i] = (unsigned char)(entry >> 8);
+        reader.consumed += entry & 0xFF;
+    }
+    return bits_finished(&reader);
+}
+
+/* Decodes the literals section of a block. Raw literals are used where
+ * they are. Returns the size of the section, or 0 if it's invalid.
+ */
+static size_t read_literals(struct zstd_decoder *decoder,
+                            const unsigned char *data,
+                            size_t size,
+                            const unsigned char **literals,
+                            size_t *num_literals) {
+    int type = data[0] & 3;
+    int size_format = (data[0] >> 2) & 3;
+    size_t header_size;
+    size_t regenerated_size;
+    size_t compressed_size;
+    size_t tree_size = 0;
+    int num_streams;
+
+    if (type == LITERALS_RAW || type == LITERALS_RLE) {
+        switch (size_format) {
+            case 1:
+                header_size = 2;
+                break;
+            case 3:
+                header_size = 3;
+                break;
+            default:
+                header_size = 1;
+                break;
+        }
+        if (header_size > size) {
+            return 0;
+        }
+        regenerated_size = header_size == 1
+            ? (size_t)(data[0] >> 3)
+            : (size_t)(read_le(data, (int)header_size) >> 4);
+        if (regenerated_size > ZSTD_BLOCK_SIZE) {
+            return 0;
+        }
+        *num_literals = regenerated_size;
+        if (type == LITERALS_RAW) {
+            if (header_size + regenerated_size > size) {
+                return 0;
+            }
+            *literals = data + header_size;
+            return header_size + regenerated_size;
+        }
+        if (header_size + 1 > size) {
+            return 0;
+        }
+        memset(decoder->literals, data[header_size], regenerated_size);
+        *literals = decoder->literals;
+        return header_size + 1;
+    }
+
+    switch (size_format) {
+        case 0:
+        case 1:
+            header_size = 3;
+            break;
+        case 2:
+            header_size = 4;
+            break;
+        default:
+            header_size = 5;
+            break;
+    }
+    if (header_size > size) {
+        return 0;
+    }
+    num_streams = size_format == 0 ? 1 : 4;
+    {
+        uint64_t header = read_le(data, (int)header_size) >> 4;
+        int field_bits = (int)(header_size * 8 - 4) / 2;
+
+        regenerated_size = (size_t)(header & ((1U << field_bits) - 1));
+        compressed_size = (size_t)(header >> field_bits);
+    }
+    if (regenerated_size > ZSTD_BLOCK_SIZE
+        || header_size + compressed_size > size) {
+        return 0;
+    }
+    data += header_size;
+
+    if (type == LITERALS_COMPRESSED) {
+        tree_size = read_huffman_table(decoder, data, compressed_size);
+        if (tree_size == 0) {
+            return 0;
+        }
+    } else if (decoder->huffman_bits == 0) {
+        return 0;
+    }
+
+    if (num_streams == 1) {
+        if (!decode_huffman_stream(decoder,
+                                   data + tree_size,
+                                   compressed_size - tree_size,
+                                   decoder->literals,
+                                   regenerated_size)) {
+            return 0;
+        }
+    } else {
+        const unsigned char *streams = data + tree_size;
+        size_t streams_size = compressed_size - tree_size;
+        size_t segment_size = (regenerated_size + 3) / 4;
+        size_t offset = 6;
+        int i;
+
+        if (streams_size < 6 || regenerated_size < 4) {
+            return 0;
+        }
+        for (i = 0; i < 4; i++) {
+            size_t stream_size = i < 3
+                ? (size_t)read_le(streams + 2 * i, 2)
+                : streams_size - offset;
+            size_t start = segment_size * i;
+            size_t count = i < 3 ? segment_size
+                                 : regenerated_size - start;
+
+            if (offset + stream_size > streams_size
+                || !decode_huffman_stream(decoder,
+                                          streams + offset,
+                                          stream_size,
+                                          decoder->literals + start,
+                                          count)) {
+                return 0;
+            }
+            offset += stream_size;
+        }
+    }
+
+    *literals = decoder->literals;
+    *num_literals = regenerated_size;
+    return header_size + compressed_size;
+}
+
+/* Sets up the decoding table of one kind of sequence codes. Returns the
+ * size of its description, or -1 if it's invalid.
+ */
+static int read_sequence_table(struct zstd_fse_entry *table,
+                               int *table_log,
+                               int mode,
+                               const int16_t *default_norm,
+                               int default_max_symbol,
+                               int default_table_log,
+                               int max_symbol,
+                               int max_table_log,
+                               const unsigned char *data,
+                               size_t size) {
+    int16_t norm[FSE_MAX_SYMBOLS];
+    size_t used;
+
+    switch (mode) {
+        case MODE_PREDEFINED:
+            build_fse_decode_table(table, default_norm, default_max_symbol,
+                                   default_table_log);
+            *table_log = default_table_log;
+            return 0;
+        case MODE_RLE:
+            if (size < 1 || data[0] > max_symbol) {
+                return -1;
+            }
+            table[0].symbol = data[0];
+            table[0].num_bits = 0;
+            table[0].new_state = 0;
+            *table_log = 0;
+            return 1;
+        case MODE_FSE:
+            used = read_fse_counts(norm, &max_symbol, table_log,
+                                   max_table_log, data, size);
+            if (used == 0
+                || !build_fse_decode_table(table, norm, max_symbol,
+                                           *table_log)) {
+                return -1;
+            }
+            return (int)used;
+        default:
+            return *table_log < 0 ? -1 : 0;
+    }
+}
+
+static void copy_match(unsigned char *out, size_t offset, size_t length) {
+    const unsigned char *match = out - offset;
+
+    if (offset >= length) {
+        memcpy(out, match, length);
+    } else if (offset >= 8) {
+        while (length >= 8) {
+            memcpy(out, match, 8);
+            out += 8;
+            match += 8;
+            length -= 8;
+        }
+        while (length-- > 0) {
+            *out++ = *match++;
+        }
+    } else {
+        while (length-- > 0) {
+            *out++ = *match++;
+        }
+    }
+}
+
+static enum decode_status decode_block(struct zstd_decoder *decoder,
+                                       const unsigned char *data,
+                                       size_t size,
+                                       struct out_window *out) {
+    const unsigned char *end = data + size;
+    const unsigned char *literals;
+    const unsigned char *literals_end;
+    unsigned char *block_start = out->p;
+    unsigned char *out_end = out->end;
+    size_t num_literals;
+    size_t used;
+    uint32_t num_sequences;
+    struct bit_reader reader;
+    uint32_t ll_state;
+    uint32_t of_state;
+    uint32_t ml_state;
+    uint64_t history;
+    int modes;
+    int n;
+    uint32_t i;
+
+    if ((size_t)(out_end - out->p) > ZSTD_BLOCK_SIZE) {
+        out_end = out->p + ZSTD_BLOCK_SIZE;
+    }
+
+    if (size == 0) {
+        return DECODE_CORRUPT;
+    }
+    used = read_literals(decoder, data, size, &literals, &num_literals);
+    if (used == 0) {
+        return DECODE_CORRUPT;
+    }
+    literals_end = literals + num_literals;
+    data += used;
+
+    if (data >= end) {
+        return DECODE_CORRUPT;
+    }
+    if (data[0] < 128) {
+        num_sequences = data[0];
+        data++;
+    } else if (data[0] < 255) {
+        if (end - data < 2) {
+            return DECODE_CORRUPT;
+        }
+        num_sequences = ((uint32_t)(data[0] - 128) << 8) + data[1];
+        data += 2;
+    } else {
+        if (end - data < 3) {
+            return DECODE_CORRUPT;
+        }
+        num_sequences = (uint32_t)read_le(data + 1, 2) + 0x7F00;
+        data += 3;
+    }
+
+    if (num_sequences > 0) {
+        if (data >= end || (data[0] & 3) != 0) {
+            return DECODE_CORRUPT;
+        }
+        modes = *data++;
+        n = read_sequence_table(decoder->ll_table, &decoder->ll_log,
+                                modes >> 6, ll_default_norm, LL_MAX_SYMBOL,
+                                LL_DEFAULT_TABLE_LOG, LL_MAX_SYMBOL,
+                                LL_MAX_TABLE_LOG, data, (size_t)(end - data));
+        if (n < 0) {
+            return DECODE_CORRUPT;
+        }
+        data += n;
+        n = read_sequence_table(decoder->of_table, &decoder->of_log,
+                                (modes >> 4) & 3, of_default_norm,
+                                OF_DEFAULT_MAX_SYMBOL, OF_DEFAULT_TABLE_LOG,
+                                31, OF_MAX_TABLE_LOG, data,
+                                (size_t)(end - data));
+        if (n < 0) {
+            return DECODE_CORRUPT;
+        }
+        data += n;
+        n = read_sequence_table(decoder->ml_table, &decoder->ml_log,
+                                (modes >> 2) & 3, ml_default_norm,
+                                ML_MAX_SYMBOL, ML_DEFAULT_TABLE_LOG,
+                                ML_MAX_SYMBOL, ML_MAX_TABLE_LOG, data,
+                                (size_t)(end - data));
+        if (n < 0) {
+            return DECODE_CORRUPT;
+        }
+        data += n;
+
+        if (!bits_init(&reader, data, (size_t)(end - data))) {
+            return DECODE_CORRUPT;
+        }
+        ll_state = (uint32_t)bits_read(&reader, decoder->ll_log);
+        of_state = (uint32_t)bits_read(&reader, decoder->of_log);
+        ml_state = (uint32_t)bits_read(&reader, decoder->ml_log);
+        bits_reload(&reader);
+
+        /* Matches can reach back into earlier blocks of the frame, as far
+         * as the caller keeps them.
+         */
+        history = (uint64_t)(out->p - out->start);
+        if (history > decoder->frame_size) {
+            history = decoder->frame_size;
+        }
+
+        for (i = 0; i < num_sequences; i++) {
+            const struct zstd_fse_entry *ll = &decoder->ll_table[ll_state];
+            const struct zstd_fse_entry *of = &decoder->of_table[of_state];
+            const struct zstd_fse_entry *ml = &decoder->ml_table[ml_state];
+            uint32_t offset_base;
+            uint32_t offset;
+            uint32_t match_length;
+            uint32_t literal_length;
+
+            offset_base = (1U << of->symbol)
+                + (uint32_t)bits_read(&reader, of->symbol);
+            bits_reload(&reader);
+            match_length = ml_base[ml->symbol]
+                + (uint32_t)bits_read(&reader, ml_bits[ml->symbol]);
+            literal_length = ll_base[ll->symbol]
+                + (uint32_t)bits_read(&reader, ll_bits[ll->symbol]);
+            if (bits_reload(&reader)) {
+                return DECODE_CORRUPT;
+            }
+
+            if (offset_base > 3) {
+                offset = offset_base - 3;
+                decoder->repeat_offsets[2] = decoder->repeat_offsets[1];
+                decoder->repeat_offsets[1] = decoder->repeat_offsets[0];
+                decoder->repeat_offsets[0] = offset;
+            } else {
+                uint32_t index = offset_base - 1 + (literal_length == 0);
+
+                if (index == 0) {
+                    offset = decoder->repeat_offsets[0];
+                } else {
+                    offset = index == 3 ? decoder->repeat_offsets[0] - 1
+                                        : decoder->repeat_offsets[index];
+                    if (index > 1) {
+                        decoder->repeat_offsets[2] =
+                            decoder->repeat_offsets[1];
+                    }
+                    decoder->repeat_offsets[1] = decoder->repeat_offsets[0];
+                    decoder->repeat_offsets[0] = offset;
+                }
+            }
+
+            if (literal_length > (size_t)(literals_end - literals)
+                || (size_t)literal_length + match_length
+                    > (size_t)(out_end - out->p)) {
+                return DECODE_CORRUPT;
+            }
+            memcpy(out->p, literals, literal_length);
+            out->p += literal_length;
+            literals += literal_length;
+            if (offset == 0
+                || offset > history + (uint64_t)(out->p - block_start)) {
+                return DECODE_CORRUPT;
+            }
+            copy_match(out->p, offset, match_length);
+            out->p += match_length;
+
+            if (i + 1 < num_sequences) {
+                ll_state = ll->new_state
+                    + (uint32_t)bits_read(&reader, ll->num_bits);
+                ml_state = ml->new_state
+                    + (uint32_t)bits_read(&reader, ml->num_bits);
+                of_state = of->new_state
+                    + (uint32_t)bits_read(&reader, of->num_bits);
+                if (bits_reload(&reader)) {
+                    return DECODE_CORRUPT;
+                }
+            }
+        }
+        if (!bits_finished(&reader)) {
+            return DECODE_CORRUPT;
+        }
+    } else if (data != end) {
+        return DECODE_CORRUPT;
+    }
+
+    num_literals = (size_t)(literals_end - literals);
+    if (num_literals > (size_t)(out_end - out->p)) {
+        return DECODE_CORRUPT;
+    }
+    memcpy(out->p, literals, num_literals);
+    out->p += num_literals;
+    return DECODE_OK;
+}
+
+/* Parses a frame header. Returns its size, or 0 if it's invalid. */
+static size_t read_frame_header(const unsigned char *data,
+                                size_t size,
+                                uint64_t *window_size,
+                                uint64_t *content_size,
+                                int *has_checksum,
+                                int *has_dictionary) {
+    static const int dictionary_id_sizes[4] = {0, 1, 2, 4};
+    int descriptor;
+    int single_segment;
+    int content_size_bytes;
+    size_t header_size;
+
+    if (size < 5 || read32(data) != ZSTD_MAGIC) {
+        return 0;
+    }
+    descriptor = data[4];
+    if (descriptor & 0x08) {
+        return 0;
+    }
+    single_segment = (descriptor >> 5) & 1;
+    switch (descriptor >> 6) {
+        case 0:
+            content_size_bytes = single_segment;
+            break;
+        case 1:
+            content_size_bytes = 2;
+            break;
+        case 2:
+            content_size_bytes = 4;
+            break;
+        default:
+            content_size_bytes = 8;
+            break;
+    }
+    header_size = 5 + !single_segment + dictionary_id_sizes[descriptor & 3]
+        + content_size_bytes;
+    if (header_size > size) {
+        return 0;
+    }
+
+    *window_size = 0;
+    if (!single_segment) {
+        int exponent = data[5] >> 3;
+        uint64_t base = (uint64_t)1 << (10 + exponent);
+
+        *window_size = base + (base >> 3) * (data[5] & 7);
+    }
+    *has_dictionary = (descriptor & 3) != 0
+        && read_le(data + 5 + !single_segment,
+                   dictionary_id_sizes[descriptor & 3]) != 0;
+    *content_size = (uint64_t)-1;
+    if (content_size_bytes > 0) {
+        *content_size = read_le(data + header_size - content_size_bytes,
+                                content_size_bytes);
+        if (content_size_bytes == 2) {
+            *content_size += 256;
+        }
+    }
+    if (single_segment) {
+        *window_size = *content_size;
+    }
+    *has_checksum = (descriptor >> 2) & 1;
+    return header_size;
+}
+
+uint64_t zstd_window_size(const void *data, size_t size) {
+    uint64_t window_size;
+    uint64_t content_size;
+    int has_checksum;
+    int has_dictionary;
+
+    if (read_frame_header(data, size, &window_size, &content_size,
+                          &has_checksum, &has_dictionary) == 0) {
+        return 0;
+    }
+    return window_size;
+}
+
+void zstd_decoder_init(struct zstd_decoder *decoder) {
+    decoder->in_frame = 0;
+}
+
+static enum decode_status start_frame(struct zstd_decoder *decoder,
+                                      struct in_stream *in,
+                                      struct out_window *out) {
+    for (;;) {
+        size_t available = fill(in, 8);
+        uint32_t magic;
+        uint64_t window_size;
+        int has_dictionary;
+        size_t header_size;
+
+        if (available == 0) {
+            return DECODE_END;
+        }
+        if (available < 4) {
+            return DECODE_CORRUPT;
+        }
+        magic = read32(in->p);
+
+        if ((magic & SKIPPABLE_MAGIC_MASK) == SKIPPABLE_MAGIC) {
+            uint64_t skip;
+
+            if (available < 8) {
+                return DECODE_CORRUPT;
+            }
+            skip = read32(in->p + 4);
+            in->p += 8;
+            while (skip > 0) {
+                size_t n = fill(in, skip < MAX_SKIP_CHUNK
+                                    ? (size_t)skip
+                                    : MAX_SKIP_CHUNK);
+                if (n == 0) {
+                    return DECODE_CORRUPT;
+                }
+                if (n > skip) {
+                    n = (size_t)skip;
+                }
+                in->p += n;
+                skip -= n;
+            }
+            continue;
+        }
+
+        available = fill(in, MAX_FRAME_HEADER_SIZE);
+        header_size = read_frame_header(in->p, available, &window_size,
+                                        &decoder->content_size,
+                                        &decoder->has_checksum,
+                                        &has_dictionary);
+        if (header_size == 0) {
+            return DECODE_CORRUPT;
+        }
+        if (has_dictionary || window_size > out->window_size) {
+            return DECODE_UNSUPPORTED;
+        }
+        in->p += header_size;
+        break;
+    }
+
+    decoder->in_frame = 1;
+    decoder->frame_size = 0;
+    decoder->repeat_offsets[0] = 1;
+    decoder->repeat_offsets[1] = 4;
+    decoder->repeat_offsets[2] = 8;
+    decoder->huffman_bits = 0;
+    decoder->ll_log = -1;
+    decoder->of_log = -1;
+    decoder->ml_log = -1;
+    hash_init(decoder);
+    return DECODE_OK;
+}
+
+enum decode_status zstd_decode(struct zstd_decoder *decoder,
+                               struct in_stream *in,
+                               struct out_window *out) {
+    unsigned char *block_start = out->p;
+    enum decode_status status;
+    uint32_t header;
+    size_t size;
+    int last;
+
+    if (!decoder->in_frame) {
+        status = start_frame(decoder, in, out);
+        if (status != DECODE_OK) {
+            return status;
+        }
+    }
+
+    if (fill(in, 3) < 3) {
+        return DECODE_CORRUPT;
+    }
+    header = (uint32_t)read_le(in->p, 3);
+    last = header & 1;
+    size = header >> 3;
+    if (size > ZSTD_BLOCK_SIZE) {
+        return DECODE_CORRUPT;
+    }
+
+    switch ((header >> 1) & 3) {
+        case BLOCK_RAW:
+            if (fill(in, 3 + size) < 3 + size
+                || size > (size_t)(out->end - out->p)) {
+                return DECODE_CORRUPT;
+            }
+            memcpy(out->p, in->p + 3, size);
+            out->p += size;
+            in->p += 3 + size;
+            break;
+        case BLOCK_RLE:
+            if (fill(in, 4) < 4 || size > (size_t)(out->end - out->p)) {
+                return DECODE_CORRUPT;
+            }
+            memset(out->p, in->p[3], size);
+            out->p += size;
+            in->p += 4;
+            break;
+        case BLOCK_COMPRESSED:
+            if (fill(in, 3 + size) < 3 + size) {
+                return DECODE_CORRUPT;
+            }
+            status = decode_block(decoder, in->p + 3, size, out);
+            if (status != DECODE_OK) {
+                return status;
+            }
+            in->p += 3 + size;
+            break;
+        default:
+            return DECODE_CORRUPT;
+    }
+
+    if (decoder->has_checksum) {
+        hash_update(decoder, block_start, (size_t)(out->p - block_start));
+    }
+    decoder->frame_size += (uint64_t)(out->p - block_start);
+    if (decoder->frame_size > decoder->content_size) {
+        return DECODE_CORRUPT;
+    }
+
+    if (last) {
+        if (decoder->content_size != (uint64_t)-1
+            && decoder->frame_size != decoder->content_size) {
+            return DECODE_CORRUPT;
+        }
+        if (decoder->has_checksum) {
+            if (fill(in, 4) < 4
+                || read32(in->p) != (uint32_t)hash_digest(decoder)) {
+                return DECODE_CORRUPT;
+            }
+            in->p += 4;
+        }
+        decoder->in_frame = 0;
+    }
+    return DECODE_OK;
+}
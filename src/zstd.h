@@ -0,0 +1,113 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WDD_ZSTD_H
+#define WDD_ZSTD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "stream.h"
+
+#define ZSTD_HASH_BITS 17
+#define ZSTD_WINDOW_SIZE (1 << 20)
+#define ZSTD_BLOCK_SIZE (128 << 10)
+#define ZSTD_DEFAULT_LEVEL 3
+#define ZSTD_MAX_LEVEL 19
+#define ZSTD_MAGIC 0xFD2FB528U
+#define ZSTD_HUFFMAN_MAX_BITS 11
+
+struct zstd_sequence {
+    uint32_t literal_length;
+    uint32_t match_length;
+    uint32_t offset_base;
+};
+
+/* Match finder and block buffers of the compressor. Matches reach back at
+ * most ZSTD_WINDOW_SIZE bytes.
+ */
+struct zstd_state {
+    int32_t head[1 << ZSTD_HASH_BITS];
+    int32_t prev[ZSTD_WINDOW_SIZE];
+    unsigned char literals[ZSTD_BLOCK_SIZE];
+    struct zstd_sequence sequences[ZSTD_BLOCK_SIZE / 4 + 1];
+    uint8_t codes[3][ZSTD_BLOCK_SIZE / 4 + 1];
+    unsigned char block[4 * ZSTD_BLOCK_SIZE];
+};
+
+/* Returns the most space a frame of size bytes can take. */
+size_t zstd_compress_bound(size_t size);
+
+/* Compresses data as a single Zstandard frame at level 1-19, with the
+ * content size in the header. Returns the size of the frame.
+ */
+size_t zstd_compress_frame(struct zstd_state *state,
+                           int level,
+                           const void *data,
+                           size_t size,
+                           void *frame);
+
+struct zstd_fse_entry {
+    uint16_t new_state;
+    uint8_t symbol;
+    uint8_t num_bits;
+};
+
+/* Decoder state. Tables and repeat offsets carry over from one block to the
+ * next within a frame.
+ */
+struct zstd_decoder {
+    int in_frame;
+    int has_checksum;
+    uint64_t content_size;
+    uint64_t frame_size;
+    uint32_t repeat_offsets[3];
+    uint64_t hash[4];
+    unsigned char hash_buffer[32];
+    size_t hash_buffered;
+    uint16_t huffman_table[1 << ZSTD_HUFFMAN_MAX_BITS];
+    int huffman_bits;
+    struct zstd_fse_entry ll_table[1 << 9];
+    struct zstd_fse_entry of_table[1 << 8];
+    struct zstd_fse_entry ml_table[1 << 9];
+    int ll_log;
+    int of_log;
+    int ml_log;
+    unsigned char literals[ZSTD_BLOCK_SIZE];
+};
+
+/* Returns the window size that the frame at data needs, or 0 if it isn't
+ * a frame header.
+ */
+uint64_t zstd_window_size(const void *data, size_t size);
+
+void zstd_decoder_init(struct zstd_decoder *decoder);
+
+/* Decodes the next block of the input, reading a frame header first if
+ * needed, and skipping skippable frames. There must be room for at least
+ * ZSTD_BLOCK_SIZE bytes of output. Returns DECODE_END when the input ends
+ * between frames.
+ */
+enum decode_status zstd_decode(struct zstd_decoder *decoder,
+                               struct in_stream *in,
+                               struct out_window *out);
+
+#endif
@@ -0,0 +1,31 @@
+# Compresses the sample with one of the encoders and decompresses it with
+# the reference tool, which checks the checksums too.
+
+set(_base ${WORK_DIR}/reference_${FORMAT}_${LEVEL})
+
+execute_process(COMMAND ${CODEC} sample ${_base}.bin
+    RESULT_VARIABLE _result)
+if(NOT _result EQUAL 0)
+    message(FATAL_ERROR "Could not write the sample")
+endif()
+
+execute_process(
+    COMMAND ${CODEC} compress ${FORMAT} ${LEVEL} ${_base}.bin ${_base}.packed
+    RESULT_VARIABLE _result)
+if(NOT _result EQUAL 0)
+    message(FATAL_ERROR "Could not compress the sample")
+endif()
+
+execute_process(COMMAND ${TOOL} -d -c ${_base}.packed
+    OUTPUT_FILE ${_base}.out
+    RESULT_VARIABLE _result)
+if(NOT _result EQUAL 0)
+    message(FATAL_ERROR "${TOOL} could not decompress the sample")
+endif()
+
+execute_process(
+    COMMAND ${CMAKE_COMMAND} -E compare_files ${_base}.bin ${_base}.out
+    RESULT_VARIABLE _result)
+if(NOT _result EQUAL 0)
+    message(FATAL_ERROR "${TOOL} decompressed the sample differently")
+endif()
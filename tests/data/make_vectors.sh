@@ -0,0 +1,16 @@
+#!/bin/sh
+# Makes the reference files in this directory with the reference tools.
+# Usage: make_vectors.sh <path to test_codecs>
+set -e
+cd "$(dirname "$0")"
+"$1" sample sample.bin
+zstd -q -f -19 --check sample.bin -o sample.zst
+zstd -q -f -1 --no-check sample.bin -o sample-fast.zst
+lz4 -q -f -9 --content-size sample.bin sample.lz4
+lz4 -q -f -1 -B4 -BD -BX sample.bin sample-linked.lz4
+gzip -n -9 -c sample.bin > sample.gz
+gzip -n -1 -c sample.bin > sample-fast.gz
+xz -q -f -6 -k -c sample.bin > sample.xz
+xz -q -f -6 -k -c --check=crc32 --block-size=65536 sample.bin \
+    > sample-blocks.xz
+rm sample.bin
@@ -0,0 +1,380 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Feeds arbitrary input to one of the decoders the way wdd does: the input
+ * comes in through fill() in chunks that get moved around, and the output
+ * goes to a buffer that holds only the window and one step more, sliding
+ * along as it fills up. Buffers are allocated to their exact size so that
+ * address sanitizer catches anything that strays out of them.
+ *
+ * FUZZ_FORMAT picks the decoder. Built with FUZZ_LIBFUZZER it's a
+ * libFuzzer target. Otherwise it runs on the files given on the command
+ * line and on FUZZ_MUTATIONS damaged copies of each, so that CTest can
+ * run it over the reference vectors (see CMakeLists.txt). Longer runs can
+ * raise FUZZ_MUTATIONS.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gzip.h"
+#include "lz4.h"
+#include "xz.h"
+#include "zstd.h"
+
+#define FORMAT_ZSTD 0
+#define FORMAT_LZ4 1
+#define FORMAT_GZIP 2
+#define FORMAT_XZ 3
+
+/* The largest input a decoder may ask for at once, as in decompress.h. */
+#define FUZZ_MAX_INPUT_SIZE ((4 << 20) + 16)
+#define FUZZ_CHUNK_SIZE 4093
+#define FUZZ_MAX_WINDOW_SIZE (64 << 20)
+#define FUZZ_MAX_OUTPUT_SIZE (256 << 20)
+#ifndef FUZZ_MUTATIONS
+#define FUZZ_MUTATIONS 300
+#endif
+#define MAX_STEPS 1000000
+
+#if FUZZ_FORMAT == FORMAT_ZSTD
+#define STEP_SIZE ZSTD_BLOCK_SIZE
+#elif FUZZ_FORMAT == FORMAT_LZ4
+#define STEP_SIZE LZ4_MAX_BLOCK_SIZE
+#elif FUZZ_FORMAT == FORMAT_GZIP
+#define STEP_SIZE GZIP_DECODE_SIZE
+#elif FUZZ_FORMAT == FORMAT_XZ
+#define STEP_SIZE XZ_MAX_CHUNK_SIZE
+#else
+#error FUZZ_FORMAT must be one of the FORMAT_ constants
+#endif
+
+struct decoder {
+    union {
+        struct zstd_decoder zstd;
+        struct lz4_decoder lz4;
+        struct gzip_decoder gzip;
+        struct xz_decoder xz;
+    } u;
+};
+
+/* Input that is copied into buffer a chunk at a time when the decoder asks
+ * for more than it has, like fill_input_stream() in wdd.
+ */
+struct fuzz_input {
+    struct in_stream in;
+    const unsigned char *next;
+    const unsigned char *end;
+    unsigned char *buffer;
+    size_t buffer_size;
+};
+
+static void *allocate(size_t size) {
+    void *p = malloc(size > 0 ? size : 1);
+
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void check(int condition, const char *what) {
+    if (!condition) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        abort();
+    }
+}
+
+static size_t fill_input(struct in_stream *in, size_t size) {
+    struct fuzz_input *input = (struct fuzz_input *)in;
+    size_t available = (size_t)(in->end - in->p);
+
+    if (available >= size) {
+        return available;
+    }
+    if (size > input->buffer_size) {
+        size = input->buffer_size;
+    }
+    memmove(input->buffer, in->p, available);
+    in->p = input->buffer;
+    in->end = input->buffer + available;
+
+    while (available < size && input->next < input->end) {
+        size_t chunk_size = (size_t)(input->end - input->next);
+
+        if (chunk_size > FUZZ_CHUNK_SIZE) {
+            chunk_size = FUZZ_CHUNK_SIZE;
+        }
+        if (chunk_size > input->buffer_size - available) {
+            chunk_size = input->buffer_size - available;
+        }
+        memcpy(input->buffer + available, input->next, chunk_size);
+        input->next += chunk_size;
+        available += chunk_size;
+        in->end += chunk_size;
+    }
+    return available;
+}
+
+/* The window of the first frame, as decompress_window_size() finds it, but
+ * without rounding it up, so that matches reaching too far back end up
+ * outside the buffer.
+ */
+static size_t get_window_size(const unsigned char *data, size_t size) {
+    uint64_t window_size;
+
+#if FUZZ_FORMAT == FORMAT_ZSTD
+    window_size = zstd_window_size(data, size);
+#elif FUZZ_FORMAT == FORMAT_LZ4
+    window_size = LZ4_WINDOW_SIZE;
+#elif FUZZ_FORMAT == FORMAT_GZIP
+    window_size = GZIP_WINDOW_SIZE;
+#else
+    window_size = xz_dictionary_size(data, size);
+#endif
+    if (window_size > FUZZ_MAX_WINDOW_SIZE) {
+        return 0;
+    }
+    return window_size > 0 ? (size_t)window_size : STEP_SIZE;
+}
+
+static void decoder_init(struct decoder *decoder) {
+#if FUZZ_FORMAT == FORMAT_ZSTD
+    zstd_decoder_init(&decoder->u.zstd);
+#elif FUZZ_FORMAT == FORMAT_LZ4
+    lz4_decoder_init(&decoder->u.lz4);
+#elif FUZZ_FORMAT == FORMAT_GZIP
+    gzip_decoder_init(&decoder->u.gzip);
+#else
+    xz_decoder_init(&decoder->u.xz);
+#endif
+}
+
+static enum decode_status decoder_step(struct decoder *decoder,
+                                       struct in_stream *in,
+                                       struct out_window *out) {
+#if FUZZ_FORMAT == FORMAT_ZSTD
+    return zstd_decode(&decoder->u.zstd, in, out);
+#elif FUZZ_FORMAT == FORMAT_LZ4
+    return lz4_decode(&decoder->u.lz4, in, out);
+#elif FUZZ_FORMAT == FORMAT_GZIP
+    return gzip_decode(&decoder->u.gzip, in, out);
+#else
+    return xz_decode(&decoder->u.xz, in, out);
+#endif
+}
+
+#if FUZZ_FORMAT == FORMAT_XZ
+/* wdd also reads the index at the end of xz input to find the blocks. */
+static void parse_xz_index(const unsigned char *data, size_t size) {
+    struct xz_block_record *records;
+    uint64_t index_size;
+    size_t num_records = 0;
+    unsigned char *index;
+    int check_type;
+
+    if (size < XZ_FOOTER_SIZE) {
+        return;
+    }
+    index_size = xz_index_size(data + size - XZ_FOOTER_SIZE, &check_type);
+    if (index_size == 0 || index_size > size - XZ_FOOTER_SIZE) {
+        return;
+    }
+    index = allocate((size_t)index_size);
+    records = allocate(sizeof(*records) * (size_t)(index_size / 2 + 1));
+    memcpy(index, data + size - XZ_FOOTER_SIZE - index_size, index_size);
+    if (xz_parse_index(index, (size_t)index_size, records, &num_records)) {
+        check(num_records <= index_size / 2, "too many index records");
+    }
+    free(records);
+    free(index);
+}
+#endif
+
+static void decode(const unsigned char *data, size_t size) {
+    struct decoder *decoder = allocate(sizeof(*decoder));
+    struct fuzz_input input;
+    struct out_window out;
+    unsigned char *window;
+    size_t window_size;
+    size_t buffer_size;
+    size_t num_bytes_out = 0;
+    int i;
+
+    window_size = get_window_size(data, size);
+    if (window_size == 0) {
+        free(decoder);
+        return;
+    }
+    buffer_size = 2 * window_size + STEP_SIZE;
+    window = allocate(buffer_size);
+
+    input.buffer_size = size;
+    if (input.buffer_size > FUZZ_MAX_INPUT_SIZE) {
+        input.buffer_size = FUZZ_MAX_INPUT_SIZE;
+    }
+    input.buffer = allocate(input.buffer_size);
+    input.next = data;
+    input.end = data + size;
+    input.in.p = input.buffer;
+    input.in.end = input.buffer;
+    input.in.fill = fill_input;
+
+    out.start = window;
+    out.p = window;
+    out.end = window + buffer_size;
+    out.window_size = window_size;
+
+    decoder_init(decoder);
+    for (i = 0; i < MAX_STEPS && num_bytes_out < FUZZ_MAX_OUTPUT_SIZE; i++) {
+        unsigned char *p;
+        enum decode_status status;
+
+        if ((size_t)(out.end - out.p) < STEP_SIZE) {
+            size_t keep = (size_t)(out.p - window);
+
+            if (keep > window_size) {
+                keep = window_size;
+            }
+            memmove(window, out.p - keep, keep);
+            out.p = window + keep;
+        }
+
+        p = out.p;
+        status = decoder_step(decoder, &input.in, &out);
+        check(out.p >= p && out.p <= out.end, "output pointer out of range");
+        check(input.in.p <= input.in.end
+              && input.in.end <= input.buffer + input.buffer_size,
+              "input pointer out of range");
+        num_bytes_out += (size_t)(out.p - p);
+        if (status != DECODE_OK) {
+            break;
+        }
+    }
+
+    free(input.buffer);
+    free(window);
+    free(decoder);
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size) {
+    decode(data, size);
+#if FUZZ_FORMAT == FORMAT_XZ
+    parse_xz_index(data, size);
+#endif
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+static unsigned char *read_file(const char *path, size_t *size) {
+    FILE *file;
+    unsigned char *data;
+    long length;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = allocate((size_t)length);
+    *size = fread(data, 1, (size_t)length, file);
+    fclose(file);
+    return data;
+}
+
+static uint64_t next_random(uint64_t *seed) {
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *seed >> 33;
+}
+
+/* Flips a few bits, overwrites a few bytes or cuts the end off. Damage
+ * near the start reaches the headers and table descriptions, so it's
+ * picked from there more often. The same seed always gives the same copy.
+ */
+static size_t mutate(unsigned char *data, size_t size, uint64_t seed) {
+    uint64_t kind = next_random(&seed) % 3;
+    int count = 1 + (int)(next_random(&seed) % 4);
+    int i;
+
+    if (size == 0) {
+        return 0;
+    }
+    if (kind == 2) {
+        return (size_t)(next_random(&seed) % size);
+    }
+    for (i = 0; i < count; i++) {
+        size_t range = next_random(&seed) % 2 == 0 && size > 64 ? 64 : size;
+        size_t offset = (size_t)(next_random(&seed) % range);
+
+        if (kind == 0) {
+            data[offset] ^= (unsigned char)(1 << (next_random(&seed) % 8));
+        } else {
+            data[offset] = (unsigned char)next_random(&seed);
+        }
+    }
+    return size;
+}
+
+int main(int argc, char **argv) {
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s FILE...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 1; i < argc; i++) {
+        unsigned char *data;
+        unsigned char *copy;
+        size_t size;
+        int j;
+
+        data = read_file(argv[i], &size);
+        if (data == NULL) {
+            fprintf(stderr, "FAIL: could not read %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        LLVMFuzzerTestOneInput(data, size);
+
+        copy = allocate(size);
+        for (j = 0; j < FUZZ_MUTATIONS; j++) {
+            memcpy(copy, data, size);
+            LLVMFuzzerTestOneInput(
+                copy,
+                mutate(copy, size, (uint64_t)j + 1));
+        }
+        free(copy);
+        free(data);
+    }
+
+    printf("Decoded %d file%s and %d damaged copies without faults\n",
+           argc - 1,
+           argc > 2 ? "s" : "",
+           (argc - 1) * FUZZ_MUTATIONS);
+    return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,691 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks the decoders against files made by the reference zstd, lz4, gzip
+ * and xz tools, and the encoders by decoding what they produce. With
+ * "sample FILE" it writes the data the reference files were made from, and
+ * with "compress FORMAT LEVEL IN OUT" it compresses a file so that the
+ * reference tools can check the encoders too (see CMakeLists.txt).
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gzip.h"
+#include "lz4.h"
+#include "xz.h"
+#include "zstd.h"
+
+#define SAMPLE_SIZE 274489
+#define SAMPLE_ZEROS_START 70000
+#define SAMPLE_ZEROS_END 90000
+#define SAMPLE_NOISE_START 150000
+#define SAMPLE_NOISE_END 160000
+#define LARGE_SAMPLE_SIZE ((1 << 20) + 17)
+#define MAX_STEPS 1000000
+#define SKIPPABLE_MAGIC 0x184D2A5EU
+
+enum format {
+    FORMAT_ZSTD,
+    FORMAT_LZ4,
+    FORMAT_GZIP,
+    FORMAT_XZ
+};
+
+static const char *const format_names[] = {"zstd", "lz4", "gzip", "xz"};
+
+static const size_t step_sizes[] = {
+    ZSTD_BLOCK_SIZE,
+    LZ4_MAX_BLOCK_SIZE,
+    GZIP_DECODE_SIZE,
+    XZ_MAX_CHUNK_SIZE
+};
+
+/* Files in tests/data, made from the sample by make_vectors.sh. The
+ * checksum is checked by damaging the byte checksum_end bytes from the end
+ * of the file, 0 for files without one. xz files have the check of their
+ * last block before the index, so that is found through the footer.
+ */
+static const struct {
+    const char *filename;
+    enum format format;
+    size_t checksum_end;
+} vectors[] = {
+    {"sample.zst", FORMAT_ZSTD, 1},
+    {"sample-fast.zst", FORMAT_ZSTD, 0},
+    {"sample.lz4", FORMAT_LZ4, 1},
+    {"sample-linked.lz4", FORMAT_LZ4, 1},
+    {"sample.gz", FORMAT_GZIP, 5},
+    {"sample-fast.gz", FORMAT_GZIP, 5},
+    {"sample.xz", FORMAT_XZ, 1},
+    {"sample-blocks.xz", FORMAT_XZ, 1}
+};
+
+static const struct {
+    enum format format;
+    int level;
+} encoders[] = {
+    {FORMAT_ZSTD, 1},
+    {FORMAT_ZSTD, 3},
+    {FORMAT_ZSTD, 9},
+    {FORMAT_ZSTD, 19},
+    {FORMAT_LZ4, 0},
+    {FORMAT_GZIP, 1},
+    {FORMAT_GZIP, 6},
+    {FORMAT_GZIP, 9}
+};
+
+struct decoder {
+    enum format format;
+    union {
+        struct zstd_decoder zstd;
+        struct lz4_decoder lz4;
+        struct gzip_decoder gzip;
+        struct xz_decoder xz;
+    } u;
+};
+
+struct encoder_states {
+    struct zstd_state zstd;
+    struct lz4_state lz4;
+    struct gzip_state gzip;
+};
+
+/* Compressed input that is handed out only as far as the decoder asks for
+ * it, to catch decoders that read more than they filled.
+ */
+struct test_input {
+    struct in_stream in;
+    const unsigned char *end;
+};
+
+static int num_failures;
+
+static void fail(const char *format, ...) {
+    va_list arg_list;
+
+    va_start(arg_list, format);
+    fprintf(stderr, "FAIL: ");
+    vfprintf(stderr, format, arg_list);
+    fprintf(stderr, "\n");
+    va_end(arg_list);
+    num_failures++;
+}
+
+static void *allocate(size_t size) {
+    void *p = malloc(size > 0 ? size : 1);
+
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* Text made of a few words, a run of zeros and a stretch of noise, so that
+ * literals, matches, RLE and stored blocks all show up. The same seed
+ * always gives the same data.
+ */
+static void make_sample(unsigned char *data, size_t size) {
+    static const char *const words[] = {
+        "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+        "wdd", "copies", "disks", "and", "images", "on", "windows", "in",
+        "blocks"
+    };
+    uint64_t seed = 1;
+    const char *word = "";
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        if (i >= SAMPLE_ZEROS_START && i < SAMPLE_ZEROS_END) {
+            data[i] = 0;
+        } else if (i >= SAMPLE_NOISE_START && i < SAMPLE_NOISE_END) {
+            data[i] = (unsigned char)(seed >> 56);
+        } else if (*word == '\0') {
+            word = words[(seed >> 33) % (sizeof(words) / sizeof(words[0]))];
+            data[i] = (seed >> 40) % 10 == 0 ? '\n' : ' ';
+        } else {
+            data[i] = (unsigned char)*word++;
+        }
+    }
+}
+
+static unsigned char *read_file(const char *path, size_t *size) {
+    FILE *file;
+    unsigned char *data;
+    long length;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = allocate((size_t)length);
+    *size = fread(data, 1, (size_t)length, file);
+    fclose(file);
+    return data;
+}
+
+static int write_file(const char *path, const void *data, size_t size) {
+    FILE *file = fopen(path, "wb");
+    int result;
+
+    if (file == NULL) {
+        return 0;
+    }
+    result = fwrite(data, 1, size, file) == size;
+    return fclose(file) == 0 && result;
+}
+
+static size_t fill_slowly(struct in_stream *in, size_t size) {
+    struct test_input *input = (struct test_input *)in;
+    size_t available = (size_t)(input->end - in->p);
+
+    if (size > available) {
+        size = available;
+    }
+    if ((size_t)(in->end - in->p) < size) {
+        in->end = in->p + size;
+    }
+    return (size_t)(in->end - in->p);
+}
+
+static void decoder_init(struct decoder *decoder,
+                         enum format format,
+                         int xz_check_type) {
+    decoder->format = format;
+    switch (format) {
+        case FORMAT_ZSTD:
+            zstd_decoder_init(&decoder->u.zstd);
+            break;
+        case FORMAT_LZ4:
+            lz4_decoder_init(&decoder->u.lz4);
+            break;
+        case FORMAT_GZIP:
+            gzip_decoder_init(&decoder->u.gzip);
+            break;
+        case FORMAT_XZ:
+            if (xz_check_type >= 0) {
+                xz_decoder_init_block(&decoder->u.xz, xz_check_type);
+            } else {
+                xz_decoder_init(&decoder->u.xz);
+            }
+            break;
+    }
+}
+
+static enum decode_status decoder_step(struct decoder *decoder,
+                                       struct in_stream *in,
+                                       struct out_window *out) {
+    switch (decoder->format) {
+        case FORMAT_ZSTD:
+            return zstd_decode(&decoder->u.zstd, in, out);
+        case FORMAT_LZ4:
+            return lz4_decode(&decoder->u.lz4, in, out);
+        case FORMAT_GZIP:
+            return gzip_decode(&decoder->u.gzip, in, out);
+        case FORMAT_XZ:
+            return xz_decode(&decoder->u.xz, in, out);
+    }
+    return DECODE_UNSUPPORTED;
+}
+
+/* Decodes data until the decoder stops, the same way wdd does. A check
+ * type of 0 or more decodes a single xz block. Returns the final status.
+ */
+static enum decode_status decode(enum format format,
+                                 int xz_check_type,
+                                 const unsigned char *data,
+                                 size_t size,
+                                 int slow,
+                                 unsigned char *out,
+                                 size_t out_capacity,
+                                 size_t *out_size) {
+    struct decoder *decoder = allocate(sizeof(*decoder));
+    struct test_input input;
+    struct out_window window;
+    enum decode_status status = DECODE_CORRUPT;
+    int i;
+
+    decoder_init(decoder, format, xz_check_type);
+    input.in.p = data;
+    input.in.end = slow ? data : data + size;
+    input.in.fill = slow ? fill_slowly : NULL;
+    input.end = data + size;
+    window.start = out;
+    window.p = out;
+    window.end = out + out_capacity;
+    window.window_size = (size_t)-1;
+
+    for (i = 0; i < MAX_STEPS; i++) {
+        status = decoder_step(decoder, &input.in, &window);
+        if (status != DECODE_OK) {
+            break;
+        }
+    }
+    *out_size = (size_t)(window.p - out);
+    free(decoder);
+    return status;
+}
+
+/* Decodes a whole stream with all of the input at hand and then again with
+ * input that comes in as needed, and compares the result both times.
+ */
+static void check_decoded(const char *name,
+                          enum format format,
+                          const unsigned char *data,
+                          size_t size,
+                          const unsigned char *expected,
+                          size_t expected_size) {
+    size_t capacity = expected_size + step_sizes[format];
+    unsigned char *out = allocate(capacity);
+    int slow;
+
+    for (slow = 0; slow <= 1; slow++) {
+        size_t out_size;
+        enum decode_status status = decode(
+            format,
+            -1,
+            data,
+            size,
+            slow,
+            out,
+            capacity,
+            &out_size);
+
+        if (status != DECODE_END) {
+            fail("%s: decoding %s input ended with status %d",
+                 name,
+                 slow ? "streamed" : "buffered",
+                 (int)status);
+        } else if (out_size != expected_size
+                   || memcmp(out, expected, expected_size) != 0) {
+            fail("%s: decoding %s input gave different data",
+                 name,
+                 slow ? "streamed" : "buffered");
+        }
+    }
+    free(out);
+}
+
+/* Damages the end of a stream, which holds its checksum, and makes sure
+ * that the decoder notices.
+ */
+static void check_corruption_found(const char *name,
+                                   enum format format,
+                                   const unsigned char *data,
+                                   size_t size,
+                                   size_t expected_size,
+                                   size_t damage_offset) {
+    size_t capacity = expected_size + step_sizes[format];
+    unsigned char *copy = allocate(size);
+    unsigned char *out = allocate(capacity);
+    size_t out_size;
+
+    memcpy(copy, data, size);
+    copy[damage_offset] ^= 0x01;
+    if (decode(format, -1, copy, size, 0, out, capacity, &out_size)
+            != DECODE_CORRUPT) {
+        fail("%s: damaged checksum at offset %lu was not detected",
+             name,
+             (unsigned long)damage_offset);
+    }
+    free(out);
+    free(copy);
+}
+
+/* Decodes the blocks listed in the index of an xz file one at a time, the
+ * way wdd decompresses them in parallel.
+ */
+static void check_xz_blocks(const char *name,
+                            const unsigned char *data,
+                            size_t size,
+                            const unsigned char *expected,
+                            size_t expected_size) {
+    const unsigned char *footer = data + size - XZ_FOOTER_SIZE;
+    struct xz_block_record *records;
+    uint64_t index_size;
+    size_t num_records = 0;
+    size_t offset = XZ_HEADER_SIZE;
+    size_t out_offset = 0;
+    int check_type;
+    size_t i;
+
+    index_size = xz_index_size(footer, &check_type);
+    if (index_size == 0 || index_size > size - XZ_FOOTER_SIZE) {
+        fail("%s: no valid index", name);
+        return;
+    }
+    records = allocate(sizeof(*records) * (size_t)(index_size / 2));
+    if (!xz_parse_index(
+            footer - index_size,
+            (size_t)index_size,
+            records,
+            &num_records)) {
+        fail("%s: index could not be parsed", name);
+        free(records);
+        return;
+    }
+    if (num_records < 2) {
+        fail("%s: expected several blocks, got %lu",
+             name,
+             (unsigned long)num_records);
+    }
+
+    for (i = 0; i < num_records; i++) {
+        size_t block_size = (size_t)((records[i].unpadded_size + 3) & ~3ULL);
+        size_t capacity = (size_t)records[i].size;
+        unsigned char *out = allocate(capacity);
+        size_t out_size;
+        enum decode_status status;
+
+        status = decode(
+            FORMAT_XZ,
+            check_type,
+            data + offset,
+            block_size,
+            0,
+            out,
+            capacity,
+            &out_size);
+        if (status != DECODE_END
+            || out_size != capacity
+            || out_offset + out_size > expected_size
+            || memcmp(out, expected + out_offset, out_size) != 0) {
+            fail("%s: block %lu decoded wrong", name, (unsigned long)i);
+        }
+        offset += block_size;
+        out_offset += capacity;
+        free(out);
+    }
+    if (out_offset != expected_size
+        || offset + index_size + XZ_FOOTER_SIZE != size) {
+        fail("%s: blocks don't add up to the whole file", name);
+    }
+    free(records);
+}
+
+static void test_reference_files(const char *dir,
+                                 const unsigned char *sample) {
+    size_t i;
+
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        const char *name = vectors[i].filename;
+        enum format format = vectors[i].format;
+        char path[1024];
+        unsigned char *data;
+        size_t size;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        data = read_file(path, &size);
+        if (data == NULL) {
+            fail("%s: could not read %s", name, path);
+            continue;
+        }
+        check_decoded(name, format, data, size, sample, SAMPLE_SIZE);
+        if (vectors[i].checksum_end > 0) {
+            size_t damage_offset = size - vectors[i].checksum_end;
+            int check_type;
+
+            if (format == FORMAT_XZ) {
+                damage_offset -= XZ_FOOTER_SIZE
+                    + (size_t)xz_index_size(
+                        data + size - XZ_FOOTER_SIZE,
+                        &check_type);
+            }
+            check_corruption_found(
+                name,
+                format,
+                data,
+                size,
+                SAMPLE_SIZE,
+                damage_offset);
+        }
+        if (strcmp(name, "sample-blocks.xz") == 0) {
+            check_xz_blocks(name, data, size, sample, SAMPLE_SIZE);
+        }
+        free(data);
+    }
+}
+
+static size_t compress_bound(enum format format, size_t size) {
+    switch (format) {
+        case FORMAT_ZSTD:
+            return zstd_compress_bound(size);
+        case FORMAT_LZ4:
+            return lz4_compress_bound(size);
+        case FORMAT_GZIP:
+            return gzip_compress_bound(size);
+        default:
+            return 0;
+    }
+}
+
+static size_t compress(struct encoder_states *states,
+                       enum format format,
+                       int level,
+                       const void *data,
+                       size_t size,
+                       void *frame) {
+    switch (format) {
+        case FORMAT_ZSTD:
+            return zstd_compress_frame(&states->zstd, level, data, size, frame);
+        case FORMAT_LZ4:
+            return lz4_compress_frame(&states->lz4, data, size, frame);
+        case FORMAT_GZIP:
+            return gzip_compress_member(
+                &states->gzip,
+                level,
+                data,
+                size,
+                frame);
+        default:
+            return 0;
+    }
+}
+
+static void put_le32(unsigned char *p, uint32_t value) {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+}
+
+/* Compresses every input with every encoder and level and decodes it
+ * again, first as one frame and then as two frames in a row, with a
+ * skippable frame in between where the format has them.
+ */
+static void test_round_trips(const unsigned char *sample,
+                             const unsigned char *large_sample) {
+    struct encoder_states *states = allocate(sizeof(*states));
+    unsigned char *zeros = allocate(SAMPLE_SIZE);
+    unsigned char *noise = allocate(SAMPLE_SIZE);
+    uint64_t seed = 7;
+    size_t i;
+    size_t j;
+    const struct {
+        const char *name;
+        const unsigned char *data;
+        size_t size;
+    } inputs[] = {
+        {"empty", (const unsigned char *)"", 0},
+        {"one byte", (const unsigned char *)"x", 1},
+        {"zeros", zeros, SAMPLE_SIZE},
+        {"noise", noise, SAMPLE_SIZE},
+        {"sample", sample, SAMPLE_SIZE},
+        {"large sample", large_sample, LARGE_SAMPLE_SIZE}
+    };
+
+    memset(zeros, 0, SAMPLE_SIZE);
+    for (i = 0; i < SAMPLE_SIZE; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        noise[i] = (unsigned char)(seed >> 56);
+    }
+
+    for (i = 0; i < sizeof(encoders) / sizeof(encoders[0]); i++) {
+        enum format format = encoders[i].format;
+        int level = encoders[i].level;
+
+        for (j = 0; j < sizeof(inputs) / sizeof(inputs[0]); j++) {
+            const unsigned char *data = inputs[j].data;
+            size_t size = inputs[j].size;
+            size_t bound = compress_bound(format, size);
+            unsigned char *frames;
+            unsigned char *twice;
+            size_t frame_size;
+            size_t total_size;
+            char name[64];
+
+            /* The highest levels take seconds for the large sample and
+             * search the same window as the lower ones.
+             */
+            if (size > SAMPLE_SIZE && level > 9) {
+                continue;
+            }
+            frames = allocate(2 * bound + 16);
+            twice = allocate(2 * size);
+            snprintf(name, sizeof(name), "%s level %d, %s",
+                     format_names[format],
+                     level,
+                     inputs[j].name);
+
+            frame_size = compress(states, format, level, data, size, frames);
+            if (frame_size == 0 || frame_size > bound) {
+                fail("%s: compressed size %lu is out of bounds",
+                     name,
+                     (unsigned long)frame_size);
+                free(twice);
+                free(frames);
+                continue;
+            }
+            check_decoded(name, format, frames, frame_size, data, size);
+
+            total_size = frame_size;
+            if (format != FORMAT_GZIP) {
+                put_le32(frames + total_size, SKIPPABLE_MAGIC);
+                put_le32(frames + total_size + 4, 8);
+                memset(frames + total_size + 8, 0xAA, 8);
+                total_size += 16;
+            }
+            memcpy(frames + total_size, frames, frame_size);
+            total_size += frame_size;
+            memcpy(twice, data, size);
+            memcpy(twice + size, data, size);
+            strncat(name, " twice", sizeof(name) - strlen(name) - 1);
+            check_decoded(name, format, frames, total_size, twice, 2 * size);
+
+            free(twice);
+            free(frames);
+        }
+    }
+
+    free(noise);
+    free(zeros);
+    free(states);
+}
+
+static int parse_format(const char *name, enum format *format) {
+    int i;
+
+    for (i = FORMAT_ZSTD; i <= FORMAT_GZIP; i++) {
+        if (strcmp(name, format_names[i]) == 0) {
+            *format = (enum format)i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Compresses a file as a single frame for the reference tools to check. */
+static int compress_file(const char *format_name,
+                         const char *level,
+                         const char *in_path,
+                         const char *out_path) {
+    struct encoder_states *states;
+    enum format format;
+    unsigned char *data;
+    unsigned char *frame;
+    size_t size;
+    size_t frame_size;
+    int result;
+
+    if (!parse_format(format_name, &format)) {
+        fprintf(stderr, "Unknown format %s\n", format_name);
+        return EXIT_FAILURE;
+    }
+    data = read_file(in_path, &size);
+    if (data == NULL) {
+        fprintf(stderr, "Could not read %s\n", in_path);
+        return EXIT_FAILURE;
+    }
+    states = allocate(sizeof(*states));
+    frame = allocate(compress_bound(format, size));
+    frame_size = compress(states, format, atoi(level), data, size, frame);
+    result = write_file(out_path, frame, frame_size);
+    free(frame);
+    free(states);
+    free(data);
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv) {
+    unsigned char *sample;
+    unsigned char *large_sample;
+
+    if (argc == 3 && strcmp(argv[1], "sample") == 0) {
+        sample = allocate(SAMPLE_SIZE);
+        make_sample(sample, SAMPLE_SIZE);
+        return write_file(argv[2], sample, SAMPLE_SIZE)
+            ? EXIT_SUCCESS
+            : EXIT_FAILURE;
+    }
+    if (argc == 6 && strcmp(argv[1], "compress") == 0) {
+        return compress_file(argv[2], argv[3], argv[4], argv[5]);
+    }
+    if (argc != 2) {
+        fprintf(stderr, "Usage: test_codecs <data_dir>\n"
+                        "       test_codecs sample <file>\n"
+                        "       test_codecs compress zstd|lz4|gzip <level> "
+                        "<in_file> <out_file>\n");
+        return EXIT_FAILURE;
+    }
+
+    sample = allocate(SAMPLE_SIZE);
+    large_sample = allocate(LARGE_SAMPLE_SIZE);
+    make_sample(sample, SAMPLE_SIZE);
+    make_sample(large_sample, LARGE_SAMPLE_SIZE);
+
+    test_reference_files(argv[1], sample);
+    test_round_trips(sample, large_sample);
+
+    free(large_sample);
+    free(sample);
+    if (num_failures > 0) {
+        fprintf(stderr, "%d checks failed\n", num_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
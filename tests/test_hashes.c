@@ -0,0 +1,290 @@
+/*
+ * Copyright 2018-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks BLAKE3, XXH3 and CRC-32C against digests from the reference
+ * implementations (the blake3 and xxhash packages, and a bitwise CRC-32C),
+ * both for whole buffers and for the same data fed in uneven pieces. The
+ * inputs are the bytes 0, 1, ..., 250, 0, 1, ... of the given length, as
+ * in the official BLAKE3 test vectors.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blake3.h"
+#include "crc32c.h"
+#include "xxh3.h"
+
+#define MAX_INPUT_SIZE 1048577
+
+static const struct {
+    size_t size;
+    const char *blake3;
+    uint64_t xxh3;
+    uint32_t crc32c;
+} vectors[] = {
+    {0,
+        "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262",
+        0x2D06800538D394C2ULL, 0x00000000U},
+    {1,
+        "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213",
+        0xC44BDFF4074EECDBULL, 0x527D5351U},
+    {3,
+        "e1be4d7a8ab5560aa4199eea339849ba8e293d55ca0a81006726d184519e647f",
+        0x5F4299FC161C9CBBULL, 0x92FD4BFAU},
+    {4,
+        "f30f5ab28fe047904037f77b6da4fea1e27241c5d132638d8bedce9d40494f32",
+        0x60DAB036A58211F2ULL, 0xD9331AA3U},
+    {8,
+        "2351207d04fc16ade43ccab08600939c7c1fa70a5c0aaca76063d04c3228eaeb",
+        0x3A1C2D7C85AF88F8ULL, 0x8A2CBC3BU},
+    {9,
+        "a0fc27e5d7318b723207637bdeeba4f7dcb22f7f9ec3e8b6f3588ddcd4fdf861",
+        0xE9612598145BB9DCULL, 0x7144C5A8U},
+    {16,
+        "a6a492965517a830cb75fdb713465aa465f2f098233896fea44c1d98268bf9e3",
+        0x8355E3A6F61770DBULL, 0xD9C908EBU},
+    {17,
+        "8462aa7be93b09fda7b93cf9f9cddb703f6dd2cc0c8edd5f9eee092edf8abf0c",
+        0x9EF341A99DE37328ULL, 0x38435E17U},
+    {63,
+        "e9bc37a594daad83be9470df7f7b3798297c3d834ce80ba85d6e207627b7db7b",
+        0xAAA5F0FB98A36AE8ULL, 0x7A873004U},
+    {64,
+        "4eed7141ea4a5cd4b788606bd23f46e212af9cacebacdc7d1f4c6dc7f2511b98",
+        0x6187EB9089B0ED55ULL, 0xFB6D36EBU},
+    {65,
+        "de1e5fa0be70df6d2be8fffd0e99ceaa8eb6e8c93a63f2d8d1c30ecb6b263dee",
+        0x6928C76CE90422D0ULL, 0x694420FAU},
+    {128,
+        "f17e570564b26578c33bb7f44643f539624b05df1a76c81f30acd548c44b45ef",
+        0x85C6174C7FF4C46BULL, 0x30D9C515U},
+    {129,
+        "683aaae9f3c5ba37eaaf072aed0f9e30bac0865137bae68b1fde4ca2aebdcb12",
+        0xEC7642B431BA3E5AULL, 0xF514629FU},
+    {240,
+        "45e1a0dc23dbe51733d7269a3c0f519c2a63b0718835b2b537677eba734db0d8",
+        0x375A384D957FE865ULL, 0x9F4F71D6U},
+    {241,
+        "749b36ae651c22e8567db692a6876e0ca4fd3daeb7aa8fa3ab2f642ccc69a8f6",
+        0x02E8CD95421C6D02ULL, 0x54FE7516U},
+    {255,
+        "cb97b80a66306dd2d4f1ab7ff9fd17d3d62d88c974e8daf0ea9fbd0b1ae1b1c1",
+        0x074191BAF9C49567ULL, 0xEBBD63B3U},
+    {256,
+        "f462b63aae56ed9fb899ad8eb93aa35d3dd62773fda9c33bfe20f9dab5d3df5f",
+        0x44F5D90DACDE463AULL, 0x3449F810U},
+    {257,
+        "3d41df314e2c7af6919d994b391780a7d8abb9a57b1abf64e04ec5d49428788e",
+        0x88FC3F7934A6C9BEULL, 0x77E6C9DAU},
+    {1023,
+        "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11",
+        0xD3D91D80AC495685ULL, 0x39A4911AU},
+    {1024,
+        "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7",
+        0xE5D78BAFA45B2AA5ULL, 0x2AF62C0CU},
+    {1025,
+        "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444",
+        0xE95C42288F28186EULL, 0xC8D03ADDU},
+    {2048,
+        "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a",
+        0x25339063DB861586ULL, 0x9F7E33F0U},
+    {2049,
+        "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030",
+        0x6C9600C0E506E2AEULL, 0x0BE89406U},
+    {3072,
+        "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2",
+        0x4ADB90B35034DF6BULL, 0xED1122EBU},
+    {3073,
+        "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3",
+        0x6B63998099A1DB88ULL, 0x5589C733U},
+    {4096,
+        "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969",
+        0x7135FFA504F1BC71ULL, 0x719077FCU},
+    {4097,
+        "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995",
+        0xB69D29F17D48293FULL, 0xBD04B950U},
+    {8192,
+        "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63",
+        0x40A71C16BBE37322ULL, 0x5372B398U},
+    {8193,
+        "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b",
+        0xD6735A2B792CF505ULL, 0xE814309CU},
+    {16384,
+        "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4",
+        0x168F7FB4781D0831ULL, 0xEAFCA51DU},
+    {31744,
+        "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47",
+        0x5162BBAF8B257803ULL, 0xE1A4CB23U},
+    {102400,
+        "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085",
+        0x1428E17F1CAC2837ULL, 0x7957DA17U},
+    {1048577,
+        "2f053cd7472cf0cd2f9adaf45c1180255b91b9a865404a63671a0ee5f792ed33",
+        0x47A84C196FD973DFULL, 0x760B5254U}
+};
+
+/* Piece sizes for incremental hashing, used in turn. They straddle the
+ * block and buffer sizes of all three hashes.
+ */
+static const size_t piece_sizes[] = {1, 7, 63, 64, 65, 255, 256, 1000, 4097};
+
+static int num_failures;
+
+static void to_hex(const unsigned char *digest, size_t size, char *hex) {
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+}
+
+static void check_blake3(const unsigned char *data, size_t i) {
+    struct blake3_hasher hasher;
+    unsigned char digest[BLAKE3_OUT_SIZE];
+    char hex[2 * BLAKE3_OUT_SIZE + 1];
+    size_t pos = 0;
+    size_t j = 0;
+
+    blake3_init(&hasher);
+    blake3_update(&hasher, data, vectors[i].size);
+    blake3_final(&hasher, digest);
+    to_hex(digest, sizeof(digest), hex);
+    if (strcmp(hex, vectors[i].blake3) != 0) {
+        fprintf(stderr, "FAIL: BLAKE3 of %lu bytes is %s\n",
+                (unsigned long)vectors[i].size,
+                hex);
+        num_failures++;
+    }
+
+    blake3_init(&hasher);
+    while (pos < vectors[i].size) {
+        size_t size = piece_sizes[j++ % (sizeof(piece_sizes)
+                                         / sizeof(piece_sizes[0]))];
+
+        size = size < vectors[i].size - pos ? size : vectors[i].size - pos;
+        blake3_update(&hasher, data + pos, size);
+        pos += size;
+    }
+    blake3_final(&hasher, digest);
+    to_hex(digest, sizeof(digest), hex);
+    if (strcmp(hex, vectors[i].blake3) != 0) {
+        fprintf(stderr, "FAIL: BLAKE3 of %lu bytes in pieces is %s\n",
+                (unsigned long)vectors[i].size,
+                hex);
+        num_failures++;
+    }
+}
+
+static void check_xxh3(const unsigned char *data, size_t i) {
+    struct xxh3_state state;
+    uint64_t digest;
+    size_t pos = 0;
+    size_t j = 0;
+
+    digest = xxh3_64(data, vectors[i].size);
+    if (digest != vectors[i].xxh3) {
+        fprintf(stderr, "FAIL: XXH3 of %lu bytes is %016llx\n",
+                (unsigned long)vectors[i].size,
+                (unsigned long long)digest);
+        num_failures++;
+    }
+
+    xxh3_init(&state);
+    while (pos < vectors[i].size) {
+        size_t size = piece_sizes[j++ % (sizeof(piece_sizes)
+                                         / sizeof(piece_sizes[0]))];
+
+        size = size < vectors[i].size - pos ? size : vectors[i].size - pos;
+        xxh3_update(&state, data + pos, size);
+        pos += size;
+    }
+    digest = xxh3_digest(&state);
+    if (digest != vectors[i].xxh3) {
+        fprintf(stderr, "FAIL: XXH3 of %lu bytes in pieces is %016llx\n",
+                (unsigned long)vectors[i].size,
+                (unsigned long long)digest);
+        num_failures++;
+    }
+}
+
+static void check_crc32c(const unsigned char *data, size_t i) {
+    uint32_t crc;
+    size_t pos = 0;
+    size_t j = 0;
+
+    crc = crc32c_update(0, data, vectors[i].size);
+    if (crc != vectors[i].crc32c) {
+        fprintf(stderr, "FAIL: CRC-32C of %lu bytes is %08lx\n",
+                (unsigned long)vectors[i].size,
+                (unsigned long)crc);
+        num_failures++;
+    }
+
+    crc = 0;
+    while (pos < vectors[i].size) {
+        size_t size = piece_sizes[j++ % (sizeof(piece_sizes)
+                                         / sizeof(piece_sizes[0]))];
+
+        size = size < vectors[i].size - pos ? size : vectors[i].size - pos;
+        crc = crc32c_update(crc, data + pos, size);
+        pos += size;
+    }
+    if (crc != vectors[i].crc32c) {
+        fprintf(stderr, "FAIL: CRC-32C of %lu bytes in pieces is %08lx\n",
+                (unsigned long)vectors[i].size,
+                (unsigned long)crc);
+        num_failures++;
+    }
+}
+
+int main(void) {
+    unsigned char *data = malloc(MAX_INPUT_SIZE);
+    size_t i;
+
+    if (data == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < MAX_INPUT_SIZE; i++) {
+        data[i] = (unsigned char)(i % 251);
+    }
+
+    /* The check value from the CRC catalogue. */
+    if (crc32c_update(0, "123456789", 9) != 0xE3069283U) {
+        fprintf(stderr, "FAIL: CRC-32C of \"123456789\"\n");
+        num_failures++;
+    }
+
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        check_blake3(data, i);
+        check_xxh3(data, i);
+        check_crc32c(data, i);
+    }
+
+    free(data);
+    if (num_failures > 0) {
+        fprintf(stderr, "%d checks failed\n", num_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}